@@ -6,6 +6,8 @@ MEDVEDx64
 #include "lgc/lgc.h"
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <SDL/SDL_image.h>
 
 lgcImage * surf2lgc(SDL_Surface *surf, int compressed) {
@@ -15,9 +17,6 @@ lgcImage * surf2lgc(SDL_Surface *surf, int compressed) {
     lgcImage *img = lgcBlankImage();
     lgcLayer *lyr = lgcBlankLayer();
 
-    lyr->w = surf->w;
-    lyr->h = surf->h;
-
     switch(surf->format->BytesPerPixel) {
 
         case 1: lyr->format = LGC_FMT_GRAY | LGC_FMT_8BIT; break;
@@ -31,10 +30,13 @@ lgcImage * surf2lgc(SDL_Surface *surf, int compressed) {
     }
 
     lyr->format |= compressed? LGC_FMT_COMPRESSED: 0;
-    lyr->length = LGC_LAYER_BODY_LENGTH(lyr);
 
-    lyr->data = malloc(lyr->length);
-    memcpy(lyr->data, surf->pixels, lyr->length);
+    // scans may be larger than lgcLayer's own fields tell
+    uint64_t length = LGC_PIXELS_LENGTH(lyr->format, surf->w, surf->h);
+    lgcSetLayerSize(lyr, surf->w, surf->h, length);
+
+    lyr->data = malloc(length);
+    memcpy(lyr->data, surf->pixels, length);
 
     lgcPushLayer(img, lyr);
     lgcDestroyLayer(lyr, 1);
@@ -46,24 +48,55 @@ lgcImage * surf2lgc(SDL_Surface *surf, int compressed) {
 int main(int argc, char *argv[]) {
 
     if(argc < 3) {
-        printf("usage: %s [SOURCE FILE] [DESTINATION FILE]\n", argv[0]);
+        printf("usage: %s [SOURCE FILE] [DESTINATION FILE] [-bc1|-bc3|-bc7|-p[COLORS]] [-s]\n"
+               "  -p[COLORS]  indexed, with a palette of up to COLORS (256 by default)\n"
+               "  -s          sparse: crop transparent borders, skip transparent runs\n"
+               "              (RGBA and indexed images only)\n", argv[0]);
         return 0;
     }
 
+    // GPU block formats are stored as they are, to be uploaded without decoding
+    uint8_t block = 0;
+    int colors = 0, rwopts = LGC_RW_ENTRIE, a;
+    for(a = 3; a < argc; ++a) {
+        if(!strcmp(argv[a], "-s")) rwopts |= LGC_RW_SPARSE;
+        else if(!strncmp(argv[a], "-p", 2)) {
+            colors = argv[a][2]? atoi(argv[a]+2): LGC_PALETTE_MAX;
+            if(colors < 1 || colors > LGC_PALETTE_MAX) {
+                printf("Palette must have 1 to %d colors.\n", LGC_PALETTE_MAX);
+                return -1;
+            }
+        }
+        else if(!strcmp(argv[a], "-bc1")) block = LGC_FMT_BC1;
+        else if(!strcmp(argv[a], "-bc3")) block = LGC_FMT_BC3;
+        else if(!strcmp(argv[a], "-bc7")) block = LGC_FMT_BC7;
+        else {
+            printf("Unknown option %s.\n", argv[a]);
+            return -1;
+        }
+    }
+
+    if(block && colors) {
+        printf("Options -bc* and -p can't be used together.\n");
+        return -1;
+    }
+
     SDL_Surface *surf = IMG_Load(argv[1]);
     if(!surf) {
         printf("Failed to load source image.\n");
         return -1;
     }
 
-    lgcImage *img = surf2lgc(surf, 1);
-    if(!img) {
+    lgcImage *img = surf2lgc(surf, !block);
+    if(!img || (block && lgcEncodeLayer(&img->layers[0], block, 0)) ||
+        (colors && lgcQuantizeLayer(&img->layers[0], colors, 0))) {
         printf("Conversion failed.\n");
         SDL_FreeSurface(surf);
+        if(img) lgcDestroyImage(img, 1);
         return -1;
     }
 
-    if(lgcWriteToFile(argv[2], LGC_RW_ENTRIE, img)) {
+    if(lgcWriteToFile(argv[2], rwopts, img)) {
         printf("Error: can't write destination file.\n");
         SDL_FreeSurface(surf);
         lgcDestroyImage(img, 1);
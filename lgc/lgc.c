@@ -10,16 +10,25 @@
 
 /* There are almost no comments. Sorry about this. */
 
-#include "lgc.h"
+#include "lgcpriv.h"
 
 #include <malloc.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
 //#include <zlib.h>
 #include <lz4.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 //#define COMPRESION_LEVEL 9
 
+static char *blob_store = NULL;
+
 lgcImage * lgcBlankImage() {
 
     lgcImage * img = malloc(sizeof(lgcImage));
@@ -34,6 +43,7 @@ lgcLayer * lgcBlankLayer() {
 
     lgcLayer *layer = malloc(sizeof(lgcLayer));
     memset(layer, 0, sizeof(lgcLayer));
+    dropLayer(layer); // of a layer freed without lgcDestroyLayer() at the same place
     return layer;
 
 }
@@ -56,8 +66,21 @@ void lgcDestroyImage(lgcImage *image, int force_freeing){
 }
 
 void lgcDestroyLayer(lgcLayer *layer, int force_freeing) {
-    if(layer->data)
-        free(layer->data);
+    fullLayer full;
+    loadLayer(layer, &full);
+
+    if(full.refs && --*full.refs) {
+        full.data = NULL; // still used by other layers
+    }
+    else if(full.refs) {
+        free(full.refs);
+    }
+
+    if(full.data && !full.borrowed)
+        free(full.data);
+
+    layer->data = NULL;
+    dropLayer(layer);
 
     if(force_freeing)
         free(layer);
@@ -73,19 +96,25 @@ void lgcPushLayer(lgcImage *dest, lgcLayer *layer)
         return;
     }
 
-    if(dest->layers) {
-        dest->layers = realloc(dest->layers, (dest->layers_count+1)*sizeof(lgcLayer));
-        memcpy(&dest->layers[dest->layers_count], layer, sizeof(lgcLayer));
-        dest->layers[dest->layers_count].data = malloc(dest->layers[dest->layers_count].length);
-        memcpy(dest->layers[dest->layers_count].data, layer->data, layer->length);
-    }
-    else {
-        dest->layers = malloc(sizeof(lgcLayer));
-        memcpy(dest->layers, layer, sizeof(lgcLayer));
-        dest->layers[0].data = malloc(layer->length);
-        memcpy(dest->layers[0].data, layer->data, layer->length);
+    fullLayer pushed;
+    loadLayer(layer, &pushed);
+
+    // 'layer' may be one of the image's own, moving along with them
+    void *pixels = pushed.data;
+    dest->layers = resizeLayers(dest->layers, dest->layers_count, dest->layers_count+1);
+    pushed.data = malloc(pushed.length);
+    memcpy(pushed.data, pixels, pushed.length);
+    pushed.refs = NULL;
+    pushed.borrowed = 0;
+
+    // the palette is copied along with the pixels
+    if(pushed.palette) {
+        uint8_t *palette = malloc(4*pushed.colors);
+        memcpy(palette, pushed.palette, 4*pushed.colors);
+        pushed.palette = palette;
     }
 
+    storeLayer(&pushed, &dest->layers[dest->layers_count]);
     dest->layers_count++;
 
 }
@@ -95,9 +124,9 @@ lgcLayer * lgcPopLayer(lgcImage *image) {
         return NULL;
 
     lgcLayer *layer = malloc(sizeof(lgcLayer));
-    memcpy(layer, &image->layers[image->layers_count-1], sizeof(lgcLayer));
+    moveLayer(&image->layers[image->layers_count-1], layer);
     image->layers_count--;
-    image->layers = realloc(image->layers, image->layers_count*sizeof(lgcImage));
+    image->layers = resizeLayers(image->layers, image->layers_count+1, image->layers_count);
 
     return layer;
 
@@ -117,71 +146,576 @@ lgcLayer * lgcPopLayer(lgcImage *image) {
         return -1;                                                          \
     } while(0)
 
-int checkHead(FILE *file, uint32_t *layers_c) { // checks magic number, returns zero on success
-    // it also fetches layers count value
+/*  Opens the file with a large stdio buffer, for reading or writing it
+    through: heads of many small layers then cost a memcpy each
+    rather than a syscall. */
+FILE * openFile(const char *filename, const char *mode) {
+
+    FILE *f = fopen(filename, mode);
+    if(f) setvbuf(f, NULL, _IOFBF, LGC_IO_BUFFER_SIZE);
+    return f;
+
+}
+
+/*  Tells the file version by it's magic number, 0 for foreign files.
+    Byte-swapped magic (a file written on a big-endian CPU
+    without care) is reported as such. */
+int checkMagic(uint32_t magic) {
+
+    int version = magicVersion(magic);
+    if(!version && magicVersion(magic>>24|(magic>>8&0xff00)|(magic<<8&0xff0000)|magic<<24))
+        fprintf(stderr, "lgc: byte-swapped (big-endian) file\n");
+    return version;
+
+}
+
+int checkHead(FILE *file, uint32_t *layers_c, int *version) { // checks magic number, returns zero on success
+    // it also fetches layers count value and the file version
     fseek(file, LGC_BASE_OFFSET, SEEK_SET);
-    int mgck = 0;
-    if(fread(&mgck, 4, 1, file) != 1) {
+    uint8_t buf[8];
+    if(fread(buf, layers_c? 8: 4, 1, file) != 1) {
         rewind(file);
         return -1;
     }
 
-    if(layers_c) {
-        if(fread(layers_c, 4, 1, file) != 1) {
-            rewind(file);
-            return -1;
-        }
-    }
+    if(layers_c) *layers_c = getLE32(buf+4);
+
+    int v = checkMagic(getLE32(buf));
+    if(version) *version = v;
 
     rewind(file);
-    if(mgck == LGC_MAGIC)
+    if(v)
         return 0;
     else
         return 1;
 }
 
-int readLayer(FILE *f, lgcLayer *layer, int only_head) {
-    int len = 0;
+/*  Turns a v1 file into v2 before a record of the library (one with
+    it's flags or an extension) is written to it. Records of the file
+    stay what they were, unless their flags have bits the library's
+    in v2: such files are refused. Returns non-zero on failure. */
+int upgradeHead(FILE *file) {
+
+    uint8_t buf[4];
+    uint32_t records = 0, i;
+    int version = 0;
+    if(checkHead(file, &records, &version)) return -1;
+    if(version == 2) return 0;
+
+    if(fseeko(file, LGC_BASE_OFFSET+8, SEEK_SET)) return -1;
+    for(i = 0; i < records; ++i) {
+        fullLayer tmp;
+        layerExt ext;
+
+        if(readHead(file, version, &tmp, &ext) || fseeko(file, ext.len, SEEK_CUR)) return -1;
+        if(tmp.flags&LGC_LAYER_RESERVED) {
+            fprintf(stderr, "lgc: layer %u of v1 file has flags of LGC_LAYER_RESERVED\n", i);
+            return -1;
+        }
+    }
 
-    if(fread(&layer->w, 2, 1, f) != 1) return -1;
-    if(fread(&layer->h, 2, 1, f) != 1) return -1;
-    if(fread(&layer->x, 4, 1, f) != 1) return -1;
-    if(fread(&layer->y, 4, 1, f) != 1) return -1;
-    if(fread(&layer->format, 1, 1, f) != 1) return -1;
-    if(fread(&layer->flags, 4, 1, f) != 1) return -1;
-    if(fread(&len, 4, 1, f) != 1) return -1;
+    putLE32(buf, LGC_MAGIC_V2);
+    if(fseeko(file, LGC_BASE_OFFSET, SEEK_SET) || fwrite(buf, 4, 1, file) != 1) return -1;
+    return fflush(file)? -1: 0;
 
-    if(only_head) return 0;
+}
 
-    void *src_buf = malloc(len);
-    if(fread(src_buf, len, 1, f) != 1) {
-        free(src_buf);
+/*  Layer head codec. On disk the head is LGC_HEAD_LENGTH bytes,
+    little-endian: w u16 @0, h u16 @2, x i32 @4, y i32 @8,
+    format u8 @12, flags i32 @13, length u32 @17. With LGC_LAYER_WIDE
+    in flags, high halves of w u16 @21, h u16 @23, length u32 @25 follow.
+    'flags' get LGC_LAYER_WIDE when the layer needs it; returns head length. */
+uint32_t packHead(uint8_t *buf, const fullLayer *layer, int32_t flags, uint64_t len) {
+
+    if(layer->w > 0xffff || layer->h > 0xffff || len > UINT32_MAX) flags |= LGC_LAYER_WIDE;
+
+    putLE16(buf, layer->w);
+    putLE16(buf+2, layer->h);
+    putLE32(buf+4, layer->x);
+    putLE32(buf+8, layer->y);
+    buf[12] = layer->format;
+    putLE32(buf+13, flags);
+    putLE32(buf+17, len);
+
+    if(!(flags&LGC_LAYER_WIDE)) return LGC_HEAD_LENGTH;
+
+    putLE16(buf+21, layer->w>>16);
+    putLE16(buf+23, layer->h>>16);
+    putLE32(buf+25, len>>32);
+    return LGC_WIDE_HEAD_LENGTH;
+
+}
+
+/*  Fills head fields of the layer ('flags' with reserved bits), returns stored length.
+    'buf' holds HEAD_LENGTH(flags) bytes. */
+uint64_t unpackHead(const uint8_t *buf, fullLayer *layer) {
+    layer->w = getLE16(buf);
+    layer->h = getLE16(buf+2);
+    layer->x = getLE32(buf+4);
+    layer->y = getLE32(buf+8);
+    layer->format = buf[12];
+    layer->flags = getLE32(buf+13);
+
+    uint64_t len = getLE32(buf+17);
+    if(layer->flags&LGC_LAYER_WIDE) {
+        layer->w |= (uint32_t)getLE16(buf+21)<<16;
+        layer->h |= (uint32_t)getLE16(buf+23)<<16;
+        len |= (uint64_t)getLE32(buf+25)<<32;
+    }
+
+    return len;
+}
+
+static int parseExt(const uint8_t *buf, uint32_t ext_len, layerExt *ext) {
+
+    uint32_t pos = 0;
+    uint64_t trailer = 0; // payload bytes following the layer's own pixels
+    while(pos+6 <= ext_len) {
+        uint16_t tag = getLE16(buf+pos);
+        uint32_t size = getLE32(buf+pos+2);
+        pos += 6;
+
+        if(size > ext_len-pos) break;
+
+        const uint8_t *data = buf+pos;
+        int i;
+
+        // lengths are uint64 in wide heads
+        if(tag == LGC_EXT_LEVELS && size >= 1) {
+            uint8_t n = data[0];
+            uint32_t w = ext->flags&LGC_LAYER_WIDE? 8: 4;
+            if(n > LGC_MAX_LEVELS || size < 1+w*n) break;
+
+            for(i = 0; i < n; ++i) {
+                ext->level_len[i] = w == 8? getLE64(data+1+8*i): getLE32(data+1+4*i);
+                if(ext->level_len[i] > ext->len) return -1;
+                trailer += ext->level_len[i];
+            }
+
+            ext->levels = n;
+        }
+
+        if(tag == LGC_EXT_PADDING && size >= 4) {
+            ext->padding = getLE32(data);
+            trailer += ext->padding;
+        }
+
+        if(tag == LGC_EXT_HASH && size >= 8)
+            ext->hash = getLE64(data);
+        if(tag == LGC_EXT_REF && size >= 8)
+            ext->ref = getLE64(data);
+        if(tag == LGC_EXT_BLOB && size >= 8)
+            ext->blob = getLE64(data);
+
+        if(tag == LGC_EXT_DELTA && size >= 17) {
+            ext->delta_base = getLE64(data);
+            ext->delta_mode = data[8];
+            for(i = 0; i < 4; ++i)
+                ext->delta_box[i] = getLE16(data+9+2*i);
+        }
+
+        if(tag == LGC_EXT_SPARSE && size >= 4)
+            ext->sparse_len = getLE32(data);
+        if(tag == LGC_EXT_DICT && size >= 8)
+            ext->dict = getLE64(data);
+
+        if(tag == LGC_EXT_PALETTE && size%4 == 0 && size && size <= 4*LGC_PALETTE_MAX) {
+            ext->colors = size/4;
+            memcpy(ext->palette, data, size);
+        }
+
+        if(tag == LGC_EXT_CHECKSUM && size%4 == 0 && size/4 <= 1+LGC_MAX_LEVELS) {
+            ext->checksums = size/4;
+            for(i = 0; i < ext->checksums; ++i)
+                ext->checksum[i] = getLE32(data+4*i);
+        }
+
+        pos += size;
+    }
+
+    if(pos != ext_len || trailer > ext->len) return -1;
+
+    ext->body_len = ext->len-trailer;
+    return 0;
+
+}
+
+/*  Parses layer head with it's extension block from 'size' bytes of 'buf',
+    a record of a file of the 'version'. Returns 0 on success, -1 if the head
+    is corrupted, or the whole head's length when 'buf' holds only a part of it. */
+int parseHead(const uint8_t *buf, uint32_t size, int version, fullLayer *layer, layerExt *ext) {
+
+    if(size < LGC_HEAD_LENGTH) return LGC_HEAD_LENGTH;
+
+    uint32_t head_len = version < 2? LGC_HEAD_LENGTH: HEAD_LENGTH(getLE32(buf+13));
+    if(size < head_len) return head_len;
+
+    if(version < 2) {
+        // flags of v1 records are the application's, all of them
+        uint8_t plain[LGC_HEAD_LENGTH];
+        memcpy(plain, buf, LGC_HEAD_LENGTH);
+        putLE32(plain+13, 0);
+        ext->len = unpackHead(plain, layer);
+        layer->flags = getLE32(buf+13);
+    }
+    else ext->len = unpackHead(buf, layer);
+
+    ext->version = version;
+    ext->head_len = head_len;
+    ext->body_len = ext->len;
+    ext->padding = 0;
+    ext->levels = 0;
+    ext->hash = ext->ref = ext->blob = 0;
+    ext->checksums = 0;
+    ext->delta_base = 0;
+    ext->sparse_len = 0;
+    ext->dict = 0;
+    ext->colors = 0;
+    layer->levels = 0;
+    layer->refs = NULL;
+    layer->palette = NULL;
+    layer->colors = 0;
+    layer->borrowed = 0;
+
+    if(version < 2) {
+        ext->flags = 0;
+        return 0;
+    }
+
+    ext->flags = layer->flags;
+    layer->flags &= ~LGC_LAYER_RESERVED;
+
+    if(!(ext->flags&LGC_LAYER_EXTENDED)) return 0;
+
+    if(size < head_len+4) return head_len+4;
+    uint32_t ext_len = getLE32(buf+head_len);
+    if(ext_len > LGC_EXT_MAX) return -1;
+
+    ext->head_len += 4+ext_len;
+    if(size < ext->head_len) return ext->head_len;
+
+    if(parseExt(buf+head_len+4, ext_len, ext)) return -1;
+
+    layer->levels = ext->levels;
+    return 0;
+
+}
+
+/*  Reads layer's head along with it's extension block, in as many
+    reads as parseHead() asks for: the head, wide part and extension
+    length, then the extension block. */
+int readHead(FILE *f, int version, fullLayer *layer, layerExt *ext) {
+
+    uint8_t buf[LGC_RECORD_HEAD_MAX];
+    uint8_t *head = buf;
+    uint32_t have = 0;
+    int need = LGC_HEAD_LENGTH;
+
+    while(need > 0) {
+        // extension blocks we write fit the stack buffer
+        if(need > (int)sizeof(buf) && head == buf) {
+            head = malloc(need);
+            memcpy(head, buf, have);
+        }
+
+        if(fread(head+have, need-have, 1, f) != 1) {
+            need = -1;
+            break;
+        }
+
+        have = need;
+        need = parseHead(head, have, version, layer, ext);
+    }
+
+    if(head != buf) free(head);
+    return need? -1: 0;
+
+}
+
+int skipLayer(FILE *f, int version) {
+    fullLayer tmp;
+    layerExt ext;
+
+    if(readHead(f, version, &tmp, &ext)) return -1;
+    return fseeko(f, ext.len, SEEK_CUR);
+}
+
+static int checkStored(const void *stored, uint64_t len, const uint32_t *checksum) {
+
+    if(checksum && crc32c(0, stored, len) != *checksum) {
+        fprintf(stderr, "lgc: checksum mismatch\n");
         return -1;
     }
 
-    if(layer->format&LGC_FMT_COMPRESSED) {
-        int ucomp_len = LGC_LAYER_BODY_LENGTH(layer);
-        layer->data = malloc(ucomp_len);
-        ucomp_len = LZ4_decompress_safe((char*)src_buf, (char*)layer->data, len, ucomp_len);
-        //layer->data = realloc(layer->data, ucomp_len);
+    return 0;
+
+}
+
+// Decompresses single LZ4 block, against the dictionary unless it's NULL
+static int unpackBlock(const char *src, int len, char *dst, int size, const lz4Dict *dict) {
+
+    if(dict)
+        return LZ4_decompress_safe_usingDict(src, dst, len, size, (const char*)dict->data, dict->size);
+    return LZ4_decompress_safe(src, dst, len, size);
+
+}
 
-        if(ucomp_len < 0) {
-            free(src_buf);
-            free(layer->data);
+/*  Decompresses 'len' bytes of LZ4 data into exactly 'size' bytes:
+    a single block, or chunks of LGC_LZ4_CHUNK bytes when 'size'
+    is over LGC_LZ4_BLOCK_MAX. Blocks are compressed against the
+    dictionary with key 'dict' (see LGC_EXT_DICT), unless it's 0.
+    Returns non-zero on failure. */
+int unpackLZ4(const void *src, uint64_t len, void *dst, uint64_t size, uint64_t dict) {
+
+    const lz4Dict *d = NULL;
+    if(dict && !(d = findDictionary(dict))) return -1;
+
+    if(size <= LGC_LZ4_BLOCK_MAX)
+        return len > INT32_MAX ||
+            unpackBlock(src, len, dst, size, d) != (int)size? -1: 0;
+
+    const uint8_t *p = src, *end = p+len;
+    uint64_t done;
+    for(done = 0; done < size; done += LGC_LZ4_CHUNK) {
+        uint32_t chunk = size-done < LGC_LZ4_CHUNK? size-done: LGC_LZ4_CHUNK;
+        if(end-p < 4) return -1;
+
+        uint32_t clen = getLE32(p);
+        p += 4;
+        if(clen > (uint64_t)(end-p) || clen > INT32_MAX ||
+            unpackBlock((const char*)p, clen, (char*)dst+done, chunk, d) != (int)chunk)
             return -1;
-        }
+        p += clen;
+    }
+
+    return p == end? 0: -1;
+
+}
+
+/*  Turns 'len' stored bytes into 'size' bytes of pixels, in a new buffer.
+    'sparse' is the decoded length of the sparse form (LGC_EXT_SPARSE)
+    when the pixels are stored in it, 0 otherwise; 'dict' is the key of
+    the dictionary they are compressed against (see unpackLZ4()).
+    Stored bytes are checked against 'checksum' first, unless it's NULL. */
+void * decodeStored(const void *stored, uint64_t len, uint8_t format, uint64_t size,
+                    uint32_t sparse, uint64_t dict, const uint32_t *checksum) {
+
+    if(checkStored(stored, len, checksum)) return NULL;
+
+    uint64_t raw_len = sparse? sparse: size;
+
+    if(!(format&LGC_FMT_COMPRESSED)) {
+        if(len != raw_len) return NULL;
+        if(sparse) return expandSparse(stored, len, format, size);
+
+        void *data = malloc(size? size: 1);
+        if(data) memcpy(data, stored, size);
+        return data;
+    }
+
+    // LZ4 expands no more than 255 times, corrupted heads are not to allocate more
+    if(raw_len/255 > len) return NULL;
+
+    void *data = malloc(raw_len? raw_len: 1);
+    if(!data) return NULL;
 
+    if(unpackLZ4(stored, len, data, raw_len, dict)) {
+        free(data);
+        return NULL;
+    }
+
+    if(!sparse) return data;
+
+    // only the spans are decompressed; they are spread over the zeroed layer then
+    void *pixels = expandSparse(data, raw_len, format, size);
+    free(data);
+    return pixels;
+
+}
+
+/*  Same as decodeStored(), but takes 'stored' over: it is returned itself
+    for uncompressed dense pixels and freed otherwise. */
+void * decodeBody(void *stored, uint64_t len, uint8_t format, uint64_t size, uint32_t sparse,
+                  uint64_t dict, const uint32_t *checksum) {
+
+    if(format&LGC_FMT_COMPRESSED || sparse) {
+        void *data = decodeStored(stored, len, format, size, sparse, dict, checksum);
+        free(stored);
+        return data;
+    }
+
+    if(len != size || checkStored(stored, len, checksum)) {
+        free(stored);
+        return NULL;
+    }
+
+    return stored;
+
+}
+
+// Reads 'len' stored bytes and decodes them (see decodeBody)
+void * readBody(FILE *f, uint64_t len, uint8_t format, uint64_t size, uint32_t sparse,
+                uint64_t dict, const uint32_t *checksum) {
+
+    void *src_buf = malloc(len? len: 1);
+    if(!src_buf) return NULL;
+    if(len && fread(src_buf, len, 1, f) != 1) {
         free(src_buf);
+        return NULL;
+    }
+
+    return decodeBody(src_buf, len, format, size, sparse, dict, checksum);
+
+}
+
+int blobPath(uint64_t key, char *path, size_t size) {
+
+    if(!blob_store) {
+        fprintf(stderr, "lgc: layer is in the blob store, but none is set\n");
+        return -1;
+    }
+
+    snprintf(path, size, "%s/%016llx.lgcb", blob_store, (unsigned long long)key);
+    return 0;
 
-        layer->length = ucomp_len;
+}
+
+/*  Makes 'ext' describe the payload of 'owner', whose head was read
+    following the layer's LGC_EXT_REF or LGC_EXT_BLOB. Returns non-zero
+    if the owner does not match the layer. */
+int adoptPayload(fullLayer *layer, layerExt *ext, fullLayer *owner, layerExt *owner_ext) {
+
+    if(owner_ext->ref || owner_ext->blob || owner->w != layer->w || owner->h != layer->h ||
+        owner->format != layer->format)
+        return -1;
+
+    ext->body_len = owner_ext->body_len;
+    ext->sparse_len = owner_ext->sparse_len;
+    ext->dict = owner_ext->dict;
+    ext->levels = owner_ext->levels;
+    memcpy(ext->level_len, owner_ext->level_len, sizeof(ext->level_len));
+    ext->checksums = owner_ext->checksums;
+    memcpy(ext->checksum, owner_ext->checksum, sizeof(ext->checksum));
+    layer->levels = owner_ext->levels;
+
+    return 0;
+
+}
+
+/*  Positions at the stored pixels of the layer which head was just read.
+    For layers sharing the payload of another record (LGC_EXT_REF) or of
+    a blob (LGC_EXT_BLOB), 'ext' is updated to describe that payload.
+    Returns the stream to read from: 'f' itself or an opened blob file
+    to be closed by the caller; NULL on failure. */
+FILE * openPayload(FILE *f, fullLayer *layer, layerExt *ext) {
+
+    if(!ext->ref && !ext->blob) return f;
+
+    FILE *src = f;
+    uint64_t at = ext->ref;
+    int version = ext->version;
+
+    if(ext->blob) {
+        char path[4096];
+        if(blobPath(ext->blob, path, sizeof(path)) || !(src = fopen(path, "rb")))
+            return NULL;
+        at = 0;
+        version = LGC_STORE_VERSION;
+    }
+
+    fullLayer owner;
+    layerExt owner_ext;
+
+    if(fseeko(src, at, SEEK_SET) || readHead(src, version, &owner, &owner_ext) ||
+        adoptPayload(layer, ext, &owner, &owner_ext)) {
+        if(src != f) fclose(src);
+        return NULL;
+    }
+
+    return src;
+
+}
+
+/*  Reads pixels of the layer which head was just read, leaves the stream after the record.
+    With LGC_RW_VERIFY in 'rwopts', checksum of the stored pixels is checked. */
+int readLayerBody(FILE *f, fullLayer *layer, layerExt *ext, int rwopts) {
+
+    off_t next = ftello(f)+ext->len;
+
+    if(ext->delta_base) {
+        layer->length = LGC_LAYER_BODY_LENGTH(layer);
+        layer->data = decodeDeltaChain(fileReadAt, f, layer, ext, next-ext->len-ext->head_len, rwopts);
+        if(!layer->data || fseeko(f, next, SEEK_SET)) return -1;
+        return 0;
+    }
+
+    FILE *src = openPayload(f, layer, ext);
+    if(!src) return -1;
+
+    layer->length = LGC_LAYER_BODY_LENGTH(layer);
+    layer->data = readBody(src, ext->body_len, layer->format, layer->length, ext->sparse_len,
+                           ext->dict, rwopts&LGC_RW_VERIFY && ext->checksums? &ext->checksum[0]: NULL);
+    if(src != f) fclose(src);
 
+    if(!layer->data) return -1;
+
+    if(fseeko(f, next, SEEK_SET)) {
+        free(layer->data);
+        layer->data = NULL;
+        return -1;
     }
-    else layer->data = src_buf;
 
     return 0;
+
+}
+
+// Returns 1 for records which are not layers (deleted ones, index), skipping them
+int readLayer(FILE *f, int version, fullLayer *layer, int only_head) {
+
+    layerExt ext;
+    if(readHead(f, version, layer, &ext)) return -1;
+
+    if(ext.flags&(LGC_LAYER_DELETED|LGC_LAYER_HIDDEN))
+        return fseeko(f, ext.len, SEEK_CUR)? -1: 1;
+
+    attachPalette(layer, &ext);
+    if(only_head) return 0;
+
+    return readLayerBody(f, layer, &ext, 0);
+}
+
+/*  Turns the layer which head was just read into it's reduced-resolution
+    level, finding where the level is stored: 'offset' from the start
+    of the payload and stored 'len'. Level 0 is the layer itself.
+    Returns non-zero if the layer has no such level. */
+int selectLevel(fullLayer *layer, layerExt *ext, uint8_t level, uint64_t *offset, uint64_t *len) {
+
+    if(level > ext->levels) return 1;
+
+    *offset = 0;
+    *len = ext->body_len;
+    if(!level) return 0;
+
+    layer->w = LGC_LEVEL_DIM(layer->w, level);
+    layer->h = LGC_LEVEL_DIM(layer->h, level);
+    layer->x /= 1<<level;
+    layer->y /= 1<<level;
+
+    *offset = ext->body_len;
+    uint32_t i;
+    for(i = 0; i+1 < level; ++i)
+        *offset += ext->level_len[i];
+    *len = ext->level_len[level-1];
+
+    return 0;
+
 }
 
 lgcLayer * lgcReadLayer(const char * filename, int rwopts, uint32_t layer_n) {
+    return lgcReadLayerLevel(filename, rwopts, layer_n, 0);
+}
+
+lgcLayer * lgcReadLayerLevel(const char * filename, int rwopts, uint32_t layer_n, uint8_t level) {
 
     if(!(rwopts&LGC_RW_ENTRIE)) return NULL;
 
@@ -194,15 +728,22 @@ lgcLayer * lgcReadLayer(const char * filename, int rwopts, uint32_t layer_n) {
     }
 
     uint32_t lc = 0;
+    int version = 0;
 
-    if(checkHead(f, &lc)) {
+    if(checkHead(f, NULL, &version)) {
         fprintf(stderr, "%s: read error or bad magic number\n", __FUNCTION__);
         if(!(rwopts&LGC_RW_FORCE_FILE_POINTER)) fclose(f);
         return NULL;
     }
 
-    if(layer_n >= lc) {
-        fprintf(stderr, "%s: layer %u does not exist in image\n", __FUNCTION__, layer_n);
+    if(rwopts&LGC_RW_BODY) loadDictionary(f, version);
+
+    int r = seekLayer(f, layer_n, &lc);
+    if(r) {
+        if(r > 0)
+            fprintf(stderr, "%s: layer %u does not exist in image\n", __FUNCTION__, layer_n);
+        else
+            fprintf(stderr, "%s: read error\n", __FUNCTION__);
 
         if(rwopts&LGC_RW_FORCE_FILE_POINTER)
             rewind(f);
@@ -211,37 +752,111 @@ lgcLayer * lgcReadLayer(const char * filename, int rwopts, uint32_t layer_n) {
         return NULL;
     }
 
-    fseek(f, LGC_BASE_OFFSET+8, SEEK_SET);
+    fullLayer layer;
+    layerExt ext;
+    uint64_t offset = 0, len = 0;
+    memset(&layer, 0, sizeof(fullLayer));
+
+    FILE *src = NULL;
+    off_t record = ftello(f);
+    int failed = readHead(f, version, &layer, &ext) || !(src = openPayload(f, &layer, &ext));
+    if(!failed) attachPalette(&layer, &ext);
+    if(!failed && selectLevel(&layer, &ext, level, &offset, &len)) {
+        fprintf(stderr, "%s: layer %u has no level %u\n", __FUNCTION__, layer_n, level);
+        failed = 1;
+    }
 
-    int i;
-    for(i = 0; i < layer_n; ++i) {
+    if(!failed && rwopts&LGC_RW_BODY) {
 
-        fseek(f, 17, SEEK_CUR);
-        long len = 0;
-        if(fread(&len, 4, 1, f) != 1) {
-            if(rwopts&LGC_RW_FORCE_FILE_POINTER) rewind(f);
-            else fclose(f);
-        }
+        const uint32_t *checksum = NULL;
+        if(rwopts&LGC_RW_VERIFY && level < ext.checksums)
+            checksum = &ext.checksum[level];
+
+        layer.length = LGC_LAYER_BODY_LENGTH((&layer));
+        if(ext.delta_base)
+            failed = !(layer.data = decodeDeltaChain(fileReadAt, f, &layer, &ext, record, rwopts));
+        else if(fseeko(src, offset, SEEK_CUR) ||
+            !(layer.data = readBody(src, len, layer.format, layer.length,
+                                    level? 0: ext.sparse_len, ext.dict, checksum)))
+            failed = 1;
 
-        fseek(f, len, SEEK_CUR);
     }
 
-    lgcLayer *layer = lgcBlankLayer();
-    if(readLayer(f, layer, !(rwopts&LGC_RW_BODY))) {
+    if(src && src != f) fclose(src);
+
+    lgcLayer *read = NULL;
+    if(failed) {
         fprintf(stderr, "%s: read error\n", __FUNCTION__);
-        lgcDestroyLayer(layer, 1);
-        if(rwopts&LGC_RW_FORCE_FILE_POINTER) rewind(f);
-        else
-            fclose(f);
-        return NULL;
+        free(layer.data);
+        free(layer.palette);
     }
+    else read = newLayer(&layer);
 
     if(rwopts&LGC_RW_FORCE_FILE_POINTER)
         rewind(f);
     else
         fclose(f);
 
-    return layer;
+    return read;
+
+}
+
+// Reads the difference of a delta layer which head was just read, applying it to decoded 'base'
+static int readDeltaOnBase(FILE *f, fullLayer *layer, layerExt *ext, fullLayer *base, int rwopts) {
+
+    if(base->w != layer->w || base->h != layer->h || base->format != layer->format)
+        return -1;
+
+    off_t pos = ftello(f);
+    void *stored = malloc(ext->body_len? ext->body_len: 1);
+
+    if(!stored || (ext->body_len && fread(stored, ext->body_len, 1, f) != 1)) {
+        free(stored);
+        fseeko(f, pos, SEEK_SET);
+        return -1;
+    }
+
+    layer->length = LGC_LAYER_BODY_LENGTH(layer);
+    layer->data = deltaOnBase(base->data, layer, ext, stored,
+                              rwopts&LGC_RW_VERIFY && ext->checksums? &ext->checksum[0]: NULL);
+    free(stored);
+
+    if(!layer->data || fseeko(f, pos+ext->len, SEEK_SET)) {
+        free(layer->data);
+        layer->data = NULL;
+        fseeko(f, pos, SEEK_SET);
+        return -1;
+    }
+
+    return 0;
+
+}
+
+/*  Gives the layer pixels of 'owner', which has the same payload:
+    shared ones with LGC_RW_SHARE, a copy otherwise. */
+void copyLayerData(fullLayer *owner, fullLayer *layer, int rwopts) {
+
+    if(owner->borrowed) {
+        layer->data = owner->data;
+        layer->borrowed = 1;
+    }
+    else if(rwopts&LGC_RW_SHARE) {
+        if(!owner->refs) {
+            owner->refs = malloc(sizeof(int));
+            *owner->refs = 1;
+        }
+
+        layer->refs = owner->refs;
+        layer->data = owner->data;
+        (*layer->refs)++;
+    }
+    else {
+        layer->data = malloc(owner->length);
+        memcpy(layer->data, owner->data, owner->length);
+    }
+
+    layer->length = owner->length;
+    layer->levels = owner->levels;
 
 }
 
@@ -249,7 +864,7 @@ lgcImage * lgcReadImage(const char * filename, int rwopts)
 {
 
     if(!(rwopts&LGC_RW_ENTRIE)) return NULL;
-    FILE *f = rwopts&LGC_RW_FORCE_FILE_POINTER? (FILE*)filename: fopen(filename, "rb");
+    FILE *f = rwopts&LGC_RW_FORCE_FILE_POINTER? (FILE*)filename: openFile(filename, "rb");
     if(!f)
     {
         fprintf(stderr, rwopts&LGC_RW_FORCE_FILE_POINTER? "%s: filename is NULL\n":
@@ -260,27 +875,36 @@ lgcImage * lgcReadImage(const char * filename, int rwopts)
     lgcImage * img = malloc(sizeof(lgcImage));
     memset(img, 0, sizeof(lgcImage));
 
+    uint8_t head[8];
     if(fread(&img->unused, LGC_BASE_OFFSET, 1, f) != 1) RET_R_FAILURE;
-    if(fread(&img->magic, 4, 1, f) != 1) RET_R_FAILURE;
+    if(fread(head, 8, 1, f) != 1) RET_R_FAILURE;
+    img->magic = getLE32(head);
 
-    if(img->magic != LGC_MAGIC) {
+    int version = checkMagic(img->magic);
+    if(!version) {
         fprintf(stderr, "%s: bad magic number\n", __FUNCTION__);
         free(img);
         return NULL;
     }
 
-    if(fread(&img->layers_count, 4, 1, f) != 1) RET_R_FAILURE;
-    if(!img->layers_count) {
+    img->layers_count = getLE32(head+4);
 
-        if(rwopts&LGC_RW_FORCE_FILE_POINTER)
-            rewind(f);
-        else
-            fclose(f);
+    // the dictionary record is not a layer
+    int dict = loadDictionary(f, version);
 
-        return img;
+    // Edited files are read in the order their layer index tells
+    layerIndex idx;
+    memset(&idx, 0, sizeof(layerIndex));
+    int indexed = findIndex(f, version, &idx) == 0;
+    if(indexed) {
+        if(rwopts&LGC_RW_BODY && loadIndex(f, version, &idx)) RET_R_FAILURE;
+        img->layers_count = idx.count;
     }
+    else if(!(rwopts&LGC_RW_BODY) && img->layers_count) img->layers_count -= dict;
+
+    if(!img->layers_count || !(rwopts&LGC_RW_BODY)) {
+        freeIndex(&idx);
 
-    if(!(rwopts&LGC_RW_BODY)) {
         if(rwopts&LGC_RW_FORCE_FILE_POINTER)
             rewind(f);
         else
@@ -289,22 +913,81 @@ lgcImage * lgcReadImage(const char * filename, int rwopts)
         return img;
     }
 
-    img->layers = malloc(sizeof(lgcLayer)*img->layers_count);
+    // layers are read aside, shared and base ones being looked at by the later ones
+    fullLayer *read = calloc(img->layers_count, sizeof(fullLayer));
+
+    fseeko(f, LGC_BASE_OFFSET+8, SEEK_SET);
+
+    // Record offset (or blob key) of a payload to the layer having it decoded
+    offsetMap decoded;
+    mapInit(&decoded, 16);
+
+    uint32_t records = img->layers_count;
+    uint32_t i, n = 0;
+    for(i = 0; i < records; ++i) {
+
+        if(indexed && fseeko(f, idx.entries[i], SEEK_SET)) continue;
+
+        fullLayer *layer = &read[n];
+        layerExt ext;
+        off_t pos = ftello(f);
 
-    register int i;
-    for(i = 0; i < img->layers_count; ++i) {
+        if(readHead(f, version, layer, &ext)) {
+            memset(layer, 0, sizeof(fullLayer));
 
-        if(readLayer(f, &img->layers[i], 0)) {
+            // without index, place of the next record is lost along with this one
+            if(!indexed) {
+                fprintf(stderr, "%s: warning — corrupted layer %u, the rest is not read\n",
+                        __FUNCTION__, n);
+                break;
+            }
 
-            fprintf(stderr, "%s: warning — skipping corrupted layer\n", __FUNCTION__);
-            i--;
-            img->layers_count--;
+            fprintf(stderr, "%s: warning — corrupted layer %u is left blank\n", __FUNCTION__, n);
+            n++;
             continue;
+        }
+
+        if(ext.flags&(LGC_LAYER_DELETED|LGC_LAYER_HIDDEN)) {
+            fseeko(f, ext.len, SEEK_CUR);
+            continue;
+        }
 
+        attachPalette(layer, &ext);
+        uint64_t source = ext.blob? ext.blob|1ULL<<63: ext.ref? ext.ref: (uint64_t)pos;
+        uint32_t k;
+
+        if(!mapGet(&decoded, source, &k)) {
+            copyLayerData(&read[k], layer, rwopts);
+            fseeko(f, ext.len, SEEK_CUR);
+        }
+        else if(ext.delta_base && !mapGet(&decoded, ext.delta_base, &k) && read[k].data &&
+            !readDeltaOnBase(f, layer, &ext, &read[k], rwopts)) {
+            // made from the base decoded just before, rather than from the whole chain
+        }
+        else if(readLayerBody(f, layer, &ext, rwopts)) {
+            // the layer keeps it's place, so that numbers of the others match the file
+            fprintf(stderr, "%s: warning — corrupted layer %u is left without pixels\n",
+                    __FUNCTION__, n);
+            layer->length = 0;
+            fseeko(f, pos+ext.head_len+ext.len, SEEK_SET);
         }
+        else if(ext.flags&LGC_LAYER_SHARED || ext.ref || ext.blob) {
+            mapPut(&decoded, source, n);
+        }
+
+        n++;
 
     }
 
+    mapFree(&decoded);
+    img->layers_count = n;
+    freeIndex(&idx);
+
+    img->layers = malloc(sizeof(lgcLayer)*(n? n: 1));
+    for(i = 0; i < n; ++i)
+        storeLayer(&read[i], &img->layers[i]);
+    free(read);
+
     if(rwopts&LGC_RW_FORCE_FILE_POINTER) rewind(f);
     else fclose(f);
 
@@ -312,38 +995,648 @@ lgcImage * lgcReadImage(const char * filename, int rwopts)
 
 }
 
-int writeLayer(FILE *f, lgcLayer *layer) {
+/*  2x2 box filter: src (w x h) to dst (LGC_LEVEL_DIM(w, 1) x LGC_LEVEL_DIM(h, 1)).
+    Every byte of a pixel is treated as a separate 8-bit channel,
+    odd last row/column is repeated. */
+void downsample2x(const uint8_t *src, uint32_t w, uint32_t h, int bpp, uint8_t *dst) {
+
+    uint32_t dw = LGC_LEVEL_DIM(w, 1), dh = LGC_LEVEL_DIM(h, 1);
+    size_t row = (size_t)w*bpp;
+    uint16_t *sum = malloc(row*sizeof(uint16_t));
+
+    uint32_t x, y;
+    for(y = 0; y < dh; ++y) {
+
+        const uint8_t *r0 = src+2*y*row;
+        const uint8_t *r1 = 2*y+1 < h? r0+row: r0;
+
+        // vertical pass, sums of two rows
+        size_t i = 0;
+#ifdef __SSE2__
+        __m128i zero = _mm_setzero_si128();
+        for(; i+16 <= row; i += 16) {
+            __m128i a = _mm_loadu_si128((const __m128i*)(r0+i));
+            __m128i b = _mm_loadu_si128((const __m128i*)(r1+i));
+            _mm_storeu_si128((__m128i*)(sum+i),
+                _mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero)));
+            _mm_storeu_si128((__m128i*)(sum+i+8),
+                _mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero)));
+        }
+#endif
+        for(; i < row; ++i)
+            sum[i] = r0[i]+r1[i];
+
+        // horizontal pass
+        uint8_t *d = dst+(size_t)y*dw*bpp;
+        for(x = 0; x < dw; ++x) {
+            const uint16_t *p0 = sum+(size_t)2*x*bpp;
+            const uint16_t *p1 = 2*x+1 < w? p0+bpp: p0;
+
+            int c;
+            for(c = 0; c < bpp; ++c)
+                *d++ = (p0[c]+p1[c]+2)>>2;
+        }
 
-    int len = LGC_LAYER_BODY_LENGTH(layer);
-    char *compressed = NULL;
-    if(layer->format&LGC_FMT_COMPRESSED) {
-        len += 0x20;
-        compressed = malloc(len+0x100 /* reserved */);
-        len = LZ4_compress((char*)layer->data, compressed, LGC_LAYER_BODY_LENGTH(layer));
+    }
 
-        if(!len) {
+    free(sum);
+
+}
+
+// Compresses single LZ4 block, against the dictionary unless it's NULL
+static int packBlock(const char *src, char *dst, int len, const lz4Dict *dict) {
+
+    if(dict) return compressWithDictionary(dict, src, dst, len, LZ4_compressBound(len));
+    return LZ4_compress(src, dst, len);
+
+}
+
+// Returns stored (compressed when needed) form of 'size' bytes of pixels.
+// It's 'pixels' itself for uncompressed formats, otherwise free() it after use.
+// Over LGC_LZ4_BLOCK_MAX bytes, they are compressed in chunks (see FILE STRUCTURE).
+// Every block is compressed against 'dict', unless it's NULL.
+void * packBody(void *pixels, uint64_t size, uint8_t format, const lz4Dict *dict, uint64_t *len) {
+
+    if(!(format&LGC_FMT_COMPRESSED)) {
+        *len = size;
+        return pixels;
+    }
+
+    if(size <= LGC_LZ4_BLOCK_MAX) {
+        char *compressed = malloc(LZ4_compressBound(size));
+        int clen = compressed? packBlock((char*)pixels, compressed, size, dict): 0;
+
+        if(!clen) {
+            free(compressed);
+            return NULL;
+        }
+
+        *len = clen;
+        return compressed;
+    }
+
+    uint64_t chunks = (size+LGC_LZ4_CHUNK-1)/LGC_LZ4_CHUNK, done;
+    uint8_t *compressed = malloc(chunks*(4+LZ4_compressBound(LGC_LZ4_CHUNK)));
+    if(!compressed) return NULL;
+
+    uint8_t *p = compressed;
+    for(done = 0; done < size; done += LGC_LZ4_CHUNK) {
+        uint32_t chunk = size-done < LGC_LZ4_CHUNK? size-done: LGC_LZ4_CHUNK;
+        int clen = packBlock((char*)pixels+done, (char*)p+4, chunk, dict);
+
+        if(!clen) {
             free(compressed);
+            return NULL;
+        }
+
+        putLE32(p, clen);
+        p += 4+clen;
+    }
+
+    *len = p-compressed;
+    return realloc(compressed, *len);
+
+}
+
+// Starts extension record, returns where it's 'size' bytes of data go
+static uint8_t * putExtTag(uint8_t **p, uint16_t tag, uint32_t size) {
+    uint8_t *data = *p+6;
+    putLE16(*p, tag);
+    putLE32(*p+2, size);
+    *p = data+size;
+    return data;
+}
+
+// Encodes record's head and extension block; padding record is added when 'pad' >= 0
+void encodeHead(layerRecord *rec, int64_t pad) {
+
+    fullLayer *l = &rec->layer;
+
+    int32_t flags = l->flags;
+    int i;
+
+    rec->padding = pad > 0? pad: 0;
+    rec->len = rec->padding;
+    for(i = 0; i < rec->parts_count; ++i)
+        rec->len += rec->part_len[i];
+
+    // wide heads are decided first, their levels records are wider too
+    uint8_t *h = rec->head;
+    uint32_t head_len = packHead(h, l, flags, rec->len);
+    flags |= getLE32(h+13)&LGC_LAYER_WIDE;
+
+    uint8_t *e = h+head_len+4;
+    uint8_t *data;
+
+    if(l->levels) {
+        int w = flags&LGC_LAYER_WIDE? 8: 4;
+        data = putExtTag(&e, LGC_EXT_LEVELS, 1+w*l->levels);
+        data[0] = l->levels;
+        for(i = 0; i < l->levels; ++i) {
+            if(w == 8) putLE64(data+1+8*i, rec->part_len[1+i]);
+            else putLE32(data+1+4*i, rec->part_len[1+i]);
+        }
+    }
+
+    if(rec->hash)
+        putLE64(putExtTag(&e, LGC_EXT_HASH, 8), rec->hash);
+    if(rec->ref)
+        putLE64(putExtTag(&e, LGC_EXT_REF, 8), rec->ref);
+    if(rec->blob)
+        putLE64(putExtTag(&e, LGC_EXT_BLOB, 8), rec->blob);
+
+    if(rec->delta_base) {
+        data = putExtTag(&e, LGC_EXT_DELTA, 17);
+        putLE64(data, rec->delta_base);
+        data[8] = rec->delta_mode;
+        for(i = 0; i < 4; ++i)
+            putLE16(data+9+2*i, rec->delta_box[i]);
+    }
+
+    if(rec->sparse_len)
+        putLE32(putExtTag(&e, LGC_EXT_SPARSE, 4), rec->sparse_len);
+    if(rec->dict)
+        putLE64(putExtTag(&e, LGC_EXT_DICT, 8), rec->dict);
+    if(l->palette && l->colors)
+        memcpy(putExtTag(&e, LGC_EXT_PALETTE, 4*l->colors), l->palette, 4*l->colors);
+
+    if(rec->parts_count) {
+        data = putExtTag(&e, LGC_EXT_CHECKSUM, 4*rec->parts_count);
+        for(i = 0; i < rec->parts_count; ++i)
+            putLE32(data+4*i, rec->checksum[i]);
+    }
+
+    if(pad >= 0)
+        putLE32(putExtTag(&e, LGC_EXT_PADDING, 4), rec->padding);
+
+    uint32_t ext_len = e-(h+head_len+4);
+    if(ext_len) flags |= LGC_LAYER_EXTENDED;
+
+    packHead(h, l, flags, rec->len);
+    rec->head_len = head_len;
+
+    if(ext_len) {
+        putLE32(h+head_len, ext_len);
+        rec->head_len += 4+ext_len;
+    }
+
+}
+
+/*  Prepares the layer for writing: compresses it's pixels, generates
+    reduced-resolution levels and checksums. 'flags' are library's
+    flags to store with it; with LGC_PACK_DICT among them, the layer
+    is compressed against the writer's dictionary. Returns non-zero
+    on failure, freeRecord() is to be called in any case. */
+int packLayer(fullLayer *layer, int32_t flags, layerRecord *rec) {
+    return packRecord(layer, flags, layer->data, LGC_LAYER_BODY_LENGTH(layer), 0, rec);
+}
+
+/*  Same as packLayer(), with 'len' bytes of 'body' stored in place
+    of the layer's own pixels: the sparse form of them, when 'sparse'
+    is set. 'body' is to stay valid until the record is written. */
+int packRecord(fullLayer *layer, int32_t flags, void *pixels, uint64_t len, int sparse,
+               layerRecord *rec) {
+
+    const lz4Dict *dict = NULL;
+    if(flags&LGC_PACK_DICT && layer->format&LGC_FMT_COMPRESSED)
+        dict = writerDictionary(LGC_RW_DICT);
+
+    memset(rec, 0, sizeof(layerRecord));
+    memcpy(&rec->layer, layer, sizeof(fullLayer));
+    rec->layer.flags = (layer->flags&~LGC_LAYER_RESERVED)|(flags&~LGC_PACK_DICT);
+    rec->layer.levels = layer->levels > LGC_MAX_LEVELS? LGC_MAX_LEVELS: layer->levels;
+    rec->hash = layerKey(&rec->layer);
+    rec->sparse_len = sparse? len: 0;
+    rec->dict = dict? dict->key: 0;
+
+    int bpp = LGC_BYTES_PER_PIXEL(layer->format);
+
+    void *body = packBody(pixels, len, layer->format, dict, &rec->part_len[0]);
+    if(!body) return -1;
+    if(body != pixels) rec->owned[rec->owned_count++] = body;
+    rec->parts[rec->parts_count++] = body;
+
+    // Reduced-resolution levels, each one made from the previous
+    uint8_t *prev = layer->data;
+
+    // block-compressed ones are made of decoded pixels, and encoded again;
+    // indexed ones are averaged in RGBA, then mapped to the palette
+    int block = layer->format&LGC_FMT_BLOCK;
+    int indexed = isIndexed(layer->format) && layer->palette;
+    if((block || indexed) && rec->layer.levels) {
+        bpp = 4;
+        prev = malloc((size_t)layer->w*layer->h*bpp);
+        rec->owned[rec->owned_count++] = prev;
+        if(!prev || (block && decodeBlocks(layer->data, layer->w, layer->h, layer->format, prev)))
             return -1;
+        if(indexed)
+            expandPalette(layer->data, (uint64_t)layer->w*layer->h, layer->palette, layer->colors,
+                          prev);
+    }
+
+    int k;
+    for(k = 1; k <= rec->layer.levels; ++k) {
+        uint32_t pw = LGC_LEVEL_DIM(layer->w, k-1), ph = LGC_LEVEL_DIM(layer->h, k-1);
+        uint32_t w = LGC_LEVEL_DIM(layer->w, k), h = LGC_LEVEL_DIM(layer->h, k);
+
+        uint8_t *pixels = malloc((size_t)w*h*bpp);
+        rec->owned[rec->owned_count++] = pixels;
+        downsample2x(prev, pw, ph, bpp, pixels);
+        prev = pixels;
+
+        uint8_t *level = pixels;
+        uint64_t level_len = (uint64_t)w*h*bpp;
+        if(block) {
+            level_len = LGC_PIXELS_LENGTH(layer->format, w, h);
+            level = malloc(level_len);
+            rec->owned[rec->owned_count++] = level;
+            if(!level || encodeBlocks(pixels, w, h, LGC_FMT_RGBA8, layer->format, level, 0))
+                return -1;
         }
+        else if(indexed) {
+            level_len = (uint64_t)w*h;
+            level = malloc(level_len);
+            rec->owned[rec->owned_count++] = level;
+            if(!level) return -1;
+            mapToPalette(pixels, level_len, layer->palette, layer->colors, level);
+        }
+
+        body = packBody(level, level_len, layer->format, dict, &rec->part_len[k]);
+        if(!body) return -1;
+        if(body != level) rec->owned[rec->owned_count++] = body;
+        rec->parts[rec->parts_count++] = body;
+    }
+
+    for(k = 0; k < rec->parts_count; ++k)
+        rec->checksum[k] = crc32c(0, rec->parts[k], rec->part_len[k]);
+
+    encodeHead(rec, -1);
+    return 0;
+
+}
+
+// Prepares a record which payload is stored elsewhere: in record at 'ref' or in a blob
+void packRef(fullLayer *layer, uint64_t key, uint64_t ref, uint64_t blob, layerRecord *rec) {
+
+    memset(rec, 0, sizeof(layerRecord));
+    memcpy(&rec->layer, layer, sizeof(fullLayer));
+    rec->layer.flags &= ~LGC_LAYER_RESERVED;
+    rec->layer.levels = 0; // levels are where the payload is
+
+    rec->hash = key;
+    rec->ref = ref;
+    rec->blob = blob;
+
+    encodeHead(rec, -1);
+
+}
+
+/*  Grows the record to exactly 'size' bytes on disk with padding,
+    so it can take place of another one. Returns non-zero if it does not fit. */
+int padRecord(layerRecord *rec, uint64_t size) {
+
+    if(RECORD_SIZE(rec) == size && !rec->padding) return 0;
+
+    encodeHead(rec, 0);
+    if(RECORD_SIZE(rec) > size || size-RECORD_SIZE(rec) > UINT32_MAX) {
+        encodeHead(rec, -1);
+        return 1;
+    }
+
+    // padding which makes the head wide would not fit
+    encodeHead(rec, size-RECORD_SIZE(rec));
+    if(RECORD_SIZE(rec) != size) {
+        encodeHead(rec, -1);
+        return 1;
     }
 
-    if(fwrite(&layer->w, 2, 1, f) != 1) return -1;
-    if(fwrite(&layer->h, 2, 1, f) != 1) return -1;
-    if(fwrite(&layer->x, 4, 1, f) != 1) return -1;
-    if(fwrite(&layer->y, 4, 1, f) != 1) return -1;
-    if(fwrite(&layer->format, 1, 1, f) != 1) return -1;
-    if(fwrite(&layer->flags, 4, 1, f) != 1) return -1;
-    if(fwrite(&len, 4, 1, f) != 1) return -1;
-    if(fwrite((layer->format&LGC_FMT_COMPRESSED)?
-                compressed:
-                layer->data, len, 1, f) != 1) return -1;
+    return 0;
+
+}
+
+// Writes the record; padding bytes are skipped rather than written
+int writeRecord(FILE *f, layerRecord *rec) {
 
-    if(compressed) free(compressed);
+    if(fwrite(rec->head, rec->head_len, 1, f) != 1) return -1;
+
+    int i;
+    for(i = 0; i < rec->parts_count; ++i)
+        if(rec->part_len[i] && fwrite(rec->parts[i], rec->part_len[i], 1, f) != 1) return -1;
 
     return 0;
 
 }
 
+void freeRecord(layerRecord *rec) {
+    int i;
+    for(i = 0; i < rec->owned_count; ++i)
+        free(rec->owned[i]);
+    rec->owned_count = 0;
+}
+
+int writeLayer(FILE *f, fullLayer *layer) {
+
+    layerRecord rec;
+    int ret = packLayer(layer, 0, &rec) || writeRecord(f, &rec)? -1: 0;
+    freeRecord(&rec);
+    return ret;
+
+}
+
+int lgcSetBlobStore(const char * path) {
+
+    free(blob_store);
+    blob_store = NULL;
+
+    if(!path) return 0;
+
+    if(mkdir(path, 0777) && errno != EEXIST) {
+        fprintf(stderr, "%s: can't create blob store directory (%s)\n", __FUNCTION__, path);
+        return -1;
+    }
+
+    blob_store = strdup(path);
+    return 0;
+
+}
+
+/*  Whether the blob at 'path' holds the layer: keys may collide, so
+    the head and then the pixels are compared with the layer's own */
+static int sameBlob(const char *path, fullLayer *layer) {
+
+    FILE *f = fopen(path, "rb");
+    if(!f) return 0;
+
+    fullLayer stored;
+    layerExt ext;
+    memset(&stored, 0, sizeof(fullLayer));
+
+    uint8_t levels = layer->levels > LGC_MAX_LEVELS? LGC_MAX_LEVELS: layer->levels;
+    uint16_t colors = layer->palette? layer->colors: 0;
+
+    int same = !readHead(f, LGC_STORE_VERSION, &stored, &ext) && !ext.ref && !ext.blob &&
+        !ext.delta_base && stored.w == layer->w && stored.h == layer->h && stored.format == layer->format &&
+        stored.levels == levels && ext.colors == colors &&
+        (!colors || !memcmp(ext.palette, layer->palette, 4*colors)) &&
+        !readLayerBody(f, &stored, &ext, LGC_RW_VERIFY) &&
+        !memcmp(stored.data, layer->data, stored.length);
+
+    free(stored.data);
+    fclose(f);
+    return same;
+
+}
+
+/*  Writes the layer to the blob store, unless it is there already.
+    Returns 1 if the key is taken by a blob of other content. */
+static int storeBlob(fullLayer *layer, uint64_t key) {
+
+    char path[4096], tmp[4096+16];
+    if(blobPath(key, path, sizeof(path))) return -1;
+
+    if(!access(path, F_OK)) {
+        if(sameBlob(path, layer)) return 0;
+        fprintf(stderr, "lgc: blob %s holds other content, the layer is kept in the file\n", path);
+        return 1;
+    }
+
+    // written aside and renamed, for other writers not to see it incomplete
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+    FILE *f = fopen(tmp, "wb");
+    if(!f) {
+        fprintf(stderr, "lgc: can't write to the blob store (%s)\n", tmp);
+        return -1;
+    }
+
+    fullLayer blob;
+    memcpy(&blob, layer, sizeof(fullLayer));
+    blob.x = blob.y = 0;
+    blob.flags = 0;
+
+    int ret = writeLayer(f, &blob);
+    if(fclose(f)) ret = -1;
+
+    if(ret || rename(tmp, path)) {
+        remove(tmp);
+        return -1;
+    }
+
+    return 0;
+
+}
+
+static int sameContent(fullLayer *a, fullLayer *b) {
+    uint16_t colors = a->palette? a->colors: 0;
+    return a->w == b->w && a->h == b->h && a->format == b->format &&
+        a->levels == b->levels && colors == (b->palette? b->colors: 0) &&
+        (!colors || !memcmp(a->palette, b->palette, 4*colors)) &&
+        !memcmp(a->data, b->data, LGC_LAYER_BODY_LENGTH(a));
+}
+
+// Whether 'layer' can be stored as a delta against 'base'
+static int deltaFits(fullLayer *layer, fullLayer *base) {
+    return layer->w == base->w && layer->h == base->h && layer->format == base->format &&
+        !(layer->format&LGC_FMT_BLOCK) && !layer->levels && !base->levels &&
+        layer->w <= 0xffff && layer->h <= 0xffff && layer->data && base->data;
+}
+
+/*  Plans writing of image's layers, so that identical ones are stored once
+    (unless 'dedup' is zero or rwopts tell otherwise) or, with LGC_RW_DELTA,
+    which layers are stored as deltas. freePlan() after use. */
+void planLayers(writePlan *plan, lgcImage *image, int rwopts, int dedup) {
+
+    uint32_t count = image->layers_count, i;
+
+    memset(plan, 0, sizeof(writePlan));
+    plan->image = image;
+    plan->layers = malloc(sizeof(fullLayer)*(count+1));
+    for(i = 0; i < count; ++i)
+        loadLayer(&image->layers[i], &plan->layers[i]);
+    plan->rwopts = rwopts;
+    plan->dict = writerDictionary(rwopts);
+
+    if(rwopts&LGC_RW_BLOB_STORE) return;
+
+    // an identical layer is an empty delta, when it's the next one
+    if(rwopts&(LGC_RW_NO_DEDUP|LGC_RW_DELTA)) dedup = 0;
+    if(!dedup && !(rwopts&LGC_RW_DELTA)) return;
+
+    plan->offsets = malloc(sizeof(int64_t)*count);
+    for(i = 0; i < count; ++i)
+        plan->offsets[i] = -1;
+
+    if(dedup) {
+        plan->keys = malloc(sizeof(uint64_t)*count);
+        plan->owner = malloc(sizeof(uint32_t)*count);
+
+        offsetMap first;
+        mapInit(&first, count);
+
+        for(i = 0; i < count; ++i) {
+            uint32_t j;
+            plan->keys[i] = layerKey(&plan->layers[i]);
+            plan->owner[i] = i;
+
+            if(mapGet(&first, plan->keys[i], &j))
+                mapPut(&first, plan->keys[i], i);
+            else if(sameContent(&plan->layers[i], &plan->layers[j])) {
+                plan->owner[i] = j;
+                plan->offsets[j] = 0;
+            }
+        }
+
+        mapFree(&first);
+        return;
+    }
+
+    // Deltas are taken against the previous layer, starting over
+    // with a whole one every LGC_DELTA_KEYFRAME layers
+    plan->base = malloc(sizeof(int32_t)*count);
+
+    uint32_t depth = 0;
+    for(i = 0; i < count; ++i) {
+        plan->base[i] = -1;
+
+        if(!i || ++depth == LGC_DELTA_KEYFRAME ||
+            !deltaFits(&plan->layers[i], &plan->layers[i-1])) {
+            depth = 0;
+            continue;
+        }
+
+        plan->base[i] = i-1;
+        plan->offsets[i-1] = 0;
+    }
+
+}
+
+/*  Prepares the record of layer 'i', to be written at offset 'pos'.
+    Layers are to be packed in order. freeRecord() is to be called in any case. */
+int packPlanned(writePlan *plan, uint32_t i, uint64_t pos, layerRecord *rec) {
+
+    fullLayer *layer = &plan->layers[i];
+    int sparse = plan->rwopts&LGC_RW_SPARSE;
+    int delta = plan->base && (plan->base[i] >= 0 || !plan->offsets[i]);
+    memset(rec, 0, sizeof(layerRecord));
+
+    // layers of few colors are indexed, unless deltas are taken with them;
+    // identical layers get the same palette, so references stay valid
+    fullLayer indexed;
+    void *indices = NULL;
+    if(plan->rwopts&LGC_RW_PALETTE && !delta && (indices = indexLayer(layer, &indexed)))
+        layer = &indexed;
+
+    // deltas and their bases are to keep the size they have, spans of wide
+    // layers do not fit the sparse form; only transparent pixels are left out:
+    // all-zero ones of RGBA layers, zero indices when entry 0 is clear
+    const uint8_t clear[4] = {0, 0, 0, 0};
+    if(delta) sparse = 0;
+    if(layer->w > 0xffff || layer->h > 0xffff) sparse = 0;
+    if(isIndexed(layer->format)) {
+        if(!layer->palette || memcmp(layer->palette, clear, 4)) sparse = 0;
+    }
+    else if(!hasAlpha(layer->format)) sparse = 0;
+
+    // identical layers are trimmed the same way, so references stay valid
+    fullLayer view;
+    void *cropped = NULL;
+    if(sparse) {
+        cropped = trimLayer(layer, &view);
+        layer = &view;
+    }
+
+    int ret = 1;
+    if(plan->rwopts&LGC_RW_BLOB_STORE) {
+        uint64_t key = layerKey(layer);
+        if(!(ret = storeBlob(layer, key)))
+            packRef(layer, key, 0, key, rec);
+    }
+    else if(plan->keys && plan->owner[i] != i) {
+        uint64_t key = sparse || indices? layerKey(layer): plan->keys[i];
+        packRef(layer, key, plan->offsets[plan->owner[i]], 0, rec);
+        ret = 0;
+    }
+
+    if(ret > 0) {
+        int32_t flags = 0;
+        if(plan->offsets && !plan->offsets[i]) {
+            plan->offsets[i] = pos;
+            flags = LGC_LAYER_SHARED;
+        }
+
+        ret = 1;
+        if(plan->base && plan->base[i] >= 0) {
+            int32_t j = plan->base[i];
+            ret = packDelta(layer, &plan->layers[j], plan->offsets[j], flags, rec);
+            if(ret > 0) freeRecord(rec);
+        }
+
+        if(plan->dict) flags |= LGC_PACK_DICT;
+
+        if(ret > 0) ret = sparse? packSparse(layer, flags, rec): packLayer(layer, flags, rec);
+    }
+
+    // the record may point into them
+    if(cropped) rec->owned[rec->owned_count++] = cropped;
+    if(indices) rec->owned[rec->owned_count++] = indices;
+
+    return ret;
+
+}
+
+// Dictionary which record is written along with the image's layers, NULL if none
+const lz4Dict * storedDictionary(int rwopts, lgcImage *image) {
+
+    if(rwopts&LGC_RW_DICT_ELSEWHERE || !(rwopts&LGC_RW_BODY) || !image->layers_count)
+        return NULL;
+    return writerDictionary(rwopts);
+
+}
+
+/*  Magic number of the file the image is written to: v2 when any layer
+    record is, all of them having the library's flags and extensions */
+uint32_t writtenMagic(int rwopts, lgcImage *image) {
+    return rwopts&LGC_RW_BODY && image->layers_count? LGC_MAGIC_V2: image->magic;
+}
+
+void freePlan(writePlan *plan) {
+    free(plan->layers);
+    free(plan->keys);
+    free(plan->base);
+    free(plan->owner);
+    free(plan->offsets);
+    memset(plan, 0, sizeof(writePlan));
+}
+
+// Writes image's layers, storing identical ones once
+static int writeLayers(FILE *f, int rwopts, lgcImage *image) {
+
+    writePlan plan;
+    planLayers(&plan, image, rwopts, ftello(f) >= 0);
+
+    int ret = 0;
+    uint32_t i;
+
+    const lz4Dict *dict = storedDictionary(rwopts, image);
+    if(dict) {
+        layerRecord rec;
+        packDictionary(dict, &rec);
+        ret = writeRecord(f, &rec);
+    }
+
+    for(i = 0; !ret && i < image->layers_count; ++i) {
+
+        layerRecord rec;
+        ret = packPlanned(&plan, i, ftello(f), &rec);
+        if(!ret) ret = writeRecord(f, &rec);
+        freeRecord(&rec);
+
+    }
+
+    freePlan(&plan);
+    return ret;
+
+}
+
 int lgcWriteToFile(const char * filename, int rwopts, lgcImage* image)
 {
 
@@ -354,22 +1647,24 @@ int lgcWriteToFile(const char * filename, int rwopts, lgcImage* image)
         return -1;
     }
 
-    if(image->magic != LGC_MAGIC) {
+    if(!magicVersion(image->magic)) {
         fprintf(stderr, "%s: 'image' is not a LGC?\n", __FUNCTION__);
         return -1;
     }
 
     FILE *f = rwopts&LGC_RW_FORCE_FILE_POINTER? (FILE*)filename: NULL;
     if(rwopts&LGC_RW_FORCE_FILE_POINTER) rewind(f); else {
-        if(!(f = fopen(filename, "wb"))) {
+        if(!(f = openFile(filename, "wb"))) {
             fprintf(stderr, "%s: can't open the file for writing (%s)\n", __FUNCTION__, filename);
             return -1;
         }
     }
 
     if(fwrite(&image->unused, LGC_BASE_OFFSET, 1, f) != 1) RET_W_FAILURE;
-    if(fwrite(&image->magic, 4, 1, f) != 1) RET_W_FAILURE;
-    if(fwrite(&image->layers_count, 4, 1, f) != 1) RET_W_FAILURE;
+    uint8_t head[8];
+    putLE32(head, writtenMagic(rwopts, image));
+    putLE32(head+4, image->layers_count+(storedDictionary(rwopts, image)? 1: 0));
+    if(fwrite(head, 8, 1, f) != 1) RET_W_FAILURE;
 
     if(!image->layers_count) {
         if(rwopts&LGC_RW_FORCE_FILE_POINTER) rewind(f);
@@ -385,22 +1680,22 @@ int lgcWriteToFile(const char * filename, int rwopts, lgcImage* image)
         return 0;
     }
 
-    register int i;
-    for(i = 0; i < image->layers_count; ++i) {
-
-        if(writeLayer(f, &image->layers[i])) {
-            fprintf(stderr, "%s: write error\n", __FUNCTION__);
+    if(writeLayers(f, rwopts, image)) {
+        fprintf(stderr, "%s: write error\n", __FUNCTION__);
 
-            if(rwopts&LGC_RW_FORCE_FILE_POINTER) rewind(f);
-            else fclose(f);
-
-            return -1;
-        }
+        if(rwopts&LGC_RW_FORCE_FILE_POINTER) rewind(f);
+        else fclose(f);
 
+        return -1;
     }
 
+    // with write-behind buffering, the last of the data is written here
     if(rwopts&LGC_RW_FORCE_FILE_POINTER) rewind(f);
-    else fclose(f);
+    else if(fclose(f)) {
+        fprintf(stderr, "%s: write error\n", __FUNCTION__);
+        return -1;
+    }
+
     return 0;
 
 }
@@ -419,36 +1714,23 @@ int lgcAppendLayerToFile(const char * filename, int rwopts, lgcLayer *layer) {
         return 1;
     }
 
-    if(checkHead(f, NULL)) {
+    if(checkHead(f, NULL, NULL)) {
         fprintf(stderr, "%s: bad magic number\n", __FUNCTION__);
         fclose(f);
         return 1;
     }
 
-    fseek(f, 0, SEEK_END);
-    if(writeLayer(f, layer)) {
+    fullLayer full;
+    layerRecord rec;
+    loadLayer(layer, &full);
+    if(packLayer(&full, 0, &rec) || upgradeHead(f) || appendRecord(f, &rec)) {
         fprintf(stderr, "%s: error occured while writing\n", __FUNCTION__);
+        freeRecord(&rec);
         fclose(f);
         return 1;
     }
 
-    uint32_t l_count = 0;
-
-    fseek(f, LGC_BASE_OFFSET+4, SEEK_SET);
-    if(fread(&l_count, 4, 1, f) != 1) {
-        fprintf(stderr, "%s: failed to read layers_count\n", __FUNCTION__);
-        fclose(f);
-        return 1;
-    }
-
-    l_count += 1;
-    fseek(f, LGC_BASE_OFFSET+4, SEEK_SET);
-    if(fwrite(&l_count, 4, 1, f) != 1) {
-        fprintf(stderr, "%s: failed to overwrite layers_count\n", __FUNCTION__);
-        fclose(f);
-        return 1;
-    }
-
+    freeRecord(&rec);
     fclose(f);
     return 0;
 
@@ -4,7 +4,7 @@
 /* lgc.h */
 
 #define LGC_VERSION_MAJOR   0
-#define LGC_VERSION_MINOR   3
+#define LGC_VERSION_MINOR   4
 #define LGC_VERSION_MICRO   0
 
 /**
@@ -23,9 +23,21 @@
 /*  -- FILE STRUCTURE --
 
     32 bytes        | unused (may contain custom data)
-    4 bytes         | magic
+    4 bytes         | magic (LGC_MAGIC or LGC_MAGIC_V2)
     uint32          | layers_count
 
+    All fields are little-endian; the magic, read as one, tells
+    a byte-swapped file from a foreign one.
+
+    In v2 files (LGC_MAGIC_V2) the upper byte of layer 'flags'
+    (LGC_LAYER_RESERVED) belongs to the library, telling of wide heads,
+    extension blocks and records which are not layers; bits set there
+    by the application are dropped when the layer is written. In v1
+    files (LGC_MAGIC) all of 'flags' are the application's, and records
+    are plain layers, without wide heads or extension blocks. Files
+    are written as v2, so that older readers refuse them rather than
+    misread.
+
     Layers table
     (repeating for layers_count)
 
@@ -37,10 +49,170 @@
         uint8           | format
         int             | flags
         uint32          | length
-        raw             | data (pixels)
+        [wide]          | only if (flags & LGC_LAYER_WIDE)
+        [extension]     | only if (flags & LGC_LAYER_EXTENDED)
+        raw             | data (pixels, 'length' bytes)
 
     ...
 
+    Wide head, for layers larger than the fields above can tell:
+    over 65535 pixels along a side, or with more than 4 GiB of payload:
+        uint16          | high 16 bits of width
+        uint16          | high 16 bits of height
+        uint32          | high 32 bits of length
+    LEVELS records of such layers hold uint64 lengths.
+
+    Layer extension block:
+        uint32          | ext_length
+        records         | ext_length bytes, each record is
+            uint16          | tag (LGC_EXT_*)
+            uint32          | size
+            raw             | record data (size bytes)
+
+    Records with unknown tags are skipped by readers. When a layer
+    has an extension, 'length' covers its whole stored payload: the
+    layer's own pixels come first, and the records describe whatever
+    follows them.
+
+    LGC_EXT_LEVELS record:
+        uint8           | levels count (n)
+        n*uint32        | stored lengths of levels 1..n
+        Reduced-resolution copies of the layer (level k is the layer
+        downsampled by 2^k, see LGC_LEVEL_DIM), stored in the payload
+        right after the full-resolution pixels, compressed the same
+        way the layer is.
+
+    Compressed pixels (or levels) over LGC_LZ4_BLOCK_MAX bytes do not
+    fit a single LZ4 block. They are stored as a sequence of chunks,
+    each one being uint32 compressed length, then LZ4 block of
+    LGC_LZ4_CHUNK bytes (fewer for the last one).
+
+    LGC_EXT_HASH record:
+        uint64          | content key: XXH64 of the pixels, seeded with
+                          w | h<<16 | format<<32 | levels<<40 (low halves
+                          of w and h; high ones are XOR'ed in at bits 48
+                          and 56); indexed layers' palette is hashed
+                          on top, seeded with that
+
+    LGC_EXT_REF record:
+        uint64          | offset of the record which payload this layer
+                          shares (flagged LGC_LAYER_SHARED), the layer's
+                          own payload is empty. Written for layers equal
+                          to an earlier one (same key and pixels).
+
+    LGC_EXT_BLOB record:
+        uint64          | content key of the payload in the blob store
+                          (see lgcSetBlobStore), own payload is empty.
+        Blob store is a directory of "<key in hex>.lgcb" files, each one
+        holding a single layer record.
+
+    LGC_EXT_CHECKSUM record:
+        n*uint32        | CRC32C of the stored (compressed) pixels of the
+                          layer, then of each of it's levels. Written for
+                          every record having it's own payload.
+
+    LGC_EXT_DELTA record:
+        uint64          | offset of the base record
+        uint8           | mode (LGC_DELTA_*)
+        4*uint16        | x, y, w, h of the changed box, in pixels
+        Payload holds the difference between the layer and the base
+        one (of the same size and format) inside the box, compressed
+        when the format is: byte-wise XOR of the two, or the layer
+        minus the base. Pixels outside the box are the base ones.
+        Written with LGC_RW_DELTA; the base (flagged LGC_LAYER_SHARED)
+        may be a delta itself, up to LGC_DELTA_KEYFRAME records deep.
+
+    LGC_EXT_SPARSE record:
+        uint32          | decoded length of the sparse form
+        The layer's own pixels (not the levels) are stored in sparse
+        form, compressed as a whole when the format is:
+            uint16          | rows count (h)
+            h*(2*uint16)    | first pixel and count of pixels of the
+                              span kept in each row (0, 0 if empty)
+            raw             | pixels of the spans, row by row
+        Pixels outside of the spans are all-zero (fully transparent).
+        Written with LGC_RW_SPARSE for RGBA and indexed layers, when the spans leave a quarter of
+        the layer out at least.
+
+    LGC_EXT_DICT record:
+        uint64          | key of the dictionary: XXH64 of it's bytes, seed 0
+        The layer's LZ4 blocks (pixels, levels, chunks) are compressed
+        against that dictionary, each one on it's own; deltas are not.
+        A record flagged LGC_LAYER_HIDDEN with this record in it's
+        extension holds the dictionary itself (up to LGC_DICT_MAX bytes)
+        as the payload. Written with LGC_RW_DICT as the first record of
+        the file, or of the archive (see ARCHIVES); readers load it from
+        there, and keep it for other files using the same one.
+
+    LGC_EXT_PALETTE record:
+        n*4 bytes       | RGBA entries of the palette, n is 1 to 256
+        Palette of an indexed layer (LGC_FMT_INDEXED): it's pixels are
+        indices of the entries, one byte each. Levels of such a layer
+        are averaged in RGBA and mapped back to the nearest entries.
+
+    LGC_EXT_PADDING record:
+        uint32          | unused bytes at the end of the payload
+        Left by in-place layer replacement, when the new layer is
+        smaller than the old one; lgcCompactFile() drops them.
+
+*/
+
+/*  -- EDITED FILES --
+
+    lgcReplaceLayerInFile() and lgcDeleteLayerFromFile() never move
+    other layers. A replaced layer is written over the old one when
+    it fits there; otherwise it goes to a free place and the old
+    record is marked with LGC_LAYER_DELETED (a tombstone), which is
+    kept in the file (and in layers_count) until lgcCompactFile().
+
+    Tombstones, the index and the layers written are the library's
+    records, so a v1 file is turned into v2 by the first edit (and by
+    lgcAppendLayerToFile), for older readers to refuse it. A v1 file
+    having layers with bits of LGC_LAYER_RESERVED in their flags can't
+    be edited: those would mean something else in v2.
+
+    Layers order of such files is kept by the layer index, a record
+    flagged LGC_LAYER_HIDDEN which is always the last one in file:
+        head            | zero w, h, x, y, format
+        extension       | LGC_EXT_INDEX record:
+            uint32          | layers count
+            uint32          | free records count
+        payload:
+            count*uint64    | offsets of layer records, in layers order
+            free*2*uint64   | offsets and sizes of deleted records
+            raw             | reserve for more entries
+            uint64          | offset of the index record itself
+            uint32          | LGC_INDEX_MAGIC
+
+    When a file has an index, layers_count in the file head is the
+    number of records, while the index holds the number of layers.
+
+*/
+
+/*  -- ARCHIVES --
+
+    Many images packed into one file (see lgcWriteArchive):
+
+    32 bytes        | unused
+    4 bytes         | LGC_ARCHIVE_MAGIC
+    uint32          | images count (n)
+    uint64          | directory offset
+
+    Archives written with LGC_RW_DICT have the dictionary record (see
+    LGC_EXT_DICT) right here, and images don't have their own.
+    Images follow, each one a whole LGC file as lgcWriteImageToBuffer()
+    makes it, at an 8-byte aligned offset. Offsets inside of an image
+    (LGC_EXT_REF, the layer index, ..) count from it's start.
+
+    Directory, sorted by the name hash, then by the name bytes:
+        n entries:
+            uint64          | XXH64 of the name, seed 0
+            uint64          | image offset
+            uint64          | image length
+            uint32          | name offset, from the directory start
+            uint32          | name length
+        names           | each one followed by a zero byte
+
 */
 
 /*  -- FORMAT FLAGS --
@@ -55,14 +227,31 @@
      | |    |     -------------- bits per pixel
      | |    -------------------- color model
      | ------------------------- compressed?
-     --------------------------- unused
+     --------------------------- block-compressed?
+
+    Block-compressed layers (LGC_FMT_BLOCK) hold pixels in a GPU
+    texture format instead, in 4x4 pixel blocks, row by row; the low
+    bits tell which one (LGC_FMT_BC1, ..). Blocks at the right and
+    bottom edges are padded with copies of the edge pixels. Such
+    layers may be compressed (LGC_FMT_COMPRESSED) on top of that.
+
+    Indexed layers (LGC_FMT_INDEXED, 8 bits only) hold a byte per
+    pixel, the index of it's color in the layer's palette (see
+    LGC_EXT_PALETTE); indices past the palette's end are transparent.
 
 */
 
 #define LGC_BASE_OFFSET 0x20
 #define LGC_MAGIC 0x100006ff
+#define LGC_MAGIC_V2 0x200006ff     // upper byte of layer flags is the library's
+#define LGC_ARCHIVE_MAGIC 0x1a7c0eff
+
+#define LGC_LZ4_BLOCK_MAX   0x7e000000  // LZ4_MAX_INPUT_SIZE
+#define LGC_LZ4_CHUNK       (1u<<30)    // see FILE STRUCTURE
+#define LGC_DICT_MAX        0x10000     // LZ4 dictionaries take no more than the window
 
 #include <stdint.h>
+#include <stddef.h>
 
 // Layer struct
 typedef struct {
@@ -77,8 +266,50 @@ typedef struct {
     // Note that 'data' does not stores compressed pixels,
     // and 'length" tells it's uncompressed size.
 
+    // Levels count and palette of the layer are kept by the library
+    // aside of it (see lgcSetLayerLevels, lgcSetLayerPalette), until
+    // the layer is freed with lgcDestroyLayer() or lgcDestroyImage().
+    // So are size and length of layers too large for the fields above
+    // (see lgcSetLayerSize), which then hold 0xffff and UINT32_MAX.
+
 } lgcLayer;
 
+// Layer flags reserved by the library (upper byte of 'flags' in v2 files,
+// see FILE STRUCTURE); the application's own flags go to the lower 24 bits
+#define LGC_LAYER_EXTENDED  0x01000000  // extension block follows the head
+#define LGC_LAYER_DELETED   0x02000000  // tombstone, to be skipped by readers
+#define LGC_LAYER_HIDDEN    0x04000000  // library's own record, not a layer
+#define LGC_LAYER_SHARED    0x08000000  // payload referenced by other layers
+#define LGC_LAYER_WIDE      0x20000000  // high halves of w, h, length follow the head
+#define LGC_LAYER_RESERVED  0xff000000
+
+// Extension record tags
+#define LGC_EXT_LEVELS      1
+#define LGC_EXT_PADDING     2
+#define LGC_EXT_INDEX       3
+#define LGC_EXT_HASH        4
+#define LGC_EXT_REF         5
+#define LGC_EXT_BLOB        6
+#define LGC_EXT_CHECKSUM    7
+#define LGC_EXT_DELTA       8
+#define LGC_EXT_SPARSE      9
+#define LGC_EXT_DICT        10
+#define LGC_EXT_PALETTE     11
+
+// Delta modes (see LGC_EXT_DELTA)
+#define LGC_DELTA_XOR       1
+#define LGC_DELTA_SUB       2
+
+#define LGC_DELTA_KEYFRAME  32  // every that many layers, deltas start over
+
+#define LGC_INDEX_MAGIC     0x1dc0e7ff
+
+#define LGC_MAX_LEVELS      16
+
+// Size of reduced-resolution level k along a dimension d (rounds up)
+#define LGC_LEVEL_DIM(d, k) \
+    ((d) > (1u<<(k))? ((d)+(1u<<(k))-1)>>(k): 1)
+
 // Format flags
 #define LGC_FMT_8BIT        0
 #define LGC_FMT_16BIT       1
@@ -91,11 +322,28 @@ typedef struct {
 #define LGC_FMT_HSV         (3<<2)
 #define LGC_FMT_HLS         (4<<2)
 #define LGC_FMT_LAB         (5<<2)
+#define LGC_FMT_INDEXED     (6<<2)  // indices into the layer's palette
 
 #define LGC_FMT_COMPRESSED  0x40
 
 #define LGC_FMT_RGB8        LGC_FMT_RGB|LGC_FMT_24BIT
 #define LGC_FMT_RGBA8       LGC_FMT_RGB|LGC_FMT_32BIT
+#define LGC_FMT_INDEXED8    (LGC_FMT_INDEXED|LGC_FMT_8BIT)
+
+#define LGC_PALETTE_MAX     256
+
+#define LGC_FMT_BLOCK       0x80
+
+// Block-compressed formats (see lgcEncodeLayer)
+#define LGC_FMT_BC1         (LGC_FMT_BLOCK|1)   // RGB with 1-bit alpha, 8 bytes per block
+#define LGC_FMT_BC3         (LGC_FMT_BLOCK|3)   // RGBA, 16 bytes per block
+#define LGC_FMT_BC7         (LGC_FMT_BLOCK|7)   // RGBA, 16 bytes per block (mode 6 only)
+
+// Resampling filters (see lgcResizeLayer)
+#define LGC_FILTER_BOX      0   // average of the pixels covered
+#define LGC_FILTER_BILINEAR 1   // triangle
+#define LGC_FILTER_BICUBIC  2   // Catmull-Rom
+#define LGC_FILTER_LANCZOS  3   // Lanczos, 3 lobes
 
 // Image struct
 typedef struct {
@@ -111,8 +359,16 @@ typedef struct {
 
 #define LGC_LAYER_HEAD_LENGTH (sizeof(lgcLayer)-sizeof(void*))
 
+#define LGC_BLOCK_BYTES(format) (((format)&7) == 1? 8: 16)
+
+// Length of w x h pixels in the format
+#define LGC_PIXELS_LENGTH(format, w, h) \
+    ((format)&LGC_FMT_BLOCK? \
+        ((uint64_t)(w)+3)/4*(((uint64_t)(h)+3)/4)*LGC_BLOCK_BYTES(format): \
+        (uint64_t)(w)*(h)*LGC_BYTES_PER_PIXEL((format)))
+
 #define LGC_LAYER_BODY_LENGTH(layer) \
-    ((layer->w*layer->h)*LGC_BYTES_PER_PIXEL(layer->format))
+    LGC_PIXELS_LENGTH(layer->format, layer->w, layer->h)
 
 #define LGC_LAYER_LENGTH(layer) \
     (LGC_LAYER_HEAD_LENGTH+LGC_LAYER_BODY_LENGTH(layer))
@@ -124,6 +380,66 @@ typedef struct {
 
 #define LGC_RW_FORCE_FILE_POINTER 0x100     // forces 'filename' to be used as file stream
 
+#define LGC_RW_NO_DEDUP     0x200   // write identical layers in full, each one
+#define LGC_RW_SHARE        0x400   // layers with identical pixels share 'data' when read
+#define LGC_RW_BLOB_STORE   0x800   // write layers' pixels to the blob store
+#define LGC_RW_VERIFY       0x1000  // check layers' checksums when reading
+#define LGC_RW_NO_COPY      0x2000  // uncompressed layers read from memory point into it
+#define LGC_RW_DELTA        0x4000  // write layers as deltas against the previous ones
+#define LGC_RW_SPARSE       0x8000  // trim transparent borders and skip empty spans when writing
+#define LGC_RW_DICT         0x10000 // compress layers against the dictionary set (lgcSetDictionary)
+#define LGC_RW_PALETTE      0x20000 // write layers of 256 colors or fewer indexed (LGC_FMT_INDEXED)
+
+// Open file handle for concurrent reads (see lgcOpenFile)
+typedef struct lgcFile lgcFile;
+
+// Open archive of images (see lgcOpenArchive)
+typedef struct lgcArchive lgcArchive;
+
+// Sequential playback of layers as frames (see lgcOpenPlayer)
+typedef struct lgcPlayer lgcPlayer;
+
+// Asynchronous loading (see lgcCreateLoader)
+typedef struct lgcLoader lgcLoader;
+
+// Decoded layers cache shared between processes (see lgcStartCacheServer)
+typedef struct lgcCacheServer lgcCacheServer;
+typedef struct lgcCache lgcCache;
+
+typedef struct {
+
+    const char *    filename;   // must stay valid until lgcLoaderWait() returns
+    uint32_t        layer_n;
+    uint8_t         level;      // reduced-resolution level, 0 for the layer itself
+    void *          user;       // for the callback, not used by the library
+
+} lgcLoadRequest;
+
+/*  Receives a loaded layer (to be freed with lgcDestroyLayer())
+    or NULL if it failed to load. */
+typedef void (*lgcLoadCallback)(const lgcLoadRequest *request, lgcLayer *layer);
+
+// Changes of a layer between two files (lgcLayerDiff 'changes')
+#define LGC_DIFF_ADDED      0x01    // only the second file has the layer
+#define LGC_DIFF_REMOVED    0x02    // only the first file has it
+#define LGC_DIFF_SHAPE      0x04    // size or format differ, pixels are not compared
+#define LGC_DIFF_MOVED      0x08    // position differs
+#define LGC_DIFF_HEAD       0x10    // flags, levels count or compression differ
+#define LGC_DIFF_PIXELS     0x20    // pixels differ
+#define LGC_DIFF_ERROR      0x40    // the layer can't be read from one of the files
+
+/* Differences of a layer between two files (see lgcDiffFiles) */
+typedef struct {
+
+    uint32_t        layer_n;
+    int             changes;    // LGC_DIFF_ flags, 0 if the layer is the same
+    uint64_t        changed;    // pixels differing in any byte
+    uint32_t        box[4];     // x, y, w, h of the changed pixels, within the layer
+    uint8_t         max_error;  // largest difference of a byte (channel)
+    double          mean_error; // difference of a byte, averaged over the whole layer
+
+} lgcLayerDiff;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -132,6 +448,11 @@ extern "C" {
     filename — file name string or FILE stream pointer
         (if LGC_FORCE_FILE_POINTER specified in rwopts);
     rwopts — read/write options (LGC_RW_HEAD, LGC_RW_ENTRIE, ..).
+    With LGC_RW_SHARE, layers stored once get one 'data' buffer, freed
+    along with the last of them; don't modify or free() it directly then.
+    Layers which fail to read (or fail the checksum, with LGC_RW_VERIFY)
+    are kept in place with NULL 'data', so layer numbers match the file.
+    Both v1 and v2 files are read, 'magic' of the image tells which one it was.
     Returns lgcImage or NULL on failure. */
 extern lgcImage * lgcReadImage(const char * filename, int rwopts);
 
@@ -143,26 +464,420 @@ extern lgcImage * lgcReadImage(const char * filename, int rwopts);
     Returns lgcLayer or NULL on failure or if layer_n is out of range. */
 extern lgcLayer * lgcReadLayer(const char * filename, int rwopts, uint32_t layer_n);
 
+/*  Read single reduced-resolution level of a lgcLayer from file.
+    Only the requested level is read and decoded.
+    filename — file name string or FILE stream pointer
+        (if LGC_FORCE_FILE_POINTER specified in rwopts);
+    rwopts — read/write options (LGC_RW_HEAD, LGC_RW_ENTRIE, ..).
+    layer_n — number of layer in file;
+    level — 0 for full resolution, k for 1/2^k of it.
+    Returned lgcLayer has the level's dimensions and x/y scaled down to match.
+    Returns lgcLayer or NULL on failure or if layer_n or level is out of range. */
+extern lgcLayer * lgcReadLayerLevel(const char * filename, int rwopts, uint32_t layer_n, uint8_t level);
+
 /*  Write lgcImage to file.
     filename — file name string or FILE stream pointer;
     image — source lgcImage;
         (if LGC_FORCE_FILE_POINTER specified in rwopts);
     rwopts — read/write options (LGC_RW_HEAD, LGC_RW_ENTRIE, ..).
+    Layers with identical pixels are stored once, unless LGC_RW_NO_DEDUP
+    is given (or the stream is not seekable).
+    With LGC_RW_DELTA, a layer of the same size and format as the previous
+    one is stored as a delta against it (see LGC_EXT_DELTA), when that
+    is smaller; meant for animation frames. Deltas take place of the
+    deduplication then.
+    With LGC_RW_SPARSE, RGBA layers are cropped to their non-transparent
+    (non-zero) pixels, moving 'x' and 'y' so they stay in place, and
+    fully transparent runs of each row are not stored (LGC_EXT_SPARSE);
+    so are indexed layers which palette entry 0 is all-zero, with their
+    zero indices. Layers of other formats (a black border is no less a
+    part of an RGB layer) and layers taking part in deltas are written whole.
+    With LGC_RW_DICT, layers are compressed against the dictionary set
+    with lgcSetDictionary(), which is stored in the file (LGC_EXT_DICT).
+    With LGC_RW_PALETTE, 8-bit RGB and RGBA layers having 256 colors
+    or fewer are stored indexed, with a palette of exactly their colors;
+    they are read as indexed layers (see lgcExpandPalette). Layers
+    taking part in deltas are written as they are.
+    The file is written as v2 (LGC_MAGIC_V2) when it holds layers,
+    with 'image->magic' otherwise; sparse form and deltas are not used
+    for layers over 65535 pixels along a side.
     Returns non-zero on failure. */
 extern int lgcWriteToFile(const char * filename, int rwopts, lgcImage* image);
 
+/*  Read lgcImage from a whole LGC file in memory, without stdio.
+    buf — file contents;
+    size — their length;
+    rwopts — read/write options (LGC_RW_ENTRIE, LGC_RW_SHARE, LGC_RW_VERIFY, ..).
+    With LGC_RW_NO_COPY, 'data' of uncompressed layers points into 'buf'
+    (lgcDestroyLayer() leaves it be), so it must outlive the image.
+    Returns lgcImage or NULL on failure, like lgcReadImage(). */
+extern lgcImage * lgcReadImageFromMemory(const void * buf, size_t size, int rwopts);
+
+/*  Write lgcImage to a newly allocated buffer, without stdio.
+    Layers are compressed first, so the buffer is allocated once,
+    of the exact size.
+    image — source lgcImage;
+    rwopts — read/write options (LGC_RW_HEAD, LGC_RW_ENTRIE, ..);
+    buf — receives the buffer, to be free()'d by the caller;
+    size — receives it's length.
+    Returns non-zero on failure. */
+extern int lgcWriteImageToBuffer(lgcImage *image, int rwopts, void ** buf, size_t * size);
+
 /*  Append lgcLayer to file.
     layer — source lgcLayer;
     filename — file name string or FILE stream pointer
         (if LGC_FORCE_FILE_POINTER specified in rwopts);
     rwopts — read/write options (LGC_RW_HEAD, LGC_RW_ENTRIE, ..).
+    A v1 file becomes v2 (see EDITED FILES).
     Returns non-zero on failure. */
 extern int lgcAppendLayerToFile(const char * filename, int rwopts, lgcLayer *layer);
 
+/*  Replace single layer in file, leaving the rest of it untouched.
+    The new layer takes place of the old one if it fits there,
+    otherwise the old one is turned into a tombstone (see EDITED FILES).
+    filename — file name string;
+    rwopts — read/write options (LGC_RW_FORCE_FILE_POINTER is not supported);
+    layer_n — number of layer in file;
+    layer — source lgcLayer.
+    Returns non-zero on failure. */
+extern int lgcReplaceLayerInFile(const char * filename, int rwopts, uint32_t layer_n, lgcLayer *layer);
+
+/*  Delete single layer from file, by turning it into a tombstone.
+    filename — file name string;
+    rwopts — read/write options (LGC_RW_FORCE_FILE_POINTER is not supported);
+    layer_n — number of layer in file.
+    Returns non-zero on failure. */
+extern int lgcDeleteLayerFromFile(const char * filename, int rwopts, uint32_t layer_n);
+
+/*  Rewrite edited file without tombstones, padding and the layer index,
+    with layers stored in their order. Layers are copied as they are stored,
+    without decompression.
+    filename — file name string;
+    rwopts — read/write options (LGC_RW_FORCE_FILE_POINTER is not supported).
+    Returns non-zero on failure. */
+extern int lgcCompactFile(const char * filename, int rwopts);
+
+/*  Check stored pixels of every layer against their checksums,
+    without decompressing them. Layers written before checksums were
+    introduced are checked by decompressing, if they are compressed.
+    Layers are checked by several threads at once.
+    filename — file name string or FILE stream pointer
+        (if LGC_FORCE_FILE_POINTER specified in rwopts);
+    rwopts — read/write options (LGC_RW_ENTRIE, ..);
+    threads — number of threads to use, 0 for one per CPU.
+    Corrupted layers are reported to stderr.
+    Returns number of corrupted layers, or -1 if the file can't be read
+    (or memory can't be allocated). */
+extern int lgcVerifyFile(const char * filename, int rwopts, int threads);
+
+/*  Compare two files layer by layer, layers matched by their numbers.
+    Layers which heads match are taken as the same without reading them
+    when their content keys (LGC_EXT_HASH) or their stored payloads
+    (checksums and lengths) are equal; others are read and compared pixel
+    by pixel, block-compressed and indexed ones as RGBA. Every byte of
+    a pixel is a separate channel for the errors. Layers are compared in
+    several threads.
+    a, b — file names;
+    rwopts — read options (LGC_RW_ENTRIE, LGC_RW_VERIFY, ..);
+    threads — number of threads to use, 0 for one per CPU;
+    diffs — receives an array of 'count' results, one per layer of the
+        longer file, to be freed with free(); may be NULL;
+    count — receives it's length; may be NULL.
+    Returns number of layers which differ (or can't be read),
+    or -1 if the files can't be opened. */
+extern int lgcDiffFiles(const char * a, const char * b, int rwopts, int threads,
+                        lgcLayerDiff ** diffs, uint32_t * count);
+
+/*  Open file for reading layers from many threads at once.
+    The layer index is read here, layers are then read with pread(),
+    without a shared file position or locking. Changes made to the file
+    after it's opened are not seen by the handle.
+    filename — file name string;
+    rwopts — read/write options (LGC_RW_FORCE_FILE_POINTER is not supported).
+    Returns lgcFile or NULL on failure. */
+extern lgcFile * lgcOpenFile(const char * filename, int rwopts);
+
+/*  Returns number of layers in the opened file. */
+extern uint32_t lgcFileLayersCount(lgcFile *file);
+
+/*  Read single lgcLayer (or it's reduced-resolution level) from the opened
+    file, like lgcReadLayer() and lgcReadLayerLevel() do. Safe to call
+    from any number of threads at once.
+    file — lgcFile;
+    rwopts — read/write options (LGC_RW_ENTRIE, LGC_RW_VERIFY, ..);
+    layer_n — number of layer in file;
+    level — 0 for full resolution, k for 1/2^k of it.
+    Returns lgcLayer or NULL on failure or if layer_n or level is out of range. */
+extern lgcLayer * lgcFileReadLayer(lgcFile *file, int rwopts, uint32_t layer_n);
+extern lgcLayer * lgcFileReadLayerLevel(lgcFile *file, int rwopts, uint32_t layer_n, uint8_t level);
+
+/*  Close the file; no reads may be in progress. */
+extern void lgcCloseFile(lgcFile *file);
+
+/*  Write many images into one archive file, to be found by their names
+    (see ARCHIVES). Images are written one by one, like
+    lgcWriteImageToBuffer() does; layers are not deduplicated between them.
+    filename — file name string;
+    rwopts — read/write options (LGC_RW_ENTRIE, LGC_RW_SPARSE, ..;
+        LGC_RW_FORCE_FILE_POINTER is not supported);
+    count — number of images;
+    names — their names, unique non-empty strings;
+    images — the images.
+    Returns non-zero on failure. */
+extern int lgcWriteArchive(const char * filename, int rwopts, uint32_t count,
+                           const char * const * names, lgcImage ** images);
+
+/*  Open archive for reading it's images by name, from any number of
+    threads at once. The file is mapped into memory: an image is found by
+    binary search in the directory, and read without any system calls.
+    filename — file name string;
+    rwopts — read/write options (LGC_RW_FORCE_FILE_POINTER is not supported).
+    Returns lgcArchive or NULL on failure. */
+extern lgcArchive * lgcOpenArchive(const char * filename, int rwopts);
+
+/*  Returns number of images in the archive. */
+extern uint32_t lgcArchiveImagesCount(lgcArchive *archive);
+
+/*  Returns name of n-th image of the archive, in the directory order
+    (not the written one), or NULL if n is out of range. */
+extern const char * lgcArchiveImageName(lgcArchive *archive, uint32_t n);
+
+/*  Read image from the archive, like lgcReadImageFromMemory() does.
+    With LGC_RW_NO_COPY, layers' 'data' may point into the archive,
+    which must stay open then.
+    archive — lgcArchive;
+    rwopts — read/write options (LGC_RW_ENTRIE, LGC_RW_VERIFY, ..);
+    name — name of the image.
+    Returns lgcImage or NULL on failure or if there's no such image. */
+extern lgcImage * lgcArchiveReadImage(lgcArchive *archive, int rwopts, const char *name);
+
+/*  Read single lgcLayer (or it's reduced-resolution level) of an image
+    in the archive, like lgcReadLayer() and lgcReadLayerLevel() do.
+    archive — lgcArchive;
+    rwopts — read/write options (LGC_RW_ENTRIE, LGC_RW_VERIFY, ..);
+    name — name of the image;
+    layer_n — number of layer in the image;
+    level — 0 for full resolution, k for 1/2^k of it.
+    Returns lgcLayer or NULL on failure or if name, layer_n or level is not found. */
+extern lgcLayer * lgcArchiveReadLayer(lgcArchive *archive, int rwopts, const char *name,
+                                      uint32_t layer_n);
+extern lgcLayer * lgcArchiveReadLayerLevel(lgcArchive *archive, int rwopts, const char *name,
+                                           uint32_t layer_n, uint8_t level);
+
+/*  Close the archive; no reads may be in progress. */
+extern void lgcCloseArchive(lgcArchive *archive);
+
+/*  Open file for playing it's layers in order, as animation frames.
+    A frame stored as a delta against the previous one is made from it
+    in place, in time proportional to the changed area.
+    filename — file name string;
+    rwopts — read/write options (LGC_RW_ENTRIE, LGC_RW_VERIFY, ..;
+        LGC_RW_FORCE_FILE_POINTER is not supported).
+    Returns lgcPlayer or NULL on failure. */
+extern lgcPlayer * lgcOpenPlayer(const char * filename, int rwopts);
+
+/*  Returns number of frames (layers) in the played file. */
+extern uint32_t lgcPlayerFramesCount(lgcPlayer *player);
+
+/*  Decode the next frame. Returned layer belongs to the player,
+    it's pixels stay valid until the next call.
+    Returns the frame or NULL after the last one or on failure. */
+extern const lgcLayer * lgcPlayerNextFrame(lgcPlayer *player);
+
+/*  Make 'frame' the next one to be returned by lgcPlayerNextFrame().
+    Returns non-zero if there is no such frame. */
+extern int lgcPlayerSeek(lgcPlayer *player, uint32_t frame);
+
+/*  Close the file and free the player. */
+extern void lgcClosePlayer(lgcPlayer *player);
+
+/*  Create an asynchronous layer loader. Layers are read with io_uring
+    where it's available, otherwise by the worker threads with pread();
+    workers decompress them and pass them to the callback.
+    rwopts — read/write options (LGC_RW_ENTRIE, LGC_RW_VERIFY, ..;
+        LGC_RW_FORCE_FILE_POINTER is not supported);
+    threads — number of worker threads, -1 for one per CPU; with 0, everything
+        is done by the thread calling lgcLoaderWait();
+    callback — called for every request, from worker threads (concurrently).
+    Returns lgcLoader or NULL on failure. */
+extern lgcLoader * lgcCreateLoader(int rwopts, int threads, lgcLoadCallback callback);
+
+/*  Queue a batch of layers to load. Only heads are read here,
+    pixels are read by lgcLoaderWait().
+    loader — lgcLoader;
+    requests — array of 'count' requests, copied.
+    Returns non-zero on failure. */
+extern int lgcLoaderSubmit(lgcLoader *loader, const lgcLoadRequest *requests, uint32_t count);
+
+/*  Load everything submitted, returning once all the callbacks are done.
+    Returns number of requests which failed. */
+extern int lgcLoaderWait(lgcLoader *loader);
+
+/*  Wait for the loader and free it. */
+extern void lgcDestroyLoader(lgcLoader *loader);
+
+/*  Start the decoded layers cache for the processes of this host (see
+    lgccached). Layers are decoded once and kept in a shared memory
+    segment, the least recently used ones evicted to make room; clients
+    (see lgcCacheConnect) map it read-only. A layer is known by it's file
+    identity (device, inode, modification time, size) and number, so
+    a rewritten file is never served from the cache.
+    The server runs in threads of the calling process.
+    socket_path — Unix socket to listen on, replaced if it exists;
+    size — bytes of the segment.
+    Returns lgcCacheServer or NULL on failure. */
+extern lgcCacheServer * lgcStartCacheServer(const char * socket_path, uint64_t size);
+
+/*  Cache statistics: requests served from the cache, requests
+    decoded by the server, and bytes of the segment in use.
+    Any of the pointers may be NULL. */
+extern void lgcCacheServerStats(lgcCacheServer *server, uint64_t *hits, uint64_t *misses,
+                                uint64_t *used);
+
+/*  Disconnect the clients and stop the server. Views the clients
+    have stay readable until they unmap the segment. */
+extern void lgcStopCacheServer(lgcCacheServer *server);
+
+/*  Connect to the cache server and map it's segment.
+    socket_path — the server's Unix socket.
+    Returns lgcCache or NULL on failure. */
+extern lgcCache * lgcCacheConnect(const char * socket_path);
+
+/*  Read single reduced-resolution level of a layer through the cache.
+    The layer's 'data' points into the read-only segment, not to be
+    written. While held it stays in
+    the cache. Layers which don't fit there (or when the server is
+    gone) are read from the file, like lgcReadLayerLevel() does.
+    Safe to call from several threads.
+    cache — lgcCache;
+    filename — file name string;
+    layer_n — number of layer in file;
+    level — 0 for the layer itself.
+    Returns lgcLayer to be freed with lgcCacheRelease(), or NULL on failure. */
+extern lgcLayer * lgcCacheReadLayer(lgcCache *cache, const char * filename, uint32_t layer_n,
+                                    uint8_t level);
+
+/*  Free a layer read with lgcCacheReadLayer(), letting it be evicted. */
+extern void lgcCacheRelease(lgcCache *cache, lgcLayer *layer);
+
+/*  Unmap the segment and close the connection; layers read
+    from the cache must be released before. */
+extern void lgcCacheDisconnect(lgcCache *cache);
+
+/*  Set the blob store directory, shared between files for deduplication.
+    Layers written with LGC_RW_BLOB_STORE keep only a reference to their
+    pixels, which are stored in the directory once for all files. A blob
+    found under the layer's key is compared with the layer before it is
+    used; if the content differs, the layer is kept in the file.
+    Readers need the same directory set to load such layers.
+    path — directory name, NULL to unset.
+    Returns non-zero on failure. */
+extern int lgcSetBlobStore(const char * path);
+
+/*  Set the dictionary layers written with LGC_RW_DICT are compressed
+    against, meant for small layers which don't compress well alone
+    (icons, glyphs). It is stored once per file or archive; readers
+    need nothing set. Appended, replaced and blob store layers don't use it.
+    data — dictionary bytes, copied (see lgcTrainDictionary), NULL to unset;
+    size — their length, up to LGC_DICT_MAX.
+    Returns non-zero on failure. */
+extern int lgcSetDictionary(const void * data, uint32_t size);
+
+/*  Free the dictionaries loaded from files read so far (the one set with
+    lgcSetDictionary() is kept). Reading a file loads it's own again, but
+    no files, archives, players or loaders may be open meanwhile, and no
+    reads in progress. */
+extern void lgcFreeDictionaries();
+
+/*  Builds a dictionary out of pixels of the images' layers: the pieces
+    of them most common across the whole set, so that layers like those
+    find matches in it.
+    images — array of 'count' lgcImage (as read with LGC_RW_ENTRIE);
+    max_size — longest dictionary to make, up to LGC_DICT_MAX;
+    size — receives it's length.
+    Returns the dictionary to be freed with free(), or NULL on failure. */
+extern void * lgcTrainDictionary(lgcImage * const * images, uint32_t count, uint32_t max_size,
+                                 uint32_t *size);
+
+/*  Converts pixels of the layer to a block-compressed format,
+    replacing it's 'data' (shared one is left to the other layers).
+    layer — lgcLayer of 8-bit gray, RGB or RGBA pixels;
+    format — LGC_FMT_BC1, LGC_FMT_BC3 or LGC_FMT_BC7, possibly with
+        LGC_FMT_COMPRESSED;
+    threads — number of threads to use, 0 for one per CPU.
+    Returns non-zero on failure. */
+extern int lgcEncodeLayer(lgcLayer *layer, uint8_t format, int threads);
+
+/*  Decodes pixels of a block-compressed layer, for when they can't
+    go to the GPU as they are.
+    layer — lgcLayer in one of LGC_FMT_BC* formats.
+    Returns w x h RGBA pixels (LGC_FMT_RGBA8) to be freed with free(),
+    or NULL on failure. */
+extern void * lgcDecodeBlocks(const lgcLayer *layer);
+
+/*  Converts pixels of the layer to indices into a palette of 'colors'
+    entries at most (LGC_FMT_INDEXED), replacing it's 'data' (shared
+    one is left to the other layers). A layer having that few colors
+    gets exactly them; otherwise the palette is made by median cut,
+    refined with k-means, and every pixel takes the nearest entry.
+    Fully transparent pixels get entry 0 then, left transparent black.
+    layer — lgcLayer of 8-bit RGB or RGBA pixels;
+    colors — 1 to LGC_PALETTE_MAX;
+    threads — number of threads to use, 0 for one per CPU.
+    Returns non-zero on failure. */
+extern int lgcQuantizeLayer(lgcLayer *layer, uint16_t colors, int threads);
+
+/*  Looks up colors of an indexed layer's pixels in it's palette.
+    layer — lgcLayer in LGC_FMT_INDEXED8.
+    Returns w x h RGBA pixels (LGC_FMT_RGBA8) to be freed with free(),
+    or NULL on failure. */
+extern void * lgcExpandPalette(const lgcLayer *layer);
+
+/*  Resamples pixels of the layer to another size. Every byte of a pixel
+    is filtered as a separate 8-bit channel; large layers are done in
+    several threads. Position of the layer is scaled along.
+    src — lgcLayer, not block-compressed nor indexed (see lgcDecodeBlocks,
+        lgcExpandPalette);
+    w, h — new size;
+    filter — one of LGC_FILTER_*.
+    Returns new lgcLayer to be freed with lgcDestroyLayer(), or NULL on failure. */
+extern lgcLayer * lgcResizeLayer(const lgcLayer *src, uint32_t w, uint32_t h, int filter);
+
 /*  Returns newly created lgcImage or lgcLyaer. */
 extern lgcImage * lgcBlankImage();
 extern lgcLayer * lgcBlankLayer();
 
+/*  Number of reduced-resolution levels (1/2, 1/4, ...) stored along
+    with the layer. Set it before writing to have them generated;
+    readers set it from the file.
+    layer — lgcLayer;
+    levels — levels count, 0 for none. */
+extern uint8_t lgcLayerLevels(const lgcLayer *layer);
+extern void lgcSetLayerLevels(lgcLayer *layer, uint8_t levels);
+
+/*  Palette of an indexed layer (LGC_FMT_INDEXED): RGBA entries,
+    4 bytes each. lgcLayerPalette() returns it (NULL if the layer has
+    none), valid until the layer's palette is set or it is destroyed;
+    lgcSetLayerPalette() copies it.
+    layer — lgcLayer;
+    palette — entries, NULL to unset;
+    colors — receives or gives their number, up to LGC_PALETTE_MAX.
+    lgcSetLayerPalette() returns non-zero on failure. */
+extern const uint8_t * lgcLayerPalette(const lgcLayer *layer, uint16_t *colors);
+extern int lgcSetLayerPalette(lgcLayer *layer, const uint8_t *palette, uint16_t colors);
+
+/*  Size and length of the layer, wide ones included: over 65535 pixels
+    along a side, or over 4 GiB of pixels (see LGC_MAGIC_V2). 'w', 'h'
+    and 'length' of such a layer are saturated, and the wide values are
+    kept while the fields stay so.
+    layer — lgcLayer;
+    w, h — size in pixels;
+    length — length of 'data'. */
+extern uint32_t lgcLayerWidth(const lgcLayer *layer);
+extern uint32_t lgcLayerHeight(const lgcLayer *layer);
+extern uint64_t lgcLayerLength(const lgcLayer *layer);
+extern void lgcSetLayerSize(lgcLayer *layer, uint32_t w, uint32_t h, uint64_t length);
+
 // Stack-like layers operations
 /*  Appends lgcLayer to image.
     dest — destination lgcImage;
@@ -176,7 +891,8 @@ extern void lgcPushLayer(lgcImage *dest, lgcLayer *layer);
 extern lgcLayer * lgcPopLayer(lgcImage *image);
 
 /*  Memory freeing functions for lgcImage and lgcLayer.
-    lgcDestroyImage() applies lgcDestroyLayer() to all image's existing layers. */
+    lgcDestroyImage() applies lgcDestroyLayer() to all image's existing layers.
+    Shared 'data' is freed along with the last layer using it. */
 extern void lgcDestroyImage(lgcImage *image, int force_freeing);
 extern void lgcDestroyLayer(lgcLayer *layer, int force_freeing);
 
@@ -0,0 +1,333 @@
+/**
+
+    lgcarchive.c
+    lgcArchive: many images in one file, found by name through
+    a sorted directory read in place from the mapped file
+
+    This software comes under the terms of MIT License.
+
+**/
+
+#include "lgcpriv.h"
+
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define ARCHIVE_HEAD_LENGTH (LGC_BASE_OFFSET+16)
+#define ARCHIVE_ENTRY_LENGTH 32
+
+struct lgcArchive {
+
+    const uint8_t * map;        // the whole file
+    size_t          size;
+    uint32_t        count;
+    const uint8_t * dir;        // entries, then names
+    uint64_t        dir_len;
+
+};
+
+/* Directory entry being written */
+typedef struct {
+
+    uint64_t        hash;
+    uint64_t        offset;
+    uint64_t        len;
+    const char *    name;
+    uint32_t        name_len;
+
+} archiveEntry;
+
+// Directory order: by hash of the name, then by the name itself
+static int compareNames(uint64_t hash_a, const char *a, uint32_t len_a,
+                        uint64_t hash_b, const char *b, uint32_t len_b) {
+
+    if(hash_a != hash_b) return hash_a < hash_b? -1: 1;
+
+    int r = memcmp(a, b, len_a < len_b? len_a: len_b);
+    if(r) return r < 0? -1: 1;
+    return len_a == len_b? 0: len_a < len_b? -1: 1;
+
+}
+
+static int compareEntries(const void *a, const void *b) {
+
+    const archiveEntry *ea = a, *eb = b;
+    return compareNames(ea->hash, ea->name, ea->name_len, eb->hash, eb->name, eb->name_len);
+
+}
+
+static void putEntry(uint8_t *p, const archiveEntry *e, uint32_t name_offset) {
+
+    putLE64(p, e->hash);
+    putLE64(p+8, e->offset);
+    putLE64(p+16, e->len);
+    putLE32(p+24, name_offset);
+    putLE32(p+28, e->name_len);
+
+}
+
+int lgcWriteArchive(const char * filename, int rwopts, uint32_t count,
+                    const char * const * names, lgcImage ** images) {
+
+    if(rwopts&LGC_RW_FORCE_FILE_POINTER) {
+        fprintf(stderr, "%s: error: usage of external stream is not supported by this function\n",
+            __FUNCTION__);
+        return -1;
+    }
+
+    if(!filename || (count && (!names || !images))) {
+        fprintf(stderr, "%s: NULL in arguments\n", __FUNCTION__);
+        return -1;
+    }
+
+    FILE *f = openFile(filename, "wb");
+    if(!f) {
+        fprintf(stderr, "%s: can't open the file (%s)\n", __FUNCTION__, filename);
+        return -1;
+    }
+
+    archiveEntry *entries = malloc(sizeof(archiveEntry)*(count+1));
+    uint8_t head[ARCHIVE_HEAD_LENGTH];
+    memset(head, 0, sizeof(head));
+    putLE32(head+LGC_BASE_OFFSET, LGC_ARCHIVE_MAGIC);
+    putLE32(head+LGC_BASE_OFFSET+4, count);
+
+    int ret = fwrite(head, sizeof(head), 1, f) == 1? 0: -1;
+    uint64_t pos = ARCHIVE_HEAD_LENGTH, names_len = 0;
+    const uint8_t zero[8] = {0};
+
+    // The dictionary is stored once, images are compressed against it without their own copy
+    const lz4Dict *dict = writerDictionary(rwopts);
+    if(!ret && dict) {
+        layerRecord rec;
+        packDictionary(dict, &rec);
+        if(writeRecord(f, &rec)) ret = -1;
+        pos += RECORD_SIZE(&rec);
+        rwopts |= LGC_RW_DICT_ELSEWHERE;
+    }
+
+    // Images are packed one at a time, each one as a file of it's own
+    uint32_t i;
+    for(i = 0; !ret && i < count; ++i) {
+        void *buf;
+        size_t size;
+        size_t len = names[i]? strlen(names[i]): 0;
+
+        if(!images[i] || !len || len > UINT32_MAX) {
+            fprintf(stderr, "%s: image %u has no name or is NULL\n", __FUNCTION__, i);
+            ret = -1;
+            break;
+        }
+
+        if(lgcWriteImageToBuffer(images[i], rwopts, &buf, &size)) {
+            ret = -1;
+            break;
+        }
+
+        uint32_t pad = -pos&7;
+        if((pad && fwrite(zero, pad, 1, f) != 1) || (size && fwrite(buf, size, 1, f) != 1))
+            ret = -1;
+        free(buf);
+
+        archiveEntry *e = &entries[i];
+        e->hash = hash64(names[i], len, 0);
+        e->offset = pos+pad;
+        e->len = size;
+        e->name = names[i];
+        e->name_len = len;
+
+        pos = e->offset+size;
+        names_len += len+1;
+    }
+
+    qsort(entries, i, sizeof(archiveEntry), compareEntries);
+
+    uint32_t k;
+    for(k = 1; !ret && k < count; ++k)
+        if(!compareEntries(&entries[k-1], &entries[k])) {
+            fprintf(stderr, "%s: name \"%s\" is used twice\n", __FUNCTION__, entries[k].name);
+            ret = -1;
+        }
+
+    if(!ret && (uint64_t)count*ARCHIVE_ENTRY_LENGTH+names_len > UINT32_MAX) {
+        fprintf(stderr, "%s: names are too long\n", __FUNCTION__);
+        ret = -1;
+    }
+
+    // Directory goes after the images, entries first, then their names
+    uint64_t dir_offset = pos+(-pos&7);
+    uint32_t name_offset = count*ARCHIVE_ENTRY_LENGTH;
+    if(!ret && dir_offset > pos && fwrite(zero, dir_offset-pos, 1, f) != 1)
+        ret = -1;
+
+    for(k = 0; !ret && k < count; ++k) {
+        uint8_t raw[ARCHIVE_ENTRY_LENGTH];
+        putEntry(raw, &entries[k], name_offset);
+        name_offset += entries[k].name_len+1;
+        if(fwrite(raw, sizeof(raw), 1, f) != 1) ret = -1;
+    }
+
+    for(k = 0; !ret && k < count; ++k)
+        if(fwrite(entries[k].name, entries[k].name_len+1, 1, f) != 1) ret = -1;
+
+    if(!ret) {
+        uint8_t raw[8];
+        putLE64(raw, dir_offset);
+        if(fseeko(f, LGC_BASE_OFFSET+8, SEEK_SET) || fwrite(raw, 8, 1, f) != 1) ret = -1;
+    }
+
+    if(fclose(f)) ret = -1;
+    free(entries);
+
+    if(ret) fprintf(stderr, "%s: write error\n", __FUNCTION__);
+    return ret;
+
+}
+
+lgcArchive * lgcOpenArchive(const char * filename, int rwopts) {
+
+    if(rwopts&LGC_RW_FORCE_FILE_POINTER) {
+        fprintf(stderr, "%s: error: usage of external stream is not supported by this function\n",
+            __FUNCTION__);
+        return NULL;
+    }
+
+    int fd = filename? open(filename, O_RDONLY): -1;
+    if(fd < 0) {
+        fprintf(stderr, "%s: can't open the file (%s)\n", __FUNCTION__, filename);
+        return NULL;
+    }
+
+    // The mapping outlives the descriptor
+    struct stat st;
+    void *map = MAP_FAILED;
+    if(!fstat(fd, &st) && st.st_size >= ARCHIVE_HEAD_LENGTH && (uint64_t)st.st_size <= SIZE_MAX)
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if(map == MAP_FAILED) {
+        fprintf(stderr, "%s: read error or not an archive (%s)\n", __FUNCTION__, filename);
+        return NULL;
+    }
+
+    lgcArchive *a = malloc(sizeof(lgcArchive));
+    a->map = map;
+    a->size = st.st_size;
+    a->count = getLE32(a->map+LGC_BASE_OFFSET+4);
+
+    uint64_t dir_offset = getLE64(a->map+LGC_BASE_OFFSET+8);
+    if(getLE32(a->map+LGC_BASE_OFFSET) != LGC_ARCHIVE_MAGIC || dir_offset > a->size ||
+        (uint64_t)a->count*ARCHIVE_ENTRY_LENGTH > a->size-dir_offset) {
+        fprintf(stderr, "%s: bad magic number or directory\n", __FUNCTION__);
+        lgcCloseArchive(a);
+        return NULL;
+    }
+
+    a->dir = a->map+dir_offset;
+    a->dir_len = a->size-dir_offset;
+
+    loadDictionaryFromMemory(a->map, a->size, ARCHIVE_HEAD_LENGTH, LGC_STORE_VERSION);
+    return a;
+
+}
+
+uint32_t lgcArchiveImagesCount(lgcArchive *archive) {
+    return archive->count;
+}
+
+// Name of the entry, NULL if it's out of the directory
+static const char * entryName(lgcArchive *a, const uint8_t *e, uint32_t *len) {
+
+    uint64_t offset = getLE32(e+24);
+    *len = getLE32(e+28);
+
+    if(offset > a->dir_len || (uint64_t)*len+1 > a->dir_len-offset || a->dir[offset+*len])
+        return NULL;
+
+    return (const char*)a->dir+offset;
+
+}
+
+const char * lgcArchiveImageName(lgcArchive *archive, uint32_t n) {
+
+    uint32_t len;
+    return n < archive->count? entryName(archive, archive->dir+(uint64_t)n*ARCHIVE_ENTRY_LENGTH, &len):
+        NULL;
+
+}
+
+/*  Finds the image by name in the directory, with binary search.
+    Gives it's place in the mapped file, checked to be within it.
+    Returns non-zero if there's no such image. */
+static int findImage(lgcArchive *a, const char *name, const uint8_t **image, size_t *size) {
+
+    if(!name) name = "";
+
+    size_t len = strlen(name);
+    uint64_t hash = hash64(name, len, 0);
+    uint32_t lo = 0, hi = a->count;
+
+    while(lo < hi) {
+        uint32_t mid = lo+(hi-lo)/2, entry_len;
+        const uint8_t *e = a->dir+(uint64_t)mid*ARCHIVE_ENTRY_LENGTH;
+        const char *entry = entryName(a, e, &entry_len);
+
+        int r = entry? compareNames(getLE64(e), entry, entry_len, hash, name, len): -2;
+        if(r == -2) break; // corrupted directory
+
+        if(r < 0) lo = mid+1;
+        else if(r > 0) hi = mid;
+        else {
+            uint64_t offset = getLE64(e+8), image_len = getLE64(e+16);
+            if(offset > a->size || image_len > a->size-offset) break;
+
+            *image = a->map+offset;
+            *size = image_len;
+            return 0;
+        }
+    }
+
+    fprintf(stderr, "lgc: no image \"%s\" in the archive\n", name);
+    return -1;
+
+}
+
+lgcImage * lgcArchiveReadImage(lgcArchive *archive, int rwopts, const char *name) {
+
+    const uint8_t *image;
+    size_t size;
+    if(findImage(archive, name, &image, &size)) return NULL;
+
+    return lgcReadImageFromMemory(image, size, rwopts);
+
+}
+
+lgcLayer * lgcArchiveReadLayer(lgcArchive *archive, int rwopts, const char *name, uint32_t layer_n) {
+    return lgcArchiveReadLayerLevel(archive, rwopts, name, layer_n, 0);
+}
+
+lgcLayer * lgcArchiveReadLayerLevel(lgcArchive *archive, int rwopts, const char *name,
+                                    uint32_t layer_n, uint8_t level) {
+
+    const uint8_t *image;
+    size_t size;
+    if(findImage(archive, name, &image, &size)) return NULL;
+
+    return memReadLayer(image, size, rwopts, layer_n, level);
+
+}
+
+void lgcCloseArchive(lgcArchive *archive) {
+
+    if(!archive) return;
+
+    munmap((void*)archive->map, archive->size);
+    free(archive);
+
+}
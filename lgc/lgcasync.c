@@ -0,0 +1,645 @@
+/**
+
+    lgcasync.c
+    Asynchronous batch loading of layers: io_uring reads
+    (or a pread thread pool where it's unavailable), decompression
+    on worker threads
+
+    This software comes under the terms of MIT License.
+
+**/
+
+#include "lgcpriv.h"
+
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <sched.h>
+
+#if defined(__linux__) && !defined(LGC_NO_IO_URING)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#define HAVE_IO_URING
+#endif
+
+#define LOAD_ALIGN 4096
+#define LOAD_QUEUE_DEPTH 64
+#define LOAD_MAX_THREADS 64
+
+typedef struct loadJob {
+
+    lgcLoadRequest  request;
+    fullLayer       layer;      // head, as it will be returned
+    int             fd;
+    int             own_fd;     // blob file, to be closed after reading
+    int             failed;
+
+    uint64_t        len;        // stored pixels length
+    uint32_t        sparse;     // decoded length of their sparse form, 0 if dense
+    uint64_t        dict;       // key of the dictionary they are compressed against
+    layerExt *      delta;      // head of a delta layer, decoded whole by the worker
+    uint64_t        record;
+    int             has_checksum;
+    uint32_t        checksum;
+
+    // aligned read covering the stored pixels
+    uint64_t        read_off;
+    uint64_t        read_len;
+    uint32_t        skip;       // where the pixels start in 'buf'
+    uint64_t        done;
+    uint8_t *       buf;
+    struct iovec    iov;
+
+    struct loadJob *next;
+
+} loadJob;
+
+typedef struct {
+
+    const char *    name;
+    FILE *          f;
+    layerIndex      idx;        // where the layers are, read once
+
+} loadFile;
+
+#ifdef HAVE_IO_URING
+typedef struct {
+
+    int             fd;
+    unsigned        entries;
+
+    void *          sq_ptr;
+    size_t          sq_size;
+    void *          cq_ptr;
+    size_t          cq_size;
+    struct io_uring_sqe * sqes;
+
+    unsigned *      sq_head;
+    unsigned *      sq_tail;
+    unsigned *      sq_mask;
+    unsigned *      sq_array;
+    unsigned *      cq_head;
+    unsigned *      cq_tail;
+    unsigned *      cq_mask;
+    struct io_uring_cqe * cqes;
+
+} loadRing;
+#endif
+
+struct lgcLoader {
+
+    int             rwopts;
+    lgcLoadCallback callback;
+
+    loadJob *       queued;     // submitted, waiting for lgcLoaderWait()
+    loadJob *       queued_tail;
+    uint32_t        queued_count;
+
+    loadFile *      files;      // files opened by this batch
+    uint32_t        files_count;
+    offsetMap       files_map;  // name hash to index in 'files'
+
+    pthread_t       threads[LOAD_MAX_THREADS];
+    int             threads_count;
+    pthread_mutex_t lock;
+    pthread_cond_t  wake;       // for workers: a job is ready, or quit
+    pthread_cond_t  idle;       // for the waiter: 'pending' dropped to 0
+    loadJob *       ready;      // read (or to be read) by workers
+    loadJob *       ready_tail;
+    uint32_t        pending;
+    int             failures;
+    int             quit;
+
+#ifdef HAVE_IO_URING
+    loadRing        ring;
+    int             has_ring;
+#endif
+
+};
+
+/* -- io_uring, through raw syscalls -- */
+
+#ifdef HAVE_IO_URING
+static int ringSetup(loadRing *r, unsigned entries) {
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    memset(r, 0, sizeof(loadRing));
+
+    r->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if(r->fd < 0) return -1;
+
+    r->entries = p.sq_entries;
+    r->sq_size = p.sq_off.array+p.sq_entries*sizeof(unsigned);
+    r->cq_size = p.cq_off.cqes+p.cq_entries*sizeof(struct io_uring_cqe);
+
+    int single = p.features&IORING_FEAT_SINGLE_MMAP;
+    if(single && r->cq_size > r->sq_size) r->sq_size = r->cq_size;
+
+    r->sq_ptr = mmap(NULL, r->sq_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                     r->fd, IORING_OFF_SQ_RING);
+    if(r->sq_ptr == MAP_FAILED) {
+        close(r->fd);
+        return -1;
+    }
+
+    r->cq_ptr = r->sq_ptr;
+    if(!single) {
+        r->cq_ptr = mmap(NULL, r->cq_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                         r->fd, IORING_OFF_CQ_RING);
+        if(r->cq_ptr == MAP_FAILED) {
+            munmap(r->sq_ptr, r->sq_size);
+            close(r->fd);
+            return -1;
+        }
+    }
+
+    r->sqes = mmap(NULL, p.sq_entries*sizeof(struct io_uring_sqe), PROT_READ|PROT_WRITE,
+                   MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if(r->sqes == MAP_FAILED) {
+        if(r->cq_ptr != r->sq_ptr) munmap(r->cq_ptr, r->cq_size);
+        munmap(r->sq_ptr, r->sq_size);
+        close(r->fd);
+        return -1;
+    }
+
+    uint8_t *sq = r->sq_ptr, *cq = r->cq_ptr;
+    r->sq_head = (unsigned*)(sq+p.sq_off.head);
+    r->sq_tail = (unsigned*)(sq+p.sq_off.tail);
+    r->sq_mask = (unsigned*)(sq+p.sq_off.ring_mask);
+    r->sq_array = (unsigned*)(sq+p.sq_off.array);
+    r->cq_head = (unsigned*)(cq+p.cq_off.head);
+    r->cq_tail = (unsigned*)(cq+p.cq_off.tail);
+    r->cq_mask = (unsigned*)(cq+p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*)(cq+p.cq_off.cqes);
+
+    return 0;
+
+}
+
+static void ringFree(loadRing *r) {
+    munmap(r->sqes, r->entries*sizeof(struct io_uring_sqe));
+    if(r->cq_ptr != r->sq_ptr) munmap(r->cq_ptr, r->cq_size);
+    munmap(r->sq_ptr, r->sq_size);
+    close(r->fd);
+}
+
+// Queues read of the rest of the job's range, the caller submits it
+static void ringQueueRead(loadRing *r, loadJob *job) {
+
+    unsigned tail = *r->sq_tail;
+    unsigned i = tail&*r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[i];
+
+    job->iov.iov_base = job->buf+job->done;
+    job->iov.iov_len = job->read_len-job->done;
+
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = IORING_OP_READV;
+    sqe->fd = job->fd;
+    sqe->addr = (uintptr_t)&job->iov;
+    sqe->len = 1;
+    sqe->off = job->read_off+job->done;
+    sqe->user_data = (uintptr_t)job;
+
+    r->sq_array[i] = i;
+    __atomic_store_n(r->sq_tail, tail+1, __ATOMIC_RELEASE);
+
+}
+#endif
+
+/* -- decompression and delivery -- */
+
+// Turns read payload into pixels and hands the layer over to the callback
+static void finishJob(lgcLoader *loader, loadJob *job) {
+
+    fullLayer *layer = &job->layer;
+    uint8_t *stored = job->buf? job->buf+job->skip: NULL;
+
+    if(!job->failed && loader->rwopts&LGC_RW_BODY) {
+        layer->length = LGC_LAYER_BODY_LENGTH(layer);
+
+        if(job->delta) {
+            // bases are read along the chain, with blocking reads
+            layer->data = decodeDeltaChain(fdReadAt, &job->fd, layer, job->delta, job->record,
+                                           loader->rwopts);
+            if(!layer->data) job->failed = 1;
+        }
+        else if(job->has_checksum && crc32c(0, stored, job->len) != job->checksum) {
+            fprintf(stderr, "lgcLoader: layer %u of %s: checksum mismatch\n",
+                    job->request.layer_n, job->request.filename);
+            job->failed = 1;
+        }
+        else if(job->sparse) {
+            if(!(layer->data = decodeStored(stored, job->len, layer->format, layer->length,
+                                            job->sparse, job->dict, NULL)))
+                job->failed = 1;
+        }
+        else if(layer->format&LGC_FMT_COMPRESSED) {
+            layer->data = malloc(layer->length);
+            if(!layer->data || unpackLZ4(stored, job->len, layer->data, layer->length, job->dict))
+                job->failed = 1;
+        }
+        else if(job->len != layer->length) {
+            job->failed = 1;
+        }
+        else {
+            // read buffer becomes the layer's data
+            if(job->skip) memmove(job->buf, stored, job->len);
+            layer->data = job->buf;
+            job->buf = NULL;
+        }
+    }
+
+    free(job->buf);
+    free(job->delta);
+    if(job->own_fd) close(job->fd);
+
+    lgcLayer *loaded = NULL;
+    if(job->failed) {
+        free(layer->data);
+        free(layer->palette);
+    }
+    else loaded = newLayer(layer);
+
+    loader->callback(&job->request, loaded);
+
+    pthread_mutex_lock(&loader->lock);
+    if(job->failed) loader->failures++;
+    if(!--loader->pending) pthread_cond_broadcast(&loader->idle);
+    pthread_mutex_unlock(&loader->lock);
+
+    free(job);
+
+}
+
+// Blocking read of the job's range, for when there's no io_uring
+static void readJob(loadJob *job) {
+
+    // heads alone (or deltas, read by the worker) have nothing to read here
+    if(!job->buf) return;
+
+    while(!job->failed && job->done < job->skip+job->len) {
+        ssize_t r = pread(job->fd, job->buf+job->done, job->read_len-job->done,
+                          job->read_off+job->done);
+        if(r <= 0) job->failed = 1;
+        else job->done += r;
+    }
+
+}
+
+static void * loadWorker(void *arg) {
+
+    lgcLoader *loader = arg;
+
+    pthread_mutex_lock(&loader->lock);
+    for(;;) {
+        while(!loader->ready && !loader->quit)
+            pthread_cond_wait(&loader->wake, &loader->lock);
+        if(!loader->ready) break;
+
+        loadJob *job = loader->ready;
+        loader->ready = job->next;
+        pthread_mutex_unlock(&loader->lock);
+
+        readJob(job);   // no-op for jobs read through io_uring
+        finishJob(loader, job);
+
+        pthread_mutex_lock(&loader->lock);
+    }
+    pthread_mutex_unlock(&loader->lock);
+
+    return NULL;
+
+}
+
+// Passes the job to worker threads, or finishes it right here if there are none
+static void dispatchJob(lgcLoader *loader, loadJob *job) {
+
+    if(!loader->threads_count) {
+        readJob(job);
+        finishJob(loader, job);
+        return;
+    }
+
+    job->next = NULL;
+    pthread_mutex_lock(&loader->lock);
+    if(loader->ready) loader->ready_tail->next = job;
+    else loader->ready = job;
+    loader->ready_tail = job;
+    pthread_cond_signal(&loader->wake);
+    pthread_mutex_unlock(&loader->lock);
+
+}
+
+/* -- API -- */
+
+lgcLoader * lgcCreateLoader(int rwopts, int threads, lgcLoadCallback callback) {
+
+    if(!callback || rwopts&LGC_RW_FORCE_FILE_POINTER) {
+        fprintf(stderr, "%s: no callback given or LGC_RW_FORCE_FILE_POINTER is set\n",
+                __FUNCTION__);
+        return NULL;
+    }
+
+    lgcLoader *loader = malloc(sizeof(lgcLoader));
+    memset(loader, 0, sizeof(lgcLoader));
+    loader->rwopts = rwopts;
+    loader->callback = callback;
+    mapInit(&loader->files_map, 16);
+
+    pthread_mutex_init(&loader->lock, NULL);
+    pthread_cond_init(&loader->wake, NULL);
+    pthread_cond_init(&loader->idle, NULL);
+
+#ifdef HAVE_IO_URING
+    loader->has_ring = !ringSetup(&loader->ring, LOAD_QUEUE_DEPTH);
+#endif
+
+    if(threads < 0) threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if(threads > LOAD_MAX_THREADS) threads = LOAD_MAX_THREADS;
+
+    while(loader->threads_count < threads &&
+        !pthread_create(&loader->threads[loader->threads_count], NULL, loadWorker, loader))
+        loader->threads_count++;
+
+    return loader;
+
+}
+
+// Returns the file, opening it and reading where it's layers are once per batch
+static loadFile * loaderFile(lgcLoader *loader, const char *filename) {
+
+    uint64_t key = hash64(filename, strlen(filename), 0);
+    uint32_t k;
+
+    if(!mapGet(&loader->files_map, key, &k) && !strcmp(loader->files[k].name, filename))
+        return &loader->files[k];
+
+    FILE *f = openFile(filename, "rb");
+    if(!f) return NULL;
+
+    loadFile file;
+    file.name = filename;
+    file.f = f;
+    int version = 0;
+    if(checkHead(f, NULL, &version) || loadIndex(f, version, &file.idx)) {
+        fclose(f);
+        return NULL;
+    }
+
+    if(loader->rwopts&LGC_RW_BODY) loadDictionary(f, version);
+
+    loader->files = realloc(loader->files, sizeof(loadFile)*(loader->files_count+1));
+    loader->files[loader->files_count] = file;
+    mapPut(&loader->files_map, key, loader->files_count);
+
+    return &loader->files[loader->files_count++];
+
+}
+
+// Finds the record of requested layer, reading it's head
+static loadJob * locateJob(lgcLoader *loader, const lgcLoadRequest *request) {
+
+    loadJob *job = malloc(sizeof(loadJob));
+    memset(job, 0, sizeof(loadJob));
+    memcpy(&job->request, request, sizeof(lgcLoadRequest));
+    job->fd = -1;
+
+    loadFile *file = loaderFile(loader, request->filename);
+    FILE *f = file? file->f: NULL;
+    if(!f || request->layer_n >= file->idx.count ||
+        fseeko(f, file->idx.entries[request->layer_n], SEEK_SET)) {
+        fprintf(stderr, "lgcLoader: can't find layer %u in %s\n",
+                request->layer_n, request->filename);
+        job->failed = 1;
+        return job;
+    }
+
+    layerExt ext;
+    uint64_t offset = 0;
+    FILE *src = NULL;
+
+    if(readHead(f, file->idx.version, &job->layer, &ext) || !(src = openPayload(f, &job->layer, &ext)) ||
+        selectLevel(&job->layer, &ext, request->level, &offset, &job->len)) {
+        fprintf(stderr, "lgcLoader: can't read layer %u (level %u) of %s\n",
+                request->layer_n, request->level, request->filename);
+        if(src && src != f) fclose(src);
+        job->failed = 1;
+        return job;
+    }
+
+    attachPalette(&job->layer, &ext);
+    uint64_t payload = ftello(src)+offset;
+    if(!request->level) job->sparse = ext.sparse_len;
+    job->dict = ext.dict;
+
+    job->fd = fileno(src);
+    if(src != f) {
+        job->fd = dup(job->fd);
+        job->own_fd = 1;
+        fclose(src);
+    }
+
+    if(loader->rwopts&LGC_RW_VERIFY && request->level < ext.checksums) {
+        job->has_checksum = 1;
+        job->checksum = ext.checksum[request->level];
+    }
+
+    if(!(loader->rwopts&LGC_RW_BODY) || job->fd < 0) {
+        job->failed = job->fd < 0;
+        return job;
+    }
+
+    if(ext.delta_base) {
+        job->delta = malloc(sizeof(layerExt));
+        memcpy(job->delta, &ext, sizeof(layerExt));
+        job->record = file->idx.entries[request->layer_n];
+        job->len = 0;
+        return job;
+    }
+
+    // reads are aligned, so the buffer suits O_DIRECT too
+    job->read_off = payload&~(uint64_t)(LOAD_ALIGN-1);
+    job->skip = payload-job->read_off;
+    job->read_len = (job->skip+job->len+LOAD_ALIGN-1)&~(LOAD_ALIGN-1);
+
+    if(posix_memalign((void**)&job->buf, LOAD_ALIGN, job->read_len ? job->read_len: LOAD_ALIGN)) {
+        job->buf = NULL;
+        job->failed = 1;
+    }
+
+    return job;
+
+}
+
+int lgcLoaderSubmit(lgcLoader *loader, const lgcLoadRequest *requests, uint32_t count) {
+
+    uint32_t i;
+    for(i = 0; i < count; ++i) {
+        loadJob *job = locateJob(loader, &requests[i]);
+
+        job->next = NULL;
+        if(loader->queued) loader->queued_tail->next = job;
+        else loader->queued = job;
+        loader->queued_tail = job;
+        loader->queued_count++;
+    }
+
+    pthread_mutex_lock(&loader->lock);
+    loader->pending += count;
+    pthread_mutex_unlock(&loader->lock);
+
+    return 0;
+
+}
+
+#ifdef HAVE_IO_URING
+// Keeps up to a ring full of reads in flight, passing completed ones on
+static void runRing(lgcLoader *loader, loadJob *jobs) {
+
+    loadRing *r = &loader->ring;
+    unsigned in_flight = 0, queued = 0;
+    int broken = 0;
+
+    while(jobs || in_flight) {
+
+        while(jobs && (broken || in_flight+queued < r->entries)) {
+            loadJob *job = jobs;
+            jobs = job->next;
+
+            if(broken || job->failed || !job->buf || job->done >= job->skip+job->len) {
+                dispatchJob(loader, job);
+                continue;
+            }
+
+            ringQueueRead(r, job);
+            queued++;
+        }
+
+        // jobs passed on as they are leave no read to wait for
+        if(broken) {
+            // only waiting for reads the kernel has already taken
+            sched_yield();
+        }
+        else if(in_flight+queued) {
+            int n = syscall(__NR_io_uring_enter, r->fd, queued, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+            if(n >= 0) {
+                in_flight += n;
+                queued -= n;
+            }
+            else if(errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+                // the ring is unusable: reads it didn't take go to the pool
+                unsigned tail = *r->sq_tail, k;
+                for(k = 0; k < queued; ++k)
+                    dispatchJob(loader, (loadJob*)(uintptr_t)
+                                r->sqes[(tail-queued+k)&*r->sq_mask].user_data);
+
+                __atomic_store_n(r->sq_tail, tail-queued, __ATOMIC_RELEASE);
+                queued = 0;
+                broken = 1;
+            }
+        }
+
+        unsigned head = *r->cq_head;
+        unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+        for(; head != tail; ++head) {
+            struct io_uring_cqe *cqe = &r->cqes[head&*r->cq_mask];
+            loadJob *job = (loadJob*)(uintptr_t)cqe->user_data;
+            in_flight--;
+
+            if(cqe->res <= 0) job->failed = 1;
+            else job->done += cqe->res;
+
+            // short read before the end of the pixels: ask for the rest
+            if(!job->failed && job->done < job->skip+job->len) {
+                job->next = jobs;
+                jobs = job;
+            }
+            else dispatchJob(loader, job);
+        }
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+
+    }
+
+    if(broken) {
+        ringFree(r);
+        loader->has_ring = 0;
+    }
+
+}
+#endif
+
+int lgcLoaderWait(lgcLoader *loader) {
+
+    loadJob *jobs = loader->queued;
+    loader->queued = loader->queued_tail = NULL;
+    loader->queued_count = 0;
+
+#ifdef HAVE_IO_URING
+    if(loader->has_ring) {
+        runRing(loader, jobs);
+        jobs = NULL;
+    }
+#endif
+
+    while(jobs) {
+        loadJob *job = jobs;
+        jobs = job->next;
+        dispatchJob(loader, job);
+    }
+
+    pthread_mutex_lock(&loader->lock);
+    while(loader->pending)
+        pthread_cond_wait(&loader->idle, &loader->lock);
+    int failures = loader->failures;
+    loader->failures = 0;
+    pthread_mutex_unlock(&loader->lock);
+
+    uint32_t i;
+    for(i = 0; i < loader->files_count; ++i) {
+        freeIndex(&loader->files[i].idx);
+        fclose(loader->files[i].f);
+    }
+    free(loader->files);
+    loader->files = NULL;
+    loader->files_count = 0;
+    mapFree(&loader->files_map);
+    mapInit(&loader->files_map, 16);
+
+    return failures;
+
+}
+
+void lgcDestroyLoader(lgcLoader *loader) {
+
+    if(!loader) return;
+    lgcLoaderWait(loader);
+
+    pthread_mutex_lock(&loader->lock);
+    loader->quit = 1;
+    pthread_cond_broadcast(&loader->wake);
+    pthread_mutex_unlock(&loader->lock);
+
+    int i;
+    for(i = 0; i < loader->threads_count; ++i)
+        pthread_join(loader->threads[i], NULL);
+
+#ifdef HAVE_IO_URING
+    if(loader->has_ring) ringFree(&loader->ring);
+#endif
+
+    mapFree(&loader->files_map);
+    pthread_cond_destroy(&loader->idle);
+    pthread_cond_destroy(&loader->wake);
+    pthread_mutex_destroy(&loader->lock);
+    free(loader);
+
+}
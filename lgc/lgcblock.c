@@ -0,0 +1,716 @@
+/**
+
+    lgcblock.c
+    Block-compressed (GPU texture) formats: BC1, BC3 and BC7 encoding
+    on the CPU, and decoding for when the GPU lacks them
+
+    This software comes under the terms of MIT License.
+
+**/
+
+#include "lgcpriv.h"
+
+#include <malloc.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define BLOCK_MAX_THREADS 64
+
+// BC7 interpolation weights of 4-bit indices, out of 64
+static const int bc7_weights[16] = {0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64};
+
+/* -- common -- */
+
+// Bytes per pixel of layers which can be encoded, 0 for others
+static int sourceBpp(uint8_t format) {
+
+    switch(format&~LGC_FMT_COMPRESSED) {
+        case LGC_FMT_GRAY|LGC_FMT_8BIT: return 1;
+        case LGC_FMT_RGB8: return 3;
+        case LGC_FMT_RGBA8: return 4;
+    }
+
+    return 0;
+
+}
+
+static int isBlockFormat(uint8_t format) {
+    uint8_t kind = format&~LGC_FMT_COMPRESSED;
+    return kind == LGC_FMT_BC1 || kind == LGC_FMT_BC3 || kind == LGC_FMT_BC7;
+}
+
+// Reads 4x4 pixels of block (bx, by) as RGBA, repeating the edge ones
+static void loadBlock(const uint8_t *pixels, uint32_t w, uint32_t h, int bpp,
+                      uint32_t bx, uint32_t by, uint8_t *block) {
+
+    int i, j;
+    for(j = 0; j < 4; ++j) {
+        uint32_t y = by*4+j < h? by*4+j: h-1;
+
+        for(i = 0; i < 4; ++i) {
+            uint32_t x = bx*4+i < w? bx*4+i: w-1;
+            const uint8_t *p = pixels+((size_t)y*w+x)*bpp;
+            uint8_t *d = block+4*(j*4+i);
+
+            if(bpp == 1) {
+                d[0] = d[1] = d[2] = p[0];
+                d[3] = 255;
+            }
+            else {
+                memcpy(d, p, 3);
+                d[3] = bpp == 4? p[3]: 255;
+            }
+        }
+    }
+
+}
+
+/*  Finds the nearest of 'n' RGBA palette entries for each of 16 RGBA
+    pixels: it's index and squared distance to it. */
+static void nearestEntries(const uint8_t *block, const uint8_t (*palette)[4], int n,
+                           uint8_t *idx, uint32_t *dist) {
+
+    int i, k;
+
+#ifdef __SSE2__
+    // four pixels at once, channels widened to 16 bits
+    __m128i zero = _mm_setzero_si128();
+    for(i = 0; i < 16; i += 4) {
+        __m128i p = _mm_loadu_si128((const __m128i*)(block+4*i));
+        __m128i lo = _mm_unpacklo_epi8(p, zero), hi = _mm_unpackhi_epi8(p, zero);
+        __m128i best = _mm_set1_epi32(0x7fffffff), best_k = zero;
+
+        for(k = 0; k < n; ++k) {
+            uint32_t entry;
+            memcpy(&entry, palette[k], 4);
+            __m128i c = _mm_unpacklo_epi8(_mm_set1_epi32(entry), zero);
+
+            __m128i dlo = _mm_sub_epi16(lo, c), dhi = _mm_sub_epi16(hi, c);
+            __m128 slo = _mm_castsi128_ps(_mm_madd_epi16(dlo, dlo));
+            __m128 shi = _mm_castsi128_ps(_mm_madd_epi16(dhi, dhi));
+
+            // r*r+g*g and b*b+a*a of each pixel, added together
+            __m128i d = _mm_add_epi32(
+                _mm_castps_si128(_mm_shuffle_ps(slo, shi, _MM_SHUFFLE(2, 0, 2, 0))),
+                _mm_castps_si128(_mm_shuffle_ps(slo, shi, _MM_SHUFFLE(3, 1, 3, 1))));
+
+            __m128i closer = _mm_cmplt_epi32(d, best);
+            best = _mm_or_si128(_mm_and_si128(closer, d), _mm_andnot_si128(closer, best));
+            best_k = _mm_or_si128(_mm_and_si128(closer, _mm_set1_epi32(k)),
+                                  _mm_andnot_si128(closer, best_k));
+        }
+
+        uint32_t ks[4];
+        _mm_storeu_si128((__m128i*)ks, best_k);
+        _mm_storeu_si128((__m128i*)(dist+i), best);
+        for(k = 0; k < 4; ++k) idx[i+k] = ks[k];
+    }
+#else
+    for(i = 0; i < 16; ++i) {
+        const uint8_t *p = block+4*i;
+        dist[i] = 0xffffffff;
+
+        for(k = 0; k < n; ++k) {
+            int c;
+            uint32_t d = 0;
+            for(c = 0; c < 4; ++c)
+                d += (p[c]-palette[k][c])*(p[c]-palette[k][c]);
+
+            if(d < dist[i]) {
+                dist[i] = d;
+                idx[i] = k;
+            }
+        }
+    }
+#endif
+
+}
+
+/*  Principal axis of 'n' points of 'ch' channels, through their mean:
+    it's ends are where the points' projections on it end. */
+static void fitLine(const float (*px)[4], int n, int ch, float *e0, float *e1) {
+
+    float mean[4] = {0, 0, 0, 0}, cov[4][4], axis[4];
+    int i, a, b, it;
+
+    for(i = 0; i < n; ++i)
+        for(a = 0; a < ch; ++a) mean[a] += px[i][a];
+    for(a = 0; a < ch; ++a) mean[a] /= n;
+
+    memset(cov, 0, sizeof(cov));
+    for(i = 0; i < n; ++i)
+        for(a = 0; a < ch; ++a)
+            for(b = 0; b < ch; ++b)
+                cov[a][b] += (px[i][a]-mean[a])*(px[i][b]-mean[b]);
+
+    // power iteration, from the diagonal
+    for(a = 0; a < ch; ++a) axis[a] = cov[a][a];
+
+    for(it = 0; it < 8; ++it) {
+        float v[4] = {0, 0, 0, 0}, m = 0;
+        for(a = 0; a < ch; ++a) {
+            for(b = 0; b < ch; ++b) v[a] += cov[a][b]*axis[b];
+            if(v[a] > m) m = v[a];
+            if(-v[a] > m) m = -v[a];
+        }
+
+        if(m == 0) break;
+        for(a = 0; a < ch; ++a) axis[a] = v[a]/m;
+    }
+
+    float len = 0, t0 = 0, t1 = 0;
+    for(a = 0; a < ch; ++a) len += axis[a]*axis[a];
+
+    if(len > 0)
+        for(i = 0; i < n; ++i) {
+            float t = 0;
+            for(a = 0; a < ch; ++a) t += (px[i][a]-mean[a])*axis[a];
+            t /= len;
+            if(t < t0) t0 = t;
+            if(t > t1) t1 = t;
+        }
+
+    for(a = 0; a < ch; ++a) {
+        e0[a] = mean[a]+t0*axis[a];
+        e1[a] = mean[a]+t1*axis[a];
+        e0[a] = e0[a] < 0? 0: e0[a] > 255? 255: e0[a];
+        e1[a] = e1[a] < 0? 0: e1[a] > 255? 255: e1[a];
+    }
+
+}
+
+/*  Endpoints which fit the points best (least squares), each point
+    being at 't' of the way from e0 to e1. Returns non-zero when the
+    points don't tell them apart. */
+static int refineLine(const float (*px)[4], const float *t, int n, int ch, float *e0, float *e1) {
+
+    float a = 0, b = 0, c = 0, x0[4] = {0, 0, 0, 0}, x1[4] = {0, 0, 0, 0};
+    int i, k;
+
+    for(i = 0; i < n; ++i) {
+        float s = 1-t[i];
+        a += s*s;
+        b += s*t[i];
+        c += t[i]*t[i];
+        for(k = 0; k < ch; ++k) {
+            x0[k] += s*px[i][k];
+            x1[k] += t[i]*px[i][k];
+        }
+    }
+
+    float det = a*c-b*b;
+    if(det < 1e-3f) return -1;
+
+    for(k = 0; k < ch; ++k) {
+        e0[k] = (c*x0[k]-b*x1[k])/det;
+        e1[k] = (a*x1[k]-b*x0[k])/det;
+        e0[k] = e0[k] < 0? 0: e0[k] > 255? 255: e0[k];
+        e1[k] = e1[k] < 0? 0: e1[k] > 255? 255: e1[k];
+    }
+
+    return 0;
+
+}
+
+/* -- BC1 and BC3 -- */
+
+static uint16_t pack565(const float *c) {
+    return (uint16_t)(c[0]*31/255+0.5f)<<11|(uint16_t)(c[1]*63/255+0.5f)<<5|
+        (uint16_t)(c[2]*31/255+0.5f);
+}
+
+static void unpack565(uint16_t v, uint8_t *c) {
+    c[0] = (v>>11)<<3|v>>13;
+    c[1] = (v>>5&63)<<2|(v>>9&3);
+    c[2] = (v&31)<<3|(v>>2&7);
+    c[3] = 255;
+}
+
+/*  Palette of a color block, as GPUs decode it: four colors when
+    c0 > c1 (or 'four' is set, as in BC3), three and transparent black
+    otherwise. Returns the number of colors. */
+static int colorPalette(uint16_t c0, uint16_t c1, int four, uint8_t (*pal)[4]) {
+
+    int k;
+    unpack565(c0, pal[0]);
+    unpack565(c1, pal[1]);
+
+    if(four || c0 > c1) {
+        for(k = 0; k < 3; ++k) {
+            pal[2][k] = (2*pal[0][k]+pal[1][k])/3;
+            pal[3][k] = (pal[0][k]+2*pal[1][k])/3;
+        }
+        pal[2][3] = pal[3][3] = 255;
+        return 4;
+    }
+
+    for(k = 0; k < 3; ++k) pal[2][k] = (pal[0][k]+pal[1][k])/2;
+    pal[2][3] = 255;
+    memset(pal[3], 0, 4);
+    return 3;
+
+}
+
+/*  Color block (8 bytes). With 'punch', pixels having alpha below 128
+    become transparent, in the three-color mode. */
+static void encodeColor(const uint8_t *block, int punch, uint8_t *out) {
+
+    static const float weights[2][4] = {{0, 1, 1.f/3, 2.f/3}, {0, 1, 0.5f, 0}};
+
+    float px[16][4], e0[4], e1[4], t[16];
+    uint8_t opaque[64], pal[4][4], idx[16], best_idx[16];
+    uint32_t dist[16], best = 0xffffffff;
+    uint16_t best_c0 = 0, best_c1 = 0;
+    int n = 0, transparent = 0, i, k, pass;
+
+    // alpha takes no part in the distances
+    memcpy(opaque, block, 64);
+    for(i = 0; i < 16; ++i) {
+        opaque[4*i+3] = 255;
+
+        if(punch && block[4*i+3] < 128) {
+            transparent = 1;
+            continue;
+        }
+
+        for(k = 0; k < 3; ++k) px[n][k] = block[4*i+k];
+        n++;
+    }
+
+    if(!n) {
+        memset(out, 0, 4);
+        memset(out+4, 0xff, 4);
+        return;
+    }
+
+    fitLine((const float (*)[4])px, n, 3, e0, e1);
+
+    for(pass = 0; pass < 2; ++pass) {
+        uint16_t c0 = pack565(e0), c1 = pack565(e1);
+        if(transparent? c0 > c1: c0 < c1) {
+            uint16_t c = c0;
+            c0 = c1;
+            c1 = c;
+        }
+
+        // the fourth color of the three-color mode is left to the transparent pixels
+        int entries = colorPalette(c0, c1, 0, pal);
+        nearestEntries(opaque, (const uint8_t (*)[4])pal, entries, idx, dist);
+
+        uint32_t err = 0;
+        for(i = 0, k = 0; i < 16; ++i) {
+            if(punch && block[4*i+3] < 128) {
+                idx[i] = 3;
+                continue;
+            }
+            err += dist[i];
+            t[k++] = weights[entries == 4? 0: 1][idx[i]];
+        }
+
+        if(err < best) {
+            best = err;
+            best_c0 = c0;
+            best_c1 = c1;
+            memcpy(best_idx, idx, 16);
+        }
+
+        if(!err || refineLine((const float (*)[4])px, t, n, 3, e0, e1)) break;
+    }
+
+    uint32_t bits = 0;
+    for(i = 0; i < 16; ++i)
+        bits |= (uint32_t)best_idx[i]<<2*i;
+
+    putLE16(out, best_c0);
+    putLE16(out+2, best_c1);
+    putLE32(out+4, bits);
+
+}
+
+// BC3 alpha block (8 bytes), in the mode of eight interpolated values
+static void encodeAlpha(const uint8_t *block, uint8_t *out) {
+
+    int lo = 255, hi = 0, i, k;
+    for(i = 0; i < 16; ++i) {
+        int a = block[4*i+3];
+        if(a < lo) lo = a;
+        if(a > hi) hi = a;
+    }
+
+    out[0] = hi;
+    out[1] = lo;
+    memset(out+2, 0, 6);
+    if(hi == lo) return;
+
+    int values[8] = {hi, lo};
+    for(k = 2; k < 8; ++k)
+        values[k] = ((8-k)*hi+(k-1)*lo)/7;
+
+    uint64_t bits = 0;
+    for(i = 0; i < 16; ++i) {
+        int a = block[4*i+3], best = 0, best_d = 256;
+        for(k = 0; k < 8; ++k) {
+            int d = a > values[k]? a-values[k]: values[k]-a;
+            if(d < best_d) {
+                best_d = d;
+                best = k;
+            }
+        }
+        bits |= (uint64_t)best<<3*i;
+    }
+
+    for(k = 0; k < 6; ++k)
+        out[2+k] = bits>>8*k;
+
+}
+
+static void decodeColor(const uint8_t *in, int four, uint8_t *block) {
+
+    uint8_t pal[4][4];
+    colorPalette(getLE16(in), getLE16(in+2), four, pal);
+
+    uint32_t bits = getLE32(in+4);
+    int i;
+    for(i = 0; i < 16; ++i)
+        memcpy(block+4*i, pal[bits>>2*i&3], 4);
+
+}
+
+static void decodeAlpha(const uint8_t *in, uint8_t *block) {
+
+    int a0 = in[0], a1 = in[1], values[8] = {a0, a1}, k, i;
+
+    if(a0 > a1)
+        for(k = 2; k < 8; ++k) values[k] = ((8-k)*a0+(k-1)*a1)/7;
+    else {
+        for(k = 2; k < 6; ++k) values[k] = ((6-k)*a0+(k-1)*a1)/5;
+        values[6] = 0;
+        values[7] = 255;
+    }
+
+    uint64_t bits = 0;
+    for(k = 0; k < 6; ++k)
+        bits |= (uint64_t)in[2+k]<<8*k;
+
+    for(i = 0; i < 16; ++i)
+        block[4*i+3] = values[bits>>3*i&7];
+
+}
+
+/* -- BC7 -- */
+
+typedef struct {
+
+    uint8_t *       out;
+    int             pos;    // in bits
+
+} bitWriter;
+
+static void putBits(bitWriter *w, uint32_t v, int n) {
+    int i;
+    for(i = 0; i < n; ++i, ++w->pos)
+        w->out[w->pos>>3] |= (v>>i&1)<<(w->pos&7);
+}
+
+static uint32_t getBits(const uint8_t *in, int *pos, int n) {
+    uint32_t v = 0;
+    int i;
+    for(i = 0; i < n; ++i, ++*pos)
+        v |= (uint32_t)(in[*pos>>3]>>(*pos&7)&1)<<i;
+    return v;
+}
+
+/*  Endpoint of 7 bits per channel and a shared lowest bit ('p'),
+    the nearest to 'e'. Returns 8-bit values of it in 'v'. */
+static void quantizeEndpoint(const float *e, uint8_t *q, int *p, uint8_t *v) {
+
+    float best = -1;
+    int bit, k;
+    for(bit = 0; bit < 2; ++bit) {
+        uint8_t tq[4];
+        float err = 0;
+
+        for(k = 0; k < 4; ++k) {
+            int c = (int)((e[k]-bit)/2+0.5f);
+            tq[k] = c < 0? 0: c > 127? 127: c;
+            float d = tq[k]*2+bit-e[k];
+            err += d*d;
+        }
+
+        if(best < 0 || err < best) {
+            best = err;
+            *p = bit;
+            memcpy(q, tq, 4);
+        }
+    }
+
+    for(k = 0; k < 4; ++k) v[k] = q[k]*2+*p;
+
+}
+
+// BC7 block (16 bytes) in mode 6: one RGBA line of 16 values per block
+static void encodeBC7(const uint8_t *block, uint8_t *out) {
+
+    float px[16][4], e0[4], e1[4], t[16];
+    uint8_t q[2][4], best_q[2][4], v[2][4], pal[16][4], idx[16], best_idx[16];
+    uint32_t dist[16], best = 0xffffffff;
+    int p[2], best_p[2] = {0, 0}, i, k, pass;
+
+    for(i = 0; i < 16; ++i)
+        for(k = 0; k < 4; ++k) px[i][k] = block[4*i+k];
+
+    fitLine((const float (*)[4])px, 16, 4, e0, e1);
+
+    for(pass = 0; pass < 2; ++pass) {
+        quantizeEndpoint(e0, q[0], &p[0], v[0]);
+        quantizeEndpoint(e1, q[1], &p[1], v[1]);
+
+        for(i = 0; i < 16; ++i)
+            for(k = 0; k < 4; ++k)
+                pal[i][k] = ((64-bc7_weights[i])*v[0][k]+bc7_weights[i]*v[1][k]+32)>>6;
+
+        nearestEntries(block, (const uint8_t (*)[4])pal, 16, idx, dist);
+
+        uint32_t err = 0;
+        for(i = 0; i < 16; ++i) {
+            err += dist[i];
+            t[i] = bc7_weights[idx[i]]/64.f;
+        }
+
+        if(err < best) {
+            best = err;
+            memcpy(best_q, q, sizeof(q));
+            memcpy(best_p, p, sizeof(p));
+            memcpy(best_idx, idx, 16);
+        }
+
+        if(!err || refineLine((const float (*)[4])px, t, 16, 4, e0, e1)) break;
+    }
+
+    // highest bit of the first index is not stored, it must be 0
+    int swap = best_idx[0] >= 8;
+
+    bitWriter w = {out, 0};
+    memset(out, 0, 16);
+    putBits(&w, 1<<6, 7);
+
+    for(k = 0; k < 4; ++k) {
+        putBits(&w, best_q[swap][k], 7);
+        putBits(&w, best_q[!swap][k], 7);
+    }
+
+    putBits(&w, best_p[swap], 1);
+    putBits(&w, best_p[!swap], 1);
+
+    for(i = 0; i < 16; ++i)
+        putBits(&w, swap? 15-best_idx[i]: best_idx[i], i? 4: 3);
+
+}
+
+// Returns non-zero for blocks in modes other than 6, which are not supported
+static int decodeBC7(const uint8_t *in, uint8_t *block) {
+
+    int pos = 0, mode = 0;
+    while(mode < 8 && !getBits(in, &pos, 1)) mode++;
+
+    if(mode != 6) {
+        // reserved mode 8 decodes to transparent black
+        memset(block, 0, 64);
+        return mode == 8? 0: -1;
+    }
+
+    uint8_t e[2][4];
+    int i, k;
+    for(k = 0; k < 4; ++k) {
+        e[0][k] = getBits(in, &pos, 7)<<1;
+        e[1][k] = getBits(in, &pos, 7)<<1;
+    }
+
+    int p0 = getBits(in, &pos, 1), p1 = getBits(in, &pos, 1);
+    for(k = 0; k < 4; ++k) {
+        e[0][k] |= p0;
+        e[1][k] |= p1;
+    }
+
+    for(i = 0; i < 16; ++i) {
+        int w = bc7_weights[getBits(in, &pos, i? 4: 3)];
+        for(k = 0; k < 4; ++k)
+            block[4*i+k] = ((64-w)*e[0][k]+w*e[1][k]+32)>>6;
+    }
+
+    return 0;
+
+}
+
+/* -- layers -- */
+
+typedef struct {
+
+    const uint8_t * pixels;
+    uint32_t        w, h;
+    int             bpp;
+    uint8_t         format;
+    uint8_t *       out;
+    uint32_t        rows;   // of blocks
+    uint32_t        next;   // next row to take, atomic
+
+} encodeQueue;
+
+static void * encodeWorker(void *arg) {
+
+    encodeQueue *q = arg;
+    uint32_t cols = (q->w+3)/4, bytes = LGC_BLOCK_BYTES(q->format);
+    uint8_t block[64];
+
+    for(;;) {
+        uint32_t by = __atomic_fetch_add(&q->next, 1, __ATOMIC_RELAXED), bx;
+        if(by >= q->rows) break;
+
+        uint8_t *out = q->out+(size_t)by*cols*bytes;
+        for(bx = 0; bx < cols; ++bx, out += bytes) {
+            loadBlock(q->pixels, q->w, q->h, q->bpp, bx, by, block);
+
+            if(q->format == LGC_FMT_BC1)
+                encodeColor(block, 1, out);
+            else if(q->format == LGC_FMT_BC3) {
+                encodeAlpha(block, out);
+                encodeColor(block, 0, out+8);
+            }
+            else encodeBC7(block, out);
+        }
+    }
+
+    return NULL;
+
+}
+
+/*  Encodes w x h pixels of 'src_format' (8-bit gray, RGB or RGBA) to
+    blocks of 'format', rows of blocks being shared between threads. Returns non-zero on failure. */
+int encodeBlocks(const uint8_t *pixels, uint32_t w, uint32_t h, uint8_t src_format,
+                 uint8_t format, uint8_t *out, int threads) {
+
+    encodeQueue q = {pixels, w, h, sourceBpp(src_format), format&~LGC_FMT_COMPRESSED, out,
+                     (h+3)/4, 0};
+    if(!q.bpp || !isBlockFormat(format)) return -1;
+    if(!w || !h) return 0;
+
+    if(threads <= 0) threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if(threads > BLOCK_MAX_THREADS) threads = BLOCK_MAX_THREADS;
+    if((uint32_t)threads > q.rows) threads = q.rows;
+
+    // the calling thread is one of the workers
+    pthread_t workers[BLOCK_MAX_THREADS];
+    int started = 0, t;
+    while(started+1 < threads && !pthread_create(&workers[started], NULL, encodeWorker, &q))
+        started++;
+
+    encodeWorker(&q);
+
+    for(t = 0; t < started; ++t)
+        pthread_join(workers[t], NULL);
+
+    return 0;
+
+}
+
+/*  Decodes blocks of 'format' to w x h RGBA pixels.
+    Returns non-zero on failure. */
+int decodeBlocks(const uint8_t *blocks, uint32_t w, uint32_t h, uint8_t format, uint8_t *rgba) {
+
+    uint8_t kind = format&~LGC_FMT_COMPRESSED;
+    if(!isBlockFormat(kind)) return -1;
+
+    uint32_t cols = (w+3)/4, rows = (h+3)/4, bytes = LGC_BLOCK_BYTES(kind), bx, by;
+    uint8_t block[64];
+
+    for(by = 0; by < rows; ++by)
+        for(bx = 0; bx < cols; ++bx, blocks += bytes) {
+
+            if(kind == LGC_FMT_BC1)
+                decodeColor(blocks, 0, block);
+            else if(kind == LGC_FMT_BC3) {
+                decodeColor(blocks+8, 1, block);
+                decodeAlpha(blocks, block);
+            }
+            else if(decodeBC7(blocks, block)) {
+                fprintf(stderr, "lgc: BC7 blocks of modes other than 6 are not supported\n");
+                return -1;
+            }
+
+            // blocks at the edges are cut
+            uint32_t bw = w-bx*4 < 4? w-bx*4: 4, bh = h-by*4 < 4? h-by*4: 4, j;
+            for(j = 0; j < bh; ++j)
+                memcpy(rgba+((size_t)(by*4+j)*w+bx*4)*4, block+16*j, bw*4);
+        }
+
+    return 0;
+
+}
+
+int lgcEncodeLayer(lgcLayer *layer, uint8_t format, int threads) {
+
+    if(!layer || !layer->data) {
+        fprintf(stderr, "%s: layer has no pixels\n", __FUNCTION__);
+        return -1;
+    }
+
+    if(!isBlockFormat(format)) {
+        fprintf(stderr, "%s: format %u is not a block-compressed one\n", __FUNCTION__, format);
+        return -1;
+    }
+
+    fullLayer full;
+    loadLayer(layer, &full);
+
+    if(!sourceBpp(full.format)) {
+        fprintf(stderr, "%s: only 8-bit gray, RGB and RGBA layers can be encoded\n", __FUNCTION__);
+        return -1;
+    }
+
+    uint64_t len = LGC_PIXELS_LENGTH(format, full.w, full.h);
+    uint8_t *blocks = malloc(len? len: 1);
+    if(!blocks || encodeBlocks(full.data, full.w, full.h, full.format, format, blocks, threads)) {
+        free(blocks);
+        return -1;
+    }
+
+    // old pixels go the way lgcDestroyLayer() takes them, shared ones stay with the others
+    lgcDestroyLayer(layer, 0);
+
+    full.data = blocks;
+    full.length = len;
+    full.format = format;
+    full.palette = NULL;
+    full.refs = NULL;
+    full.borrowed = 0;
+    storeLayer(&full, layer);
+
+    return 0;
+
+}
+
+void * lgcDecodeBlocks(const lgcLayer *layer) {
+
+    if(!layer || !layer->data || !isBlockFormat(layer->format)) {
+        fprintf(stderr, "%s: layer has no block-compressed pixels\n", __FUNCTION__);
+        return NULL;
+    }
+
+    fullLayer full;
+    loadLayer(layer, &full);
+
+    uint8_t *rgba = malloc((size_t)full.w*full.h*4+1);
+    if(rgba && decodeBlocks(full.data, full.w, full.h, full.format, rgba)) {
+        free(rgba);
+        return NULL;
+    }
+
+    return rgba;
+
+}
@@ -0,0 +1,879 @@
+/**
+
+    lgccache.c
+    Decoded layers cache shared between processes of a host: the
+    server keeps layers in a shared memory segment, clients map it
+    read-only and get layers pointing into it
+
+    This software comes under the terms of MIT License.
+
+**/
+
+#include "lgcpriv.h"
+
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define CACHE_ALIGN 64
+#define CACHE_KEY_LENGTH 44
+#define CACHE_NONE 0xffffffff
+
+enum { CACHE_GET = 1, CACHE_RELEASE = 2 };
+
+// Status of a reply; on CACHE_MISSED the client decodes the layer itself
+enum { CACHE_OK = 0, CACHE_MISSED = 1 };
+
+/* Client's request, one datagram */
+typedef struct {
+
+    uint32_t        op;
+    uint32_t        layer_n;
+    uint64_t        offset;     // of the layer released
+    uint8_t         level;
+    char            path[PATH_MAX];
+
+} cacheRequest;
+
+/*  Server's reply; the first one, sent on connection along with
+    the segment descriptor, has the segment size in 'len' */
+typedef struct {
+
+    int32_t         status;
+    uint64_t        offset;
+    uint64_t        len;
+    uint32_t        w, h;
+    int32_t         x, y;
+    uint8_t         format;
+    uint8_t         levels;
+    int32_t         flags;
+    uint64_t        palette;    // offset of the palette of indexed layers
+    uint16_t        colors;
+
+} cacheReply;
+
+/* Decoded layer in the segment */
+typedef struct {
+
+    uint8_t         key[CACHE_KEY_LENGTH];
+    uint64_t        hash;
+    uint64_t        offset, len;    // of the block (palette, then pixels), len is aligned
+    cacheReply      head;
+    uint32_t        pins;           // clients' views of it
+    int             hashed;         // found by key; not while being filled
+    uint32_t        chain;          // next in the bucket, or in the free slots
+    uint32_t        prev, next;     // in LRU order, most recent first
+
+} cacheEntry;
+
+typedef struct {
+
+    uint64_t        offset, len;
+
+} cacheHole;
+
+typedef struct cacheClient {
+
+    lgcCacheServer *        server;
+    int                     fd;
+    pthread_t               thread;
+    int                     done;
+    uint32_t *              pins;   // entries pinned, once per view
+    uint32_t                pins_count, pins_cap;
+    struct cacheClient *    next;
+
+} cacheClient;
+
+struct lgcCacheServer {
+
+    char *          socket_path;
+    int             listen_fd;
+    int             seg_fd;         // read-only one, for clients
+    uint8_t *       seg;
+    uint64_t        size;
+    pthread_t       acceptor;
+    int             stopping;
+
+    pthread_mutex_t lock;           // everything below
+    cacheEntry *    entries;
+    uint32_t        entries_count, entries_cap;
+    uint32_t        free_slot;
+    uint32_t *      buckets;
+    uint32_t        buckets_count;  // power of two
+    uint32_t        lru_head, lru_tail;
+    cacheHole *     holes;          // free space, by offset
+    uint32_t        holes_count, holes_cap;
+    cacheClient *   clients;
+    uint64_t        hits, misses;
+
+};
+
+struct lgcCache {
+
+    int             fd;
+    const uint8_t * map;
+    uint64_t        size;
+    pthread_mutex_t lock;           // one request at a time on the socket
+
+};
+
+/* -- server: space of the segment -- */
+
+static void addHole(lgcCacheServer *s, uint64_t offset, uint64_t len) {
+
+    // first hole after the freed block
+    uint32_t lo = 0, hi = s->holes_count;
+    while(lo < hi) {
+        uint32_t mid = (lo+hi)/2;
+        if(s->holes[mid].offset < offset) lo = mid+1;
+        else hi = mid;
+    }
+
+    int prev = lo > 0 && s->holes[lo-1].offset+s->holes[lo-1].len == offset;
+    int next = lo < s->holes_count && offset+len == s->holes[lo].offset;
+
+    if(prev && next) {
+        s->holes[lo-1].len += len+s->holes[lo].len;
+        memmove(&s->holes[lo], &s->holes[lo+1], sizeof(cacheHole)*(s->holes_count-lo-1));
+        s->holes_count--;
+    }
+    else if(prev) s->holes[lo-1].len += len;
+    else if(next) {
+        s->holes[lo].offset = offset;
+        s->holes[lo].len += len;
+    }
+    else {
+        if(s->holes_count == s->holes_cap) {
+            s->holes_cap = s->holes_cap? 2*s->holes_cap: 64;
+            s->holes = realloc(s->holes, sizeof(cacheHole)*s->holes_cap);
+        }
+        memmove(&s->holes[lo+1], &s->holes[lo], sizeof(cacheHole)*(s->holes_count-lo));
+        s->holes[lo].offset = offset;
+        s->holes[lo].len = len;
+        s->holes_count++;
+    }
+
+}
+
+// First fit; returns non-zero if no hole is large enough
+static int takeSpace(lgcCacheServer *s, uint64_t len, uint64_t *offset) {
+
+    uint32_t i;
+    for(i = 0; i < s->holes_count; ++i) {
+        cacheHole *h = &s->holes[i];
+        if(h->len < len) continue;
+
+        *offset = h->offset;
+        h->offset += len;
+        h->len -= len;
+        if(!h->len) {
+            memmove(h, h+1, sizeof(cacheHole)*(s->holes_count-i-1));
+            s->holes_count--;
+        }
+        return 0;
+    }
+
+    return -1;
+
+}
+
+/* -- server: entries -- */
+
+static void lruUnlink(lgcCacheServer *s, uint32_t e) {
+
+    cacheEntry *entry = &s->entries[e];
+    if(entry->prev != CACHE_NONE) s->entries[entry->prev].next = entry->next;
+    else s->lru_head = entry->next;
+    if(entry->next != CACHE_NONE) s->entries[entry->next].prev = entry->prev;
+    else s->lru_tail = entry->prev;
+
+}
+
+static void lruPush(lgcCacheServer *s, uint32_t e) {
+
+    cacheEntry *entry = &s->entries[e];
+    entry->prev = CACHE_NONE;
+    entry->next = s->lru_head;
+    if(s->lru_head != CACHE_NONE) s->entries[s->lru_head].prev = e;
+    else s->lru_tail = e;
+    s->lru_head = e;
+
+}
+
+static uint32_t * bucketOf(lgcCacheServer *s, uint64_t hash) {
+    return &s->buckets[hash&(s->buckets_count-1)];
+}
+
+static uint32_t findEntry(lgcCacheServer *s, const uint8_t *key, uint64_t hash) {
+
+    uint32_t e = *bucketOf(s, hash);
+    for(; e != CACHE_NONE; e = s->entries[e].chain)
+        if(s->entries[e].hash == hash && !memcmp(s->entries[e].key, key, CACHE_KEY_LENGTH))
+            return e;
+
+    return CACHE_NONE;
+
+}
+
+static void hashEntry(lgcCacheServer *s, uint32_t e) {
+
+    // buckets grow along with the entries, chains stay short
+    if(s->entries_count > 2*s->buckets_count) {
+        uint32_t i;
+        s->buckets_count *= 2;
+        s->buckets = realloc(s->buckets, sizeof(uint32_t)*s->buckets_count);
+        memset(s->buckets, 0xff, sizeof(uint32_t)*s->buckets_count);
+        for(i = 0; i < s->entries_cap; ++i)
+            if(s->entries[i].hashed) {
+                uint32_t *b = bucketOf(s, s->entries[i].hash);
+                s->entries[i].chain = *b;
+                *b = i;
+            }
+    }
+
+    uint32_t *b = bucketOf(s, s->entries[e].hash);
+    s->entries[e].chain = *b;
+    s->entries[e].hashed = 1;
+    *b = e;
+
+}
+
+static void unhashEntry(lgcCacheServer *s, uint32_t e) {
+
+    uint32_t *p = bucketOf(s, s->entries[e].hash);
+    while(*p != e) p = &s->entries[*p].chain;
+    *p = s->entries[e].chain;
+    s->entries[e].hashed = 0;
+
+}
+
+static void dropEntry(lgcCacheServer *s, uint32_t e) {
+
+    cacheEntry *entry = &s->entries[e];
+    if(entry->hashed) unhashEntry(s, e);
+    lruUnlink(s, e);
+    addHole(s, entry->offset, entry->len);
+
+    entry->len = 0;
+    entry->chain = s->free_slot;
+    s->free_slot = e;
+    s->entries_count--;
+
+}
+
+/*  New entry with a block of 'len' bytes, evicting the least recently
+    used entries which are not pinned to make room. It is pinned once,
+    and not found by key until hashEntry().
+    Returns it, CACHE_NONE if it doesn't fit. */
+static uint32_t newEntry(lgcCacheServer *s, uint64_t len) {
+
+    uint64_t offset;
+    len = (len+CACHE_ALIGN-1)&~(uint64_t)(CACHE_ALIGN-1);
+    if(!len) len = CACHE_ALIGN;
+
+    uint32_t victim = s->lru_tail;
+    while(takeSpace(s, len, &offset)) {
+        while(victim != CACHE_NONE && s->entries[victim].pins)
+            victim = s->entries[victim].prev;
+        if(victim == CACHE_NONE) return CACHE_NONE;
+
+        uint32_t prev = s->entries[victim].prev;
+        dropEntry(s, victim);
+        victim = prev;
+    }
+
+    uint32_t e = s->free_slot;
+    if(e != CACHE_NONE) s->free_slot = s->entries[e].chain;
+    else {
+        if(s->entries_cap == UINT32_MAX-1) {
+            addHole(s, offset, len);
+            return CACHE_NONE;
+        }
+        e = s->entries_cap++;
+        s->entries = realloc(s->entries, sizeof(cacheEntry)*s->entries_cap);
+    }
+
+    cacheEntry *entry = &s->entries[e];
+    memset(entry, 0, sizeof(cacheEntry));
+    entry->offset = offset;
+    entry->len = len;
+    entry->pins = 1;
+    s->entries_count++;
+    lruPush(s, e);
+
+    return e;
+
+}
+
+/* -- server: requests -- */
+
+static void pinEntry(cacheClient *c, uint32_t e) {
+
+    if(c->pins_count == c->pins_cap) {
+        c->pins_cap = c->pins_cap? 2*c->pins_cap: 16;
+        c->pins = realloc(c->pins, sizeof(uint32_t)*c->pins_cap);
+    }
+    c->pins[c->pins_count++] = e;
+
+}
+
+/*  Key of a layer: identity of the file it is in (device, inode,
+    modification time and size, so a rewritten file is another one),
+    and the layer itself */
+static void makeKey(uint8_t *key, const struct stat *st, uint32_t layer_n, uint8_t level) {
+
+    putLE64(key, st->st_dev);
+    putLE64(key+8, st->st_ino);
+    putLE64(key+16, st->st_mtim.tv_sec);
+    putLE32(key+24, st->st_mtim.tv_nsec);
+    putLE64(key+28, st->st_size);
+    putLE32(key+36, layer_n);
+    putLE32(key+40, level);
+
+}
+
+static void handleGet(cacheClient *c, cacheRequest *req, cacheReply *reply) {
+
+    lgcCacheServer *s = c->server;
+    reply->status = CACHE_MISSED;
+
+    req->path[sizeof(req->path)-1] = 0;
+    FILE *f = fopen(req->path, "rb");
+    struct stat st;
+    if(!f || fstat(fileno(f), &st)) {
+        if(f) fclose(f);
+        return;
+    }
+
+    uint8_t key[CACHE_KEY_LENGTH];
+    makeKey(key, &st, req->layer_n, req->level);
+    uint64_t hash = hash64(key, sizeof(key), 0);
+
+    pthread_mutex_lock(&s->lock);
+    uint32_t e = findEntry(s, key, hash);
+    if(e != CACHE_NONE) {
+        s->hits++;
+        s->entries[e].pins++;
+        lruUnlink(s, e);
+        lruPush(s, e);
+    }
+    else s->misses++;
+    pthread_mutex_unlock(&s->lock);
+
+    // Decoded from the file just stat'ed, out of the lock
+    if(e == CACHE_NONE) {
+        lgcLayer *read = lgcReadLayerLevel((const char*)f, LGC_RW_ENTRIE|LGC_RW_VERIFY|
+                                           LGC_RW_FORCE_FILE_POINTER, req->layer_n, req->level);
+        if(!read || !read->data) {
+            if(read) lgcDestroyLayer(read, 1);
+            fclose(f);
+            return;
+        }
+
+        fullLayer layer;
+        loadLayer(read, &layer);
+
+        uint64_t offset = 0, palette_len = 0;
+        if(layer.palette)
+            palette_len = (4*layer.colors+CACHE_ALIGN-1)&~(uint64_t)(CACHE_ALIGN-1);
+
+        pthread_mutex_lock(&s->lock);
+        e = newEntry(s, palette_len+layer.length);
+        if(e != CACHE_NONE) offset = s->entries[e].offset;
+        pthread_mutex_unlock(&s->lock);
+
+        if(e == CACHE_NONE) {
+            lgcDestroyLayer(read, 1);
+            fclose(f);
+            return;
+        }
+
+        // The block is pinned and unknown to others while being filled
+        if(palette_len) memcpy(s->seg+offset, layer.palette, 4*layer.colors);
+        memcpy(s->seg+offset+palette_len, layer.data, layer.length);
+
+        pthread_mutex_lock(&s->lock);
+        cacheEntry *entry = &s->entries[e];
+        memcpy(entry->key, key, sizeof(key));
+        entry->hash = hash;
+        entry->head.offset = offset+palette_len;
+        entry->head.len = layer.length;
+        entry->head.palette = offset;
+        entry->head.colors = palette_len? layer.colors: 0;
+        entry->head.w = layer.w;
+        entry->head.h = layer.h;
+        entry->head.x = layer.x;
+        entry->head.y = layer.y;
+        entry->head.format = layer.format;
+        entry->head.levels = layer.levels;
+        entry->head.flags = layer.flags;
+        // another client may have decoded it meanwhile, that one stays found by key
+        if(findEntry(s, key, hash) == CACHE_NONE) hashEntry(s, e);
+        pthread_mutex_unlock(&s->lock);
+
+        lgcDestroyLayer(read, 1);
+    }
+
+    fclose(f);
+
+    pthread_mutex_lock(&s->lock);
+    pinEntry(c, e);
+    *reply = s->entries[e].head;
+    reply->status = CACHE_OK;
+    pthread_mutex_unlock(&s->lock);
+
+}
+
+static void handleRelease(cacheClient *c, cacheRequest *req, cacheReply *reply) {
+
+    lgcCacheServer *s = c->server;
+    uint32_t i;
+    reply->status = CACHE_MISSED;
+
+    pthread_mutex_lock(&s->lock);
+    for(i = 0; i < c->pins_count; ++i)
+        if(s->entries[c->pins[i]].head.offset == req->offset) {
+            s->entries[c->pins[i]].pins--;
+            c->pins[i] = c->pins[--c->pins_count];
+            reply->status = CACHE_OK;
+            break;
+        }
+    pthread_mutex_unlock(&s->lock);
+
+}
+
+static void * serveClient(void *arg) {
+
+    cacheClient *c = arg;
+    lgcCacheServer *s = c->server;
+    cacheRequest *req = malloc(sizeof(cacheRequest));
+    cacheReply reply;
+
+    for(;;) {
+        ssize_t r = recv(c->fd, req, sizeof(cacheRequest), 0);
+        if(r < 0 && errno == EINTR) continue;
+        if(r < (ssize_t)offsetof(cacheRequest, path)) break;
+
+        memset(&reply, 0, sizeof(reply));
+        if(req->op == CACHE_GET) {
+            memset((char*)req+r, 0, sizeof(cacheRequest)-r);
+            handleGet(c, req, &reply);
+        }
+        else if(req->op == CACHE_RELEASE) handleRelease(c, req, &reply);
+        else reply.status = CACHE_MISSED;
+
+        if(send(c->fd, &reply, sizeof(reply), MSG_NOSIGNAL) != sizeof(reply)) break;
+    }
+
+    // Views of a client gone are released
+    uint32_t i;
+    pthread_mutex_lock(&s->lock);
+    for(i = 0; i < c->pins_count; ++i)
+        s->entries[c->pins[i]].pins--;
+    c->pins_count = 0;
+    pthread_mutex_unlock(&s->lock);
+
+    free(req);
+    __atomic_store_n(&c->done, 1, __ATOMIC_RELEASE);
+    return NULL;
+
+}
+
+static void freeClient(cacheClient *c) {
+
+    pthread_join(c->thread, NULL);
+    close(c->fd);
+    free(c->pins);
+    free(c);
+
+}
+
+// Passes the segment to a new client
+static int sendSegment(lgcCacheServer *s, int fd) {
+
+    cacheReply hello;
+    memset(&hello, 0, sizeof(hello));
+    hello.len = s->size;
+
+    struct iovec iov = { &hello, sizeof(hello) };
+    union {
+        struct cmsghdr  align;
+        char            buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    memset(&control, 0, sizeof(control));
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &s->seg_fd, sizeof(int));
+
+    return sendmsg(fd, &msg, MSG_NOSIGNAL) == sizeof(hello)? 0: -1;
+
+}
+
+static void * acceptClients(void *arg) {
+
+    lgcCacheServer *s = arg;
+
+    for(;;) {
+        int fd = accept(s->listen_fd, NULL, NULL);
+        if(__atomic_load_n(&s->stopping, __ATOMIC_ACQUIRE)) {
+            if(fd >= 0) close(fd);
+            break;
+        }
+        if(fd < 0) {
+            if(errno == EINTR || errno == ECONNABORTED) continue;
+            fprintf(stderr, "lgcCacheServer: accept failed\n");
+            break;
+        }
+
+        // threads of clients gone are joined
+        pthread_mutex_lock(&s->lock);
+        cacheClient **p = &s->clients;
+        while(*p) {
+            cacheClient *c = *p;
+            if(__atomic_load_n(&c->done, __ATOMIC_ACQUIRE)) {
+                *p = c->next;
+                freeClient(c);
+            }
+            else p = &c->next;
+        }
+        pthread_mutex_unlock(&s->lock);
+
+        cacheClient *c = malloc(sizeof(cacheClient));
+        memset(c, 0, sizeof(cacheClient));
+        c->server = s;
+        c->fd = fd;
+
+        if(sendSegment(s, fd) || pthread_create(&c->thread, NULL, serveClient, c)) {
+            close(fd);
+            free(c);
+            continue;
+        }
+
+        pthread_mutex_lock(&s->lock);
+        c->next = s->clients;
+        s->clients = c;
+        pthread_mutex_unlock(&s->lock);
+    }
+
+    return NULL;
+
+}
+
+/*  Creates the segment: a shared memory object opened twice,
+    read-write for the server, read-only for clients, and unlinked
+    right away so it goes with the last process using it */
+static int createSegment(lgcCacheServer *s) {
+
+    static int serial = 0;
+    char name[64];
+    snprintf(name, sizeof(name), "/lgc-cache-%ld-%d", (long)getpid(),
+             __atomic_fetch_add(&serial, 1, __ATOMIC_RELAXED));
+
+    int fd = shm_open(name, O_RDWR|O_CREAT|O_EXCL, 0600);
+    if(fd < 0) return -1;
+
+    s->seg_fd = shm_open(name, O_RDONLY, 0);
+    shm_unlink(name);
+
+    if(s->seg_fd < 0 || ftruncate(fd, s->size) ||
+        (s->seg = mmap(NULL, s->size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        s->seg = NULL;
+        close(fd);
+        return -1;
+    }
+
+    close(fd);
+    return 0;
+
+}
+
+lgcCacheServer * lgcStartCacheServer(const char * socket_path, uint64_t size) {
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+
+    if(!socket_path || strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "%s: socket path is NULL or too long\n", __FUNCTION__);
+        return NULL;
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    size = (size+CACHE_ALIGN-1)&~(uint64_t)(CACHE_ALIGN-1);
+    if(!size || size > SIZE_MAX) {
+        fprintf(stderr, "%s: bad cache size\n", __FUNCTION__);
+        return NULL;
+    }
+
+    lgcCacheServer *s = malloc(sizeof(lgcCacheServer));
+    memset(s, 0, sizeof(lgcCacheServer));
+    s->size = size;
+    s->seg_fd = -1;
+
+    if(createSegment(s)) {
+        fprintf(stderr, "%s: can't create shared memory of %llu bytes\n",
+                __FUNCTION__, (unsigned long long)size);
+        if(s->seg_fd >= 0) close(s->seg_fd);
+        free(s);
+        return NULL;
+    }
+
+    // A socket left by a server which is gone is replaced
+    unlink(socket_path);
+    s->listen_fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if(s->listen_fd < 0 || bind(s->listen_fd, (struct sockaddr*)&addr, sizeof(addr)) ||
+        listen(s->listen_fd, 64)) {
+        fprintf(stderr, "%s: can't listen on %s\n", __FUNCTION__, socket_path);
+        if(s->listen_fd >= 0) close(s->listen_fd);
+        munmap(s->seg, s->size);
+        close(s->seg_fd);
+        free(s);
+        return NULL;
+    }
+
+    s->socket_path = strdup(socket_path);
+    pthread_mutex_init(&s->lock, NULL);
+    s->free_slot = s->lru_head = s->lru_tail = CACHE_NONE;
+    s->buckets_count = 256;
+    s->buckets = malloc(sizeof(uint32_t)*s->buckets_count);
+    memset(s->buckets, 0xff, sizeof(uint32_t)*s->buckets_count);
+    addHole(s, 0, s->size);
+
+    if(pthread_create(&s->acceptor, NULL, acceptClients, s)) {
+        fprintf(stderr, "%s: can't start a thread\n", __FUNCTION__);
+        s->acceptor = pthread_self();
+        lgcStopCacheServer(s);
+        return NULL;
+    }
+
+    return s;
+
+}
+
+void lgcCacheServerStats(lgcCacheServer *server, uint64_t *hits, uint64_t *misses,
+                         uint64_t *used) {
+
+    pthread_mutex_lock(&server->lock);
+
+    if(hits) *hits = server->hits;
+    if(misses) *misses = server->misses;
+    if(used) {
+        uint64_t free_len = 0;
+        uint32_t i;
+        for(i = 0; i < server->holes_count; ++i)
+            free_len += server->holes[i].len;
+        *used = server->size-free_len;
+    }
+
+    pthread_mutex_unlock(&server->lock);
+
+}
+
+void lgcStopCacheServer(lgcCacheServer *server) {
+
+    if(!server) return;
+
+    // accept() and recv() return once their sockets are shut down
+    __atomic_store_n(&server->stopping, 1, __ATOMIC_RELEASE);
+    shutdown(server->listen_fd, SHUT_RDWR);
+    if(!pthread_equal(server->acceptor, pthread_self()))
+        pthread_join(server->acceptor, NULL);
+
+    cacheClient *c;
+    for(c = server->clients; c; c = c->next)
+        shutdown(c->fd, SHUT_RDWR);
+    while((c = server->clients)) {
+        server->clients = c->next;
+        freeClient(c);
+    }
+
+    close(server->listen_fd);
+    unlink(server->socket_path);
+    munmap(server->seg, server->size);
+    close(server->seg_fd);
+
+    pthread_mutex_destroy(&server->lock);
+    free(server->socket_path);
+    free(server->entries);
+    free(server->buckets);
+    free(server->holes);
+    free(server);
+
+}
+
+/* -- client -- */
+
+lgcCache * lgcCacheConnect(const char * socket_path) {
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+
+    if(!socket_path || strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "%s: socket path is NULL or too long\n", __FUNCTION__);
+        return NULL;
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if(fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr))) {
+        fprintf(stderr, "%s: can't connect to %s\n", __FUNCTION__, socket_path);
+        if(fd >= 0) close(fd);
+        return NULL;
+    }
+
+    cacheReply hello;
+    struct iovec iov = { &hello, sizeof(hello) };
+    union {
+        struct cmsghdr  align;
+        char            buf[CMSG_SPACE(sizeof(int))];
+    } control;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    int seg_fd = -1;
+    if(recvmsg(fd, &msg, 0) == sizeof(hello)) {
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if(cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+            memcpy(&seg_fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+
+    // The mapping outlives the descriptor
+    void *map = MAP_FAILED;
+    if(seg_fd >= 0 && hello.len && hello.len <= SIZE_MAX)
+        map = mmap(NULL, hello.len, PROT_READ, MAP_SHARED, seg_fd, 0);
+    if(seg_fd >= 0) close(seg_fd);
+
+    if(map == MAP_FAILED) {
+        fprintf(stderr, "%s: can't map the cache of %s\n", __FUNCTION__, socket_path);
+        close(fd);
+        return NULL;
+    }
+
+    lgcCache *cache = malloc(sizeof(lgcCache));
+    cache->fd = fd;
+    cache->map = map;
+    cache->size = hello.len;
+    pthread_mutex_init(&cache->lock, NULL);
+
+    return cache;
+
+}
+
+static int request(lgcCache *cache, const cacheRequest *req, size_t len, cacheReply *reply) {
+
+    pthread_mutex_lock(&cache->lock);
+    int ret = send(cache->fd, req, len, MSG_NOSIGNAL) == (ssize_t)len &&
+        recv(cache->fd, reply, sizeof(cacheReply), 0) == sizeof(cacheReply)? 0: -1;
+    pthread_mutex_unlock(&cache->lock);
+
+    return ret;
+
+}
+
+lgcLayer * lgcCacheReadLayer(lgcCache *cache, const char * filename, uint32_t layer_n,
+                             uint8_t level) {
+
+    if(!cache || !filename) {
+        fprintf(stderr, "%s: NULL in arguments\n", __FUNCTION__);
+        return NULL;
+    }
+
+    // The server resolves paths from it's own working directory
+    cacheRequest req;
+    cacheReply reply;
+    memset(&req, 0, offsetof(cacheRequest, path));
+    req.op = CACHE_GET;
+    req.layer_n = layer_n;
+    req.level = level;
+
+    if(realpath(filename, req.path) && !request(cache, &req,
+        offsetof(cacheRequest, path)+strlen(req.path)+1, &reply) &&
+        reply.status == CACHE_OK && reply.offset <= cache->size &&
+        reply.len <= cache->size-reply.offset) {
+
+        fullLayer layer;
+        memset(&layer, 0, sizeof(fullLayer));
+        layer.w = reply.w;
+        layer.h = reply.h;
+        layer.x = reply.x;
+        layer.y = reply.y;
+        layer.format = reply.format;
+        layer.levels = reply.levels;
+        layer.flags = reply.flags;
+        layer.length = reply.len;
+        layer.data = (void*)(cache->map+reply.offset);
+        layer.borrowed = 1;
+
+        // the palette is the layer's own
+        if(reply.colors && reply.colors <= LGC_PALETTE_MAX && reply.palette <= reply.offset) {
+            layer.palette = malloc(4*reply.colors);
+            memcpy(layer.palette, cache->map+reply.palette, 4*reply.colors);
+            layer.colors = reply.colors;
+        }
+        return newLayer(&layer);
+    }
+
+    // Not in the cache and not fitting there, or no server: decoded here
+    return lgcReadLayerLevel(filename, LGC_RW_ENTRIE, layer_n, level);
+
+}
+
+void lgcCacheRelease(lgcCache *cache, lgcLayer *layer) {
+
+    if(!layer) return;
+
+    fullLayer full;
+    loadLayer(layer, &full);
+
+    const uint8_t *data = full.data;
+    if(cache && full.borrowed && data >= cache->map &&
+        data < cache->map+cache->size) {
+        cacheRequest req;
+        cacheReply reply;
+        memset(&req, 0, offsetof(cacheRequest, path));
+        req.op = CACHE_RELEASE;
+        req.offset = data-cache->map;
+        request(cache, &req, offsetof(cacheRequest, path), &reply);
+    }
+
+    lgcDestroyLayer(layer, 1);
+
+}
+
+void lgcCacheDisconnect(lgcCache *cache) {
+
+    if(!cache) return;
+
+    close(cache->fd);
+    munmap((void*)cache->map, cache->size);
+    pthread_mutex_destroy(&cache->lock);
+    free(cache);
+
+}
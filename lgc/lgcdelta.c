@@ -0,0 +1,500 @@
+/**
+
+    lgcdelta.c
+    Layers stored as deltas against previous ones (animation frames)
+    and sequential playback of them
+
+    This software comes under the terms of MIT License.
+
+**/
+
+#include "lgcpriv.h"
+
+#include <malloc.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define DELTA_MAX_CHAIN 4096    // longer chains are taken for corruption
+
+/* -- encoding -- */
+
+// Difference of two rows of 'len' bytes: a^b or a-b
+static void diffRow(uint8_t *d, const uint8_t *a, const uint8_t *b, size_t len, uint8_t mode) {
+
+    size_t i;
+    if(mode == LGC_DELTA_XOR)
+        for(i = 0; i < len; ++i) d[i] = a[i]^b[i];
+    else
+        for(i = 0; i < len; ++i) d[i] = a[i]-b[i];
+
+}
+
+// Finds the box of pixels which differ; w or h of it is 0 when there are none
+static void changedBox(const uint8_t *a, const uint8_t *b, uint32_t w, uint32_t h, int bpp,
+                       uint16_t *box) {
+
+    size_t row = (size_t)w*bpp;
+    uint32_t x0 = w, x1 = 0, y0 = h, y1 = 0, y;
+
+    for(y = 0; y < h; ++y) {
+        const uint8_t *ra = a+y*row, *rb = b+y*row;
+        if(!memcmp(ra, rb, row)) continue;
+
+        size_t first = 0, last = row-1;
+        while(ra[first] == rb[first]) first++;
+        while(ra[last] == rb[last]) last--;
+
+        if(first/bpp < x0) x0 = first/bpp;
+        if(last/bpp+1 > x1) x1 = last/bpp+1;
+        if(y < y0) y0 = y;
+        y1 = y+1;
+    }
+
+    if(y0 >= y1) {
+        box[0] = box[1] = box[2] = box[3] = 0;
+        return;
+    }
+
+    box[0] = x0;
+    box[1] = y0;
+    box[2] = x1-x0;
+    box[3] = y1-y0;
+
+}
+
+// Stored form of the difference inside 'box', in 'mode'; free() it after use
+static void * packDiff(fullLayer *layer, fullLayer *base, const uint16_t *box, uint8_t mode,
+                       uint64_t *len) {
+
+    int bpp = LGC_BYTES_PER_PIXEL(layer->format);
+    size_t row = (size_t)box[2]*bpp, y;
+
+    uint8_t *diff = malloc(row*box[3]+1);
+    for(y = 0; y < box[3]; ++y) {
+        size_t at = ((size_t)(box[1]+y)*layer->w+box[0])*bpp;
+        diffRow(diff+y*row, (uint8_t*)layer->data+at, (uint8_t*)base->data+at, row, mode);
+    }
+
+    void *stored = packBody(diff, row*box[3], layer->format, NULL, len);
+    if(stored != diff) free(diff);
+    return stored;
+
+}
+
+/*  Prepares the layer as a delta against 'base' (same size and format,
+    in record at 'base_offset'). The mode giving the smaller payload is
+    used. Returns 1 when the whole layer would be smaller, -1 on failure;
+    freeRecord() is to be called in any case. */
+int packDelta(fullLayer *layer, fullLayer *base, uint64_t base_offset, int32_t flags,
+              layerRecord *rec) {
+
+    memset(rec, 0, sizeof(layerRecord));
+    memcpy(&rec->layer, layer, sizeof(fullLayer));
+    rec->layer.flags = (layer->flags&~LGC_LAYER_RESERVED)|flags;
+    rec->layer.levels = 0;
+    rec->hash = layerKey(&rec->layer);
+
+    int bpp = LGC_BYTES_PER_PIXEL(layer->format);
+    uint64_t size = LGC_LAYER_BODY_LENGTH(layer);
+    uint16_t *box = rec->delta_box;
+    changedBox(layer->data, base->data, layer->w, layer->h, bpp, box);
+
+    void *stored = NULL;
+    uint64_t len = 0;
+
+    if(box[2] && box[3]) {
+        rec->delta_mode = LGC_DELTA_XOR;
+        stored = packDiff(layer, base, box, LGC_DELTA_XOR, &len);
+        if(!stored) return -1;
+
+        // subtraction suits gradual changes better, XOR sharp ones
+        if(layer->format&LGC_FMT_COMPRESSED) {
+            uint64_t sub_len;
+            void *sub = packDiff(layer, base, box, LGC_DELTA_SUB, &sub_len);
+            if(sub && sub_len < len) {
+                free(stored);
+                stored = sub;
+                len = sub_len;
+                rec->delta_mode = LGC_DELTA_SUB;
+            }
+            else free(sub);
+        }
+    }
+    else rec->delta_mode = LGC_DELTA_XOR;
+
+    rec->owned[rec->owned_count++] = stored;
+
+    // most of the layer changed: it may be better off stored whole
+    if((uint64_t)box[2]*box[3]*bpp*2 >= size) {
+        uint64_t whole_len;
+        void *whole = packBody(layer->data, size, layer->format, NULL, &whole_len);
+        if(whole != layer->data) free(whole);
+        if(whole && whole_len <= len) return 1;
+    }
+
+    rec->delta_base = base_offset;
+    rec->parts[0] = stored;
+    rec->part_len[0] = len;
+    rec->parts_count = 1;
+    rec->checksum[0] = crc32c(0, stored, len);
+
+    encodeHead(rec, -1);
+    return 0;
+
+}
+
+/* -- decoding -- */
+
+/*  Applies the stored difference of a delta layer to 'pixels' of it's base,
+    turning them into the layer's ones. Takes time proportional to the box. */
+static int applyDelta(uint8_t *pixels, fullLayer *layer, layerExt *ext, const void *stored,
+                      const uint32_t *checksum) {
+
+    int bpp = LGC_BYTES_PER_PIXEL(layer->format);
+    uint16_t *box = ext->delta_box;
+
+    if((uint32_t)box[0]+box[2] > layer->w || (uint32_t)box[1]+box[3] > layer->h ||
+        (ext->delta_mode != LGC_DELTA_XOR && ext->delta_mode != LGC_DELTA_SUB))
+        return -1;
+
+    if(checksum && crc32c(0, stored, ext->body_len) != *checksum) {
+        fprintf(stderr, "lgc: checksum mismatch\n");
+        return -1;
+    }
+
+    size_t row = (size_t)box[2]*bpp, y, i;
+    if(!row || !box[3]) return ext->body_len? -1: 0;
+
+    const uint8_t *diff = stored;
+    uint8_t *unpacked = NULL;
+
+    if(layer->format&LGC_FMT_COMPRESSED) {
+        unpacked = malloc(row*box[3]);
+        if(!unpacked || unpackLZ4(stored, ext->body_len, unpacked, row*box[3], 0)) {
+            free(unpacked);
+            return -1;
+        }
+        diff = unpacked;
+    }
+    else if(ext->body_len != row*box[3]) return -1;
+
+    for(y = 0; y < box[3]; ++y) {
+        uint8_t *p = pixels+((size_t)(box[1]+y)*layer->w+box[0])*bpp;
+        const uint8_t *d = diff+y*row;
+
+        if(ext->delta_mode == LGC_DELTA_XOR)
+            for(i = 0; i < row; ++i) p[i] ^= d[i];
+        else
+            for(i = 0; i < row; ++i) p[i] += d[i];
+    }
+
+    free(unpacked);
+    return 0;
+
+}
+
+/*  Pixels of the delta layer, made from already decoded pixels of it's base
+    and it's stored difference. Returns a new buffer or NULL on failure. */
+void * deltaOnBase(const void *base, fullLayer *layer, layerExt *ext, const void *stored,
+                   const uint32_t *checksum) {
+
+    uint64_t size = LGC_LAYER_BODY_LENGTH(layer);
+    void *pixels = malloc(size);
+    if(!pixels) return NULL;
+
+    memcpy(pixels, base, size);
+    if(applyDelta(pixels, layer, ext, stored, checksum)) {
+        free(pixels);
+        return NULL;
+    }
+
+    return pixels;
+
+}
+
+static int readFullAt(readAtFunc read_at, void *src, void *buf, uint64_t len, uint64_t offset) {
+
+    uint8_t *p = buf;
+    while(len) {
+        int64_t r = read_at(src, p, len, offset);
+        if(r <= 0) return -1;
+        p += r;
+        offset += r;
+        len -= r;
+    }
+
+    return 0;
+
+}
+
+static int headAt(readAtFunc read_at, void *src, uint64_t offset, int version, fullLayer *layer,
+                  layerExt *ext) {
+
+    uint8_t buf[LGC_RECORD_HEAD_MAX];
+    int64_t n = read_at(src, buf, sizeof(buf), offset);
+    if(n <= 0) return -1;
+
+    int need = parseHead(buf, n, version, layer, ext);
+    if(need > n) {
+        uint8_t *head = malloc(need);
+        need = head && !readFullAt(read_at, src, head, need, offset)?
+            parseHead(head, need, version, layer, ext): -1;
+        free(head);
+    }
+
+    return need? -1: 0;
+
+}
+
+// Reads the stored bytes of a record's own payload
+static void * readStored(readAtFunc read_at, void *src, uint64_t at, uint64_t len) {
+
+    void *stored = malloc(len? len: 1);
+    if(stored && readFullAt(read_at, src, stored, len, at)) {
+        free(stored);
+        return NULL;
+    }
+
+    return stored;
+
+}
+
+typedef struct {
+
+    uint64_t        offset;
+    layerExt        ext;
+
+} deltaStep;
+
+/*  Decodes the delta layer which head at 'record' is in 'ext': walks back
+    to the nearest record with whole pixels, then applies the deltas
+    on the way forward. Returns the pixels or NULL on failure. */
+void * decodeDeltaChain(readAtFunc read_at, void *src, fullLayer *layer, layerExt *ext,
+                        uint64_t record, int rwopts) {
+
+    deltaStep *chain = malloc(sizeof(deltaStep)*16);
+    uint32_t n = 0, cap = 16;
+    uint8_t *pixels = NULL;
+
+    chain[n].offset = record;
+    chain[n++].ext = *ext;
+
+    fullLayer base;
+    layerExt base_ext = *ext;
+    uint64_t at = record;
+
+    while(base_ext.delta_base) {
+        // bases always come earlier, so the walk ends
+        if(base_ext.delta_base >= at || n == DELTA_MAX_CHAIN) goto done;
+        at = base_ext.delta_base;
+
+        if(headAt(read_at, src, at, ext->version, &base, &base_ext) || base.w != layer->w ||
+            base.h != layer->h || base.format != layer->format)
+            goto done;
+
+        if(!base_ext.delta_base) break;
+
+        if(n == cap) chain = realloc(chain, sizeof(deltaStep)*(cap *= 2));
+        chain[n].offset = at;
+        chain[n++].ext = base_ext;
+    }
+
+    // payload with whole pixels may be shared from another record
+    uint64_t payload = at+base_ext.head_len;
+    if(base_ext.blob) goto done;
+    if(base_ext.ref) {
+        fullLayer owner;
+        layerExt owner_ext;
+
+        if(headAt(read_at, src, base_ext.ref, ext->version, &owner, &owner_ext) ||
+            adoptPayload(&base, &base_ext, &owner, &owner_ext))
+            goto done;
+
+        payload = base_ext.ref+owner_ext.head_len;
+    }
+
+    void *stored = readStored(read_at, src, payload, base_ext.body_len);
+    if(!stored) goto done;
+
+    pixels = decodeBody(stored, base_ext.body_len, layer->format, LGC_LAYER_BODY_LENGTH(layer),
+                        base_ext.sparse_len, base_ext.dict,
+                        rwopts&LGC_RW_VERIFY && base_ext.checksums? &base_ext.checksum[0]: NULL);
+
+    while(pixels && n--) {
+        layerExt *e = &chain[n].ext;
+        stored = readStored(read_at, src, chain[n].offset+e->head_len, e->body_len);
+
+        if(!stored || applyDelta(pixels, layer, e, stored,
+                                 rwopts&LGC_RW_VERIFY && e->checksums? &e->checksum[0]: NULL)) {
+            free(pixels);
+            pixels = NULL;
+        }
+
+        free(stored);
+    }
+
+done:
+    free(chain);
+    return pixels;
+
+}
+
+int64_t fileReadAt(void *f, void *buf, uint64_t len, uint64_t offset) {
+    if(fseeko(f, offset, SEEK_SET)) return -1;
+    return fread(buf, 1, len, f);
+}
+
+int64_t fdReadAt(void *fd, void *buf, uint64_t len, uint64_t offset) {
+    return pread(*(int*)fd, buf, len, offset);
+}
+
+/* -- playback -- */
+
+struct lgcPlayer {
+
+    FILE *          f;
+    int             rwopts;
+    layerIndex      idx;
+    uint32_t        next;       // frame to be returned next
+
+    lgcLayer        frame;      // the last returned one
+    uint64_t        record;     // where the frame is stored, 0 if it's not decoded
+    uint64_t        source;     // where it's payload is (for frames sharing one)
+
+};
+
+lgcPlayer * lgcOpenPlayer(const char * filename, int rwopts) {
+
+    if(rwopts&LGC_RW_FORCE_FILE_POINTER) {
+        fprintf(stderr, "%s: error: usage of external stream is not supported by this function\n",
+            __FUNCTION__);
+        return NULL;
+    }
+
+    FILE *f = openFile(filename, "rb");
+    if(!f) {
+        fprintf(stderr, "%s: can't open the file (%s)\n", __FUNCTION__, filename);
+        return NULL;
+    }
+
+    lgcPlayer *player = malloc(sizeof(lgcPlayer));
+    memset(player, 0, sizeof(lgcPlayer));
+    player->f = f;
+    player->rwopts = rwopts;
+
+    int version = 0;
+    if(checkHead(f, NULL, &version) || loadIndex(f, version, &player->idx)) {
+        fprintf(stderr, "%s: read error or bad magic number\n", __FUNCTION__);
+        fclose(f);
+        free(player);
+        return NULL;
+    }
+
+    loadDictionary(f, version);
+
+    return player;
+
+}
+
+uint32_t lgcPlayerFramesCount(lgcPlayer *player) {
+    return player->idx.count;
+}
+
+// Drops the decoded frame
+static void playerReset(lgcPlayer *player) {
+    lgcDestroyLayer(&player->frame, 0);
+    memset(&player->frame, 0, sizeof(lgcLayer));
+    player->record = player->source = 0;
+}
+
+const lgcLayer * lgcPlayerNextFrame(lgcPlayer *player) {
+
+    if(player->next >= player->idx.count) return NULL;
+
+    uint64_t record = player->idx.entries[player->next++];
+    fullLayer head;
+    layerExt ext;
+    memset(&head, 0, sizeof(fullLayer));
+
+    if(fseeko(player->f, record, SEEK_SET) || readHead(player->f, player->idx.version, &head, &ext)) {
+        fprintf(stderr, "%s: read error\n", __FUNCTION__);
+        playerReset(player);
+        return NULL;
+    }
+
+    fullLayer frame;
+    loadLayer(&player->frame, &frame);
+    int same = player->record && head.w == frame.w && head.h == frame.h &&
+        head.format == frame.format;
+    uint64_t base = ext.ref? ext.ref: ext.delta_base;
+
+    if(same && base && (base == player->record || base == player->source)) {
+
+        // the previous frame is the base or has the same payload
+        if(ext.delta_base) {
+            const uint32_t *checksum = player->rwopts&LGC_RW_VERIFY && ext.checksums?
+                &ext.checksum[0]: NULL;
+            void *stored = readStored(fileReadAt, player->f, record+ext.head_len, ext.body_len);
+
+            if(!stored || applyDelta(frame.data, &head, &ext, stored, checksum)) {
+                fprintf(stderr, "%s: corrupted frame %u\n", __FUNCTION__, player->next-1);
+                free(stored);
+                playerReset(player);
+                return NULL;
+            }
+
+            free(stored);
+        }
+
+        void *data = frame.data;
+        uint64_t length = frame.length;
+        frame = head;
+        frame.data = data;
+        frame.length = length;
+        frame.levels = 0;
+
+    }
+    else {
+
+        playerReset(player);
+        frame = head;
+
+        if(fseeko(player->f, record+ext.head_len, SEEK_SET) ||
+            readLayerBody(player->f, &frame, &ext, player->rwopts)) {
+            fprintf(stderr, "%s: corrupted frame %u\n", __FUNCTION__, player->next-1);
+            playerReset(player);
+            return NULL;
+        }
+
+    }
+
+    attachPalette(&frame, &ext);
+    storeLayer(&frame, &player->frame);
+    player->record = record;
+    player->source = ext.ref? ext.ref: record;
+    return &player->frame;
+
+}
+
+int lgcPlayerSeek(lgcPlayer *player, uint32_t frame) {
+
+    if(frame >= player->idx.count) return 1;
+
+    // stepping right to the next frame keeps the decoded one as the base
+    if(frame != player->next) playerReset(player);
+    player->next = frame;
+    return 0;
+
+}
+
+void lgcClosePlayer(lgcPlayer *player) {
+
+    if(!player) return;
+
+    playerReset(player);
+    freeIndex(&player->idx);
+    fclose(player->f);
+    free(player);
+
+}
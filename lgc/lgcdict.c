@@ -0,0 +1,373 @@
+/**
+
+    lgcdict.c
+    Shared LZ4 dictionaries: the registry of loaded ones, the writer's
+    dictionary, dictionary records and training on a corpus of layers
+
+    This software comes under the terms of MIT License.
+
+**/
+
+#include "lgcpriv.h"
+
+#include <malloc.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <lz4.h>
+
+#define DICT_DMER 8                 // bytes of the substrings counted by the trainer
+#define DICT_SEGMENT 256            // longest piece of a sample taken into dictionary
+#define DICT_TABLE_BITS 22
+#define DICT_SAMPLE_MAX (1<<16)     // bytes of a layer taken as a sample
+#define DICT_CORPUS_MAX (1<<28)
+#define DICT_MAX_PASSES 16
+
+/* Dictionaries are kept until lgcFreeDictionaries(): layers decoded in other threads may be using them */
+static pthread_mutex_t dicts_lock = PTHREAD_MUTEX_INITIALIZER;
+static lz4Dict **dicts = NULL;
+static uint32_t dicts_count = 0, dicts_cap = 0;
+
+static const lz4Dict *writer_dict = NULL;
+
+static lz4Dict * lookup(uint64_t key) {
+
+    uint32_t i;
+    for(i = 0; i < dicts_count; ++i)
+        if(dicts[i]->key == key) return dicts[i];
+
+    return NULL;
+
+}
+
+const lz4Dict * findDictionary(uint64_t key) {
+
+    pthread_mutex_lock(&dicts_lock);
+    lz4Dict *dict = lookup(key);
+    pthread_mutex_unlock(&dicts_lock);
+
+    if(!dict)
+        fprintf(stderr, "lgc: dictionary %016llx is not loaded\n", (unsigned long long)key);
+    return dict;
+
+}
+
+/*  Registers 'size' bytes of dictionary, which key must be 'key'
+    (the key of it's bytes is taken when 'key' is 0).
+    Returns the registered one, NULL if the bytes don't match the key. */
+static const lz4Dict * addDictionary(const void *data, uint32_t size, uint64_t key) {
+
+    uint64_t own = hash64(data, size, 0);
+    if(key && key != own) {
+        fprintf(stderr, "lgc: dictionary record is corrupted\n");
+        return NULL;
+    }
+
+    pthread_mutex_lock(&dicts_lock);
+
+    lz4Dict *dict = lookup(own);
+    if(!dict) {
+        dict = malloc(sizeof(lz4Dict));
+        dict->key = own;
+        dict->size = size;
+        dict->data = malloc(size? size: 1);
+        memcpy(dict->data, data, size);
+
+        // compressing against it starts from a copy of this stream
+        dict->stream = LZ4_createStream();
+        LZ4_loadDict(dict->stream, (const char*)dict->data, size);
+
+        if(dicts_count == dicts_cap) {
+            dicts_cap = dicts_cap? 2*dicts_cap: 8;
+            dicts = realloc(dicts, sizeof(lz4Dict*)*dicts_cap);
+        }
+        dicts[dicts_count++] = dict;
+    }
+
+    pthread_mutex_unlock(&dicts_lock);
+    return dict;
+
+}
+
+// Whether the record is a dictionary one (see LGC_EXT_DICT)
+static int isDictRecord(layerExt *ext) {
+    return ext->flags&LGC_LAYER_HIDDEN && ext->dict && ext->body_len <= LGC_DICT_MAX;
+}
+
+/* Same as loadDictionary(), for the record at 'pos' of 'buf' */
+int loadDictionaryFromMemory(const uint8_t *buf, size_t size, uint64_t pos, int version) {
+
+    fullLayer head;
+    layerExt ext;
+
+    if(pos >= size) return 0;
+    if(parseHead(buf+pos, size-pos < UINT32_MAX? size-pos: UINT32_MAX, version, &head, &ext) ||
+        !isDictRecord(&ext) || ext.head_len+ext.body_len > size-pos)
+        return 0;
+
+    addDictionary(buf+pos+ext.head_len, ext.body_len, ext.dict);
+    return 1;
+
+}
+
+/*  Registers the dictionary of the file of the 'version' when it's first
+    record holds one, returns 1 if it does. Leaves the stream anywhere. */
+int loadDictionary(FILE *f, int version) {
+
+    fullLayer head;
+    layerExt ext;
+
+    if(fseeko(f, LGC_BASE_OFFSET+8, SEEK_SET) || readHead(f, version, &head, &ext) ||
+        !isDictRecord(&ext))
+        return 0;
+
+    pthread_mutex_lock(&dicts_lock);
+    int known = lookup(ext.dict) != NULL;
+    pthread_mutex_unlock(&dicts_lock);
+    if(known) return 1;
+
+    uint8_t *data = malloc(ext.body_len? ext.body_len: 1);
+    if(ext.body_len && fread(data, ext.body_len, 1, f) != 1) {
+        free(data);
+        return 0;
+    }
+
+    addDictionary(data, ext.body_len, ext.dict);
+    free(data);
+    return 1;
+
+}
+
+int lgcSetDictionary(const void * data, uint32_t size) {
+
+    if(!data) {
+        writer_dict = NULL;
+        return 0;
+    }
+
+    if(!size || size > LGC_DICT_MAX) {
+        fprintf(stderr, "%s: dictionary must be 1 to %u bytes long\n", __FUNCTION__, LGC_DICT_MAX);
+        return -1;
+    }
+
+    writer_dict = addDictionary(data, size, 0);
+    return 0;
+
+}
+
+void lgcFreeDictionaries() {
+
+    pthread_mutex_lock(&dicts_lock);
+
+    // the writer's one is still to be stored with the files written
+    uint32_t i, kept = 0;
+    for(i = 0; i < dicts_count; ++i) {
+        lz4Dict *dict = dicts[i];
+        if(dict == writer_dict) {
+            dicts[kept++] = dict;
+            continue;
+        }
+
+        LZ4_freeStream(dict->stream);
+        free(dict->data);
+        free(dict);
+    }
+    dicts_count = kept;
+
+    if(!kept) {
+        free(dicts);
+        dicts = NULL;
+        dicts_cap = 0;
+    }
+
+    pthread_mutex_unlock(&dicts_lock);
+
+}
+
+// Dictionary layers written with 'rwopts' are compressed against, NULL if none
+const lz4Dict * writerDictionary(int rwopts) {
+    return rwopts&LGC_RW_DICT && !(rwopts&LGC_RW_BLOB_STORE)? writer_dict: NULL;
+}
+
+// Compresses single LZ4 block against the dictionary, returns it's length or 0
+int compressWithDictionary(const lz4Dict *dict, const char *src, char *dst, int len, int cap) {
+
+    LZ4_stream_t stream;
+    memcpy(&stream, dict->stream, sizeof(LZ4_stream_t));
+    return LZ4_compress_fast_continue(&stream, src, dst, len, cap, 1);
+
+}
+
+// Prepares the hidden record holding the dictionary (see LGC_EXT_DICT)
+void packDictionary(const lz4Dict *dict, layerRecord *rec) {
+
+    memset(rec, 0, sizeof(layerRecord));
+    rec->layer.flags = LGC_LAYER_HIDDEN;
+    rec->dict = dict->key;
+
+    rec->parts[0] = dict->data;
+    rec->part_len[0] = dict->size;
+    rec->checksum[0] = crc32c(0, dict->data, dict->size);
+    rec->parts_count = 1;
+
+    encodeHead(rec, -1);
+
+}
+
+/* -- training -- */
+
+static inline uint32_t dmerHash(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return (v*0x9e3779b185ebca87ULL)>>(64-DICT_TABLE_BITS);
+}
+
+typedef struct {
+
+    const uint8_t * corpus;
+    uint64_t *      starts;     // of samples in corpus, and it's end
+    uint32_t *      counts;     // occurrences of d-mers over the corpus, by hash
+
+} trainer;
+
+/*  Best piece of samples [first, last): the one which d-mers occur
+    most often over the corpus. Returns it's score, 0 if none is left. */
+static uint64_t bestSegment(trainer *t, uint32_t first, uint32_t last,
+                            uint64_t *seg_start, uint32_t *seg_len) {
+
+    uint64_t best = 0;
+    uint32_t s;
+
+    for(s = first; s < last; ++s) {
+        uint64_t start = t->starts[s], len = t->starts[s+1]-start;
+        if(len < DICT_DMER) continue;
+
+        uint32_t seg = len < DICT_SEGMENT? len: DICT_SEGMENT;
+        uint32_t dmers = seg-DICT_DMER+1, i;
+        const uint8_t *p = t->corpus+start;
+
+        // sliding sum over the d-mers of the window
+        uint64_t score = 0;
+        for(i = 0; i < dmers; ++i)
+            score += t->counts[dmerHash(p+i)];
+
+        for(i = 0;; ++i) {
+            if(score > best) {
+                best = score;
+                *seg_start = start+i;
+                *seg_len = seg;
+            }
+
+            if(i+seg >= len) break;
+            score += t->counts[dmerHash(p+i+dmers)];
+            score -= t->counts[dmerHash(p+i)];
+        }
+    }
+
+    return best;
+
+}
+
+void * lgcTrainDictionary(lgcImage * const * images, uint32_t count, uint32_t max_size,
+                          uint32_t *size) {
+
+    if(!images || !size) {
+        fprintf(stderr, "%s: NULL in arguments\n", __FUNCTION__);
+        return NULL;
+    }
+
+    if(max_size > LGC_DICT_MAX) max_size = LGC_DICT_MAX;
+    *size = 0;
+
+    // Samples are the layers' pixels, large layers taken in part
+    uint32_t samples = 0, cap = 64, i, l;
+    uint64_t total = 0;
+    trainer t;
+    const uint8_t **sample = malloc(sizeof(uint8_t*)*cap);
+    t.starts = malloc(sizeof(uint64_t)*(cap+1));
+
+    for(i = 0; i < count; ++i)
+        for(l = 0; images[i] && l < images[i]->layers_count; ++l) {
+            fullLayer layer;
+            loadLayer(&images[i]->layers[l], &layer);
+            uint64_t len = LGC_LAYER_BODY_LENGTH((&layer));
+            if(len > DICT_SAMPLE_MAX) len = DICT_SAMPLE_MAX;
+            if(!layer.data || len < DICT_DMER || total+len > DICT_CORPUS_MAX) continue;
+
+            if(samples == cap) {
+                sample = realloc(sample, sizeof(uint8_t*)*(cap *= 2));
+                t.starts = realloc(t.starts, sizeof(uint64_t)*(cap+1));
+            }
+
+            sample[samples] = layer.data;
+            t.starts[samples++] = total;
+            total += len;
+        }
+
+    t.starts[samples] = total;
+
+    if(!samples || !max_size) {
+        fprintf(stderr, "%s: no layers to train on\n", __FUNCTION__);
+        free(sample);
+        free(t.starts);
+        return NULL;
+    }
+
+    uint8_t *corpus = malloc(total);
+    for(i = 0; i < samples; ++i)
+        memcpy(corpus+t.starts[i], sample[i], t.starts[i+1]-t.starts[i]);
+    free(sample);
+
+    t.corpus = corpus;
+    t.counts = calloc(1<<DICT_TABLE_BITS, sizeof(uint32_t));
+
+    for(i = 0; i < samples; ++i) {
+        uint64_t pos;
+        for(pos = t.starts[i]; pos+DICT_DMER <= t.starts[i+1]; ++pos)
+            t.counts[dmerHash(corpus+pos)]++;
+    }
+
+    /*  Samples are split into epochs, each one giving the best of it's
+        segments in turn; d-mers of the segments taken don't count anymore.
+        The dictionary is filled from it's end, so the most common
+        segments are the nearest ones to the data (cheapest offsets). */
+    uint32_t epochs = max_size/DICT_SEGMENT;
+    if(epochs < 1) epochs = 1;
+    if(epochs > samples) epochs = samples;
+
+    uint8_t *dict = malloc(max_size);
+    uint32_t fill = max_size, pass, e;
+
+    for(pass = 0; fill && pass < DICT_MAX_PASSES; ++pass) {
+        int taken = 0;
+
+        for(e = 0; fill && e < epochs; ++e) {
+            uint64_t start;
+            uint32_t len;
+
+            if(!bestSegment(&t, (uint64_t)samples*e/epochs, (uint64_t)samples*(e+1)/epochs,
+                            &start, &len))
+                continue;
+
+            uint32_t put = len < fill? len: fill;
+            memcpy(dict+fill-put, corpus+start, put);
+            fill -= put;
+            taken = 1;
+
+            uint32_t k;
+            for(k = 0; k+DICT_DMER <= len; ++k)
+                t.counts[dmerHash(corpus+start+k)] = 0;
+        }
+
+        if(!taken) break;
+    }
+
+    free(t.counts);
+    free(t.starts);
+    free(corpus);
+
+    *size = max_size-fill;
+    memmove(dict, dict+fill, *size);
+    return dict;
+
+}
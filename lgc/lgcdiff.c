@@ -0,0 +1,305 @@
+/**
+
+    lgcdiff.c
+    Comparing layers of two files
+
+    This software comes under the terms of MIT License.
+
+**/
+
+#include "lgcpriv.h"
+
+#include <malloc.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define DIFF_MAX_THREADS 64
+
+typedef struct {
+
+    lgcFile *       a;
+    lgcFile *       b;
+    int             rwopts;
+    lgcLayerDiff *  diffs;
+    uint32_t        count;
+    uint32_t        next;       // next layer to take, atomic
+    int             differ;     // atomic
+
+} diffQueue;
+
+/* Differences found so far in the layer */
+typedef struct {
+
+    uint64_t        changed;
+    uint64_t        sum;        // of differences of bytes
+    uint8_t         max;
+
+} diffTotals;
+
+#ifdef __SSE2__
+// First bits of 16 pixels' bytes in a mask of them, by bytes per pixel
+static const uint64_t pixel_bits[5] = {
+    0, 0xffff, 0x55555555, 0x249249249249, 0x1111111111111111
+};
+#endif
+
+/*  Compares a row of 'w' pixels, 'bpp' bytes each.
+    Returns number of changed ones, their first and last column in 'first' and 'last'. */
+static uint32_t diffRow(const uint8_t *a, const uint8_t *b, uint32_t w, int bpp,
+                        diffTotals *t, uint32_t *first, uint32_t *last) {
+
+    uint32_t x = 0, changed = 0;
+    *first = UINT32_MAX;
+    *last = 0;
+
+#ifdef __SSE2__
+    // 16 pixels at a time: bytes which differ make a mask, reduced to one bit
+    // per pixel; unchanged runs cost a compare and a load of each row
+    const __m128i zero = _mm_setzero_si128();
+    __m128i sum = zero, max = zero;
+    int k;
+
+    for(; x+16 <= w; x += 16) {
+        const uint8_t *pa = a+(size_t)x*bpp, *pb = b+(size_t)x*bpp;
+        uint64_t mask = 0;
+
+        for(k = 0; k < bpp; ++k) {
+            __m128i va = _mm_loadu_si128((const __m128i*)(pa+16*k));
+            __m128i vb = _mm_loadu_si128((const __m128i*)(pb+16*k));
+            uint64_t ne = ~_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb))&0xffff;
+            if(!ne) continue;
+
+            __m128i d = _mm_or_si128(_mm_subs_epu8(va, vb), _mm_subs_epu8(vb, va));
+            sum = _mm_add_epi64(sum, _mm_sad_epu8(d, zero));
+            max = _mm_max_epu8(max, d);
+            mask |= ne << 16*k;
+        }
+        if(!mask) continue;
+
+        uint64_t pixels = mask;
+        for(k = 1; k < bpp; ++k)
+            pixels |= mask>>k;
+        pixels &= pixel_bits[bpp];
+
+        changed += __builtin_popcountll(pixels);
+        if(*first == UINT32_MAX) *first = x+__builtin_ctzll(pixels)/bpp;
+        *last = x+(63-__builtin_clzll(pixels))/bpp;
+    }
+
+    uint8_t lanes[16];
+    _mm_storeu_si128((__m128i*)lanes, max);
+    for(k = 0; k < 16; ++k)
+        if(lanes[k] > t->max) t->max = lanes[k];
+
+    uint64_t sums[2];
+    _mm_storeu_si128((__m128i*)sums, sum);
+    t->sum += sums[0]+sums[1];
+#endif
+
+    for(; x < w; ++x) {
+        const uint8_t *pa = a+(size_t)x*bpp, *pb = b+(size_t)x*bpp;
+        int k, differs = 0;
+
+        for(k = 0; k < bpp; ++k) {
+            uint8_t d = pa[k] > pb[k]? pa[k]-pb[k]: pb[k]-pa[k];
+            if(!d) continue;
+
+            differs = 1;
+            t->sum += d;
+            if(d > t->max) t->max = d;
+        }
+        if(!differs) continue;
+
+        changed++;
+        if(*first == UINT32_MAX) *first = x;
+        *last = x;
+    }
+
+    return changed;
+
+}
+
+static void diffPixels(const uint8_t *a, const uint8_t *b, uint32_t w, uint32_t h, int bpp,
+                       lgcLayerDiff *d) {
+
+    diffTotals t;
+    memset(&t, 0, sizeof(diffTotals));
+
+    uint32_t x0 = UINT32_MAX, x1 = 0, y0 = UINT32_MAX, y1 = 0, y;
+    size_t row = (size_t)w*bpp;
+
+    for(y = 0; y < h; ++y) {
+        uint32_t first, last;
+        uint32_t changed = diffRow(a+y*row, b+y*row, w, bpp, &t, &first, &last);
+        if(!changed) continue;
+
+        t.changed += changed;
+        if(first < x0) x0 = first;
+        if(last > x1) x1 = last;
+        if(y0 == UINT32_MAX) y0 = y;
+        y1 = y;
+    }
+
+    if(!t.changed) return;
+
+    d->changes |= LGC_DIFF_PIXELS;
+    d->changed = t.changed;
+    d->box[0] = x0;
+    d->box[1] = y0;
+    d->box[2] = x1-x0+1;
+    d->box[3] = y1-y0+1;
+    d->max_error = t.max;
+    d->mean_error = (double)t.sum/((double)row*h);
+
+}
+
+/*  Whether the stored heads tell the pixels are the same, without reading them:
+    content keys cover them however they are stored, otherwise payloads must be alike */
+static int samePixels(const layerExt *a, const layerExt *b) {
+
+    if(a->colors != b->colors || memcmp(a->palette, b->palette, 4*a->colors))
+        return 0;
+
+    if(a->hash && a->hash == b->hash)
+        return 1;
+
+    return !a->delta_base && !b->delta_base && a->checksums && b->checksums &&
+        a->checksum[0] == b->checksum[0] && a->body_len == b->body_len &&
+        a->sparse_len == b->sparse_len && a->dict == b->dict;
+
+}
+
+// Pixels to compare: block-compressed and indexed layers are decoded to RGBA
+static uint8_t * comparable(const lgcLayer *layer, int *bpp) {
+
+    *bpp = 4;
+    if(layer->format&LGC_FMT_BLOCK)
+        return lgcDecodeBlocks(layer);
+    if(isIndexed(layer->format))
+        return lgcExpandPalette(layer);
+
+    *bpp = LGC_BYTES_PER_PIXEL(layer->format);
+    return layer->data;
+
+}
+
+static void diffLayer(diffQueue *q, lgcLayerDiff *d) {
+
+    uint32_t i = d->layer_n;
+    if(i >= lgcFileLayersCount(q->a)) {
+        d->changes = LGC_DIFF_ADDED;
+        return;
+    }
+    if(i >= lgcFileLayersCount(q->b)) {
+        d->changes = LGC_DIFF_REMOVED;
+        return;
+    }
+
+    fullLayer ha, hb;
+    layerExt ea, eb;
+    if(fileLayerHead(q->a, i, &ha, &ea) || fileLayerHead(q->b, i, &hb, &eb)) {
+        d->changes = LGC_DIFF_ERROR;
+        return;
+    }
+
+    if(ha.x != hb.x || ha.y != hb.y)
+        d->changes |= LGC_DIFF_MOVED;
+    if((ha.flags^hb.flags)&~LGC_LAYER_RESERVED || ha.levels != hb.levels ||
+        (ha.format^hb.format)&LGC_FMT_COMPRESSED)
+        d->changes |= LGC_DIFF_HEAD;
+
+    if(ha.w != hb.w || ha.h != hb.h || (ha.format^hb.format)&~LGC_FMT_COMPRESSED) {
+        d->changes |= LGC_DIFF_SHAPE;
+        return;
+    }
+
+    if(samePixels(&ea, &eb)) return;
+
+    lgcLayer *la = lgcFileReadLayer(q->a, q->rwopts, i);
+    lgcLayer *lb = la? lgcFileReadLayer(q->b, q->rwopts, i): NULL;
+    uint8_t *pa = NULL, *pb = NULL;
+    int bpp = 0;
+
+    if(la && lb && (pa = comparable(la, &bpp)) && (pb = comparable(lb, &bpp)))
+        diffPixels(pa, pb, ha.w, ha.h, bpp, d);
+    else
+        d->changes |= LGC_DIFF_ERROR;
+
+    if(la && pa != la->data) free(pa);
+    if(lb && pb != lb->data) free(pb);
+    if(la) lgcDestroyLayer(la, 1);
+    if(lb) lgcDestroyLayer(lb, 1);
+
+}
+
+static void * diffWorker(void *arg) {
+
+    diffQueue *q = arg;
+
+    for(;;) {
+        uint32_t j = __atomic_fetch_add(&q->next, 1, __ATOMIC_RELAXED);
+        if(j >= q->count) break;
+
+        diffLayer(q, &q->diffs[j]);
+        if(q->diffs[j].changes)
+            __atomic_fetch_add(&q->differ, 1, __ATOMIC_RELAXED);
+    }
+
+    return NULL;
+
+}
+
+int lgcDiffFiles(const char * a, const char * b, int rwopts, int threads,
+                 lgcLayerDiff ** diffs, uint32_t * count) {
+
+    if(diffs) *diffs = NULL;
+    if(count) *count = 0;
+
+    diffQueue q;
+    memset(&q, 0, sizeof(diffQueue));
+    q.rwopts = rwopts;
+
+    if(!(q.a = lgcOpenFile(a, rwopts)) || !(q.b = lgcOpenFile(b, rwopts))) {
+        fprintf(stderr, "%s: can't open the files (%s, %s)\n", __FUNCTION__, a, b);
+        lgcCloseFile(q.a);
+        return -1;
+    }
+
+    uint32_t count_a = lgcFileLayersCount(q.a), count_b = lgcFileLayersCount(q.b), i;
+    q.count = count_a > count_b? count_a: count_b;
+    q.diffs = calloc(q.count+1, sizeof(lgcLayerDiff));
+    for(i = 0; i < q.count; ++i)
+        q.diffs[i].layer_n = i;
+
+    if(threads <= 0) threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if(threads > DIFF_MAX_THREADS) threads = DIFF_MAX_THREADS;
+    if((uint32_t)threads > q.count) threads = q.count;
+
+    // the calling thread is one of the workers
+    pthread_t workers[DIFF_MAX_THREADS];
+    int started = 0;
+    while(started+1 < threads && !pthread_create(&workers[started], NULL, diffWorker, &q))
+        started++;
+
+    diffWorker(&q);
+
+    int t;
+    for(t = 0; t < started; ++t)
+        pthread_join(workers[t], NULL);
+
+    lgcCloseFile(q.a);
+    lgcCloseFile(q.b);
+
+    if(diffs) *diffs = q.diffs;
+    else free(q.diffs);
+    if(count) *count = q.count;
+
+    return q.differ;
+
+}
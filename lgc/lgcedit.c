@@ -0,0 +1,855 @@
+/**
+
+    lgcedit.c
+    In-place editing of LGC files: layer replacement and deletion,
+    the layer index and compaction
+
+    This software comes under the terms of MIT License.
+
+**/
+
+#include "lgcpriv.h"
+
+#include <malloc.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define INDEX_HEAD_LENGTH (LGC_HEAD_LENGTH+4+6+8)   // head, LGC_EXT_INDEX record
+#define INDEX_TRAILER_LENGTH 12
+#define INDEX_MIN_RESERVE 256
+
+#define COPY_BUFFER_SIZE (1<<20)
+
+// Offset of the index record, as the file's trailer tells; 0 if it does not look right
+static uint64_t indexOffset(const uint8_t *trailer, uint64_t end) {
+
+    uint64_t offset = getLE64(trailer);
+
+    if(getLE32(trailer+8) != LGC_INDEX_MAGIC || offset < LGC_BASE_OFFSET+8 ||
+        offset > end-INDEX_HEAD_LENGTH-INDEX_TRAILER_LENGTH)
+        return 0;
+
+    return offset;
+
+}
+
+// Checks the index record head at 'offset' of 'end' bytes long file
+static int parseIndexHead(const uint8_t *head, uint64_t offset, uint64_t end, layerIndex *idx) {
+
+    int32_t flags = getLE32(head+13);
+    uint32_t len = getLE32(head+17);
+    uint32_t ext_len = getLE32(head+21);
+    uint16_t tag = getLE16(head+25);
+    uint32_t size = getLE32(head+27);
+
+    if(!(flags&LGC_LAYER_HIDDEN) || ext_len != 14 || tag != LGC_EXT_INDEX || size != 8 ||
+        offset+INDEX_HEAD_LENGTH+len != end)
+        return 1;
+
+    idx->count = getLE32(head+31);
+    idx->free_count = getLE32(head+35);
+
+    if(((uint64_t)idx->count+2*(uint64_t)idx->free_count)*8+INDEX_TRAILER_LENGTH > len)
+        return 1;
+
+    idx->offset = offset;
+    idx->size = INDEX_HEAD_LENGTH+len;
+    return 0;
+
+}
+
+// Decodes index entries, stored right after the index record head
+static void unpackIndex(const uint8_t *raw, layerIndex *idx) {
+
+    uint32_t i;
+    idx->entries = malloc(8*(idx->count+1));
+    idx->free = malloc(16*(idx->free_count+1));
+
+    for(i = 0; i < idx->count; ++i)
+        idx->entries[i] = getLE64(raw+8*i);
+    for(i = 0; i < 2*idx->free_count; ++i)
+        idx->free[i] = getLE64(raw+8*(idx->count+i));
+
+}
+
+/*  Looks for the layer index at the end of file of the 'version' and reads
+    it's head. Returns 0 when found, 1 if the file has none, -1 on read error. */
+int findIndex(FILE *f, int version, layerIndex *idx) {
+
+    memset(idx, 0, sizeof(layerIndex));
+    idx->version = version;
+    if(version < 2) return 1;
+
+    if(fseeko(f, 0, SEEK_END)) return -1;
+    off_t end = ftello(f);
+    if(end < LGC_BASE_OFFSET+8+INDEX_HEAD_LENGTH+INDEX_TRAILER_LENGTH)
+        return 1;
+
+    uint8_t trailer[INDEX_TRAILER_LENGTH];
+    fseeko(f, end-INDEX_TRAILER_LENGTH, SEEK_SET);
+    if(fread(trailer, INDEX_TRAILER_LENGTH, 1, f) != 1) return -1;
+
+    uint64_t offset = indexOffset(trailer, end);
+    if(!offset) return 1;
+
+    uint8_t head[INDEX_HEAD_LENGTH];
+    fseeko(f, offset, SEEK_SET);
+    if(fread(head, INDEX_HEAD_LENGTH, 1, f) != 1) return -1;
+
+    return parseIndexHead(head, offset, end, idx);
+
+}
+
+/*  Same as loadIndex() for a whole file in memory, but only finds a stored
+    index: returns 0 when found, 1 if there is none. */
+int loadIndexFromMemory(const uint8_t *buf, uint64_t size, int version, layerIndex *idx) {
+
+    memset(idx, 0, sizeof(layerIndex));
+    idx->version = version;
+
+    if(version < 2 || size < LGC_BASE_OFFSET+8+INDEX_HEAD_LENGTH+INDEX_TRAILER_LENGTH)
+        return 1;
+
+    uint64_t offset = indexOffset(buf+size-INDEX_TRAILER_LENGTH, size);
+    if(!offset || parseIndexHead(buf+offset, offset, size, idx)) return 1;
+
+    unpackIndex(buf+offset+INDEX_HEAD_LENGTH, idx);
+    return 0;
+
+}
+
+/*  Reads the whole layer index. For files which have none,
+    builds it by walking through the records. Returns non-zero on failure. */
+int loadIndex(FILE *f, int version, layerIndex *idx) {
+
+    int r = findIndex(f, version, idx);
+    if(r < 0) return -1;
+
+    if(!r) {
+        uint32_t n = idx->count+2*idx->free_count;
+        uint8_t *raw = malloc(8*(n+1));
+
+        fseeko(f, idx->offset+INDEX_HEAD_LENGTH, SEEK_SET);
+        if(n && fread(raw, 8*n, 1, f) != 1) {
+            free(raw);
+            freeIndex(idx);
+            return -1;
+        }
+
+        unpackIndex(raw, idx);
+        free(raw);
+        return 0;
+    }
+
+    uint32_t records = 0;
+    if(checkHead(f, &records, NULL)) return -1;
+
+    uint32_t entries_cap = 16, free_cap = 16;
+    idx->entries = malloc(8*entries_cap);
+    idx->free = malloc(16*free_cap);
+
+    fseeko(f, LGC_BASE_OFFSET+8, SEEK_SET);
+
+    uint32_t i;
+    for(i = 0; i < records; ++i) {
+        fullLayer tmp;
+        layerExt ext;
+        off_t pos = ftello(f);
+
+        if(readHead(f, version, &tmp, &ext) || fseeko(f, ext.len, SEEK_CUR)) {
+            freeIndex(idx);
+            return -1;
+        }
+
+        // deleted records which payload is shared are kept intact
+        if((ext.flags&(LGC_LAYER_DELETED|LGC_LAYER_SHARED)) == LGC_LAYER_DELETED) {
+            if(idx->free_count == free_cap)
+                idx->free = realloc(idx->free, 16*(free_cap *= 2));
+
+            idx->free[2*idx->free_count] = pos;
+            idx->free[2*idx->free_count+1] = (uint64_t)ext.head_len+ext.len;
+            idx->free_count++;
+        }
+        else if(!(ext.flags&(LGC_LAYER_DELETED|LGC_LAYER_HIDDEN))) {
+            if(idx->count == entries_cap)
+                idx->entries = realloc(idx->entries, 8*(entries_cap *= 2));
+
+            idx->entries[idx->count++] = pos;
+        }
+    }
+
+    return 0;
+
+}
+
+void freeIndex(layerIndex *idx) {
+    free(idx->entries);
+    free(idx->free);
+    idx->entries = NULL;
+    idx->free = NULL;
+}
+
+/*  Positions the stream at the record of layer number 'layer_n',
+    using the layer index when the file has one.
+    Returns 0 on success, 1 if there is no such layer, -1 on read error. */
+int seekLayer(FILE *f, uint32_t layer_n, uint32_t *layers_c) {
+
+    uint32_t records = 0;
+    int version = 0;
+    if(checkHead(f, &records, &version)) return -1;
+
+    layerIndex idx;
+    int r = findIndex(f, version, &idx);
+    if(r < 0) return -1;
+
+    if(!r) {
+        if(layers_c) *layers_c = idx.count;
+        if(layer_n >= idx.count) return 1;
+
+        uint8_t entry[8];
+        fseeko(f, idx.offset+INDEX_HEAD_LENGTH+8*(uint64_t)layer_n, SEEK_SET);
+        if(fread(entry, 8, 1, f) != 1) return -1;
+
+        return fseeko(f, getLE64(entry), SEEK_SET)? -1: 0;
+    }
+
+    if(layers_c) *layers_c = records;
+
+    fseeko(f, LGC_BASE_OFFSET+8, SEEK_SET);
+
+    uint32_t i, n = 0;
+    for(i = 0; i < records; ++i) {
+        fullLayer tmp;
+        layerExt ext;
+        off_t pos = ftello(f);
+
+        if(readHead(f, version, &tmp, &ext)) return -1;
+
+        if(!(ext.flags&(LGC_LAYER_DELETED|LGC_LAYER_HIDDEN)) && n++ == layer_n)
+            return fseeko(f, pos, SEEK_SET)? -1: 0;
+
+        if(fseeko(f, ext.len, SEEK_CUR)) return -1;
+    }
+
+    return 1;
+
+}
+
+// Writes the index as the last record of file
+static int storeIndex(FILE *f, layerIndex *idx, int *records_delta) {
+
+    uint64_t needed = ((uint64_t)idx->count+2*(uint64_t)idx->free_count)*8;
+    uint64_t reserve = idx->size? idx->size-INDEX_HEAD_LENGTH-INDEX_TRAILER_LENGTH: 0;
+
+    if(!idx->offset) {
+        if(fseeko(f, 0, SEEK_END)) return -1;
+        idx->offset = ftello(f);
+        (*records_delta)++;
+    }
+
+    if(needed > reserve) {
+        reserve = needed*2;
+        if(reserve < INDEX_MIN_RESERVE) reserve = INDEX_MIN_RESERVE;
+    }
+
+    if(reserve+INDEX_TRAILER_LENGTH > UINT32_MAX) return -1;
+
+    uint32_t len = reserve+INDEX_TRAILER_LENGTH;
+    uint8_t *buf = malloc(INDEX_HEAD_LENGTH+len);
+    memset(buf, 0, INDEX_HEAD_LENGTH+len);
+
+    putLE32(buf+13, LGC_LAYER_HIDDEN|LGC_LAYER_EXTENDED);
+    putLE32(buf+17, len);
+    putLE32(buf+21, 14);
+    putLE16(buf+25, LGC_EXT_INDEX);
+    putLE32(buf+27, 8);
+    putLE32(buf+31, idx->count);
+    putLE32(buf+35, idx->free_count);
+
+    uint8_t *p = buf+INDEX_HEAD_LENGTH;
+    uint32_t i;
+    for(i = 0; i < idx->count; ++i)
+        putLE64(p+8*i, idx->entries[i]);
+    for(i = 0; i < 2*idx->free_count; ++i)
+        putLE64(p+8*(idx->count+i), idx->free[i]);
+    putLE64(p+reserve, idx->offset);
+    putLE32(p+reserve+8, LGC_INDEX_MAGIC);
+
+    idx->size = INDEX_HEAD_LENGTH+len;
+
+    int ret = 0;
+    if(fseeko(f, idx->offset, SEEK_SET) || fwrite(buf, idx->size, 1, f) != 1 || fflush(f) ||
+        ftruncate(fileno(f), idx->offset+idx->size))
+        ret = -1;
+
+    free(buf);
+    return ret;
+
+}
+
+static int updateRecordsCount(FILE *f, int delta) {
+
+    if(!delta) return 0;
+
+    uint8_t records[4];
+    if(fseeko(f, LGC_BASE_OFFSET+4, SEEK_SET) || fread(records, 4, 1, f) != 1) return -1;
+
+    putLE32(records, getLE32(records)+delta);
+    if(fseeko(f, LGC_BASE_OFFSET+4, SEEK_SET) || fwrite(records, 4, 1, f) != 1) return -1;
+
+    return 0;
+
+}
+
+static int recordSize(FILE *f, int version, uint64_t offset, uint64_t *size, int32_t *flags) {
+
+    fullLayer tmp;
+    layerExt ext;
+
+    if(fseeko(f, offset, SEEK_SET) || readHead(f, version, &tmp, &ext)) return -1;
+
+    *size = (uint64_t)ext.head_len+ext.len;
+    if(flags) *flags = ext.flags;
+    return 0;
+
+}
+
+/*  Marks the record as deleted and remembers it's place as free,
+    unless other layers share it's payload. */
+static int buryRecord(FILE *f, layerIndex *idx, uint64_t offset) {
+
+    uint64_t size = 0;
+    int32_t flags = 0;
+
+    if(recordSize(f, idx->version, offset, &size, &flags)) return -1;
+
+    uint8_t raw[4];
+    flags |= LGC_LAYER_DELETED;
+    putLE32(raw, flags);
+    if(fseeko(f, offset+13, SEEK_SET) || fwrite(raw, 4, 1, f) != 1) return -1;
+
+    if(flags&LGC_LAYER_SHARED) return 0;
+
+    idx->free = realloc(idx->free, 16*(idx->free_count+1));
+    idx->free[2*idx->free_count] = offset;
+    idx->free[2*idx->free_count+1] = size;
+    idx->free_count++;
+
+    return 0;
+
+}
+
+/*  Writes the record to the first deleted one it fits in,
+    or after the last layer (where the index is). */
+static int placeRecord(FILE *f, layerIndex *idx, layerRecord *rec, uint64_t *offset,
+                    int *records_delta) {
+
+    uint32_t i;
+    for(i = 0; i < idx->free_count; ++i) {
+        if(padRecord(rec, idx->free[2*i+1])) continue;
+
+        *offset = idx->free[2*i];
+        idx->free_count--;
+        memmove(&idx->free[2*i], &idx->free[2*i+2], 16*(idx->free_count-i));
+
+        if(fseeko(f, *offset, SEEK_SET)) return -1;
+        return writeRecord(f, rec);
+    }
+
+    if(idx->offset) {
+        *offset = idx->offset;
+        idx->offset += RECORD_SIZE(rec);
+        idx->size = 0; // index record is to be rebuilt after the new layer
+    }
+    else {
+        if(fseeko(f, 0, SEEK_END)) return -1;
+        *offset = ftello(f);
+    }
+
+    (*records_delta)++;
+
+    if(fseeko(f, *offset, SEEK_SET)) return -1;
+    return writeRecord(f, rec);
+
+}
+
+/*  Appends the layer record to file and counts it in. Files with
+    a layer index get it updated, the others are just appended to. */
+int appendRecord(FILE *f, layerRecord *rec) {
+
+    int version = 0;
+    if(checkHead(f, NULL, &version)) return -1;
+
+    layerIndex idx;
+    int r = findIndex(f, version, &idx);
+    if(r < 0) return -1;
+
+    if(r) {
+        if(fseeko(f, 0, SEEK_END) || writeRecord(f, rec)) return -1;
+        return updateRecordsCount(f, 1);
+    }
+
+    if(loadIndex(f, version, &idx)) return -1;
+
+    int delta = 0;
+    uint64_t offset = 0;
+
+    int ret = -1;
+    if(!placeRecord(f, &idx, rec, &offset, &delta)) {
+        idx.entries = realloc(idx.entries, 8*(idx.count+1));
+        idx.entries[idx.count++] = offset;
+
+        if(!storeIndex(f, &idx, &delta) && !updateRecordsCount(f, delta))
+            ret = 0;
+    }
+
+    freeIndex(&idx);
+    return ret;
+
+}
+
+/*  Opens file for editing, rejects FILE* streams; 'version' is the file's.
+    Files edited 'in_place' are turned into v2 ones (see EDITED FILES). */
+static FILE * openForEdit(const char *function, const char *filename, int rwopts, int in_place,
+                          int *version) {
+
+    if(rwopts&LGC_RW_FORCE_FILE_POINTER) {
+        fprintf(stderr, "%s: error: usage of external stream is not supported by this function\n",
+            function);
+        return NULL;
+    }
+
+    FILE *f = fopen(filename, in_place? "r+b": "rb");
+    if(!f) {
+        fprintf(stderr, "%s: error: can't open the file (%s)\n", function, filename);
+        return NULL;
+    }
+
+    if(checkHead(f, NULL, version)) {
+        fprintf(stderr, "%s: bad magic number\n", function);
+        fclose(f);
+        return NULL;
+    }
+
+    if(in_place && *version < 2) {
+        if(upgradeHead(f)) {
+            fprintf(stderr, "%s: can't turn the file into v2 (%s)\n", function, filename);
+            fclose(f);
+            return NULL;
+        }
+        *version = 2;
+    }
+
+    return f;
+
+}
+
+int lgcReplaceLayerInFile(const char * filename, int rwopts, uint32_t layer_n, lgcLayer *layer) {
+
+    int version = 0;
+    FILE *f = openForEdit(__FUNCTION__, filename, rwopts, 1, &version);
+    if(!f) return 1;
+
+    layerIndex idx;
+    if(loadIndex(f, version, &idx)) {
+        fprintf(stderr, "%s: read error\n", __FUNCTION__);
+        fclose(f);
+        return 1;
+    }
+
+    if(layer_n >= idx.count) {
+        fprintf(stderr, "%s: layer %u does not exist in image\n", __FUNCTION__, layer_n);
+        freeIndex(&idx);
+        fclose(f);
+        return 1;
+    }
+
+    int ret = 1;
+    layerRecord rec;
+    uint64_t old = idx.entries[layer_n], old_size = 0;
+    int32_t old_flags = 0;
+
+    fullLayer full;
+    loadLayer(layer, &full);
+
+    if(packLayer(&full, 0, &rec) || recordSize(f, idx.version, old, &old_size, &old_flags)) {
+        fprintf(stderr, "%s: can't prepare the layer\n", __FUNCTION__);
+    }
+    else if(!(old_flags&LGC_LAYER_SHARED) && !padRecord(&rec, old_size)) {
+        // fits in place, nothing else changes
+        if(fseeko(f, old, SEEK_SET) || writeRecord(f, &rec))
+            fprintf(stderr, "%s: write error\n", __FUNCTION__);
+        else ret = 0;
+    }
+    else {
+        int delta = 0;
+        uint64_t offset = 0;
+
+        if(placeRecord(f, &idx, &rec, &offset, &delta) || buryRecord(f, &idx, old)) {
+            fprintf(stderr, "%s: write error\n", __FUNCTION__);
+        }
+        else {
+            idx.entries[layer_n] = offset;
+            if(storeIndex(f, &idx, &delta) || updateRecordsCount(f, delta))
+                fprintf(stderr, "%s: failed to update the layer index\n", __FUNCTION__);
+            else ret = 0;
+        }
+    }
+
+    freeRecord(&rec);
+    freeIndex(&idx);
+    fclose(f);
+    return ret;
+
+}
+
+int lgcDeleteLayerFromFile(const char * filename, int rwopts, uint32_t layer_n) {
+
+    int version = 0;
+    FILE *f = openForEdit(__FUNCTION__, filename, rwopts, 1, &version);
+    if(!f) return 1;
+
+    layerIndex idx;
+    if(loadIndex(f, version, &idx)) {
+        fprintf(stderr, "%s: read error\n", __FUNCTION__);
+        fclose(f);
+        return 1;
+    }
+
+    if(layer_n >= idx.count) {
+        fprintf(stderr, "%s: layer %u does not exist in image\n", __FUNCTION__, layer_n);
+        freeIndex(&idx);
+        fclose(f);
+        return 1;
+    }
+
+    int ret = 1, delta = 0;
+
+    if(buryRecord(f, &idx, idx.entries[layer_n])) {
+        fprintf(stderr, "%s: write error\n", __FUNCTION__);
+    }
+    else {
+        idx.count--;
+        memmove(&idx.entries[layer_n], &idx.entries[layer_n+1], 8*(idx.count-layer_n));
+
+        if(storeIndex(f, &idx, &delta) || updateRecordsCount(f, delta))
+            fprintf(stderr, "%s: failed to update the layer index\n", __FUNCTION__);
+        else ret = 0;
+    }
+
+    freeIndex(&idx);
+    fclose(f);
+    return ret;
+
+}
+
+/* Layer record as stored, with it's extension records sorted out */
+typedef struct {
+
+    uint8_t         head[LGC_WIDE_HEAD_LENGTH];
+    uint8_t *       ext;        // extension records, without LGC_EXT_PADDING
+    uint32_t        ext_len;
+    uint64_t        payload;    // offset of the payload
+    uint64_t        len;        // payload length, without padding
+    uint64_t        ref;
+    uint64_t        delta_base;
+
+} rawRecord;
+
+static void dropExt(rawRecord *r, uint16_t drop) {
+
+    uint32_t pos = 0, kept = 0;
+    while(pos+6 <= r->ext_len) {
+        uint16_t tag = getLE16(r->ext+pos);
+        uint32_t size = getLE32(r->ext+pos+2);
+        if(size > r->ext_len-pos-6) break;
+
+        if(tag != drop) {
+            memmove(r->ext+kept, r->ext+pos, 6+size);
+            kept += 6+size;
+        }
+
+        pos += 6+size;
+    }
+
+    r->ext_len = kept;
+
+}
+
+static int readRaw(FILE *in, uint64_t offset, rawRecord *r) {
+
+    memset(r, 0, sizeof(rawRecord));
+
+    fullLayer tmp;
+    layerExt ext;
+
+    if(fseeko(in, offset, SEEK_SET) || readHead(in, 2, &tmp, &ext)) return -1;
+
+    uint32_t head_len = HEAD_LENGTH(ext.flags);
+    if(fseeko(in, offset, SEEK_SET) || fread(r->head, head_len, 1, in) != 1)
+        return -1;
+
+    r->ext_len = ext.head_len-head_len;
+    r->ext = malloc(r->ext_len+16);
+    if(r->ext_len) {
+        if(fread(r->ext, r->ext_len, 1, in) != 1)
+            return -1;
+
+        r->ext_len -= 4;
+        memmove(r->ext, r->ext+4, r->ext_len);
+    }
+
+    dropExt(r, LGC_EXT_PADDING);
+
+    r->payload = offset+ext.head_len;
+    r->len = ext.len-ext.padding;
+    r->ref = ext.ref;
+    r->delta_base = ext.delta_base;
+    return 0;
+
+}
+
+// Copies data of the first extension record with 'tag', if it's at least 'size' bytes
+static int extData(rawRecord *r, uint16_t tag, uint8_t *data, uint32_t size) {
+
+    uint32_t pos = 0;
+    while(pos+6 <= r->ext_len) {
+        uint32_t len = getLE32(r->ext+pos+2);
+        if(len > r->ext_len-pos-6) break;
+
+        if(getLE16(r->ext+pos) == tag && len >= size) {
+            memcpy(data, r->ext+pos+6, size);
+            return 0;
+        }
+
+        pos += 6+len;
+    }
+
+    return -1;
+
+}
+
+// Adds extension record; room for it is made by dropping the old one
+static void putExt(rawRecord *r, uint16_t tag, const uint8_t *data, uint32_t size) {
+    putLE16(r->ext+r->ext_len, tag);
+    putLE32(r->ext+r->ext_len+2, size);
+    memcpy(r->ext+r->ext_len+6, data, size);
+    r->ext_len += 6+size;
+}
+
+static void putExt64(rawRecord *r, uint16_t tag, uint64_t value) {
+    uint8_t data[8];
+    putLE64(data, value);
+    putExt(r, tag, data, 8);
+}
+
+/*  Writes the record with 'len' bytes of payload taken from 'payload' offset of 'in'.
+    A wide head stays wide, so LEVELS records taken along keep matching it. */
+static int writeRaw(FILE *in, FILE *out, rawRecord *r, int32_t add_flags, int32_t drop_flags,
+                    uint64_t payload, uint64_t len, uint8_t *buf) {
+
+    fullLayer layer;
+    unpackHead(r->head, &layer);
+    int32_t flags = layer.flags;
+
+    flags &= ~(LGC_LAYER_DELETED|LGC_LAYER_HIDDEN|drop_flags);
+    flags |= add_flags;
+    if(r->ext_len) flags |= LGC_LAYER_EXTENDED;
+    else flags &= ~LGC_LAYER_EXTENDED;
+
+    uint8_t ext_len[4];
+    uint32_t head_len = packHead(r->head, &layer, flags, len);
+    putLE32(ext_len, r->ext_len);
+
+    if(fwrite(r->head, head_len, 1, out) != 1) return -1;
+    if(r->ext_len && (fwrite(ext_len, 4, 1, out) != 1 || fwrite(r->ext, r->ext_len, 1, out) != 1))
+        return -1;
+
+    if(len && fseeko(in, payload, SEEK_SET)) return -1;
+
+    while(len) {
+        uint32_t chunk = len < COPY_BUFFER_SIZE? len: COPY_BUFFER_SIZE;
+        if(fread(buf, chunk, 1, in) != 1 || fwrite(buf, chunk, 1, out) != 1)
+            return -1;
+        len -= chunk;
+    }
+
+    return 0;
+
+}
+
+/*  Writes the delta layer at 'offset' whole, for when it's base is gone.
+    Shared payload of it stays shared. */
+static int materializeDelta(FILE *in, uint64_t offset, FILE *out) {
+
+    fullLayer layer;
+    layerExt ext;
+    layerRecord rec;
+
+    memset(&layer, 0, sizeof(fullLayer));
+    if(fseeko(in, offset, SEEK_SET) || readHead(in, 2, &layer, &ext)) return -1;
+
+    layer.data = decodeDeltaChain(fileReadAt, in, &layer, &ext, offset, 0);
+    if(!layer.data) return -1;
+
+    // indexed layers keep their palette
+    attachPalette(&layer, &ext);
+    int ret = packLayer(&layer, ext.flags&LGC_LAYER_SHARED, &rec) || writeRecord(out, &rec)? -1: 0;
+
+    freeRecord(&rec);
+    free(layer.palette);
+    free(layer.data);
+    return ret;
+
+}
+
+/*  Copies layer record as it is stored, dropping it's padding.
+    Payload shared by several layers stays in the first one of them
+    written, which may be a layer which shared it before. 'moved' maps
+    offsets of such payloads (and of delta bases) to their new places
+    in 'placed'. */
+static int copyRecord(FILE *in, uint64_t offset, FILE *out, offsetMap *moved,
+                    uint64_t *placed, uint32_t n, uint8_t *buf) {
+
+    rawRecord r, owner;
+    uint32_t k;
+    int ret = -1;
+
+    placed[n] = ftello(out);
+    if(readRaw(in, offset, &r)) {
+        free(r.ext);
+        return -1;
+    }
+
+    uint64_t source = r.ref? r.ref: offset;
+
+    if(!mapGet(moved, source, &k)) {
+        // payload is already written, referring to it
+        dropExt(&r, LGC_EXT_REF);
+        dropExt(&r, LGC_EXT_LEVELS);
+        putExt64(&r, LGC_EXT_REF, placed[k]);
+
+        ret = writeRaw(in, out, &r, 0, LGC_LAYER_SHARED, 0, 0, buf);
+    }
+    else if(r.ref) {
+        // owner of the payload is deleted or comes later, this one takes it
+        if(!readRaw(in, r.ref, &owner)) {
+            free(r.ext);
+            r.ext = owner.ext;
+            r.ext_len = owner.ext_len;
+            owner.ext = NULL;
+
+            mapPut(moved, r.ref, n);
+            ret = writeRaw(in, out, &r, LGC_LAYER_SHARED, 0, owner.payload, owner.len, buf);
+        }
+
+        free(owner.ext);
+    }
+    else if(r.delta_base && mapGet(moved, r.delta_base, &k)) {
+        // base of the delta is deleted, the layer is stored whole
+        if(getLE32(r.head+13)&LGC_LAYER_SHARED)
+            mapPut(moved, offset, n);
+
+        ret = materializeDelta(in, offset, out);
+    }
+    else {
+        if(getLE32(r.head+13)&LGC_LAYER_SHARED)
+            mapPut(moved, offset, n);
+
+        if(r.delta_base) {
+            // the base is written already (found in 'moved' above), pointing to it's new place
+            uint8_t delta[17];
+            if(extData(&r, LGC_EXT_DELTA, delta, sizeof(delta))) {
+                free(r.ext);
+                return -1;
+            }
+
+            dropExt(&r, LGC_EXT_DELTA);
+            putLE64(delta, placed[k]);
+            putExt(&r, LGC_EXT_DELTA, delta, sizeof(delta));
+        }
+
+        ret = writeRaw(in, out, &r, 0, 0, r.payload, r.len, buf);
+    }
+
+    free(r.ext);
+    return ret;
+
+}
+
+int lgcCompactFile(const char * filename, int rwopts) {
+
+    int version = 0;
+    FILE *f = openForEdit(__FUNCTION__, filename, rwopts, 0, &version);
+    if(!f) return 1;
+
+    // v1 files are never edited in place, there is nothing to reclaim
+    if(version < 2) {
+        fclose(f);
+        return 0;
+    }
+
+    layerIndex idx;
+    if(loadIndex(f, version, &idx)) {
+        fprintf(stderr, "%s: read error\n", __FUNCTION__);
+        fclose(f);
+        return 1;
+    }
+
+    char *tmpname = malloc(strlen(filename)+10);
+    sprintf(tmpname, "%s.compact", filename);
+
+    FILE *out = openFile(tmpname, "wb");
+    if(!out) {
+        fprintf(stderr, "%s: can't open the file for writing (%s)\n", __FUNCTION__, tmpname);
+        free(tmpname);
+        freeIndex(&idx);
+        fclose(f);
+        return 1;
+    }
+
+    // the dictionary record stays the first one (see LGC_EXT_DICT)
+    int dict = loadDictionary(f, version);
+
+    uint8_t head[LGC_BASE_OFFSET+4], count[4];
+    putLE32(count, idx.count+dict);
+    uint8_t *buf = malloc(COPY_BUFFER_SIZE);
+    uint64_t *placed = malloc(8*(idx.count+1));
+
+    offsetMap moved;
+    mapInit(&moved, 16);
+
+    int failed = fseeko(f, 0, SEEK_SET) || fread(head, sizeof(head), 1, f) != 1 ||
+        fwrite(head, sizeof(head), 1, out) != 1 || fwrite(count, 4, 1, out) != 1;
+
+    if(!failed && dict) {
+        rawRecord r;
+        failed = readRaw(f, LGC_BASE_OFFSET+8, &r) ||
+            writeRaw(f, out, &r, LGC_LAYER_HIDDEN, 0, r.payload, r.len, buf);
+        free(r.ext);
+    }
+
+    uint32_t i;
+    for(i = 0; !failed && i < idx.count; ++i)
+        failed = copyRecord(f, idx.entries[i], out, &moved, placed, i, buf);
+
+    mapFree(&moved);
+    free(placed);
+    free(buf);
+    freeIndex(&idx);
+    fclose(f);
+
+    if(fclose(out)) failed = 1;
+
+    if(failed || rename(tmpname, filename)) {
+        fprintf(stderr, "%s: failed to rewrite the file (%s)\n", __FUNCTION__, filename);
+        remove(tmpname);
+        free(tmpname);
+        return 1;
+    }
+
+    free(tmpname);
+    return 0;
+
+}
@@ -0,0 +1,236 @@
+/**
+
+    lgcfile.c
+    lgcFile: open file handle for concurrent, position-independent reads
+
+    This software comes under the terms of MIT License.
+
+**/
+
+#include "lgcpriv.h"
+
+#include <malloc.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+struct lgcFile {
+
+    int             fd;
+    int             version;
+    uint32_t        layers_count;
+    uint64_t *      offsets;    // of layer records, from the layer index
+
+};
+
+// pread() of exactly 'len' bytes
+int preadFull(int fd, void *buf, uint64_t len, uint64_t offset) {
+
+    uint8_t *p = buf;
+    while(len) {
+        ssize_t r = pread(fd, p, len, offset);
+        if(r <= 0) return -1;
+        p += r;
+        offset += r;
+        len -= r;
+    }
+
+    return 0;
+
+}
+
+// Reads and parses the record head at 'offset', usually with a single pread()
+static int preadHead(int fd, uint64_t offset, int version, fullLayer *layer, layerExt *ext) {
+
+    uint8_t buf[LGC_RECORD_HEAD_MAX];
+    ssize_t n = pread(fd, buf, sizeof(buf), offset);
+    if(n <= 0) return -1;
+
+    int need = parseHead(buf, n, version, layer, ext);
+    if(need > n) {
+        uint8_t *head = malloc(need);
+        need = head && !preadFull(fd, head, need, offset)?
+            parseHead(head, need, version, layer, ext): -1;
+        free(head);
+    }
+
+    return need? -1: 0;
+
+}
+
+/*  Finds the stored pixels of the layer which head is in 'ext':
+    descriptor to read them from (the file's one or an opened blob,
+    to be closed by the caller) and their offset. */
+static int locatePayload(lgcFile *file, uint64_t record, fullLayer *layer, layerExt *ext,
+                         int *fd, uint64_t *at) {
+
+    *fd = file->fd;
+    *at = record+ext->head_len;
+    if(!ext->ref && !ext->blob) return 0;
+
+    uint64_t owner_at = ext->ref;
+    int version = ext->version;
+    if(ext->blob) {
+        char path[4096];
+        if(blobPath(ext->blob, path, sizeof(path)) || (*fd = open(path, O_RDONLY)) < 0)
+            return -1;
+        owner_at = 0;
+        version = LGC_STORE_VERSION;
+    }
+
+    fullLayer owner;
+    layerExt owner_ext;
+
+    if(preadHead(*fd, owner_at, version, &owner, &owner_ext) ||
+        adoptPayload(layer, ext, &owner, &owner_ext)) {
+        if(*fd != file->fd) close(*fd);
+        *fd = -1;
+        return -1;
+    }
+
+    *at = owner_at+owner_ext.head_len;
+    return 0;
+
+}
+
+/*  Reads the head of layer 'layer_n', with 'ext' describing the payload
+    it's pixels are in, like lgcFileReadLayer() sees it. */
+int fileLayerHead(lgcFile *file, uint32_t layer_n, fullLayer *layer, layerExt *ext) {
+
+    int fd = -1;
+    uint64_t at;
+
+    if(layer_n >= file->layers_count ||
+        preadHead(file->fd, file->offsets[layer_n], file->version, layer, ext) ||
+        locatePayload(file, file->offsets[layer_n], layer, ext, &fd, &at))
+        return -1;
+
+    if(fd != file->fd) close(fd);
+    return 0;
+
+}
+
+lgcFile * lgcOpenFile(const char * filename, int rwopts) {
+
+    if(rwopts&LGC_RW_FORCE_FILE_POINTER) {
+        fprintf(stderr, "%s: error: usage of external stream is not supported by this function\n",
+            __FUNCTION__);
+        return NULL;
+    }
+
+    FILE *f = openFile(filename, "rb");
+    if(!f) {
+        fprintf(stderr, "%s: can't open the file (%s)\n", __FUNCTION__, filename);
+        return NULL;
+    }
+
+    layerIndex idx;
+    int version = 0;
+    if(checkHead(f, NULL, &version) || loadIndex(f, version, &idx)) {
+        fprintf(stderr, "%s: read error or bad magic number\n", __FUNCTION__);
+        fclose(f);
+        return NULL;
+    }
+
+    // layers are read with any options later on
+    loadDictionary(f, version);
+
+    lgcFile *file = malloc(sizeof(lgcFile));
+    file->fd = dup(fileno(f));
+    file->version = version;
+    file->layers_count = idx.count;
+    file->offsets = idx.entries;
+    idx.entries = NULL;
+
+    freeIndex(&idx);
+    fclose(f);
+
+    if(file->fd < 0) {
+        lgcCloseFile(file);
+        return NULL;
+    }
+
+    return file;
+
+}
+
+uint32_t lgcFileLayersCount(lgcFile *file) {
+    return file->layers_count;
+}
+
+lgcLayer * lgcFileReadLayer(lgcFile *file, int rwopts, uint32_t layer_n) {
+    return lgcFileReadLayerLevel(file, rwopts, layer_n, 0);
+}
+
+lgcLayer * lgcFileReadLayerLevel(lgcFile *file, int rwopts, uint32_t layer_n, uint8_t level) {
+
+    if(!(rwopts&LGC_RW_ENTRIE)) return NULL;
+
+    if(layer_n >= file->layers_count) {
+        fprintf(stderr, "%s: layer %u does not exist in image\n", __FUNCTION__, layer_n);
+        return NULL;
+    }
+
+    fullLayer layer;
+    layerExt ext;
+    int fd = -1;
+    uint64_t at = 0;
+    uint64_t offset = 0, len = 0;
+    memset(&layer, 0, sizeof(fullLayer));
+
+    uint64_t record = file->offsets[layer_n];
+    int failed = preadHead(file->fd, record, file->version, &layer, &ext) ||
+        locatePayload(file, record, &layer, &ext, &fd, &at);
+    if(!failed) attachPalette(&layer, &ext);
+
+    if(!failed && selectLevel(&layer, &ext, level, &offset, &len)) {
+        fprintf(stderr, "%s: layer %u has no level %u\n", __FUNCTION__, layer_n, level);
+        failed = 1;
+    }
+
+    if(!failed && rwopts&LGC_RW_BODY) {
+
+        const uint32_t *checksum = NULL;
+        if(rwopts&LGC_RW_VERIFY && level < ext.checksums)
+            checksum = &ext.checksum[level];
+
+        layer.length = LGC_LAYER_BODY_LENGTH((&layer));
+
+        void *stored = NULL;
+        if(ext.delta_base) {
+            if(!(layer.data = decodeDeltaChain(fdReadAt, &file->fd, &layer, &ext, record, rwopts)))
+                failed = 1;
+        }
+        else if(!(stored = malloc(len? len: 1)) || preadFull(fd, stored, len, at+offset)) {
+            free(stored);
+            failed = 1;
+        }
+        else if(!(layer.data = decodeBody(stored, len, layer.format, layer.length,
+                                          level? 0: ext.sparse_len, ext.dict, checksum)))
+            failed = 1;
+
+    }
+
+    if(fd >= 0 && fd != file->fd) close(fd);
+
+    if(failed) {
+        fprintf(stderr, "%s: read error\n", __FUNCTION__);
+        free(layer.data);
+        free(layer.palette);
+        return NULL;
+    }
+
+    return newLayer(&layer);
+
+}
+
+void lgcCloseFile(lgcFile *file) {
+
+    if(!file) return;
+
+    if(file->fd >= 0) close(file->fd);
+    free(file->offsets);
+    free(file);
+
+}
@@ -0,0 +1,286 @@
+/**
+
+    lgchash.c
+    Hashing of layer contents, CRC32C checksums and a small offset map
+
+    This software comes under the terms of MIT License.
+
+**/
+
+#include "lgcpriv.h"
+
+#include <malloc.h>
+#include <string.h>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <nmmintrin.h>
+#define HAVE_CRC32_INSN
+#endif
+
+/* -- 64-bit content hash (XXH64 algorithm) -- */
+
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+#define ROTL64(x, r) (((x)<<(r))|((x)>>(64-(r))))
+
+static inline uint64_t read64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+static inline uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static inline uint64_t hashRound(uint64_t acc, uint64_t input) {
+    acc += input*PRIME64_2;
+    acc = ROTL64(acc, 31);
+    return acc*PRIME64_1;
+}
+
+static inline uint64_t hashMerge(uint64_t acc, uint64_t val) {
+    acc ^= hashRound(0, val);
+    return acc*PRIME64_1+PRIME64_4;
+}
+
+uint64_t hash64(const void *data, size_t len, uint64_t seed) {
+
+    const uint8_t *p = data;
+    const uint8_t *end = p+len;
+    uint64_t h;
+
+    if(len >= 32) {
+        uint64_t v1 = seed+PRIME64_1+PRIME64_2;
+        uint64_t v2 = seed+PRIME64_2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed-PRIME64_1;
+
+        do {
+            v1 = hashRound(v1, read64(p));
+            v2 = hashRound(v2, read64(p+8));
+            v3 = hashRound(v3, read64(p+16));
+            v4 = hashRound(v4, read64(p+24));
+            p += 32;
+        } while(p+32 <= end);
+
+        h = ROTL64(v1, 1)+ROTL64(v2, 7)+ROTL64(v3, 12)+ROTL64(v4, 18);
+        h = hashMerge(h, v1);
+        h = hashMerge(h, v2);
+        h = hashMerge(h, v3);
+        h = hashMerge(h, v4);
+    }
+    else h = seed+PRIME64_5;
+
+    h += len;
+
+    for(; p+8 <= end; p += 8) {
+        h ^= hashRound(0, read64(p));
+        h = ROTL64(h, 27)*PRIME64_1+PRIME64_4;
+    }
+
+    if(p+4 <= end) {
+        h ^= (uint64_t)read32(p)*PRIME64_1;
+        h = ROTL64(h, 23)*PRIME64_2+PRIME64_3;
+        p += 4;
+    }
+
+    for(; p < end; ++p) {
+        h ^= (*p)*PRIME64_5;
+        h = ROTL64(h, 11)*PRIME64_1;
+    }
+
+    h ^= h>>33;
+    h *= PRIME64_2;
+    h ^= h>>29;
+    h *= PRIME64_3;
+    h ^= h>>32;
+
+    return h;
+
+}
+
+/*  Content key of a layer: hash of it's pixels, seeded with everything
+    else that affects the stored payload, the palette of indexed layers
+    hashed on top. Layers with equal keys (and equal content) are stored
+    once. Fields past 'data' are to be claimed. */
+uint64_t layerKey(fullLayer *layer) {
+
+    uint8_t levels = layer->levels > LGC_MAX_LEVELS? LGC_MAX_LEVELS: layer->levels;
+    uint64_t seed = (layer->w&0xffff)|(uint64_t)(layer->h&0xffff)<<16|
+        (uint64_t)layer->format<<32|(uint64_t)levels<<40;
+
+    // high halves of wide layers' dimensions, leaving keys of the others as they were
+    seed ^= (uint64_t)(layer->w>>16)<<48^(uint64_t)(layer->h>>16)<<56;
+
+    uint64_t key = hash64(layer->data, LGC_LAYER_BODY_LENGTH(layer), seed);
+
+    // same indices mean other pixels with another palette
+    if(isIndexed(layer->format) && layer->palette && layer->colors)
+        key = hash64(layer->palette, 4*layer->colors, key);
+
+    return key;
+
+}
+
+/* -- CRC32C (Castagnoli) checksums -- */
+
+#define CRC32C_POLY 0x82F63B78  // reversed
+
+static uint32_t crc_table[8][256];
+
+static void crcInitTable() {
+
+    uint32_t i, j;
+    for(i = 0; i < 256; ++i) {
+        uint32_t c = i;
+        for(j = 0; j < 8; ++j)
+            c = c&1? (c>>1)^CRC32C_POLY: c>>1;
+        crc_table[0][i] = c;
+    }
+
+    for(i = 0; i < 256; ++i)
+        for(j = 1; j < 8; ++j)
+            crc_table[j][i] = (crc_table[j-1][i]>>8)^crc_table[0][crc_table[j-1][i]&0xff];
+
+}
+
+// Slicing-by-8, for CPUs without the CRC32 instruction
+static uint32_t crcTable(uint32_t crc, const uint8_t *p, size_t len) {
+
+    for(; len && ((uintptr_t)p&7); --len)
+        crc = (crc>>8)^crc_table[0][(crc^*p++)&0xff];
+
+    for(; len >= 8; len -= 8, p += 8) {
+        uint32_t lo = read32(p)^crc, hi = read32(p+4);
+        crc = crc_table[7][lo&0xff]^crc_table[6][(lo>>8)&0xff]^
+            crc_table[5][(lo>>16)&0xff]^crc_table[4][lo>>24]^
+            crc_table[3][hi&0xff]^crc_table[2][(hi>>8)&0xff]^
+            crc_table[1][(hi>>16)&0xff]^crc_table[0][hi>>24];
+    }
+
+    while(len--)
+        crc = (crc>>8)^crc_table[0][(crc^*p++)&0xff];
+
+    return crc;
+
+}
+
+#ifdef HAVE_CRC32_INSN
+__attribute__((target("sse4.2")))
+static uint32_t crcInsn(uint32_t crc, const uint8_t *p, size_t len) {
+
+    uint64_t c = crc;
+
+    for(; len && ((uintptr_t)p&7); --len)
+        c = _mm_crc32_u8(c, *p++);
+
+    for(; len >= 8; len -= 8, p += 8)
+        c = _mm_crc32_u64(c, read64(p));
+
+    while(len--)
+        c = _mm_crc32_u8(c, *p++);
+
+    return c;
+
+}
+#endif
+
+typedef uint32_t (*crcFunc)(uint32_t, const uint8_t*, size_t);
+static crcFunc crc_impl = NULL;
+
+/*  CRC32C of 'len' bytes, continuing from 'crc' (0 to start).
+    Uses the SSE4.2 instruction when the CPU has it. */
+uint32_t crc32c(uint32_t crc, const void *data, size_t len) {
+
+    // picked on first use; racing threads pick the same one
+    crcFunc impl = __atomic_load_n(&crc_impl, __ATOMIC_ACQUIRE);
+    if(!impl) {
+#ifdef HAVE_CRC32_INSN
+        __builtin_cpu_init();
+        if(__builtin_cpu_supports("sse4.2")) impl = crcInsn;
+#endif
+        if(!impl) {
+            crcInitTable();
+            impl = crcTable;
+        }
+        __atomic_store_n(&crc_impl, impl, __ATOMIC_RELEASE);
+    }
+
+    return ~impl(~crc, data, len);
+
+}
+
+/* -- uint64 to uint32 map, open addressing -- */
+
+#define MAP_EMPTY 0xffffffff
+
+static uint32_t mapSlot(offsetMap *map, uint64_t key) {
+    uint64_t h = key*PRIME64_1;
+    uint32_t i = (h^(h>>32))&(map->cap-1);
+
+    while(map->values[i] != MAP_EMPTY && map->keys[i] != key)
+        i = (i+1)&(map->cap-1);
+
+    return i;
+}
+
+void mapInit(offsetMap *map, uint32_t expected) {
+
+    map->cap = 16;
+    while(map->cap < expected*2) map->cap <<= 1;
+
+    map->count = 0;
+    map->keys = malloc(sizeof(uint64_t)*map->cap);
+    map->values = malloc(sizeof(uint32_t)*map->cap);
+    memset(map->values, 0xff, sizeof(uint32_t)*map->cap);
+
+}
+
+void mapPut(offsetMap *map, uint64_t key, uint32_t value) {
+
+    if((map->count+1)*2 > map->cap) {
+        offsetMap bigger;
+        mapInit(&bigger, map->cap);
+
+        uint32_t i;
+        for(i = 0; i < map->cap; ++i)
+            if(map->values[i] != MAP_EMPTY)
+                mapPut(&bigger, map->keys[i], map->values[i]);
+
+        mapFree(map);
+        *map = bigger;
+    }
+
+    uint32_t i = mapSlot(map, key);
+    if(map->values[i] == MAP_EMPTY) map->count++;
+
+    map->keys[i] = key;
+    map->values[i] = value;
+
+}
+
+// Returns zero and fills 'value' if the key is there
+int mapGet(offsetMap *map, uint64_t key, uint32_t *value) {
+
+    if(!map->cap) return 1;
+
+    uint32_t i = mapSlot(map, key);
+    if(map->values[i] == MAP_EMPTY) return 1;
+
+    *value = map->values[i];
+    return 0;
+
+}
+
+void mapFree(offsetMap *map) {
+    free(map->keys);
+    free(map->values);
+    memset(map, 0, sizeof(offsetMap));
+}
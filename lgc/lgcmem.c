@@ -0,0 +1,405 @@
+/**
+
+    lgcmem.c
+    Reading and writing of LGC images in memory buffers
+
+    This software comes under the terms of MIT License.
+
+**/
+
+#include "lgcpriv.h"
+
+#include <malloc.h>
+#include <stdio.h>
+#include <string.h>
+
+typedef struct {
+
+    const uint8_t * buf;
+    size_t          size;
+
+} memBuffer;
+
+static int64_t memReadAt(void *src, void *buf, uint64_t len, uint64_t offset) {
+
+    memBuffer *mem = src;
+    if(offset >= mem->size) return 0;
+    if(len > mem->size-offset) len = mem->size-offset;
+
+    memcpy(buf, mem->buf+offset, len);
+    return len;
+
+}
+
+// Parses the record head at 'pos', checking that the whole record is in the buffer
+static int memHead(const uint8_t *buf, size_t size, uint64_t pos, int version, fullLayer *layer,
+                   layerExt *ext) {
+
+    if(pos >= size ||
+        parseHead(buf+pos, size-pos < UINT32_MAX? size-pos: UINT32_MAX, version, layer, ext))
+        return -1;
+
+    return (uint64_t)ext->head_len+ext->len > size-pos? -1: 0;
+
+}
+
+/*  Decodes pixels of the layer which head is at 'pos', or of it's
+    reduced-resolution 'level' (the layer takes it's size then); without
+    LGC_RW_BODY in 'rwopts' only the size. Payloads of other records are
+    found in the buffer, blobs are read from the blob store.
+    Returns 1 if the layer has no such level, -1 on failure. */
+static int memLayerBody(const uint8_t *buf, size_t size, uint64_t pos,
+                        fullLayer *layer, layerExt *ext, uint8_t level, int rwopts) {
+
+    FILE *src = NULL;
+    uint64_t at = pos+ext->head_len, offset, len;
+
+    if(ext->blob) {
+        if(!(src = openPayload(NULL, layer, ext))) return -1;
+    }
+    else if(ext->ref) {
+        fullLayer owner;
+        layerExt owner_ext;
+
+        if(memHead(buf, size, ext->ref, ext->version, &owner, &owner_ext) ||
+            adoptPayload(layer, ext, &owner, &owner_ext))
+            return -1;
+
+        at = ext->ref+owner_ext.head_len;
+    }
+
+    if(selectLevel(layer, ext, level, &offset, &len) || !(rwopts&LGC_RW_BODY)) {
+        if(src) fclose(src);
+        return level > ext->levels? 1: 0;
+    }
+
+    layer->length = LGC_LAYER_BODY_LENGTH(layer);
+
+    const uint32_t *checksum = rwopts&LGC_RW_VERIFY && level < ext->checksums?
+        &ext->checksum[level]: NULL;
+    uint32_t sparse = level? 0: ext->sparse_len;
+
+    if(src) {
+        layer->data = fseeko(src, offset, SEEK_CUR)? NULL:
+            readBody(src, len, layer->format, layer->length, sparse, ext->dict, checksum);
+        fclose(src);
+        return layer->data? 0: -1;
+    }
+
+    if(ext->delta_base) {
+        memBuffer mem = {buf, size};
+        layer->data = decodeDeltaChain(memReadAt, &mem, layer, ext, pos, rwopts);
+        return layer->data? 0: -1;
+    }
+
+    at += offset;
+    if(at > size || len > size-at) return -1;
+
+    const uint8_t *stored = buf+at;
+
+    // uncompressed pixels are used right where they are
+    if(rwopts&LGC_RW_NO_COPY && !(layer->format&LGC_FMT_COMPRESSED) && !sparse) {
+        if(len != layer->length || (checksum && crc32c(0, stored, len) != *checksum))
+            return -1;
+
+        layer->data = (void*)stored;
+        layer->borrowed = 1;
+        return 0;
+    }
+
+    layer->data = decodeStored(stored, len, layer->format, layer->length, sparse, ext->dict, checksum);
+    return layer->data? 0: -1;
+
+}
+
+// Applies the difference of a delta layer to it's decoded 'base'
+static int memDeltaOnBase(const uint8_t *buf, size_t size, uint64_t pos, fullLayer *layer,
+                          layerExt *ext, fullLayer *base, int rwopts) {
+
+    if(!base->data || base->w != layer->w || base->h != layer->h || base->format != layer->format)
+        return -1;
+
+    // the difference is read right from the buffer
+    if(pos > size || (uint64_t)ext->head_len+ext->len > size-pos)
+        return -1;
+
+    layer->length = LGC_LAYER_BODY_LENGTH(layer);
+    layer->data = deltaOnBase(base->data, layer, ext, buf+pos+ext->head_len,
+                              rwopts&LGC_RW_VERIFY && ext->checksums? &ext->checksum[0]: NULL);
+    return layer->data? 0: -1;
+
+}
+
+lgcImage * lgcReadImageFromMemory(const void * buf, size_t size, int rwopts) {
+
+    if(!(rwopts&LGC_RW_ENTRIE)) return NULL;
+
+    if(!buf) {
+        fprintf(stderr, "%s: buffer is NULL\n", __FUNCTION__);
+        return NULL;
+    }
+
+    const uint8_t *p = buf;
+    int version = size < LGC_BASE_OFFSET+8? 0: checkMagic(getLE32(p+LGC_BASE_OFFSET));
+    if(!version) {
+        fprintf(stderr, "%s: bad magic number\n", __FUNCTION__);
+        return NULL;
+    }
+
+    lgcImage * img = malloc(sizeof(lgcImage));
+    memset(img, 0, sizeof(lgcImage));
+
+    memcpy(img->unused, p, LGC_BASE_OFFSET);
+    img->magic = getLE32(p+LGC_BASE_OFFSET);
+    img->layers_count = getLE32(p+LGC_BASE_OFFSET+4);
+
+    // the dictionary record is not a layer
+    int dict = loadDictionaryFromMemory(p, size, LGC_BASE_OFFSET+8, version);
+
+    // Edited files are read in the order their layer index tells
+    layerIndex idx;
+    int indexed = loadIndexFromMemory(p, size, version, &idx) == 0;
+    if(indexed) img->layers_count = idx.count;
+    else if(!(rwopts&LGC_RW_BODY) && img->layers_count) img->layers_count -= dict;
+
+    if(!img->layers_count || !(rwopts&LGC_RW_BODY)) {
+        freeIndex(&idx);
+        return img;
+    }
+
+    // every record takes a head at least, more of them than that is a corrupted count
+    if(img->layers_count > (size-LGC_BASE_OFFSET-8)/LGC_HEAD_LENGTH) {
+        fprintf(stderr, "%s: layers count is past the buffer's end\n", __FUNCTION__);
+        freeIndex(&idx);
+        free(img);
+        return NULL;
+    }
+
+    // layers are read aside, shared and base ones being looked at by the later ones
+    fullLayer *read = calloc(img->layers_count, sizeof(fullLayer));
+
+    // Record offset (or blob key) of a payload to the layer having it decoded
+    offsetMap decoded;
+    mapInit(&decoded, 16);
+
+    uint64_t pos = LGC_BASE_OFFSET+8;
+    uint32_t records = img->layers_count;
+    uint32_t i, n = 0;
+    for(i = 0; i < records; ++i) {
+
+        if(indexed) pos = idx.entries[i];
+
+        fullLayer *layer = &read[n];
+        layerExt ext;
+
+        if(memHead(p, size, pos, version, layer, &ext)) {
+            memset(layer, 0, sizeof(fullLayer));
+
+            // without index, place of the next record is lost along with this one
+            if(!indexed) {
+                fprintf(stderr, "%s: warning — corrupted layer %u, the rest is not read\n",
+                        __FUNCTION__, n);
+                break;
+            }
+
+            fprintf(stderr, "%s: warning — corrupted layer %u is left blank\n", __FUNCTION__, n);
+            n++;
+            continue;
+        }
+
+        uint64_t record = pos;
+        pos += (uint64_t)ext.head_len+ext.len;
+
+        if(ext.flags&(LGC_LAYER_DELETED|LGC_LAYER_HIDDEN)) continue;
+
+        attachPalette(layer, &ext);
+        uint64_t source = ext.blob? ext.blob|1ULL<<63: ext.ref? ext.ref: record;
+        uint32_t k;
+
+        if(!mapGet(&decoded, source, &k)) {
+            copyLayerData(&read[k], layer, rwopts);
+        }
+        else if(ext.delta_base && !mapGet(&decoded, ext.delta_base, &k) &&
+            !memDeltaOnBase(p, size, record, layer, &ext, &read[k], rwopts)) {
+            // made from the base decoded just before, rather than from the whole chain
+        }
+        else if(memLayerBody(p, size, record, layer, &ext, 0, rwopts)) {
+            // the layer keeps it's place, so that numbers of the others match the file
+            fprintf(stderr, "%s: warning — corrupted layer %u is left without pixels\n",
+                    __FUNCTION__, n);
+            layer->data = NULL;
+            layer->length = 0;
+        }
+        else if(ext.flags&LGC_LAYER_SHARED || ext.ref || ext.blob) {
+            mapPut(&decoded, source, n);
+        }
+
+        n++;
+
+    }
+
+    mapFree(&decoded);
+    img->layers_count = n;
+    freeIndex(&idx);
+
+    img->layers = malloc(sizeof(lgcLayer)*(n? n: 1));
+    for(i = 0; i < n; ++i)
+        storeLayer(&read[i], &img->layers[i]);
+    free(read);
+
+    return img;
+
+}
+
+/*  Reads single layer (or it's reduced-resolution level) of the LGC file
+    in 'buf', like lgcReadLayerLevel() does with a file. */
+lgcLayer * memReadLayer(const void *buf, size_t size, int rwopts, uint32_t layer_n, uint8_t level) {
+
+    if(!(rwopts&LGC_RW_ENTRIE)) return NULL;
+
+    const uint8_t *p = buf;
+    int version = !buf || size < LGC_BASE_OFFSET+8? 0: checkMagic(getLE32(p+LGC_BASE_OFFSET));
+    if(!version) {
+        fprintf(stderr, "%s: bad magic number\n", __FUNCTION__);
+        return NULL;
+    }
+
+    fullLayer layer;
+    layerExt ext;
+    uint64_t pos = LGC_BASE_OFFSET+8;
+    int r = 1;
+    memset(&layer, 0, sizeof(fullLayer));
+
+    loadDictionaryFromMemory(p, size, pos, version);
+
+    // Edited files are read in the order their layer index tells
+    layerIndex idx;
+    if(!loadIndexFromMemory(p, size, version, &idx)) {
+        if(layer_n < idx.count) {
+            pos = idx.entries[layer_n];
+            r = memHead(p, size, pos, version, &layer, &ext)? -1: 0;
+        }
+        freeIndex(&idx);
+    }
+    else {
+        uint32_t records = getLE32(p+LGC_BASE_OFFSET+4), i, n = 0;
+        for(i = 0; i < records; ++i, pos += (uint64_t)ext.head_len+ext.len) {
+            if(memHead(p, size, pos, version, &layer, &ext)) {
+                r = -1;
+                break;
+            }
+            if(!(ext.flags&(LGC_LAYER_DELETED|LGC_LAYER_HIDDEN)) && n++ == layer_n) {
+                r = 0;
+                break;
+            }
+        }
+    }
+
+    if(!r) {
+        attachPalette(&layer, &ext);
+        r = memLayerBody(p, size, pos, &layer, &ext, level, rwopts);
+    }
+
+    if(r) {
+        if(r > 0)
+            fprintf(stderr, "%s: layer %u or it's level %u does not exist in image\n",
+                    __FUNCTION__, layer_n, level);
+        else
+            fprintf(stderr, "%s: read error\n", __FUNCTION__);
+
+        free(layer.palette);
+        return NULL;
+    }
+
+    return newLayer(&layer);
+
+}
+
+// Copies the record to 'p', returns where the next one goes
+static uint8_t * copyRecord(uint8_t *p, layerRecord *rec) {
+
+    memcpy(p, rec->head, rec->head_len);
+    p += rec->head_len;
+
+    int k;
+    for(k = 0; k < rec->parts_count; ++k) {
+        memcpy(p, rec->parts[k], rec->part_len[k]);
+        p += rec->part_len[k];
+    }
+
+    return p;
+
+}
+
+int lgcWriteImageToBuffer(lgcImage *image, int rwopts, void ** buf, size_t * size) {
+
+    if(!image || !buf || !size) {
+        fprintf(stderr, "%s: NULL in arguments\n", __FUNCTION__);
+        return -1;
+    }
+
+    *buf = NULL;
+    *size = 0;
+
+    if(!(rwopts&LGC_RW_ENTRIE)) return 0;
+
+    if(!magicVersion(image->magic)) {
+        fprintf(stderr, "%s: 'image' is not a LGC?\n", __FUNCTION__);
+        return -1;
+    }
+
+    uint32_t count = rwopts&LGC_RW_BODY? image->layers_count: 0, i;
+    layerRecord *recs = malloc(sizeof(layerRecord)*(count+1));
+
+    // Everything is packed first, for the buffer to be allocated once
+    writePlan plan;
+    planLayers(&plan, image, rwopts, 1);
+
+    int ret = 0;
+    uint64_t total = LGC_BASE_OFFSET+8;
+
+    layerRecord dict_rec;
+    const lz4Dict *dict = storedDictionary(rwopts, image);
+    if(dict) {
+        packDictionary(dict, &dict_rec);
+        total += RECORD_SIZE(&dict_rec);
+    }
+
+    for(i = 0; i < count; ++i) {
+        if(packPlanned(&plan, i, total, &recs[i])) {
+            ret = -1;
+            freeRecord(&recs[i]);
+            break;
+        }
+        total += RECORD_SIZE(&recs[i]);
+    }
+
+    freePlan(&plan);
+
+    uint8_t *out = NULL;
+    if(!ret && (total > SIZE_MAX || !(out = malloc(total)))) ret = -1;
+
+    if(!ret) {
+        memcpy(out, image->unused, LGC_BASE_OFFSET);
+        putLE32(out+LGC_BASE_OFFSET, writtenMagic(rwopts, image));
+        putLE32(out+LGC_BASE_OFFSET+4, image->layers_count+(dict? 1: 0));
+
+        uint8_t *p = out+LGC_BASE_OFFSET+8;
+        if(dict) p = copyRecord(p, &dict_rec);
+        for(i = 0; i < count; ++i)
+            p = copyRecord(p, &recs[i]);
+
+        *buf = out;
+        *size = total;
+    }
+    else fprintf(stderr, "%s: write error\n", __FUNCTION__);
+
+    // the failed one is freed already
+    uint32_t packed = i < count? i: count;
+    for(i = 0; i < packed; ++i)
+        freeRecord(&recs[i]);
+    free(recs);
+
+    return ret;
+
+}
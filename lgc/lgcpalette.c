@@ -0,0 +1,602 @@
+/**
+
+    lgcpalette.c
+    Indexed layers (LGC_FMT_INDEXED): exact palettes of layers with
+    few colors, quantization of the others (median cut refined with
+    k-means), nearest entry search and expansion back to RGBA
+
+    This software comes under the terms of MIT License.
+
+**/
+
+#include "lgcpriv.h"
+
+#include <malloc.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#define PALETTE_MAX_THREADS 64
+#define PALETTE_SAMPLES (1<<16)     // pixels the palette is built from
+#define PALETTE_KMEANS_PASSES 6
+#define PALETTE_TASK_PIXELS (1<<16)
+
+/* -- common -- */
+
+// Bytes per pixel of layers which can be indexed (8-bit RGB or RGBA), 0 for others
+static int sourceBpp(uint8_t format) {
+
+    switch(format&~LGC_FMT_COMPRESSED) {
+        case LGC_FMT_RGB8: return 3;
+        case LGC_FMT_RGBA8: return 4;
+    }
+
+    return 0;
+
+}
+
+// Pixel as RGBA bytes in an uint32, in memory order
+static inline uint32_t loadPixel(const uint8_t *p, int bpp) {
+
+    uint32_t v;
+    if(bpp == 4) memcpy(&v, p, 4);
+    else {
+        uint8_t c[4] = {p[0], p[1], p[2], 255};
+        memcpy(&v, c, 4);
+    }
+    return v;
+
+}
+
+// Gives the layer which head was just read a copy of it's palette, if it has one
+void attachPalette(fullLayer *layer, const layerExt *ext) {
+
+    layer->palette = NULL;
+    layer->colors = 0;
+    if(!ext->colors) return;
+
+    layer->palette = malloc(4*ext->colors);
+    memcpy(layer->palette, ext->palette, 4*ext->colors);
+    layer->colors = ext->colors;
+
+}
+
+/* -- expansion -- */
+
+// Looks up 'n' indices in the palette, giving RGBA pixels
+void expandPalette(const uint8_t *indices, uint64_t n, const uint8_t *palette, uint16_t colors,
+                   uint8_t *rgba) {
+
+    // indices past the palette's end are transparent
+    uint32_t table[256];
+    memset(table, 0, sizeof(table));
+    memcpy(table, palette, 4*(colors > 256? 256: colors));
+
+    uint64_t i = 0;
+#ifdef __AVX2__
+    for(; i+8 <= n; i += 8) {
+        __m256i idx = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(indices+i)));
+        _mm256_storeu_si256((__m256i*)(rgba+4*i), _mm256_i32gather_epi32((const int*)table, idx, 4));
+    }
+#endif
+    for(; i < n; ++i)
+        memcpy(rgba+4*i, &table[indices[i]], 4);
+
+}
+
+void * lgcExpandPalette(const lgcLayer *layer) {
+
+    if(!layer || !layer->data || !isIndexed(layer->format)) {
+        fprintf(stderr, "%s: not an indexed layer or no pixels\n", __FUNCTION__);
+        return NULL;
+    }
+
+    fullLayer full;
+    loadLayer(layer, &full);
+
+    uint64_t n = (uint64_t)full.w*full.h;
+    uint8_t *rgba = malloc(n? 4*n: 1);
+    if(!rgba) {
+        fprintf(stderr, "%s: can't allocate memory\n", __FUNCTION__);
+        return NULL;
+    }
+
+    expandPalette(full.data, n, full.palette, full.colors, rgba);
+    return rgba;
+
+}
+
+/* -- nearest entry search -- */
+
+/*  Palette laid out for the search: entries as (R, G) and (B, A)
+    pairs of int16, padded to a multiple of 4 with copies of the
+    first one (ties go to the lower index, so copies are never chosen) */
+typedef struct {
+
+    int16_t         rg[2*LGC_PALETTE_MAX];
+    int16_t         ba[2*LGC_PALETTE_MAX];
+    uint32_t        count, padded;
+
+} searchPalette;
+
+static void prepareSearch(searchPalette *s, const uint8_t *palette, uint32_t colors) {
+
+    uint32_t i;
+    s->count = colors;
+    s->padded = (colors+3)&~3u;
+
+    for(i = 0; i < s->padded; ++i) {
+        const uint8_t *c = palette+4*(i < colors? i: 0);
+        s->rg[2*i] = c[0];
+        s->rg[2*i+1] = c[1];
+        s->ba[2*i] = c[2];
+        s->ba[2*i+1] = c[3];
+    }
+
+}
+
+// Index of the entry nearest to the pixel (squared RGBA distance)
+static inline uint32_t nearestEntry(const searchPalette *s, uint32_t pixel) {
+
+    uint8_t c[4];
+    memcpy(c, &pixel, 4);
+    uint32_t i;
+
+#ifdef __SSE2__
+    // four entries at a time, distances are at most 4*255^2
+    __m128i prg = _mm_set1_epi32(c[0]|c[1]<<16), pba = _mm_set1_epi32(c[2]|c[3]<<16);
+    __m128i best = _mm_set1_epi32(0x7fffffff), best_i = _mm_setzero_si128();
+    __m128i idx = _mm_setr_epi32(0, 1, 2, 3), four = _mm_set1_epi32(4);
+
+    for(i = 0; i < s->padded; i += 4) {
+        __m128i drg = _mm_sub_epi16(prg, _mm_loadu_si128((const __m128i*)(s->rg+2*i)));
+        __m128i dba = _mm_sub_epi16(pba, _mm_loadu_si128((const __m128i*)(s->ba+2*i)));
+        __m128i d = _mm_add_epi32(_mm_madd_epi16(drg, drg), _mm_madd_epi16(dba, dba));
+
+        __m128i closer = _mm_cmplt_epi32(d, best);
+        best = _mm_or_si128(_mm_and_si128(closer, d), _mm_andnot_si128(closer, best));
+        best_i = _mm_or_si128(_mm_and_si128(closer, idx), _mm_andnot_si128(closer, best_i));
+        idx = _mm_add_epi32(idx, four);
+    }
+
+    int32_t d[4], n[4];
+    _mm_storeu_si128((__m128i*)d, best);
+    _mm_storeu_si128((__m128i*)n, best_i);
+
+    uint32_t found = n[0];
+    int32_t least = d[0];
+    for(i = 1; i < 4; ++i)
+        if(d[i] < least || (d[i] == least && (uint32_t)n[i] < found)) {
+            least = d[i];
+            found = n[i];
+        }
+
+    return found;
+#else
+    uint32_t found = 0;
+    int32_t least = 0x7fffffff;
+
+    for(i = 0; i < s->count; ++i) {
+        int dr = c[0]-s->rg[2*i], dg = c[1]-s->rg[2*i+1];
+        int db = c[2]-s->ba[2*i], da = c[3]-s->ba[2*i+1];
+        int32_t d = dr*dr+dg*dg+db*db+da*da;
+        if(d < least) {
+            least = d;
+            found = i;
+        }
+    }
+
+    return found;
+#endif
+
+}
+
+typedef struct {
+
+    const uint8_t *         pixels;
+    uint64_t                count;      // of pixels
+    int                     bpp;
+    const searchPalette *   search;
+    int                     clear;      // fully transparent pixels go to entry 0
+    uint8_t *               out;
+    uint64_t                tasks;
+    uint64_t                task_len;   // pixels per task
+    uint64_t                next;       // next task to take, atomic
+
+} mapQueue;
+
+static void * mapWorker(void *arg) {
+
+    mapQueue *q = arg;
+
+    for(;;) {
+        uint64_t t = __atomic_fetch_add(&q->next, 1, __ATOMIC_RELAXED);
+        if(t >= q->tasks) break;
+
+        uint64_t i = t*q->task_len, end = i+q->task_len;
+        if(end > q->count) end = q->count;
+
+        // flat artwork has long runs of one color
+        uint32_t last = 0, last_i = q->clear? 0: nearestEntry(q->search, 0);
+        for(; i < end; ++i) {
+            uint32_t pixel = loadPixel(q->pixels+i*q->bpp, q->bpp);
+            if(pixel != last) {
+                last = pixel;
+                last_i = q->clear && !((uint8_t*)&pixel)[3]? 0: nearestEntry(q->search, pixel);
+            }
+            q->out[i] = last_i;
+        }
+    }
+
+    return NULL;
+
+}
+
+/*  Maps 'n' pixels (bpp 3 or 4) to indices of the nearest palette entries,
+    spans of them being shared between threads. With 'clear', fully
+    transparent pixels are mapped to entry 0. */
+static void mapPixels(const uint8_t *pixels, uint64_t n, int bpp, const uint8_t *palette,
+                      uint16_t colors, int clear, uint8_t *out, int threads) {
+
+    searchPalette s;
+    prepareSearch(&s, palette, colors);
+
+    mapQueue q = {pixels, n, bpp, &s, clear, out, 0, 0, 0};
+    q.task_len = PALETTE_TASK_PIXELS;
+    q.tasks = (n+q.task_len-1)/q.task_len;
+    if(!q.tasks) return;
+
+    if(threads <= 0) threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if(threads > PALETTE_MAX_THREADS) threads = PALETTE_MAX_THREADS;
+    if((uint64_t)threads > q.tasks) threads = q.tasks;
+
+    // the calling thread is one of the workers
+    pthread_t workers[PALETTE_MAX_THREADS];
+    int started = 0, t;
+    while(started+1 < threads && !pthread_create(&workers[started], NULL, mapWorker, &q))
+        started++;
+
+    mapWorker(&q);
+
+    for(t = 0; t < started; ++t)
+        pthread_join(workers[t], NULL);
+
+}
+
+// Maps 'n' RGBA pixels to indices of the nearest palette entries
+void mapToPalette(const uint8_t *rgba, uint64_t n, const uint8_t *palette, uint16_t colors,
+                  uint8_t *indices) {
+    mapPixels(rgba, n, 4, palette, colors, 0, indices, 1);
+}
+
+/* -- exact palettes -- */
+
+/*  Indices of 'n' pixels in a palette of their own colors, when there
+    are 'max' of them at most; fully transparent black is made entry 0.
+    Returns number of colors, 0 if there are more. */
+static uint32_t exactPalette(const uint8_t *pixels, uint64_t n, int bpp, uint32_t max,
+                             uint8_t *palette, uint8_t *indices) {
+
+    // open addressing, twice the palette in slots
+    uint32_t keys[2*LGC_PALETTE_MAX];
+    int16_t slots[2*LGC_PALETTE_MAX];
+    memset(slots, 0xff, sizeof(slots));
+
+    uint32_t colors = 0, last = 0, last_i = 0;
+    int have_last = 0;
+    uint64_t i;
+
+    for(i = 0; i < n; ++i) {
+        uint32_t pixel = loadPixel(pixels+i*bpp, bpp);
+        if(!have_last || pixel != last) {
+            uint32_t h = (pixel*0x9e3779b1u)>>23;
+            while(slots[h] >= 0 && keys[h] != pixel)
+                h = (h+1)&(2*LGC_PALETTE_MAX-1);
+
+            if(slots[h] < 0) {
+                if(colors == max) return 0;
+                keys[h] = pixel;
+                slots[h] = colors;
+                memcpy(palette+4*colors++, &pixel, 4);
+            }
+
+            last = pixel;
+            last_i = slots[h];
+            have_last = 1;
+        }
+        indices[i] = last_i;
+    }
+
+    // sparse form takes zero indices for empty pixels
+    uint32_t zero = 0, z;
+    for(z = 0; z < colors && memcmp(palette+4*z, &zero, 4); ++z);
+    if(z && z < colors) {
+        uint8_t remap[256];
+        for(i = 0; i < 256; ++i)
+            remap[i] = i;
+        remap[0] = z;
+        remap[z] = 0;
+
+        memcpy(palette+4*z, palette, 4);
+        memset(palette, 0, 4);
+        for(i = 0; i < n; ++i)
+            indices[i] = remap[indices[i]];
+    }
+
+    return colors;
+
+}
+
+/*  Fills 'view' with the layer indexed, when it has LGC_PALETTE_MAX colors
+    at most. Returns the buffer of the view's indices and palette, to be
+    freed by the caller, or NULL if the layer is left as it is. */
+void * indexLayer(const fullLayer *layer, fullLayer *view) {
+
+    memcpy(view, layer, sizeof(fullLayer));
+
+    int bpp = sourceBpp(layer->format);
+    uint64_t n = (uint64_t)layer->w*layer->h;
+    if(!bpp || !layer->data || !n) return NULL;
+
+    // indices, then the palette
+    uint8_t *buf = malloc(n+4*LGC_PALETTE_MAX);
+    if(!buf) return NULL;
+
+    uint32_t colors = exactPalette(layer->data, n, bpp, LGC_PALETTE_MAX, buf+n, buf);
+    if(!colors) {
+        free(buf);
+        return NULL;
+    }
+
+    view->format = LGC_FMT_INDEXED8|(layer->format&LGC_FMT_COMPRESSED);
+    view->data = buf;
+    view->length = n;
+    view->palette = buf+n;
+    view->colors = colors;
+    view->refs = NULL;
+
+    return buf;
+
+}
+
+/* -- quantization -- */
+
+// Box of the median cut: samples [first, last) of the array
+typedef struct {
+
+    uint32_t        first, last;
+    uint8_t         axis;       // channel of the widest range
+    uint8_t         range;
+
+} cutBox;
+
+static void measureBox(const uint8_t (*samples)[4], cutBox *box) {
+
+    uint8_t lo[4] = {255, 255, 255, 255}, hi[4] = {0, 0, 0, 0};
+    uint32_t i;
+    int c;
+
+    for(i = box->first; i < box->last; ++i)
+        for(c = 0; c < 4; ++c) {
+            if(samples[i][c] < lo[c]) lo[c] = samples[i][c];
+            if(samples[i][c] > hi[c]) hi[c] = samples[i][c];
+        }
+
+    box->range = 0;
+    box->axis = 0;
+    for(c = 0; c < 4; ++c)
+        if(hi[c] >= lo[c] && hi[c]-lo[c] > box->range) {
+            box->range = hi[c]-lo[c];
+            box->axis = c;
+        }
+
+}
+
+// Orders samples of the box along it's axis (counting sort, values are bytes)
+static void sortBox(uint8_t (*samples)[4], uint8_t (*tmp)[4], const cutBox *box) {
+
+    uint32_t counts[257], i;
+    memset(counts, 0, sizeof(counts));
+
+    for(i = box->first; i < box->last; ++i)
+        counts[samples[i][box->axis]+1]++;
+    for(i = 1; i < 257; ++i)
+        counts[i] += counts[i-1];
+
+    for(i = box->first; i < box->last; ++i)
+        memcpy(tmp[counts[samples[i][box->axis]]++], samples[i], 4);
+    memcpy(samples+box->first, tmp, 4*(size_t)(box->last-box->first));
+
+}
+
+/*  Median cut of the samples into 'colors' boxes at most, the palette
+    being their means. Returns number of entries made. */
+static uint32_t medianCut(uint8_t (*samples)[4], uint32_t n, uint32_t colors, uint8_t *palette) {
+
+    cutBox boxes[LGC_PALETTE_MAX];
+    uint8_t (*tmp)[4] = malloc(4*(size_t)n);
+    uint32_t count = 1, i;
+
+    boxes[0].first = 0;
+    boxes[0].last = n;
+    measureBox((const uint8_t (*)[4])samples, &boxes[0]);
+
+    // the box to split: widest range, weighted by samples in it
+    while(count < colors) {
+        uint32_t b = count;
+        uint64_t most = 0;
+        for(i = 0; i < count; ++i) {
+            uint64_t weight = (uint64_t)boxes[i].range*(boxes[i].last-boxes[i].first);
+            if(boxes[i].last-boxes[i].first > 1 && weight > most) {
+                most = weight;
+                b = i;
+            }
+        }
+        if(b == count) break;
+
+        cutBox *box = &boxes[b];
+        sortBox(samples, tmp, box);
+
+        uint32_t mid = box->first+(box->last-box->first)/2;
+        boxes[count].first = mid;
+        boxes[count].last = box->last;
+        box->last = mid;
+        measureBox((const uint8_t (*)[4])samples, box);
+        measureBox((const uint8_t (*)[4])samples, &boxes[count]);
+        count++;
+    }
+
+    for(i = 0; i < count; ++i) {
+        uint64_t sum[4] = {0, 0, 0, 0};
+        uint32_t k, len = boxes[i].last-boxes[i].first;
+        int c;
+        for(k = boxes[i].first; k < boxes[i].last; ++k)
+            for(c = 0; c < 4; ++c)
+                sum[c] += samples[k][c];
+        for(c = 0; c < 4; ++c)
+            palette[4*i+c] = (sum[c]+len/2)/len;
+    }
+
+    free(tmp);
+    return count;
+
+}
+
+// Moves every entry to the mean of the samples nearest to it (Lloyd's iterations)
+static void refinePalette(const uint8_t (*samples)[4], uint32_t n, uint8_t *palette,
+                          uint32_t colors) {
+
+    uint64_t (*sum)[5] = malloc(sizeof(*sum)*colors);
+    searchPalette s;
+    int pass, c;
+    uint32_t i;
+
+    for(pass = 0; pass < PALETTE_KMEANS_PASSES; ++pass) {
+        prepareSearch(&s, palette, colors);
+        memset(sum, 0, sizeof(*sum)*colors);
+
+        for(i = 0; i < n; ++i) {
+            uint32_t pixel;
+            memcpy(&pixel, samples[i], 4);
+            uint32_t e = nearestEntry(&s, pixel);
+            for(c = 0; c < 4; ++c)
+                sum[e][c] += samples[i][c];
+            sum[e][4]++;
+        }
+
+        // entries no sample is near to stay where they are
+        int moved = 0;
+        for(i = 0; i < colors; ++i) {
+            if(!sum[i][4]) continue;
+            for(c = 0; c < 4; ++c) {
+                uint8_t v = (sum[i][c]+sum[i][4]/2)/sum[i][4];
+                moved |= v != palette[4*i+c];
+                palette[4*i+c] = v;
+            }
+        }
+        if(!moved) break;
+    }
+
+    free(sum);
+
+}
+
+int lgcQuantizeLayer(lgcLayer *layer, uint16_t colors, int threads) {
+
+    fullLayer full;
+    if(layer) loadLayer(layer, &full);
+
+    if(!layer || !full.data || !full.w || !full.h) {
+        fprintf(stderr, "%s: layer has no pixels\n", __FUNCTION__);
+        return -1;
+    }
+
+    int bpp = sourceBpp(full.format);
+    if(!bpp) {
+        fprintf(stderr, "%s: only 8-bit RGB and RGBA layers can be quantized\n", __FUNCTION__);
+        return -1;
+    }
+
+    if(!colors || colors > LGC_PALETTE_MAX) {
+        fprintf(stderr, "%s: palette must have 1 to %u colors\n", __FUNCTION__, LGC_PALETTE_MAX);
+        return -1;
+    }
+
+    uint64_t n = (uint64_t)full.w*full.h, i;
+    uint8_t *indices = malloc(n? n: 1);
+    uint8_t *palette = malloc(4*LGC_PALETTE_MAX);
+    if(!indices || !palette) {
+        fprintf(stderr, "%s: can't allocate memory\n", __FUNCTION__);
+        free(indices);
+        free(palette);
+        return -1;
+    }
+
+    const uint8_t *pixels = full.data;
+    uint32_t used = exactPalette(pixels, n, bpp, colors, palette, indices);
+
+    // Too many colors: the palette is built from a sample of the pixels,
+    // fully transparent ones keep entry 0 to themselves
+    if(!used) {
+        uint8_t (*samples)[4] = malloc(4*(size_t)(n < PALETTE_SAMPLES? n: PALETTE_SAMPLES));
+        if(!samples) {
+            fprintf(stderr, "%s: can't allocate memory\n", __FUNCTION__);
+            free(indices);
+            free(palette);
+            return -1;
+        }
+
+        uint64_t step = n/PALETTE_SAMPLES+1;
+        uint32_t count = 0;
+        int clear = 0;
+
+        for(i = 0; i < n; i += step) {
+            uint32_t pixel = loadPixel(pixels+i*bpp, bpp);
+            memcpy(samples[count], &pixel, 4);
+            if(samples[count][3]) count++;
+            else clear = 1;
+        }
+
+        // mostly transparent layers may leave no sample, their colors are seen anyway
+        for(i = 0; !count && i < n; ++i) {
+            uint32_t pixel = loadPixel(pixels+i*bpp, bpp);
+            if(((uint8_t*)&pixel)[3]) {
+                memcpy(samples[0], &pixel, 4);
+                count = 1;
+            }
+        }
+
+        if(clear && colors == 1) count = 0;
+        uint8_t *entries = palette+4*clear;
+        used = count? medianCut(samples, count, colors-clear, entries): 0;
+        if(used) refinePalette((const uint8_t (*)[4])samples, count, entries, used);
+        free(samples);
+
+        if(clear) memset(palette, 0, 4);
+        used += clear;
+        mapPixels(pixels, n, bpp, palette, used, clear, indices, threads);
+    }
+
+    // old pixels go the way lgcDestroyLayer() takes them, shared ones stay with the others
+    lgcDestroyLayer(layer, 0);
+
+    full.data = indices;
+    full.length = n;
+    full.format = LGC_FMT_INDEXED8|(full.format&LGC_FMT_COMPRESSED);
+    full.palette = realloc(palette, 4*used);
+    full.colors = used;
+    full.refs = NULL;
+    full.borrowed = 0;
+    storeLayer(&full, layer);
+
+    return 0;
+
+}
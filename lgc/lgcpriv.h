@@ -0,0 +1,317 @@
+#ifndef LGCPRIV_H_
+#define LGCPRIV_H_
+
+/* lgcpriv.h
+   Internals shared between the library's source files,
+   not a part of the API. */
+
+#include "lgc.h"
+
+#include <stdio.h>
+#include <sys/types.h>
+
+#define LGC_HEAD_LENGTH 21          // layer head on disk, without extension
+#define LGC_WIDE_HEAD_LENGTH 29     // same, with LGC_LAYER_WIDE
+#define LGC_RECORD_HEAD_MAX 1440    // head with the largest extension block we write
+
+// Length of the layer head with it's raw 'flags' (without extension)
+#define HEAD_LENGTH(flags) ((flags)&LGC_LAYER_WIDE? LGC_WIDE_HEAD_LENGTH: LGC_HEAD_LENGTH)
+
+#define LGC_EXT_MAX (1<<24)         // larger extension blocks are taken for corruption
+#define LGC_IO_BUFFER_SIZE (1<<18)  // stdio buffer of files read or written through
+
+#define LGC_PACK_DICT 0x40000000        // packRecord(): compress against the writer's dictionary
+#define LGC_RW_DICT_ELSEWHERE 0x40000000 // rwopts: LGC_RW_DICT, the dictionary is stored by the caller
+
+/* Little-endian fields of on-disk structures; compilers turn
+   these into plain loads and stores on little-endian CPUs */
+static inline uint16_t getLE16(const uint8_t *p) {
+    return p[0]|p[1]<<8;
+}
+
+static inline uint32_t getLE32(const uint8_t *p) {
+    return p[0]|p[1]<<8|p[2]<<16|(uint32_t)p[3]<<24;
+}
+
+static inline uint64_t getLE64(const uint8_t *p) {
+    return getLE32(p)|(uint64_t)getLE32(p+4)<<32;
+}
+
+static inline void putLE16(uint8_t *p, uint16_t v) {
+    p[0] = v;
+    p[1] = v>>8;
+}
+
+static inline void putLE32(uint8_t *p, uint32_t v) {
+    p[0] = v;
+    p[1] = v>>8;
+    p[2] = v>>16;
+    p[3] = v>>24;
+}
+
+static inline void putLE64(uint8_t *p, uint64_t v) {
+    putLE32(p, v);
+    putLE32(p+4, v>>32);
+}
+
+// Version of the file with the magic, 0 if it is not a LGC file
+static inline int magicVersion(uint32_t magic) {
+    return magic == LGC_MAGIC? 1: magic == LGC_MAGIC_V2? 2: 0;
+}
+
+#define LGC_STORE_VERSION 2         // records of blob store files and archives are v2 ones
+
+/*  Layer as the library works with it: fields of lgcLayer along with
+    what the library keeps aside of them (see loadLayer()) */
+typedef struct {
+
+    uint32_t        w, h;
+    int32_t         x, y;
+    uint8_t         format;
+    int32_t         flags;
+    uint64_t        length;
+    void *          data;
+
+    uint8_t         levels;     // reduced-resolution levels, to be generated or stored
+    uint8_t *       palette;    // RGBA entries of an indexed layer, NULL for others
+    uint16_t        colors;
+    int *           refs;       // counter of layers sharing 'data', NULL if not shared
+    int             borrowed;   // 'data' is not owned by the layer
+
+} fullLayer;
+
+// Whether the layer may need a wide head: compressed data with levels stays under 4 GiB otherwise
+static inline int isWide(const fullLayer *layer) {
+    return layer->w > 0xffff || layer->h > 0xffff || LGC_LAYER_BODY_LENGTH(layer) > INT32_MAX;
+}
+
+// Whether the layer's pixels are palette indices (see LGC_FMT_INDEXED)
+static inline int isIndexed(uint8_t format) {
+    return (format&~LGC_FMT_COMPRESSED) == LGC_FMT_INDEXED8;
+}
+
+// Whether all-zero pixels of the format are fully transparent (RGBA, not blocks)
+static inline int hasAlpha(uint8_t format) {
+    return (format&~LGC_FMT_COMPRESSED) == (LGC_FMT_RGBA8);
+}
+
+/* Layer head and extension block, as parsed from disk */
+typedef struct {
+
+    uint8_t         version;    // of the file the record is in (see magicVersion())
+    int32_t         flags;      // raw flags, including LGC_LAYER_RESERVED bits
+    uint32_t        head_len;   // head with extension block
+    uint64_t        len;        // whole stored payload length (head's 'length')
+    uint64_t        body_len;   // stored length of the layer's own pixels
+    uint32_t        padding;    // unused bytes at the end of the payload
+    uint8_t         levels;
+    uint64_t        level_len[LGC_MAX_LEVELS];
+    uint64_t        hash;       // content key (LGC_EXT_HASH), 0 if not stored
+    uint64_t        ref;        // offset of the record holding the payload (LGC_EXT_REF)
+    uint64_t        blob;       // blob store key of the payload (LGC_EXT_BLOB)
+    uint8_t         checksums;  // count of LGC_EXT_CHECKSUM values, 0 if not stored
+    uint32_t        checksum[1+LGC_MAX_LEVELS];
+    uint64_t        delta_base; // offset of the base record (LGC_EXT_DELTA), 0 if not a delta
+    uint8_t         delta_mode;
+    uint16_t        delta_box[4];   // x, y, w, h
+    uint32_t        sparse_len; // decoded length of the sparse form (LGC_EXT_SPARSE), 0 if dense
+    uint64_t        dict;       // key of the dictionary LZ4 blocks are compressed against, 0 if none
+    uint16_t        colors;     // entries of the palette (LGC_EXT_PALETTE), 0 if none
+    uint8_t         palette[4*LGC_PALETTE_MAX];
+
+} layerExt;
+
+/* Layer record ready to be written: head with extension block, then payload parts */
+typedef struct {
+
+    fullLayer       layer;      // head fields, 'flags' with library's ones to store
+    uint64_t        hash;
+    uint64_t        ref;
+    uint64_t        blob;
+    uint64_t        delta_base;
+    uint8_t         delta_mode;
+    uint16_t        delta_box[4];
+    uint32_t        sparse_len;
+    uint64_t        dict;
+
+    uint8_t         head[LGC_RECORD_HEAD_MAX];
+    uint32_t        head_len;
+    uint64_t        len;        // payload length, as stored in head
+    uint32_t        padding;
+
+    int             parts_count;
+    void *          parts[1+LGC_MAX_LEVELS];
+    uint64_t        part_len[1+LGC_MAX_LEVELS];
+    uint32_t        checksum[1+LGC_MAX_LEVELS];
+
+    void *          owned[6+3*LGC_MAX_LEVELS];  // buffers to free()
+    int             owned_count;
+
+} layerRecord;
+
+/* LZ4 dictionary, as registered (lgcdict.c) */
+typedef struct {
+
+    uint64_t        key;        // XXH64 of it's bytes, seed 0
+    uint8_t *       data;
+    uint32_t        size;
+    void *          stream;     // LZ4_stream_t with it loaded, copied for every block
+
+} lz4Dict;
+
+/* How image's layers are to be written (see planLayers()) */
+typedef struct {
+
+    lgcImage *      image;
+    fullLayer *     layers;     // image's layers, as loaded
+    int             rwopts;
+    uint64_t *      keys;       // content keys, NULL if not deduplicating
+    uint32_t *      owner;      // first layer with the same content
+    int32_t *       base;       // layer a delta is taken against, -1 if none; NULL if no deltas
+    int64_t *       offsets;    // of shared records; 0 until packed, -1 for others
+    const lz4Dict * dict;       // layers are compressed against it, NULL if not
+
+} writePlan;
+
+/*  Reads up to 'len' bytes at 'offset' of the file 'src' is,
+    returns number of bytes read or -1 on error */
+typedef int64_t (*readAtFunc)(void *src, void *buf, uint64_t len, uint64_t offset);
+
+#define RECORD_SIZE(rec) ((uint64_t)(rec)->head_len+(rec)->len)
+
+/* uint64 to uint32 map (lgchash.c) */
+typedef struct {
+
+    uint64_t *      keys;
+    uint32_t *      values;
+    uint32_t        cap;
+    uint32_t        count;
+
+} offsetMap;
+
+/* Layer index of an edited file (see lgc.h) */
+typedef struct {
+
+    int             version;    // of the file
+    uint64_t        offset;     // of the index record, 0 if it is not stored
+    uint32_t        size;       // whole index record size on disk
+    uint32_t        count;
+    uint32_t        free_count;
+    uint64_t *      entries;    // offsets of layer records, in layers order
+    uint64_t *      free;       // (offset, size) pairs of deleted records
+
+} layerIndex;
+
+// lgc.c
+extern FILE * openFile(const char *filename, const char *mode);
+extern int checkMagic(uint32_t magic);
+extern uint32_t packHead(uint8_t *buf, const fullLayer *layer, int32_t flags, uint64_t len);
+extern uint64_t unpackHead(const uint8_t *buf, fullLayer *layer);
+extern int checkHead(FILE *file, uint32_t *layers_c, int *version);
+extern int upgradeHead(FILE *file);
+extern int parseHead(const uint8_t *buf, uint32_t size, int version, fullLayer *layer, layerExt *ext);
+extern int readHead(FILE *f, int version, fullLayer *layer, layerExt *ext);
+extern int skipLayer(FILE *f, int version);
+extern int unpackLZ4(const void *src, uint64_t len, void *dst, uint64_t size, uint64_t dict);
+extern void * decodeStored(const void *stored, uint64_t len, uint8_t format, uint64_t size,
+                           uint32_t sparse, uint64_t dict, const uint32_t *checksum);
+extern void * decodeBody(void *stored, uint64_t len, uint8_t format, uint64_t size, uint32_t sparse,
+                         uint64_t dict, const uint32_t *checksum);
+extern void * readBody(FILE *f, uint64_t len, uint8_t format, uint64_t size, uint32_t sparse,
+                       uint64_t dict, const uint32_t *checksum);
+extern int blobPath(uint64_t key, char *path, size_t size);
+extern int adoptPayload(fullLayer *layer, layerExt *ext, fullLayer *owner, layerExt *owner_ext);
+extern FILE * openPayload(FILE *f, fullLayer *layer, layerExt *ext);
+extern int selectLevel(fullLayer *layer, layerExt *ext, uint8_t level, uint64_t *offset, uint64_t *len);
+extern int readLayerBody(FILE *f, fullLayer *layer, layerExt *ext, int rwopts);
+extern int readLayer(FILE *f, int version, fullLayer *layer, int only_head);
+extern void copyLayerData(fullLayer *owner, fullLayer *layer, int rwopts);
+
+extern void * packBody(void *pixels, uint64_t size, uint8_t format, const lz4Dict *dict,
+                       uint64_t *len);
+extern void encodeHead(layerRecord *rec, int64_t pad);
+extern int packLayer(fullLayer *layer, int32_t flags, layerRecord *rec);
+extern int packRecord(fullLayer *layer, int32_t flags, void *pixels, uint64_t len, int sparse,
+                      layerRecord *rec);
+extern void packRef(fullLayer *layer, uint64_t key, uint64_t ref, uint64_t blob, layerRecord *rec);
+extern int padRecord(layerRecord *rec, uint64_t size);
+extern int writeRecord(FILE *f, layerRecord *rec);
+extern void freeRecord(layerRecord *rec);
+extern int writeLayer(FILE *f, fullLayer *layer);
+extern void planLayers(writePlan *plan, lgcImage *image, int rwopts, int dedup);
+extern int packPlanned(writePlan *plan, uint32_t i, uint64_t pos, layerRecord *rec);
+extern const lz4Dict * storedDictionary(int rwopts, lgcImage *image);
+extern uint32_t writtenMagic(int rwopts, lgcImage *image);
+extern void freePlan(writePlan *plan);
+
+// lgcstate.c
+extern void loadLayer(const lgcLayer *layer, fullLayer *full);
+extern void storeLayer(fullLayer *full, lgcLayer *layer);
+extern lgcLayer * newLayer(fullLayer *full);
+extern void dropLayer(const lgcLayer *layer);
+extern void moveLayer(const lgcLayer *from, lgcLayer *to);
+extern lgcLayer * resizeLayers(lgcLayer *layers, uint32_t count, uint32_t new_count);
+
+// lgchash.c
+extern uint64_t hash64(const void *data, size_t len, uint64_t seed);
+extern uint64_t layerKey(fullLayer *layer);
+extern uint32_t crc32c(uint32_t crc, const void *data, size_t len);
+
+extern void mapInit(offsetMap *map, uint32_t expected);
+extern void mapPut(offsetMap *map, uint64_t key, uint32_t value);
+extern int mapGet(offsetMap *map, uint64_t key, uint32_t *value);
+extern void mapFree(offsetMap *map);
+
+// lgcdict.c
+extern const lz4Dict * findDictionary(uint64_t key);
+extern int loadDictionary(FILE *f, int version);
+extern int loadDictionaryFromMemory(const uint8_t *buf, size_t size, uint64_t pos, int version);
+extern const lz4Dict * writerDictionary(int rwopts);
+extern int compressWithDictionary(const lz4Dict *dict, const char *src, char *dst, int len, int cap);
+extern void packDictionary(const lz4Dict *dict, layerRecord *rec);
+
+// lgcdelta.c
+extern int packDelta(fullLayer *layer, fullLayer *base, uint64_t base_offset, int32_t flags,
+                     layerRecord *rec);
+extern void * deltaOnBase(const void *base, fullLayer *layer, layerExt *ext, const void *stored,
+                          const uint32_t *checksum);
+extern void * decodeDeltaChain(readAtFunc read_at, void *src, fullLayer *layer, layerExt *ext,
+                               uint64_t record, int rwopts);
+extern int64_t fileReadAt(void *f, void *buf, uint64_t len, uint64_t offset);
+extern int64_t fdReadAt(void *fd, void *buf, uint64_t len, uint64_t offset);
+
+// lgcmem.c
+extern lgcLayer * memReadLayer(const void *buf, size_t size, int rwopts, uint32_t layer_n,
+                               uint8_t level);
+
+// lgcfile.c
+extern int preadFull(int fd, void *buf, uint64_t len, uint64_t offset);
+extern int fileLayerHead(lgcFile *file, uint32_t layer_n, fullLayer *layer, layerExt *ext);
+
+// lgcblock.c
+extern int encodeBlocks(const uint8_t *pixels, uint32_t w, uint32_t h, uint8_t src_format,
+                        uint8_t format, uint8_t *out, int threads);
+extern int decodeBlocks(const uint8_t *blocks, uint32_t w, uint32_t h, uint8_t format, uint8_t *rgba);
+
+// lgcpalette.c
+extern void attachPalette(fullLayer *layer, const layerExt *ext);
+extern void * indexLayer(const fullLayer *layer, fullLayer *view);
+extern void expandPalette(const uint8_t *indices, uint64_t n, const uint8_t *palette, uint16_t colors,
+                          uint8_t *rgba);
+extern void mapToPalette(const uint8_t *rgba, uint64_t n, const uint8_t *palette, uint16_t colors,
+                         uint8_t *indices);
+
+// lgcsparse.c
+extern void * trimLayer(fullLayer *layer, fullLayer *view);
+extern int packSparse(fullLayer *layer, int32_t flags, layerRecord *rec);
+extern void * expandSparse(const uint8_t *raw, uint32_t len, uint8_t format, uint64_t size);
+
+// lgcedit.c
+extern int findIndex(FILE *f, int version, layerIndex *idx);
+extern int loadIndex(FILE *f, int version, layerIndex *idx);
+extern int loadIndexFromMemory(const uint8_t *buf, uint64_t size, int version, layerIndex *idx);
+extern void freeIndex(layerIndex *idx);
+extern int seekLayer(FILE *f, uint32_t layer_n, uint32_t *layers_c);
+extern int appendRecord(FILE *f, layerRecord *rec);
+
+#endif // LGCPRIV_H_
@@ -0,0 +1,461 @@
+/**
+
+    lgcresize.c
+    Resampling of layers with separable filters: fixed-point weights,
+    SSE2 passes over bands of rows, bands shared between threads
+
+    This software comes under the terms of MIT License.
+
+**/
+
+#include "lgcpriv.h"
+
+#include <malloc.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define RESIZE_BITS 14                  // fixed-point weights, they sum up to 1<<RESIZE_BITS
+#define RESIZE_BAND_BYTES (1<<18)       // intermediate rows of a band, to stay in cache
+#define RESIZE_BAND_MIN 16              // output rows of a band, not to resample shared input rows too often
+#define RESIZE_THREAD_PIXELS (1<<18)    // output pixels worth starting a thread
+#define RESIZE_MAX_THREADS 64
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+/* Source pixels contributing to each output one along a dimension */
+typedef struct {
+
+    uint32_t *      first;      // first source pixel
+    uint32_t *      count;      // of taps
+    int16_t *       weights;    // 'stride' per output pixel, zero-padded
+    uint32_t        stride;     // even, so that weights can be taken in pairs
+
+} resizeAxis;
+
+typedef struct {
+
+    const uint8_t * src;
+    uint32_t        src_w, src_h;
+    uint8_t *       dst;
+    uint32_t        w, h;
+    int             bpp;
+    resizeAxis      ax, ay;     // 'first' is NULL for a dimension left as it is
+    uint32_t        band;       // output rows per band
+    uint32_t        bands;
+    uint32_t        band_rows;  // input rows needed by a band, at most
+    uint32_t        next;       // next band to take, atomic
+    int             failed;
+
+} resizeQueue;
+
+static double filterSupport(int filter) {
+
+    switch(filter) {
+        case LGC_FILTER_BOX:        return 0.5;
+        case LGC_FILTER_BILINEAR:   return 1.0;
+        case LGC_FILTER_BICUBIC:    return 2.0;
+        case LGC_FILTER_LANCZOS:    return 3.0;
+    }
+
+    return 0;
+
+}
+
+static double sinc(double x) {
+
+    if(x == 0) return 1;
+    x *= M_PI;
+    return sin(x)/x;
+
+}
+
+static double filterWeight(int filter, double x) {
+
+    if(x < 0) x = -x;
+
+    switch(filter) {
+        case LGC_FILTER_BOX:
+            return x <= 0.5? 1: 0;
+
+        case LGC_FILTER_BILINEAR:
+            return x < 1? 1-x: 0;
+
+        case LGC_FILTER_BICUBIC:    // Catmull-Rom, a = -0.5
+            if(x < 1) return (1.5*x-2.5)*x*x+1;
+            if(x < 2) return ((-0.5*x+2.5)*x-4)*x+2;
+            return 0;
+
+        case LGC_FILTER_LANCZOS:
+            return x < 3? sinc(x)*sinc(x/3): 0;
+    }
+
+    return 0;
+
+}
+
+static void freeAxis(resizeAxis *axis) {
+
+    free(axis->first);
+    free(axis->count);
+    free(axis->weights);
+    memset(axis, 0, sizeof(resizeAxis));
+
+}
+
+/*  Computes weights of 'len' source pixels for each of 'out' ones.
+    When downscaling, the filter is stretched to cover all of them.
+    Taps falling out of the source are dropped and the rest renormalized.
+    Returns non-zero on failure. */
+static int buildAxis(resizeAxis *axis, uint32_t len, uint32_t out, int filter) {
+
+    double scale = (double)len/out, stretch = scale > 1? scale: 1;
+    double support = filterSupport(filter)*stretch;
+
+    axis->stride = ((uint32_t)ceil(support)*2+2)&~1u;
+    axis->first = malloc(sizeof(uint32_t)*out);
+    axis->count = malloc(sizeof(uint32_t)*out);
+    axis->weights = calloc((size_t)out*axis->stride, sizeof(int16_t));
+    double *w = malloc(sizeof(double)*axis->stride);
+
+    if(!axis->first || !axis->count || !axis->weights || !w) {
+        free(w);
+        freeAxis(axis);
+        return -1;
+    }
+
+    uint32_t i, k;
+    for(i = 0; i < out; ++i) {
+
+        double center = (i+0.5)*scale;
+        int64_t lo = (int64_t)floor(center-support+0.5), hi = (int64_t)floor(center+support+0.5);
+        if(lo < 0) lo = 0;
+        if(hi > len) hi = len;
+        if(hi-lo > axis->stride) hi = lo+axis->stride;
+
+        uint32_t n = hi > lo? hi-lo: 0;
+        double sum = 0;
+        for(k = 0; k < n; ++k)
+            sum += w[k] = filterWeight(filter, (lo+k+0.5-center)/stretch);
+
+        int16_t *fixed = axis->weights+(size_t)i*axis->stride;
+        if(sum == 0) {
+            // nothing in reach: nearest pixel
+            lo = center < len? (uint32_t)center: len-1;
+            n = 1;
+            w[0] = sum = 1;
+        }
+
+        // rounding errors go to the largest weight, for the sum to be exact
+        int total = 0, largest = 0;
+        for(k = 0; k < n; ++k) {
+            fixed[k] = (int16_t)lrint(w[k]/sum*(1<<RESIZE_BITS));
+            total += fixed[k];
+            if(fixed[k] > fixed[largest]) largest = k;
+        }
+        fixed[largest] += (1<<RESIZE_BITS)-total;
+
+        // zero taps at the ends are of no use
+        uint32_t skip = 0;
+        while(n > 1 && !fixed[n-1]) n--;
+        while(n > 1 && !fixed[skip]) skip++, n--;
+        if(skip) {
+            memmove(fixed, fixed+skip, n*sizeof(int16_t));
+            memset(fixed+n, 0, skip*sizeof(int16_t));
+        }
+
+        axis->first[i] = lo+skip;
+        axis->count[i] = n;
+    }
+
+    free(w);
+    return 0;
+
+}
+
+#ifdef __SSE2__
+static inline __m128i loadPixel(const uint8_t *p, int bpp) {
+
+    uint32_t v = 0;
+    memcpy(&v, p, bpp);
+    return _mm_cvtsi32_si128(v);
+
+}
+
+// Two adjacent weights as one 32-bit lane, for _mm_madd_epi16
+static inline __m128i weightPair(const int16_t *w) {
+
+    return _mm_set1_epi32((uint16_t)w[0]|(uint32_t)(uint16_t)w[1]<<16);
+
+}
+#endif
+
+/*  Horizontal pass: resamples a row of source pixels to 'w' pixels.
+    Bytes of a pixel are the lanes, taps are summed two at a time. */
+static inline void resizeRow(const uint8_t *src, uint8_t *dst, const resizeAxis *axis,
+                             uint32_t w, int bpp) {
+
+    uint32_t x, k;
+    for(x = 0; x < w; ++x, dst += bpp) {
+
+        const uint8_t *p = src+(size_t)axis->first[x]*bpp;
+        const int16_t *wt = axis->weights+(size_t)x*axis->stride;
+        uint32_t n = axis->count[x];
+
+#ifdef __SSE2__
+        __m128i zero = _mm_setzero_si128(), acc = _mm_set1_epi32(1<<(RESIZE_BITS-1));
+        for(k = 0; k+1 < n; k += 2, p += 2*bpp) {
+            __m128i v = _mm_unpacklo_epi8(loadPixel(p, bpp), loadPixel(p+bpp, bpp));
+            acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_unpacklo_epi8(v, zero), weightPair(wt+k)));
+        }
+        if(k < n) {
+            // wt[n] is zero padding
+            __m128i v = _mm_unpacklo_epi8(loadPixel(p, bpp), zero);
+            acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_unpacklo_epi8(v, zero), weightPair(wt+k)));
+        }
+
+        acc = _mm_srai_epi32(acc, RESIZE_BITS);
+        acc = _mm_packs_epi32(acc, acc);
+        uint32_t v = _mm_cvtsi128_si32(_mm_packus_epi16(acc, acc));
+        memcpy(dst, &v, bpp);
+#else
+        int c;
+        for(c = 0; c < bpp; ++c) {
+            int32_t acc = 1<<(RESIZE_BITS-1);
+            for(k = 0; k < n; ++k)
+                acc += p[k*bpp+c]*wt[k];
+            acc >>= RESIZE_BITS;
+            dst[c] = acc < 0? 0: acc > 255? 255: acc;
+        }
+#endif
+    }
+
+}
+
+/*  Vertical pass: 'n' rows of 'len' bytes weighted into one. */
+static void resizeColumn(const uint8_t **rows, const int16_t *wt, uint32_t n,
+                         uint8_t *dst, size_t len) {
+
+    size_t i = 0;
+    uint32_t k;
+
+#ifdef __SSE2__
+    __m128i zero = _mm_setzero_si128(), round = _mm_set1_epi32(1<<(RESIZE_BITS-1));
+    for(; i+16 <= len; i += 16) {
+        __m128i acc0 = round, acc1 = round, acc2 = round, acc3 = round;
+
+        for(k = 0; k < n; k += 2) {
+            // wt[n] is zero padding, the row it pairs with is any
+            __m128i a = _mm_loadu_si128((const __m128i*)(rows[k]+i));
+            __m128i b = k+1 < n? _mm_loadu_si128((const __m128i*)(rows[k+1]+i)): zero;
+            __m128i lo = _mm_unpacklo_epi8(a, b), hi = _mm_unpackhi_epi8(a, b);
+            __m128i c = weightPair(wt+k);
+
+            acc0 = _mm_add_epi32(acc0, _mm_madd_epi16(_mm_unpacklo_epi8(lo, zero), c));
+            acc1 = _mm_add_epi32(acc1, _mm_madd_epi16(_mm_unpackhi_epi8(lo, zero), c));
+            acc2 = _mm_add_epi32(acc2, _mm_madd_epi16(_mm_unpacklo_epi8(hi, zero), c));
+            acc3 = _mm_add_epi32(acc3, _mm_madd_epi16(_mm_unpackhi_epi8(hi, zero), c));
+        }
+
+        __m128i lo = _mm_packs_epi32(_mm_srai_epi32(acc0, RESIZE_BITS), _mm_srai_epi32(acc1, RESIZE_BITS));
+        __m128i hi = _mm_packs_epi32(_mm_srai_epi32(acc2, RESIZE_BITS), _mm_srai_epi32(acc3, RESIZE_BITS));
+        _mm_storeu_si128((__m128i*)(dst+i), _mm_packus_epi16(lo, hi));
+    }
+#endif
+
+    for(; i < len; ++i) {
+        int32_t acc = 1<<(RESIZE_BITS-1);
+        for(k = 0; k < n; ++k)
+            acc += rows[k][i]*wt[k];
+        acc >>= RESIZE_BITS;
+        dst[i] = acc < 0? 0: acc > 255? 255: acc;
+    }
+
+}
+
+// Separate copies for each pixel size, with memcpy()s of known length
+static void resizeRowAny(const uint8_t *src, uint8_t *dst, const resizeAxis *axis,
+                         uint32_t w, int bpp) {
+
+    switch(bpp) {
+        case 1: resizeRow(src, dst, axis, w, 1); break;
+        case 2: resizeRow(src, dst, axis, w, 2); break;
+        case 3: resizeRow(src, dst, axis, w, 3); break;
+        default: resizeRow(src, dst, axis, w, 4);
+    }
+
+}
+
+static void * resizeWorker(void *arg) {
+
+    resizeQueue *q = arg;
+    size_t src_row = (size_t)q->src_w*q->bpp, row = (size_t)q->w*q->bpp;
+
+    // rows of the band after the horizontal pass
+    uint8_t *buf = NULL;
+    const uint8_t **rows = malloc(sizeof(uint8_t*)*q->band_rows);
+    if(q->ax.first && q->ay.first)
+        buf = malloc(row*q->band_rows);
+
+    if(!rows || (q->ax.first && q->ay.first && !buf)) {
+        q->failed = 1;
+        free(rows);
+        return NULL;
+    }
+
+    for(;;) {
+        uint32_t b = __atomic_fetch_add(&q->next, 1, __ATOMIC_RELAXED), y;
+        if(b >= q->bands) break;
+
+        uint32_t y0 = b*q->band, y1 = y0+q->band < q->h? y0+q->band: q->h;
+
+        if(!q->ay.first) {
+            for(y = y0; y < y1; ++y)
+                resizeRowAny(q->src+y*src_row, q->dst+y*row, &q->ax, q->w, q->bpp);
+            continue;
+        }
+
+        uint32_t in0 = q->ay.first[y0], in1 = in0, r;
+        for(y = y0; y < y1; ++y)
+            if(q->ay.first[y]+q->ay.count[y] > in1) in1 = q->ay.first[y]+q->ay.count[y];
+
+        for(r = in0; r < in1; ++r) {
+            if(!q->ax.first)
+                rows[r-in0] = q->src+r*src_row;
+            else {
+                resizeRowAny(q->src+r*src_row, buf+(r-in0)*row, &q->ax, q->w, q->bpp);
+                rows[r-in0] = buf+(r-in0)*row;
+            }
+        }
+
+        for(y = y0; y < y1; ++y)
+            resizeColumn(rows+q->ay.first[y]-in0, q->ay.weights+(size_t)y*q->ay.stride,
+                         q->ay.count[y], q->dst+y*row, row);
+    }
+
+    free(buf);
+    free(rows);
+    return NULL;
+
+}
+
+lgcLayer * lgcResizeLayer(const lgcLayer *source, uint32_t w, uint32_t h, int filter) {
+
+    fullLayer from, *src = &from;
+    if(source) loadLayer(source, &from);
+
+    if(!source || !src->data || !src->w || !src->h || !w || !h) {
+        fprintf(stderr, "%s: empty source layer or size\n", __FUNCTION__);
+        return NULL;
+    }
+
+    if(src->format&LGC_FMT_BLOCK) {
+        fprintf(stderr, "%s: block-compressed layer, decode it first (see lgcDecodeBlocks)\n",
+                __FUNCTION__);
+        return NULL;
+    }
+
+    if(isIndexed(src->format)) {
+        fprintf(stderr, "%s: indexed layer, expand it first (see lgcExpandPalette)\n",
+                __FUNCTION__);
+        return NULL;
+    }
+
+    if(filter < LGC_FILTER_BOX || filter > LGC_FILTER_LANCZOS) {
+        fprintf(stderr, "%s: unknown filter %d\n", __FUNCTION__, filter);
+        return NULL;
+    }
+
+    resizeQueue q;
+    memset(&q, 0, sizeof(resizeQueue));
+    q.src = src->data;
+    q.src_w = src->w;
+    q.src_h = src->h;
+    q.w = w;
+    q.h = h;
+    q.bpp = LGC_BYTES_PER_PIXEL(src->format);
+
+    fullLayer layer;
+    memcpy(&layer, src, sizeof(fullLayer));
+    layer.w = w;
+    layer.h = h;
+    layer.x = (int64_t)src->x*w/src->w;
+    layer.y = (int64_t)src->y*h/src->h;
+    layer.length = LGC_LAYER_BODY_LENGTH((&layer));
+    layer.refs = NULL;
+    layer.borrowed = 0;
+    layer.palette = NULL;
+    layer.colors = 0;
+    layer.data = malloc(layer.length+1);
+
+    if(!layer.data || (w != src->w && buildAxis(&q.ax, src->w, w, filter)) ||
+        (h != src->h && buildAxis(&q.ay, src->h, h, filter))) {
+        fprintf(stderr, "%s: can't allocate memory\n", __FUNCTION__);
+        q.failed = 1;
+        goto done;
+    }
+
+    q.dst = layer.data;
+    if(!q.ax.first && !q.ay.first) {
+        memcpy(q.dst, q.src, layer.length);
+        goto done;
+    }
+
+    // a band's intermediate rows are to fit the budget, unless it is a few rows anyway
+    size_t per_row = (size_t)w*q.bpp*((src->h+h-1)/h);
+    q.band = per_row < RESIZE_BAND_BYTES/RESIZE_BAND_MIN? RESIZE_BAND_BYTES/per_row: RESIZE_BAND_MIN;
+    if(q.band > h) q.band = h;
+    q.bands = (h+q.band-1)/q.band;
+
+    q.band_rows = q.band;
+    if(q.ay.first) {
+        uint32_t b;
+        for(b = 0; b < q.bands; ++b) {
+            uint32_t y0 = b*q.band, y1 = y0+q.band < h? y0+q.band: h, y, in1 = 0;
+            for(y = y0; y < y1; ++y)
+                if(q.ay.first[y]+q.ay.count[y] > in1) in1 = q.ay.first[y]+q.ay.count[y];
+            if(in1-q.ay.first[y0] > q.band_rows) q.band_rows = in1-q.ay.first[y0];
+        }
+    }
+
+    // small layers are not worth the threads
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    uint64_t pixels = (uint64_t)w*h;
+    if(threads > RESIZE_MAX_THREADS) threads = RESIZE_MAX_THREADS;
+    if((uint64_t)threads > pixels/RESIZE_THREAD_PIXELS) threads = pixels/RESIZE_THREAD_PIXELS;
+    if(threads > q.bands) threads = q.bands;
+
+    // the calling thread is one of the workers
+    pthread_t workers[RESIZE_MAX_THREADS];
+    int started = 0, t;
+    while(started+1 < threads && !pthread_create(&workers[started], NULL, resizeWorker, &q))
+        started++;
+
+    resizeWorker(&q);
+
+    for(t = 0; t < started; ++t)
+        pthread_join(workers[t], NULL);
+
+    if(q.failed)
+        fprintf(stderr, "%s: can't allocate memory\n", __FUNCTION__);
+
+done:
+    freeAxis(&q.ax);
+    freeAxis(&q.ay);
+
+    if(q.failed) {
+        free(layer.data);
+        return NULL;
+    }
+
+    return newLayer(&layer);
+
+}
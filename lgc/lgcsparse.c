@@ -0,0 +1,177 @@
+/**
+
+    lgcsparse.c
+    Layers with transparent regions: trimming of them and the sparse
+    form, keeping only non-empty spans of each row (LGC_EXT_SPARSE)
+
+    This software comes under the terms of MIT License.
+
+**/
+
+#include "lgcpriv.h"
+
+#include <malloc.h>
+#include <stdio.h>
+#include <string.h>
+
+/*  Finds the span of non-empty (not all-zero) pixels of a row:
+    it's first pixel and the count. Returns 0 for an empty row. Only
+    layers which all-zero pixels are transparent get here (see packPlanned):
+    RGBA ones, and indexed ones with a clear entry 0. */
+static uint32_t rowSpan(const uint8_t *row, uint32_t w, int bpp, uint32_t *x0) {
+
+    size_t len = (size_t)w*bpp, first, last;
+
+    for(first = 0; first < len && !row[first]; ++first);
+    if(first == len) return 0;
+    for(last = len-1; !row[last]; --last);
+
+    *x0 = first/bpp;
+    return last/bpp-*x0+1;
+
+}
+
+/*  Fills 'view' with the layer cropped to it's non-empty pixels,
+    having 'x' and 'y' moved for them to stay in place. A layer with
+    no such pixels becomes a single transparent one. Returns buffer
+    allocated for pixels of the view, to be freed by the caller, or NULL
+    if they are in the layer's own ones. */
+void * trimLayer(fullLayer *layer, fullLayer *view) {
+
+    memcpy(view, layer, sizeof(fullLayer));
+    if(!layer->data || !layer->w || !layer->h) return NULL;
+
+    int bpp = LGC_BYTES_PER_PIXEL(layer->format);
+    size_t row = (size_t)layer->w*bpp;
+    const uint8_t *pixels = layer->data;
+
+    uint32_t x0 = layer->w, x1 = 0, y0 = layer->h, y1 = 0, y;
+    for(y = 0; y < layer->h; ++y) {
+        uint32_t first, n = rowSpan(pixels+y*row, layer->w, bpp, &first);
+        if(!n) continue;
+
+        if(y < y0) y0 = y;
+        y1 = y;
+        if(first < x0) x0 = first;
+        if(first+n > x1) x1 = first+n;
+    }
+
+    // all transparent: it's first pixel is as good as any
+    if(y0 == layer->h) {
+        view->w = view->h = 1;
+        view->length = LGC_LAYER_BODY_LENGTH(view);
+        return NULL;
+    }
+
+    view->x += x0;
+    view->y += y0;
+    view->w = x1-x0;
+    view->h = y1-y0+1;
+    view->length = LGC_LAYER_BODY_LENGTH(view);
+    view->data = (uint8_t*)layer->data+y0*row;
+
+    // whole rows are cut off in place
+    if(view->w == layer->w) return NULL;
+
+    size_t view_row = (size_t)view->w*bpp;
+    uint8_t *cropped = malloc(view_row*view->h);
+    if(!cropped) {
+        memcpy(view, layer, sizeof(fullLayer));
+        return NULL;
+    }
+
+    for(y = 0; y < view->h; ++y)
+        memcpy(cropped+y*view_row, pixels+(y0+y)*row+(size_t)x0*bpp, view_row);
+
+    view->data = cropped;
+    return cropped;
+
+}
+
+/*  Same as packLayer(), storing the layer's pixels in sparse form when
+    that leaves a quarter of them out at least. */
+int packSparse(fullLayer *layer, int32_t flags, layerRecord *rec) {
+
+    int bpp = LGC_BYTES_PER_PIXEL(layer->format);
+    size_t row = (size_t)layer->w*bpp, dense = row*layer->h;
+    const uint8_t *pixels = layer->data;
+
+    if(!pixels || !dense) return packLayer(layer, flags, rec);
+
+    uint32_t *spans = malloc(sizeof(uint32_t)*2*layer->h), y;
+    if(!spans) return packLayer(layer, flags, rec);
+
+    size_t len = 2+4*(size_t)layer->h;
+    for(y = 0; y < layer->h; ++y) {
+        spans[2*y] = 0;
+        spans[2*y+1] = rowSpan(pixels+y*row, layer->w, bpp, &spans[2*y]);
+        len += (size_t)spans[2*y+1]*bpp;
+    }
+
+    // sparse_len is uint32
+    uint8_t *sparse = NULL;
+    if(len*4 < dense*3 && len <= UINT32_MAX) sparse = malloc(len);
+
+    if(!sparse) {
+        free(spans);
+        return packLayer(layer, flags, rec);
+    }
+
+    putLE16(sparse, layer->h);
+    uint8_t *p = sparse+2+4*layer->h;
+    for(y = 0; y < layer->h; ++y) {
+        putLE16(sparse+2+4*y, spans[2*y]);
+        putLE16(sparse+4+4*y, spans[2*y+1]);
+
+        size_t n = (size_t)spans[2*y+1]*bpp;
+        memcpy(p, pixels+y*row+(size_t)spans[2*y]*bpp, n);
+        p += n;
+    }
+
+    free(spans);
+
+    int ret = packRecord(layer, flags, sparse, len, 1, rec);
+    rec->owned[rec->owned_count++] = sparse;
+    return ret;
+
+}
+
+/*  Turns 'len' bytes of the sparse form into 'size' bytes of pixels,
+    in a new buffer. Returns NULL if the spans don't fit the layer. */
+void * expandSparse(const uint8_t *raw, uint32_t len, uint8_t format, uint64_t size) {
+
+    int bpp = LGC_BYTES_PER_PIXEL(format);
+    if(len < 2) return NULL;
+
+    uint32_t h = getLE16(raw), y;
+    if((h? size%h: size) || len < 2+4*h) return NULL;
+
+    size_t row = h? (size_t)size/h: 0;
+    uint32_t w = row/bpp;
+    if(row%bpp) return NULL;
+
+    uint8_t *pixels = calloc(size? size: 1, 1);
+    if(!pixels) return NULL;
+
+    const uint8_t *p = raw+2+4*h, *end = raw+len;
+    for(y = 0; y < h; ++y) {
+        uint32_t x0 = getLE16(raw+2+4*y), n = getLE16(raw+4+4*y);
+        size_t bytes = (size_t)n*bpp;
+
+        if(x0+n > w || bytes > (size_t)(end-p)) {
+            free(pixels);
+            return NULL;
+        }
+
+        memcpy(pixels+y*row+(size_t)x0*bpp, p, bytes);
+        p += bytes;
+    }
+
+    if(p != end) {
+        free(pixels);
+        return NULL;
+    }
+
+    return pixels;
+
+}
@@ -0,0 +1,375 @@
+/**
+
+    lgcstate.c
+    What the library keeps of layers aside of lgcLayer: levels to be
+    stored, palettes, size of wide layers, 'data' shared by several
+    layers or borrowed. Kept by address of the layer, until it is destroyed
+
+    This software comes under the terms of MIT License.
+
+**/
+
+#include "lgcpriv.h"
+
+#include <malloc.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+typedef struct layerState {
+
+    const lgcLayer *    layer;
+    uint8_t             levels;
+    uint8_t *           palette;    // owned
+    uint16_t            colors;
+    uint32_t            w, h;       // size and length, for the fields
+    uint64_t            length;     // of lgcLayer saturated to them
+    const void *        data;       // 'data' the fields below are about
+    int *               refs;
+    int                 borrowed;
+    struct layerState * next;
+
+} layerState;
+
+/* Chained hash table; layers the library knows nothing about are not in it */
+static pthread_mutex_t states_lock = PTHREAD_MUTEX_INITIALIZER;
+static layerState **states = NULL;
+static uint32_t states_size = 0, states_count = 0;
+
+static uint32_t slot(const lgcLayer *layer, uint32_t size) {
+    return (uint32_t)(((uint64_t)(uintptr_t)layer*0x9e3779b97f4a7c15ULL)>>32)&(size-1);
+}
+
+// Link to the layer's state, pointing to NULL if it has none
+static layerState ** findState(const lgcLayer *layer) {
+
+    layerState **link = &states[slot(layer, states_size)];
+    while(*link && (*link)->layer != layer)
+        link = &(*link)->next;
+
+    return link;
+
+}
+
+// Links the state in; non-zero if there's no table to link it to
+static int putState(layerState *s) {
+
+    if(states_count >= states_size) {
+        uint32_t size = states_size? 2*states_size: 64, i;
+        layerState **table = calloc(size, sizeof(layerState*));
+        if(!table && !states_size) return -1;
+
+        // if it can't grow, chains just get longer
+        for(i = 0; table && i < states_size; ++i) {
+            while(states[i]) {
+                layerState *t = states[i];
+                states[i] = t->next;
+                t->next = table[slot(t->layer, size)];
+                table[slot(t->layer, size)] = t;
+            }
+        }
+
+        if(table) {
+            free(states);
+            states = table;
+            states_size = size;
+        }
+    }
+
+    layerState **link = &states[slot(s->layer, states_size)];
+    s->next = *link;
+    *link = s;
+    states_count++;
+
+    return 0;
+
+}
+
+// Unlinks the layer's state, NULL if it has none
+static layerState * takeState(const lgcLayer *layer) {
+
+    if(!states_count) return NULL;
+
+    layerState **link = findState(layer), *s = *link;
+    if(s) {
+        *link = s->next;
+        states_count--;
+    }
+
+    return s;
+
+}
+
+static void freeState(layerState *s) {
+    if(!s) return;
+    free(s->palette);
+    free(s);
+}
+
+#define WIDE_DIM(v)     ((v) > 0xffff? 0xffff: (v))
+#define WIDE_LENGTH(v)  ((v) > UINT32_MAX? UINT32_MAX: (v))
+
+/*  Fills 'full' with the layer's fields and it's state. The palette
+    stays the state's: it is valid while the layer is not changed. */
+void loadLayer(const lgcLayer *layer, fullLayer *full) {
+
+    memset(full, 0, sizeof(fullLayer));
+    full->w = layer->w;
+    full->h = layer->h;
+    full->x = layer->x;
+    full->y = layer->y;
+    full->format = layer->format;
+    full->flags = layer->flags;
+    full->length = layer->length;
+    full->data = layer->data;
+
+    pthread_mutex_lock(&states_lock);
+    layerState *s = states_count? *findState(layer): NULL;
+    if(s) {
+        full->levels = s->levels;
+        full->palette = s->palette;
+        full->colors = s->palette? s->colors: 0;
+
+        // wide values stand for the saturated fields, not for ones set since
+        if(layer->w == WIDE_DIM(s->w)) full->w = s->w;
+        if(layer->h == WIDE_DIM(s->h)) full->h = s->h;
+        if(layer->length == WIDE_LENGTH(s->length)) full->length = s->length;
+
+        // set along with 'data', which the caller may have replaced since
+        if(s->data == layer->data) {
+            full->refs = s->refs;
+            full->borrowed = s->borrowed;
+        }
+    }
+    pthread_mutex_unlock(&states_lock);
+
+}
+
+/*  Sets the layer's fields and state to what 'full' has. The state
+    takes 'full->palette' over, which is to be allocated with malloc()
+    (or be the one loadLayer() gave). */
+void storeLayer(fullLayer *full, lgcLayer *layer) {
+
+    layer->w = WIDE_DIM(full->w);
+    layer->h = WIDE_DIM(full->h);
+    layer->x = full->x;
+    layer->y = full->y;
+    layer->format = full->format;
+    layer->flags = full->flags;
+    layer->length = WIDE_LENGTH(full->length);
+    layer->data = full->data;
+
+    int keep = full->levels || full->palette || full->refs || full->borrowed || isWide(full);
+
+    pthread_mutex_lock(&states_lock);
+    layerState *s = takeState(layer);
+
+    if(s && s->palette != full->palette) {
+        free(s->palette);
+        s->palette = NULL;
+    }
+
+    if(keep && !s && !(s = malloc(sizeof(layerState)))) {
+        // the palette is lost along with the state
+        free(full->palette);
+        full->palette = NULL;
+        keep = 0;
+    }
+
+    if(keep) {
+        s->layer = layer;
+        s->levels = full->levels;
+        s->palette = full->palette;
+        s->colors = full->palette? full->colors: 0;
+        s->w = full->w;
+        s->h = full->h;
+        s->length = full->length;
+        s->data = full->data;
+        s->refs = full->refs;
+        s->borrowed = full->borrowed;
+        if(putState(s)) {
+            full->palette = NULL;
+            freeState(s);
+        }
+    }
+    else freeState(s);
+    pthread_mutex_unlock(&states_lock);
+
+}
+
+// New layer made of 'full', which palette it takes over (see storeLayer())
+lgcLayer * newLayer(fullLayer *full) {
+
+    lgcLayer *layer = lgcBlankLayer();
+    storeLayer(full, layer);
+    return layer;
+
+}
+
+// Forgets the layer's state, freeing it's palette
+void dropLayer(const lgcLayer *layer) {
+
+    pthread_mutex_lock(&states_lock);
+    layerState *s = takeState(layer);
+    pthread_mutex_unlock(&states_lock);
+
+    freeState(s);
+
+}
+
+// Moves the layer to 'to', along with it's state
+void moveLayer(const lgcLayer *from, lgcLayer *to) {
+
+    memcpy(to, from, sizeof(lgcLayer));
+
+    pthread_mutex_lock(&states_lock);
+    layerState *old = takeState(to), *s = takeState(from);
+    if(s) {
+        s->layer = to;
+        if(putState(s)) freeState(s);
+    }
+    pthread_mutex_unlock(&states_lock);
+
+    freeState(old);
+
+}
+
+/*  Reallocates array of 'count' layers to 'new_count' of them,
+    moving their state along. Returns the new array, as realloc() does. */
+lgcLayer * resizeLayers(lgcLayer *layers, uint32_t count, uint32_t new_count) {
+
+    // locked throughout, so that no layer gets the old places meanwhile
+    pthread_mutex_lock(&states_lock);
+
+    uintptr_t from = (uintptr_t)layers;
+    lgcLayer *moved = realloc(layers, new_count*sizeof(lgcLayer));
+
+    if((uintptr_t)moved != from && (moved || !new_count) && states_count) {
+        uintptr_t to = (uintptr_t)moved;
+        uintptr_t old = (uintptr_t)count*sizeof(lgcLayer), end = (uintptr_t)new_count*sizeof(lgcLayer);
+        uintptr_t kept = old < end? old: end;
+        layerState *taken = NULL;
+        uint32_t i;
+
+        // states of the moved layers are taken out; the ones of layers
+        // left behind, or left at the new places by layers not destroyed,
+        // are dropped
+        for(i = 0; i < states_size; ++i) {
+            layerState **link = &states[i];
+            while(*link) {
+                layerState *s = *link;
+                uintptr_t at = (uintptr_t)s->layer;
+
+                if(at-from < old || (moved && at-to < end)) {
+                    *link = s->next;
+                    states_count--;
+
+                    if(at-from < kept) {
+                        s->layer = (const lgcLayer*)(to+(at-from));
+                        s->next = taken;
+                        taken = s;
+                    }
+                    else freeState(s);
+                }
+                else link = &s->next;
+            }
+        }
+
+        while(taken) {
+            layerState *s = taken;
+            taken = s->next;
+            if(putState(s)) freeState(s);
+        }
+    }
+
+    pthread_mutex_unlock(&states_lock);
+    return moved;
+
+}
+
+uint8_t lgcLayerLevels(const lgcLayer *layer) {
+
+    fullLayer full;
+    loadLayer(layer, &full);
+    return full.levels;
+
+}
+
+void lgcSetLayerLevels(lgcLayer *layer, uint8_t levels) {
+
+    fullLayer full;
+    loadLayer(layer, &full);
+    full.levels = levels;
+    storeLayer(&full, layer);
+
+}
+
+const uint8_t * lgcLayerPalette(const lgcLayer *layer, uint16_t *colors) {
+
+    fullLayer full;
+    loadLayer(layer, &full);
+    if(colors) *colors = full.colors;
+    return full.palette;
+
+}
+
+int lgcSetLayerPalette(lgcLayer *layer, const uint8_t *palette, uint16_t colors) {
+
+    if(colors > LGC_PALETTE_MAX || (colors && !palette)) {
+        fprintf(stderr, "%s: palette must have %u colors at most\n", __FUNCTION__, LGC_PALETTE_MAX);
+        return -1;
+    }
+
+    uint8_t *copy = NULL;
+    if(colors) {
+        if(!(copy = malloc(4*colors))) {
+            fprintf(stderr, "%s: can't allocate memory\n", __FUNCTION__);
+            return -1;
+        }
+        memcpy(copy, palette, 4*colors);
+    }
+
+    fullLayer full;
+    loadLayer(layer, &full);
+    full.palette = copy;
+    full.colors = colors;
+    storeLayer(&full, layer);
+
+    return 0;
+
+}
+
+uint32_t lgcLayerWidth(const lgcLayer *layer) {
+
+    fullLayer full;
+    loadLayer(layer, &full);
+    return full.w;
+
+}
+
+uint32_t lgcLayerHeight(const lgcLayer *layer) {
+
+    fullLayer full;
+    loadLayer(layer, &full);
+    return full.h;
+
+}
+
+uint64_t lgcLayerLength(const lgcLayer *layer) {
+
+    fullLayer full;
+    loadLayer(layer, &full);
+    return full.length;
+
+}
+
+void lgcSetLayerSize(lgcLayer *layer, uint32_t w, uint32_t h, uint64_t length) {
+
+    fullLayer full;
+    loadLayer(layer, &full);
+    full.w = w;
+    full.h = h;
+    full.length = length;
+    storeLayer(&full, layer);
+
+}
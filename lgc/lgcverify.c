@@ -0,0 +1,268 @@
+/**
+
+    lgcverify.c
+    Checking stored layers against their checksums
+
+    This software comes under the terms of MIT License.
+
+**/
+
+#include "lgcpriv.h"
+
+#include <malloc.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#define VERIFY_CHUNK_SIZE (1<<20)
+#define VERIFY_MAX_THREADS 64
+
+/* Stored payload to check, with everything needed to do it without the file stream */
+typedef struct {
+
+    uint32_t        layer_n;    // first layer having this payload
+    uint64_t        blob;       // payload is in the blob store, 0 if in the file
+    uint64_t        offset;     // of the payload
+    uint8_t         format;
+    uint64_t        dict;       // key of the dictionary it's compressed against
+    int             parts_count;
+    uint64_t        part_len[1+LGC_MAX_LEVELS];
+    uint64_t        part_size[1+LGC_MAX_LEVELS];    // decoded lengths
+    uint8_t         checksums;
+    uint32_t        checksum[1+LGC_MAX_LEVELS];
+
+} verifyJob;
+
+typedef struct {
+
+    verifyJob *     jobs;
+    uint32_t        count;
+    uint32_t        next;       // next job to take, atomic
+    int             corrupted;  // atomic
+    int             failed;     // a worker got no buffer, atomic
+    int             fd;
+
+} verifyQueue;
+
+// Reads 'len' bytes at 'offset' by chunks, returns their CRC32C in 'crc'
+static int checksumRange(int fd, uint64_t offset, uint64_t len, uint8_t *buf, uint32_t *crc) {
+
+    *crc = 0;
+    while(len) {
+        uint32_t chunk = len < VERIFY_CHUNK_SIZE? len: VERIFY_CHUNK_SIZE;
+        ssize_t r = pread(fd, buf, chunk, offset);
+        if(r <= 0) return -1;
+
+        *crc = crc32c(*crc, buf, r);
+        offset += r;
+        len -= r;
+    }
+
+    return 0;
+
+}
+
+// Layers without checksums: compressed ones must decompress to their exact size
+static int decodeRange(int fd, uint64_t offset, uint64_t len, uint64_t size, uint8_t format,
+                       uint64_t dict) {
+
+    if(!(format&LGC_FMT_COMPRESSED))
+        return len == size? 0: -1;
+
+    char *src = malloc(len? len: 1);
+    char *dst = malloc(size? size: 1);
+    int ret = -1;
+
+    if(src && dst && !preadFull(fd, src, len, offset) && !unpackLZ4(src, len, dst, size, dict))
+        ret = 0;
+
+    free(src);
+    free(dst);
+    return ret;
+
+}
+
+static int checkJob(verifyQueue *q, verifyJob *job, uint8_t *buf) {
+
+    int fd = q->fd;
+    if(job->blob) {
+        char path[4096];
+        if(blobPath(job->blob, path, sizeof(path)) || (fd = open(path, O_RDONLY)) < 0)
+            return -1;
+    }
+
+    int ret = 0;
+    uint64_t offset = job->offset;
+
+    int k;
+    for(k = 0; !ret && k < job->parts_count; ++k) {
+        uint32_t crc;
+
+        if(k < job->checksums)
+            ret = checksumRange(fd, offset, job->part_len[k], buf, &crc) ||
+                crc != job->checksum[k]? -1: 0;
+        else
+            ret = decodeRange(fd, offset, job->part_len[k], job->part_size[k], job->format,
+                              job->dict);
+
+        offset += job->part_len[k];
+    }
+
+    if(fd != q->fd) close(fd);
+    return ret;
+
+}
+
+static void * verifyWorker(void *arg) {
+
+    verifyQueue *q = arg;
+    uint8_t *buf = malloc(VERIFY_CHUNK_SIZE);
+    if(!buf) {
+        __atomic_store_n(&q->failed, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    for(;;) {
+        uint32_t j = __atomic_fetch_add(&q->next, 1, __ATOMIC_RELAXED);
+        if(j >= q->count) break;
+
+        if(checkJob(q, &q->jobs[j], buf)) {
+            fprintf(stderr, "lgcVerifyFile: layer %u is corrupted\n", q->jobs[j].layer_n);
+            __atomic_fetch_add(&q->corrupted, 1, __ATOMIC_RELAXED);
+        }
+    }
+
+    free(buf);
+    return NULL;
+
+}
+
+// Fills the job from the record at 'offset', following references to the payload
+static int describeRecord(FILE *f, int version, uint64_t offset, verifyJob *job, uint64_t *source) {
+
+    fullLayer layer;
+    layerExt ext;
+
+    if(fseeko(f, offset, SEEK_SET) || readHead(f, version, &layer, &ext)) return -1;
+
+    *source = ext.blob? ext.blob|1ULL<<63: ext.ref? ext.ref: offset;
+    job->blob = ext.blob;
+
+    FILE *src = openPayload(f, &layer, &ext);
+    if(!src) return -1;
+
+    job->offset = ftello(src);
+    if(src != f) fclose(src);
+
+    job->format = layer.format;
+    job->dict = ext.dict;
+    job->parts_count = 1+ext.levels;
+    job->checksums = ext.checksums;
+    memcpy(job->checksum, ext.checksum, sizeof(job->checksum));
+
+    int k;
+    for(k = 0; k < job->parts_count; ++k) {
+        job->part_len[k] = k? ext.level_len[k-1]: ext.body_len;
+        job->part_size[k] = LGC_PIXELS_LENGTH(layer.format, LGC_LEVEL_DIM(layer.w, k),
+                                              LGC_LEVEL_DIM(layer.h, k));
+    }
+
+    // the layer itself may be in sparse form
+    if(ext.sparse_len) job->part_size[0] = ext.sparse_len;
+
+    return 0;
+
+}
+
+int lgcVerifyFile(const char * filename, int rwopts, int threads) {
+
+    FILE *f = rwopts&LGC_RW_FORCE_FILE_POINTER? (FILE*)filename: openFile(filename, "rb");
+    if(!f)
+    {
+        fprintf(stderr, rwopts&LGC_RW_FORCE_FILE_POINTER? "%s: filename is NULL\n":
+                "%s: can't open the file (%s)\n", __FUNCTION__, filename);
+        return -1;
+    }
+
+    layerIndex idx;
+    int version = 0;
+    if(checkHead(f, NULL, &version) || loadIndex(f, version, &idx)) {
+        fprintf(stderr, "%s: read error or bad magic number\n", __FUNCTION__);
+        if(rwopts&LGC_RW_FORCE_FILE_POINTER) rewind(f);
+        else fclose(f);
+        return -1;
+    }
+
+    // the pixels are decoded for checking
+    loadDictionary(f, version);
+
+    verifyQueue q;
+    memset(&q, 0, sizeof(verifyQueue));
+    q.jobs = malloc(sizeof(verifyJob)*(idx.count+1));
+    if(!q.jobs) {
+        fprintf(stderr, "%s: can't allocate memory\n", __FUNCTION__);
+        freeIndex(&idx);
+        if(rwopts&LGC_RW_FORCE_FILE_POINTER) rewind(f);
+        else fclose(f);
+        return -1;
+    }
+
+    // Payloads shared by several layers are checked once
+    offsetMap seen;
+    mapInit(&seen, 16);
+
+    uint32_t i, k;
+    for(i = 0; i < idx.count; ++i) {
+        verifyJob *job = &q.jobs[q.count];
+        uint64_t source = idx.entries[i];
+
+        if(describeRecord(f, version, idx.entries[i], job, &source)) {
+            fprintf(stderr, "%s: layer %u is corrupted\n", __FUNCTION__, i);
+            q.corrupted++;
+            continue;
+        }
+
+        if(!mapGet(&seen, source, &k)) continue;
+        mapPut(&seen, source, q.count);
+
+        job->layer_n = i;
+        q.count++;
+    }
+
+    mapFree(&seen);
+    freeIndex(&idx);
+
+    fflush(f);
+    q.fd = fileno(f);
+
+    if(threads <= 0) threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if(threads > VERIFY_MAX_THREADS) threads = VERIFY_MAX_THREADS;
+    if((uint32_t)threads > q.count) threads = q.count;
+
+    // the calling thread is one of the workers
+    pthread_t workers[VERIFY_MAX_THREADS];
+    int started = 0;
+    while(started+1 < threads && !pthread_create(&workers[started], NULL, verifyWorker, &q))
+        started++;
+
+    verifyWorker(&q);
+
+    int t;
+    for(t = 0; t < started; ++t)
+        pthread_join(workers[t], NULL);
+
+    free(q.jobs);
+
+    if(rwopts&LGC_RW_FORCE_FILE_POINTER) rewind(f);
+    else fclose(f);
+
+    if(q.failed) {
+        fprintf(stderr, "%s: can't allocate memory\n", __FUNCTION__);
+        return -1;
+    }
+
+    return q.corrupted;
+
+}
@@ -0,0 +1,150 @@
+/**
+multi-threaded layer read benchmark
+reads every layer of a file through one shared lgcFile
+with 1, 2, 4, .. threads and prints the throughput
+**/
+
+#include "lgc/lgc.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#define BENCH_MAX_THREADS 64
+
+typedef struct {
+
+    lgcFile *       file;
+    uint32_t        first, step;    // layers first, first+step, ..
+    int             passes;
+    uint64_t        bytes;
+    int             failed;
+
+} worker_t;
+
+static double now() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec+t.tv_nsec/1e9;
+}
+
+static void *worker(void *arg) {
+
+    worker_t *w = arg;
+    uint32_t count = lgcFileLayersCount(w->file);
+
+    int p;
+    uint32_t i;
+    for(p = 0; p < w->passes; p++)
+        for(i = w->first; i < count; i += w->step) {
+            lgcLayer *layer = lgcFileReadLayer(w->file, LGC_RW_ENTRIE, i);
+            if(!layer) {
+                w->failed++;
+                continue;
+            }
+
+            w->bytes += layer->length;
+            lgcDestroyLayer(layer, 1);
+        }
+
+    return NULL;
+
+}
+
+// Writes a file of 'count' compressed RGBA layers, 'size' x 'size' each
+static int make_sample(const char *filename, uint32_t count, uint16_t size) {
+
+    lgcImage *img = lgcBlankImage();
+    img->magic = LGC_MAGIC;
+    img->layers_count = count;
+    img->layers = calloc(count, sizeof(lgcLayer));
+
+    uint32_t i, k;
+    for(i = 0; i < count; i++) {
+        lgcLayer *l = &img->layers[i];
+        l->w = l->h = size;
+        l->x = i;
+        l->format = LGC_FMT_RGBA8|LGC_FMT_COMPRESSED;
+        l->length = LGC_LAYER_BODY_LENGTH(l);
+        l->data = malloc(l->length);
+
+        // compressible, but not trivially, and different per layer
+        uint8_t *p = l->data;
+        for(k = 0; k < l->length; k++)
+            p[k] = (k*7+i)%251 < 200? (k>>6)+i: (uint32_t)rand();
+    }
+
+    int ret = lgcWriteToFile(filename, LGC_RW_ENTRIE|LGC_RW_NO_DEDUP, img);
+    lgcDestroyImage(img, 1);
+    return ret;
+
+}
+
+int main(int argc, char *argv[]) {
+
+    if(argc < 2) {
+        printf("usage: %s [FILE] [MAX THREADS] [PASSES]\n"
+               "       %s -make [FILE] [LAYERS] [SIZE]\n", argv[0], argv[0]);
+        return 0;
+    }
+
+    if(!strcmp(argv[1], "-make")) {
+        if(argc < 3) return 1;
+        uint32_t count = argc > 3? atoi(argv[3]): 4096;
+        uint16_t size = argc > 4? atoi(argv[4]): 64;
+        return make_sample(argv[2], count, size)? 1: 0;
+    }
+
+    int max_threads = argc > 2? atoi(argv[2]): 8;
+    int passes = argc > 3? atoi(argv[3]): 4;
+    if(max_threads < 1) max_threads = 1;
+    if(max_threads > BENCH_MAX_THREADS) max_threads = BENCH_MAX_THREADS;
+
+    lgcFile *file = lgcOpenFile(argv[1], LGC_RW_ENTRIE);
+    if(!file) {
+        printf("Failed to open the file.\n");
+        return -1;
+    }
+
+    printf("%u layers\n", lgcFileLayersCount(file));
+    printf("threads      MB/s   speedup\n");
+
+    // warm the page cache, so that the storage is not measured
+    worker_t warm = {file, 0, 1, 1, 0, 0};
+    worker(&warm);
+
+    double base = 0;
+    int t, i;
+    for(t = 1; t <= max_threads; t *= 2) {
+
+        pthread_t threads[BENCH_MAX_THREADS];
+        worker_t w[BENCH_MAX_THREADS];
+
+        double start = now();
+        for(i = 0; i < t; i++) {
+            worker_t init = {file, i, t, passes, 0, 0};
+            w[i] = init;
+            pthread_create(&threads[i], NULL, worker, &w[i]);
+        }
+
+        uint64_t bytes = 0;
+        int failed = 0;
+        for(i = 0; i < t; i++) {
+            pthread_join(threads[i], NULL);
+            bytes += w[i].bytes;
+            failed += w[i].failed;
+        }
+
+        double rate = bytes/(now()-start)/1e6;
+        if(t == 1) base = rate;
+
+        printf("%7d %9.1f %8.2fx%s\n", t, rate, rate/base, failed? " (read errors)": "");
+
+    }
+
+    lgcCloseFile(file);
+    return 0;
+
+}
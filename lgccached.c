@@ -0,0 +1,50 @@
+/**
+decoded layers cache daemon
+serves layers of LGC files decoded once to the processes
+of this host through shared memory (see lgcCacheConnect)
+**/
+
+#include "lgc/lgc.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <pthread.h>
+
+int main(int argc, char *argv[]) {
+
+    if(argc < 2) {
+        printf("usage: %s [SOCKET] [SIZE_MB]\n"
+               "  serves decoded layers through the Unix socket,\n"
+               "  keeping up to SIZE_MB (256 by default) of them\n", argv[0]);
+        return 0;
+    }
+
+    uint64_t size = (argc > 2? strtoull(argv[2], NULL, 10): 256) << 20;
+
+    // Signals are taken by sigwait(), the server's threads don't get them
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    lgcCacheServer *server = lgcStartCacheServer(argv[1], size);
+    if(!server) {
+        printf("Error: can't start the server.\n");
+        return -1;
+    }
+    printf("%s: serving %llu MB\n", argv[1], (unsigned long long)(size >> 20));
+
+    int sig;
+    sigwait(&set, &sig);
+
+    uint64_t hits, misses, used;
+    lgcCacheServerStats(server, &hits, &misses, &used);
+    lgcStopCacheServer(server);
+
+    printf("%llu hits, %llu misses, %llu bytes in use\n", (unsigned long long)hits,
+           (unsigned long long)misses, (unsigned long long)used);
+    return 0;
+
+}
@@ -0,0 +1,114 @@
+/**
+dictionary trainer
+builds a shared LZ4 dictionary out of the layers of a set of
+LGC files, optionally rewriting them compressed against it
+or packing them into an archive which stores it once
+**/
+
+#include "lgc/lgc.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+static long long file_size(const char *filename) {
+    struct stat st;
+    return stat(filename, &st)? -1: (long long)st.st_size;
+}
+
+int main(int argc, char *argv[]) {
+
+    uint32_t max_size = LGC_DICT_MAX;
+    int rewrite = 0, a = 1;
+    const char *archive = NULL;
+
+    for(; a < argc && argv[a][0] == '-'; a++) {
+        if(!strcmp(argv[a], "-w")) rewrite = 1;
+        else if(!strcmp(argv[a], "-s") && a+1 < argc) max_size = atoi(argv[++a]);
+        else if(!strcmp(argv[a], "-a") && a+1 < argc) archive = argv[++a];
+        else break;
+    }
+
+    if(argc-a < 2) {
+        printf("usage: %s [-s SIZE] [-w] [-a ARCHIVE] [DICTIONARY] [LGC FILE]...\n"
+               "  -s SIZE     dictionary size in bytes, up to %u\n"
+               "  -w          rewrite the files compressed against the dictionary\n"
+               "  -a ARCHIVE  pack the files into an archive compressed against it\n",
+               argv[0], LGC_DICT_MAX);
+        return 0;
+    }
+
+    const char *dict_name = argv[a++];
+    uint32_t count = argc-a, i;
+    lgcImage **images = malloc(sizeof(lgcImage*)*count);
+
+    for(i = 0; i < count; ++i)
+        if(!(images[i] = lgcReadImage(argv[a+i], LGC_RW_ENTRIE)))
+            printf("Warning: can't read %s, it is left out.\n", argv[a+i]);
+
+    uint32_t size;
+    void *dict = lgcTrainDictionary(images, count, max_size, &size);
+    if(!dict) {
+        printf("Error: training failed.\n");
+        return -1;
+    }
+
+    FILE *f = fopen(dict_name, "wb");
+    if(!f || fwrite(dict, size, 1, f) != 1 || fclose(f)) {
+        printf("Error: can't write the dictionary (%s).\n", dict_name);
+        return -1;
+    }
+    printf("%s: %u bytes\n", dict_name, size);
+
+    int failed = 0;
+    if((rewrite || archive) && lgcSetDictionary(dict, size)) failed = 1;
+
+    // images are named by their files
+    if(archive && !failed) {
+        uint32_t n = 0;
+        const char **names = malloc(sizeof(char*)*count);
+        lgcImage **packed = malloc(sizeof(lgcImage*)*count);
+
+        for(i = 0; i < count; ++i)
+            if(images[i]) {
+                names[n] = argv[a+i];
+                packed[n++] = images[i];
+            }
+
+        if(lgcWriteArchive(archive, LGC_RW_ENTRIE|LGC_RW_DICT, n, names, packed)) {
+            printf("Error: can't write the archive (%s).\n", archive);
+            failed = 1;
+        }
+        else printf("%s: %lld bytes\n", archive, file_size(archive));
+
+        free(names);
+        free(packed);
+    }
+
+    long long before = 0, after = 0;
+    for(i = 0; rewrite && !failed && i < count; ++i) {
+        if(!images[i]) continue;
+
+        long long was = file_size(argv[a+i]);
+        if(lgcWriteToFile(argv[a+i], LGC_RW_ENTRIE|LGC_RW_DICT, images[i])) {
+            printf("Error: can't rewrite %s.\n", argv[a+i]);
+            failed = 1;
+            break;
+        }
+
+        before += was;
+        after += file_size(argv[a+i]);
+    }
+
+    if(rewrite && !failed)
+        printf("%lld -> %lld bytes (dictionary is stored in every file)\n", before, after);
+
+    for(i = 0; i < count; ++i)
+        if(images[i]) lgcDestroyImage(images[i], 1);
+    free(images);
+    free(dict);
+
+    return failed? -1: 0;
+
+}
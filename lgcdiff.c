@@ -0,0 +1,63 @@
+/**
+layers comparison tool
+tells which layers of two LGC files differ and how;
+exits with 0 if they are the same, 1 if not, 2 on errors
+**/
+
+#include "lgc/lgc.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+int main(int argc, char *argv[]) {
+
+    int threads = 0, quiet = 0, a = 1;
+
+    for(; a < argc && argv[a][0] == '-'; a++) {
+        if(!strcmp(argv[a], "-q")) quiet = 1;
+        else if(!strcmp(argv[a], "-t") && a+1 < argc) threads = atoi(argv[++a]);
+        else break;
+    }
+
+    if(argc-a != 2) {
+        printf("usage: %s [-t THREADS] [-q] [LGC FILE] [LGC FILE]\n"
+               "  -t THREADS  threads to use, one per CPU by default\n"
+               "  -q          print nothing, only exit with 1 if the files differ\n", argv[0]);
+        return 2;
+    }
+
+    lgcLayerDiff *diffs;
+    uint32_t count, i;
+    int differ = lgcDiffFiles(argv[a], argv[a+1], LGC_RW_ENTRIE, threads, &diffs, &count);
+    if(differ < 0) {
+        if(!quiet) printf("Error: can't read the files.\n");
+        return 2;
+    }
+
+    int failed = 0;
+    for(i = 0; i < count; ++i) {
+        lgcLayerDiff *d = &diffs[i];
+        if(d->changes&LGC_DIFF_ERROR) failed = 1;
+        if(quiet || !d->changes) continue;
+
+        printf("layer %u:", d->layer_n);
+        if(d->changes&LGC_DIFF_ADDED) printf(" added");
+        if(d->changes&LGC_DIFF_REMOVED) printf(" removed");
+        if(d->changes&LGC_DIFF_ERROR) printf(" read error");
+        if(d->changes&LGC_DIFF_SHAPE) printf(" size or format changed");
+        if(d->changes&LGC_DIFF_MOVED) printf(" moved");
+        if(d->changes&LGC_DIFF_HEAD) printf(" head changed");
+        if(d->changes&LGC_DIFF_PIXELS)
+            printf(" %llu pixels changed in %ux%u at %u,%u, max error %u, mean %.4f",
+                   (unsigned long long)d->changed, d->box[2], d->box[3], d->box[0], d->box[1],
+                   d->max_error, d->mean_error);
+        printf("\n");
+    }
+
+    if(!quiet) printf("%d of %u layers differ\n", differ, count);
+    free(diffs);
+
+    return failed? 2: differ? 1: 0;
+
+}
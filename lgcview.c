@@ -1,5 +1,7 @@
 /// LGC Viewer
 
+#define GL_GLEXT_PROTOTYPES
+
 #include <SDL/SDL.h>
 #include <GL/gl.h>
 #include <GL/glu.h>
@@ -7,6 +9,9 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <stddef.h>
 
 static GLfloat scene_x = 0;
 static GLfloat scene_y = 0;
@@ -18,6 +23,8 @@ static GLfloat scene_scale = 1;
 
 static int grid = 1;
 
+static int redraw = 1; // scene has changed since the last frame
+
 enum {
     KEY_NOTHING, KEY_DOWN,
     KEY_UP, KEY_PRESSED
@@ -25,19 +32,40 @@ enum {
 static int keyst[0x200];
 
 void print_layer(lgcLayer *l) {
-    printf("w: %u\nh: %u\nx: %d\ny: %d\nformat: %d\nflags: %d\nlength (z): %u\ndataptr: 0x%X\n\n",
-            l->w,
-            l->h,
+    printf("w: %u\nh: %u\nx: %d\ny: %d\nformat: %d\nflags: %d\nlength (z): %llu\ndataptr: 0x%X\n\n",
+            lgcLayerWidth(l),
+            lgcLayerHeight(l),
             l->x,
             l->y,
             l->format,
             l->flags,
-            l->length,
+            (unsigned long long)lgcLayerLength(l),
             (unsigned int)l->data
     );
 
 }
 
+void handle_event(SDL_Event *ev) {
+
+    if(ev->type == SDL_QUIT)
+        exit(0);
+
+    if(ev->type == SDL_KEYDOWN)
+        keyst[ev->key.keysym.sym] = KEY_DOWN;
+    if(ev->type == SDL_KEYUP)
+        keyst[ev->key.keysym.sym] = KEY_UP;
+
+    if(ev->type == SDL_VIDEOEXPOSE || ev->type == SDL_ACTIVEEVENT)
+        redraw = 1;
+
+}
+
+// Returns non-zero while any of the continuous (held) keys is down
+int keys_held() {
+    return keyst[SDLK_UP] || keyst[SDLK_DOWN] || keyst[SDLK_LEFT] || keyst[SDLK_RIGHT]
+        || keyst[SDLK_i] || keyst[SDLK_o];
+}
+
 void eventloop() {
     SDL_Event ev;
 
@@ -47,26 +75,37 @@ void eventloop() {
         if(keyst[i] == KEY_UP) keyst[i] = KEY_NOTHING;
     }
 
-    if(SDL_PollEvent(&ev)) {
-
-        if(ev.type == SDL_QUIT)
-            exit(0);
-
-        if(ev.type == SDL_KEYDOWN)
-            keyst[ev.key.keysym.sym] = KEY_DOWN;
-        if(ev.type == SDL_KEYUP)
-            keyst[ev.key.keysym.sym] = KEY_UP;
-
+    // Nothing is animating: sleep in the event queue instead of spinning
+    if(!redraw && !keys_held()) {
+        if(!SDL_WaitEvent(&ev)) return;
+        handle_event(&ev);
     }
+
+    while(SDL_PollEvent(&ev))
+        handle_event(&ev);
 }
 
-#define SCENE_MOVEMENT_SPEED (-8.0*scene_scale)
+// Speeds are given per 32 ms step (the old fixed frame time),
+// so motion does not depend on the display refresh rate.
+#define SCENE_STEP_MS 32.0
+#define SCENE_MOVEMENT_SPEED (-8.0*scene_scale*steps)
 #define SCENE_SCALING_SPEED 0.95
 
 void kpress_logic() {
 
+    static Uint32 last_ticks = 0; // zero while idle
+    Uint32 now = SDL_GetTicks();
+    double steps = last_ticks? (now-last_ticks)/SCENE_STEP_MS: 1;
+    if(steps > 4) steps = 4;
+
     if(keyst[SDLK_q] == KEY_DOWN) exit(0);
 
+    if(keys_held()) {
+        redraw = 1;
+        last_ticks = now;
+    }
+    else last_ticks = 0;
+
     // Movement
     if(keyst[SDLK_UP]) scene_y -= SCENE_MOVEMENT_SPEED;
     if(keyst[SDLK_LEFT]) scene_x -= SCENE_MOVEMENT_SPEED;
@@ -76,14 +115,17 @@ void kpress_logic() {
 
     // Zoom
     if(keyst[SDLK_i]) {
-        scene_scale /= SCENE_SCALING_SPEED;
+        scene_scale /= pow(SCENE_SCALING_SPEED, steps);
     }
     if(keyst[SDLK_o]) {
-        scene_scale *= SCENE_SCALING_SPEED;
+        scene_scale *= pow(SCENE_SCALING_SPEED, steps);
     }
 
     // Grid toggling
-    if(keyst[SDLK_g] == KEY_DOWN) grid =! grid;
+    if(keyst[SDLK_g] == KEY_DOWN) {
+        grid =! grid;
+        redraw = 1;
+    }
 
 }
 
@@ -109,6 +151,7 @@ int init(uint16_t w, uint16_t h) {
     SDL_GL_SetAttribute(SDL_GL_RED_SIZE, 8);
     SDL_GL_SetAttribute(SDL_GL_GREEN_SIZE, 8);
     SDL_GL_SetAttribute(SDL_GL_BLUE_SIZE, 8);
+    SDL_GL_SetAttribute(SDL_GL_SWAP_CONTROL, 1); // pan at display refresh rate
 
     if(SDL_SetVideoMode(w, h, 0, SDL_OPENGL | SDL_OPENGLBLIT) == NULL)
     {
@@ -137,133 +180,344 @@ int init(uint16_t w, uint16_t h) {
     return 0;
 }
 
+/*  All scene geometry lives in one vertex buffer, built once at load time
+    in scene coordinates: the layer quads first (4 vertices each), then
+    the grid lines. Panning and zooming only touch the modelview matrix. */
+
+typedef struct {
+    GLfloat x, y;
+    GLfloat s, t;
+}
+vertex_t;
+
+#define GRID_EXTENT 1024
+#define GRID_FINE   32
+#define GRID_COARSE 512
+
+#define GRID_FINE_LINES     (4*(2*GRID_EXTENT/GRID_FINE+1))
+#define GRID_COARSE_LINES   (4*(2*GRID_EXTENT/GRID_COARSE+1))
+#define GRID_AXES_LINES     4
+#define GRID_VERTICES       (GRID_FINE_LINES+GRID_COARSE_LINES+GRID_AXES_LINES)
+
 typedef struct {
     GLuint *gltex;
     lgcImage *srcimg;
+
+    GLuint vbo;             // 0 if buffer objects are unsupported
+    vertex_t *vertices;     // client-side copy, used when vbo == 0
+    GLsizei grid_first;     // index of the first grid vertex
 }
 imagepack_t;
 
+#ifndef GL_COMPRESSED_RGBA_S3TC_DXT1_EXT
+#define GL_COMPRESSED_RGBA_S3TC_DXT1_EXT 0x83F1
+#endif
+#ifndef GL_COMPRESSED_RGBA_S3TC_DXT5_EXT
+#define GL_COMPRESSED_RGBA_S3TC_DXT5_EXT 0x83F3
+#endif
+#ifndef GL_COMPRESSED_RGBA_BPTC_UNORM
+#define GL_COMPRESSED_RGBA_BPTC_UNORM 0x8E8C
+#endif
+
+static int has_extension(const char *name) {
+    const char *ext = (const char*)glGetString(GL_EXTENSIONS);
+    size_t len = strlen(name);
+
+    while(ext && (ext = strstr(ext, name))) {
+        if(ext[len] == ' ' || !ext[len]) return 1;
+        ext += len;
+    }
+
+    return 0;
+}
+
+// GL format for a block-compressed layer, 0 if the driver lacks it
+static GLenum block_format(uint8_t format) {
+    switch(format&~LGC_FMT_COMPRESSED) {
+        case LGC_FMT_BC1: return has_extension("GL_EXT_texture_compression_s3tc")?
+            GL_COMPRESSED_RGBA_S3TC_DXT1_EXT: 0;
+        case LGC_FMT_BC3: return has_extension("GL_EXT_texture_compression_s3tc")?
+            GL_COMPRESSED_RGBA_S3TC_DXT5_EXT: 0;
+        case LGC_FMT_BC7: return has_extension("GL_ARB_texture_compression_bptc")?
+            GL_COMPRESSED_RGBA_BPTC_UNORM: 0;
+    }
+    return 0;
+}
+
+static int vbo_supported() {
+    const char *ver = (const char*)glGetString(GL_VERSION);
+    int major = 0, minor = 0;
+    if(!ver || sscanf(ver, "%d.%d", &major, &minor) != 2) return 0;
+    return major > 1 || (major == 1 && minor >= 5);
+}
+
+// Uploads pixels of the layer (gray, RGB or RGBA) as one level of the bound texture
+static void upload_level(const lgcLayer *l, GLint level) {
+    switch(LGC_BYTES_PER_PIXEL(l->format)) {
+        case 1: glTexImage2D(GL_TEXTURE_2D, level, 1, l->w, l->h, 0,
+                              GL_RED, GL_UNSIGNED_BYTE, l->data); break;
+        case 3: glTexImage2D(GL_TEXTURE_2D, level, GL_RGB, l->w, l->h, 0,
+                              GL_RGB, GL_UNSIGNED_BYTE, l->data); break;
+        case 4: glTexImage2D(GL_TEXTURE_2D, level, GL_RGBA, l->w, l->h, 0,
+                              GL_RGBA, GL_UNSIGNED_BYTE, l->data); break;
+    }
+}
+
+// Uploads the layer with a chain of reduced copies for zooming out,
+// resampled down to the texture size limit first if it is larger
+static void upload_layer(const lgcLayer *l, GLint max_size) {
+    lgcLayer *fit = NULL, *mip = NULL;
+
+    uint32_t lw = lgcLayerWidth(l), lh = lgcLayerHeight(l);
+    if(lw > max_size || lh > max_size) {
+        double k = (double)max_size/(lw > lh? lw: lh);
+        uint32_t w = lw*k, h = lh*k;
+        fit = lgcResizeLayer(l, w? w: 1, h? h: 1, LGC_FILTER_LANCZOS);
+        if(!fit) return;
+        l = fit;
+    }
+
+    GLint level = 0;
+    upload_level(l, level);
+
+    // GL wants halves rounded down
+    const lgcLayer *prev = l;
+    while(prev->w > 1 || prev->h > 1) {
+        lgcLayer *next = lgcResizeLayer(prev, prev->w > 1? prev->w/2: 1,
+                                        prev->h > 1? prev->h/2: 1, LGC_FILTER_BILINEAR);
+        if(mip) lgcDestroyLayer(mip, 1);
+        if(!(mip = next)) break;
+        upload_level(mip, ++level);
+        prev = mip;
+    }
+    if(mip) lgcDestroyLayer(mip, 1);
+    if(fit) lgcDestroyLayer(fit, 1);
+
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, level);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+}
+
+static vertex_t *grid_lines(vertex_t *v, int step) {
+    GLint i;
+    for(i = -GRID_EXTENT; i <= GRID_EXTENT; i += step) {
+
+        v->x = i; v->y = -GRID_EXTENT; v++;
+        v->x = i; v->y = GRID_EXTENT; v++;
+
+        v->x = -GRID_EXTENT; v->y = i; v++;
+        v->x = GRID_EXTENT; v->y = i; v++;
+
+    }
+
+    return v;
+}
+
+void build_geometry(imagepack_t *pk) {
+
+    uint32_t lc = pk->srcimg->layers_count;
+    GLsizei count = lc*4+GRID_VERTICES;
+
+    vertex_t *v = calloc(count, sizeof(vertex_t));
+
+    uint32_t i;
+    for(i = 0; i < lc; i++) {
+        lgcLayer *l = &pk->srcimg->layers[i];
+        vertex_t *q = &v[i*4];
+
+        q[0].x = l->x;      q[0].y = l->y;      q[0].s = 0; q[0].t = 0;
+        q[1].x = l->x;      q[1].y = l->y+l->h; q[1].s = 0; q[1].t = 1;
+        q[2].x = l->x+l->w; q[2].y = l->y+l->h; q[2].s = 1; q[2].t = 1;
+        q[3].x = l->x+l->w; q[3].y = l->y;      q[3].s = 1; q[3].t = 0;
+    }
+
+    pk->grid_first = lc*4;
+    vertex_t *g = grid_lines(&v[pk->grid_first], GRID_FINE);
+    g = grid_lines(g, GRID_COARSE);
+
+    // Axes
+    g[0].x = 0; g[0].y = -GRID_EXTENT;
+    g[1].x = 0; g[1].y = GRID_EXTENT;
+    g[2].x = -GRID_EXTENT; g[2].y = 0;
+    g[3].x = GRID_EXTENT; g[3].y = 0;
+
+    pk->vbo = 0;
+    pk->vertices = v;
+
+    if(vbo_supported()) {
+        glGenBuffers(1, &pk->vbo);
+        glBindBuffer(GL_ARRAY_BUFFER, pk->vbo);
+        glBufferData(GL_ARRAY_BUFFER, count*sizeof(vertex_t), v, GL_STATIC_DRAW);
+
+        free(pk->vertices);
+        pk->vertices = NULL;
+    }
+
+    const char *base = (const char*)pk->vertices; // NULL means offsets into the VBO
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+    glVertexPointer(2, GL_FLOAT, sizeof(vertex_t), base+offsetof(vertex_t, x));
+    glTexCoordPointer(2, GL_FLOAT, sizeof(vertex_t), base+offsetof(vertex_t, s));
+
+}
+
 imagepack_t *imgload(const char *filename) {
-    lgcImage *img = lgcReadImage(filename, LGC_RW_ENTRIE);
+    lgcImage *img = lgcReadImage(filename, LGC_RW_ENTRIE|LGC_RW_SHARE);
     if(!img) return NULL;
     if(!img->layers_count) return NULL;
 
     GLuint *gltex = malloc(sizeof(GLuint)*img->layers_count);
     glGenTextures(img->layers_count, gltex);
 
-    int i;
+    GLint maxTexSize;
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxTexSize);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+    int i, j;
     for(i = 0; i < img->layers_count; i++) {
         printf("layer %d:\n", i);
         print_layer(&img->layers[i]);
 
-        if(img->layers[i].format&56) continue; // skipping if pixel format is not gray of RGB
+        // Layers we can't upload are drawn untextured; they share texture 0
+        // so that neighbouring ones can still be batched together
+        int indexed = (img->layers[i].format&~LGC_FMT_COMPRESSED) == LGC_FMT_INDEXED8;
+        if((img->layers[i].format&56 && !indexed) || (img->layers[i].format&LGC_FMT_BLOCK &&
+            (img->layers[i].w > maxTexSize || img->layers[i].h > maxTexSize))) {
+            glDeleteTextures(1, &gltex[i]);
+            gltex[i] = 0;
+            continue; // skipping if pixel format is not gray of RGB or blocks are too large
+        }
+
+        // Identical layers share their pixels, so they can share the texture too
+        for(j = 0; img->layers[i].data && j < i; j++)
+            if(img->layers[j].data == img->layers[i].data && gltex[j]) break;
 
-        GLint maxTexSize;
-        glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxTexSize);
-        if(img->layers[i].w > maxTexSize)
+        if(img->layers[i].data && j < i) {
+            glDeleteTextures(1, &gltex[i]);
+            gltex[i] = gltex[j];
             continue;
+        }
 
         glBindTexture(GL_TEXTURE_2D, gltex[i]);
 
+        // pixels stay sharp when zoomed in, and smooth when zoomed out
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
 
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
 
-        img->layers[i].data = realloc(img->layers[i].data, img->layers[i].length+1563);
+        lgcLayer *l = &img->layers[i];
+
+        // Blocks go to the GPU as they are stored, or decoded where it can't take them
+        if(l->format&LGC_FMT_BLOCK) {
+            GLenum gl_format = block_format(l->format);
+            if(gl_format) {
+                glCompressedTexImage2D(GL_TEXTURE_2D, 0, gl_format, l->w, l->h, 0, l->length, l->data);
+                continue;
+            }
+
+            void *rgba = lgcDecodeBlocks(l);
+            if(rgba)
+                glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, l->w, l->h, 0, GL_RGBA, GL_UNSIGNED_BYTE, rgba);
+            free(rgba);
+            continue;
+        }
 
-        switch(LGC_BYTES_PER_PIXEL(img->layers[i].format)) {
-            case 1: glTexImage2D(GL_TEXTURE_2D, 0, 1, img->layers[i].w, img->layers[i].h, 0,
-                                  GL_RED, GL_UNSIGNED_BYTE, img->layers[i].data); break;
-            case 3: glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, img->layers[i].w, img->layers[i].h, 0,
-                                  GL_RGB, GL_UNSIGNED_BYTE, img->layers[i].data); break;
-            case 4: glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, img->layers[i].w, img->layers[i].h, 0,
-                                  GL_RGBA, GL_UNSIGNED_BYTE, img->layers[i].data); break;
+        // Palettes are expanded to RGBA, textures of indices would need a shader
+        if(indexed) {
+            lgcLayer rgba = *l;
+            rgba.format = LGC_FMT_RGBA8;
+            rgba.length = LGC_LAYER_BODY_LENGTH((&rgba));
+            rgba.data = lgcExpandPalette(l);
+            if(rgba.data) upload_layer(&rgba, maxTexSize);
+            free(rgba.data);
+            continue;
         }
 
+        upload_layer(l, maxTexSize);
+
     }
 
     imagepack_t *pk = malloc(sizeof(imagepack_t));
     pk->gltex = gltex;
     pk->srcimg = img;
+    build_geometry(pk);
     return pk;
 
 }
 
-void draw_grid() {
+void scene_transform() {
 
     glLoadIdentity();
-    glTranslatef(scene_x/scene_scale+SDL_GetVideoSurface()->w/2,
-        scene_y/scene_scale+SDL_GetVideoSurface()->h/2, 0);
+    glTranslatef(SDL_GetVideoSurface()->w/2, SDL_GetVideoSurface()->h/2, 0);
+    glScalef(1/scene_scale, 1/scene_scale, 1);
+    glTranslatef(scene_x, scene_y, 0);
 
-    glColor3f(0, 0, 0.5);
-
-    glBegin(GL_LINES);
+}
 
-    GLint i;
-    for(i = -1024; i <= 1024; i += 32) {
+void draw_grid(imagepack_t *pk) {
 
-        glVertex3f(i/scene_scale, -1024/scene_scale, -1);
-        glVertex3f(i/scene_scale, 1024/scene_scale, -1);
+    glDisable(GL_TEXTURE_2D);
 
-        glVertex3f(-1024/scene_scale, i/scene_scale, -1);
-        glVertex3f(1024/scene_scale, i/scene_scale, -1);
+    GLsizei first = pk->grid_first;
 
-    }
+    glColor3f(0, 0, 0.5);
+    glDrawArrays(GL_LINES, first, GRID_FINE_LINES);
+    first += GRID_FINE_LINES;
 
     glColor3f(0, 0.25, 1);
-    for(i = -1024; i <= 1024; i += 512) {
-
-        glVertex3f(i/scene_scale, -1024/scene_scale, -1);
-        glVertex3f(i/scene_scale, 1024/scene_scale, -1);
-
-        glVertex3f(-1024/scene_scale, i/scene_scale, -1);
-        glVertex3f(1024/scene_scale, i/scene_scale, -1);
-
-    }
+    glDrawArrays(GL_LINES, first, GRID_COARSE_LINES);
+    first += GRID_COARSE_LINES;
 
     glColor3f(1, 1, 1);
+    glDrawArrays(GL_LINES, first, GRID_AXES_LINES);
 
-    glVertex3f(0/scene_scale, -1024/scene_scale, -1);
-    glVertex3f(0/scene_scale, 1024/scene_scale, -1);
-
-    glVertex3f(-1024/scene_scale, 0/scene_scale, -1);
-    glVertex3f(1024/scene_scale, 0/scene_scale, -1);
+}
 
-    glEnd();
+void draw_images(imagepack_t *pk) {
 
-}
+    // Visible part of the scene, for culling off-screen layers
+    GLfloat half_w = SDL_GetVideoSurface()->w/2*scene_scale;
+    GLfloat half_h = SDL_GetVideoSurface()->h/2*scene_scale;
+    GLfloat vx0 = -half_w-scene_x, vx1 = half_w-scene_x;
+    GLfloat vy0 = -half_h-scene_y, vy1 = half_h-scene_y;
 
-#define DISTANCE_DIV 50
+    glColor4f(1,1,1,1);
+    glEnable(GL_TEXTURE_2D);
 
-void draw_images(imagepack_t *pk) {
-    int i; for(i = 0; i < pk->srcimg->layers_count; i++) {
+    // Consecutive visible layers sharing a texture go out in one draw call
+    GLuint bound = 0;
+    glBindTexture(GL_TEXTURE_2D, 0);
 
-        glColor4f(1,1,1,1);
-        glBindTexture(GL_TEXTURE_2D, pk->gltex[i]);
+    GLint run_first = 0;
+    GLsizei run_count = 0;
 
-        glEnable(GL_TEXTURE_2D);
+    uint32_t i; for(i = 0; i < pk->srcimg->layers_count; i++) {
 
-        glLoadIdentity();
-        glTranslatef((pk->srcimg->layers[i].x+scene_x)/scene_scale+SDL_GetVideoSurface()->w/2,
-            (pk->srcimg->layers[i].y+scene_y)/scene_scale+SDL_GetVideoSurface()->h/2,0);
+        lgcLayer *l = &pk->srcimg->layers[i];
+        if(l->x > vx1 || l->y > vy1 || l->x+l->w < vx0 || l->y+l->h < vy0)
+            continue;
 
-        glBegin(GL_QUADS);
+        if(run_count && (pk->gltex[i] != bound || run_first+run_count != i*4)) {
+            glDrawArrays(GL_QUADS, run_first, run_count);
+            run_count = 0;
+        }
 
-        glTexCoord2f(0, 0);
-        glVertex4f(0, 0, (GLfloat)i/(GLfloat)DISTANCE_DIV, scene_scale);
-        glTexCoord2f(0, 1);
-        glVertex4f(0, pk->srcimg->layers[i].h, (GLfloat)i/(GLfloat)DISTANCE_DIV, scene_scale);
-        glTexCoord2f(1, 1);
-        glVertex4f(pk->srcimg->layers[i].w,pk->srcimg->layers[i].h, (GLfloat)i/(GLfloat)DISTANCE_DIV, scene_scale);
-        glTexCoord2f(1, 0);
-        glVertex4f(pk->srcimg->layers[i].w, 0, (GLfloat)i/(GLfloat)DISTANCE_DIV, scene_scale);
+        if(!run_count) {
+            if(pk->gltex[i] != bound) {
+                bound = pk->gltex[i];
+                glBindTexture(GL_TEXTURE_2D, bound);
+            }
+            run_first = i*4;
+        }
 
-        glEnd();
+        run_count += 4;
 
     }
 
+    if(run_count)
+        glDrawArrays(GL_QUADS, run_first, run_count);
+
 }
 
 int main(int argc, char *argv[]) {
@@ -280,14 +534,16 @@ int main(int argc, char *argv[]) {
         eventloop();
         kpress_logic();
 
+        if(!redraw) continue;
+        redraw = 0;
+
         glClear( GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT );
 
-        if(grid) draw_grid();
+        scene_transform();
+        if(grid) draw_grid(pk);
         draw_images(pk);
         SDL_GL_SwapBuffers();
 
-        SDL_Delay(32);
-
     }
 
     SDL_Quit();
@@ -2,6 +2,34 @@
 
 #include <malloc.h>
 #include <string.h>
+#include <pthread.h>
+
+// Keeps the loaded layer where the request tells
+static void storeLoaded(const lgcLoadRequest *request, lgcLayer *layer) {
+    *(lgcLayer**)request->user = layer;
+}
+
+typedef struct {
+    lgcFile *file;
+    lgcImage *image;
+    int failed;
+} fileReads;
+
+// Reads every layer of the file a few times, comparing them with the image's
+static void * readLayers(void *arg) {
+    fileReads *r = arg;
+    uint32_t i;
+    int round;
+    for(round = 0; round < 8; ++round)
+        for(i = 0; i < r->image->layers_count; ++i) {
+            lgcLayer *l = lgcFileReadLayer(r->file, LGC_RW_ENTRIE|LGC_RW_VERIFY, i);
+            if(!l || l->length != r->image->layers[i].length ||
+                memcmp(l->data, r->image->layers[i].data, l->length))
+                r->failed = 1;
+            if(l) lgcDestroyLayer(l, 1);
+        }
+    return NULL;
+}
 
 int main() {
 
@@ -46,6 +74,29 @@ int main() {
     free(img->layers);
     free(img);
 
+    printf("levels test\n");
+    lgcLayer *ll = lgcBlankLayer();
+    ll->w = 320;
+    ll->h = 240;
+    ll->x = 100;
+    ll->format = LGC_FMT_RGBA8|LGC_FMT_COMPRESSED;
+    ll->length = LGC_LAYER_BODY_LENGTH(ll);
+    ll->data = malloc(ll->length);
+    memset(ll->data, 'a', ll->length);
+    lgcSetLayerLevels(ll, 3);
+    lgcImage *leveled = lgcBlankImage();
+    lgcPushLayer(leveled, ll);
+    lgcWriteToFile("ngtest_levels.lc1", LGC_RW_ENTRIE, leveled);
+    lgcLayer *lv = lgcReadLayerLevel("ngtest_levels.lc1", LGC_RW_ENTRIE, 0, 2);
+    if(!lv || lv->w != 80 || lv->h != 60 || lv->x != 25 || lgcLayerLevels(lv) != 3
+        || ((char*)lv->data)[lv->length-1] != 'a') {
+        printf("level read fail\n");
+        return 1;
+    }
+    lgcDestroyLayer(lv, 1);
+    lgcDestroyLayer(ll, 1);
+    lgcDestroyImage(leveled, 1);
+
     printf("load/resave test\n");
     lgcImage *test2 = lgcReadImage("ngtest.lc1", LGC_RW_ENTRIE);
     if(test2 == NULL) {
@@ -74,6 +125,356 @@ int main() {
     lgcWriteToFile("ngtest_2.lc1", LGC_RW_ENTRIE, test2);
     printf("layers: %u\n", test2->layers_count);
 
+    printf("dedup test\n");
+    lgcImage *shared = lgcReadImage("ngtest_2.lc1", LGC_RW_ENTRIE|LGC_RW_SHARE);
+    if(!shared || shared->layers_count != 3 || shared->layers[2].x != 50 ||
+        shared->layers[1].data != shared->layers[2].data) {
+        printf("shared read fail\n");
+        return 1;
+    }
+    lgcDestroyImage(shared, 1);
+
+    printf("verify test\n");
+    if(lgcVerifyFile("ngtest_2.lc1", LGC_RW_ENTRIE, 0)) {
+        printf("verify fail\n");
+        return 1;
+    }
+
+    printf("loader test\n");
+    lgcLayer *loaded[4] = {NULL, NULL, NULL, NULL};
+    lgcLoadRequest requests[4] = {
+        {"ngtest_levels.lc1", 0, 2, &loaded[0]},
+        {"ngtest_2.lc1", 2, 0, &loaded[1]},
+        {"ngtest_2.lc1", 1, 0, &loaded[2]},
+        {"ngtest_2.lc1", 99, 0, &loaded[3]}
+    };
+    int k;
+    lgcLoader *loader = lgcCreateLoader(LGC_RW_ENTRIE|LGC_RW_VERIFY, 2, storeLoaded);
+    if(!loader || lgcLoaderWait(loader) ||
+        lgcLoaderSubmit(loader, requests, 4) || lgcLoaderWait(loader) != 1 ||
+        !loaded[0] || loaded[0]->w != 80 || ((char*)loaded[0]->data)[0] != 'a' ||
+        !loaded[1] || memcmp(loaded[1]->data, lr->data, lr->length) ||
+        !loaded[2] || loaded[2]->length != 128*128 || loaded[3] ||
+        lgcLoaderSubmit(loader, &requests[3], 1) || lgcLoaderWait(loader) != 1) {
+        printf("loader fail\n");
+        return 1;
+    }
+    for(k = 0; k < 3; ++k)
+        lgcDestroyLayer(loaded[k], 1);
+    lgcDestroyLoader(loader);
+
+    // heads alone, and nothing read at all
+    loader = lgcCreateLoader(LGC_RW_HEAD, 0, storeLoaded);
+    if(!loader || lgcLoaderSubmit(loader, requests, 3) || lgcLoaderWait(loader) ||
+        !loaded[0] || loaded[0]->w != 80 || loaded[0]->data ||
+        !loaded[1] || loaded[1]->x != 50 || loaded[1]->data || !loaded[2]) {
+        printf("loader heads fail\n");
+        return 1;
+    }
+    for(k = 0; k < 3; ++k)
+        lgcDestroyLayer(loaded[k], 1);
+    lgcDestroyLoader(loader);
+
+    printf("file test\n");
+    lgcFile *file = lgcOpenFile("ngtest_2.lc1", LGC_RW_ENTRIE);
+    fileReads reads[2] = {{file, test2, 0}, {file, test2, 0}};
+    pthread_t reader;
+    if(!file || lgcFileLayersCount(file) != 3 || lgcFileReadLayer(file, LGC_RW_ENTRIE, 3) ||
+        pthread_create(&reader, NULL, readLayers, &reads[0])) {
+        printf("file open fail\n");
+        return 1;
+    }
+    readLayers(&reads[1]);
+    pthread_join(reader, NULL);
+    lgcCloseFile(file);
+    if(reads[0].failed || reads[1].failed) {
+        printf("file read fail\n");
+        return 1;
+    }
+
+    printf("diff test\n");
+    lgcLayerDiff *diffs;
+    uint32_t diffs_count;
+    if(lgcDiffFiles("ngtest_out.lc1", "ngtest_2.lc1", LGC_RW_ENTRIE, 0, &diffs, &diffs_count) != 1 ||
+        diffs_count != 3 || diffs[0].changes || diffs[1].changes ||
+        diffs[2].changes != LGC_DIFF_ADDED) {
+        printf("diff fail\n");
+        return 1;
+    }
+    free(diffs);
+
+    printf("memory test\n");
+    void *mem;
+    size_t mem_size;
+    if(lgcWriteImageToBuffer(test2, LGC_RW_ENTRIE, &mem, &mem_size)) {
+        printf("buffer write fail\n");
+        return 1;
+    }
+    lgcImage *in_mem = lgcReadImageFromMemory(mem, mem_size, LGC_RW_ENTRIE|LGC_RW_NO_COPY);
+    if(!in_mem || in_mem->layers_count != test2->layers_count ||
+        memcmp(in_mem->layers[2].data, test2->layers[2].data, test2->layers[2].length)) {
+        printf("memory read fail\n");
+        return 1;
+    }
+    lgcDestroyImage(in_mem, 1);
+    free(mem);
+
+    printf("delta test\n");
+    lgcWriteToFile("ngtest_delta.lc1", LGC_RW_ENTRIE|LGC_RW_DELTA, test2);
+    lgcPlayer *player = lgcOpenPlayer("ngtest_delta.lc1", LGC_RW_ENTRIE|LGC_RW_VERIFY);
+    const lgcLayer *frame;
+    uint32_t frames = 0;
+    while(player && (frame = lgcPlayerNextFrame(player))) {
+        if(memcmp(frame->data, test2->layers[frames].data, frame->length)) break;
+        frames++;
+    }
+    if(frames != test2->layers_count) {
+        printf("delta playback fail\n");
+        return 1;
+    }
+    lgcClosePlayer(player);
+
+    printf("sparse test\n");
+    lgcLayer *sp = lgcBlankLayer();
+    sp->w = sp->h = 64;
+    sp->format = LGC_FMT_RGBA8|LGC_FMT_COMPRESSED;
+    sp->length = LGC_LAYER_BODY_LENGTH(sp);
+    sp->data = calloc(sp->length, 1);
+    ((uint32_t*)sp->data)[10*64+20] = ((uint32_t*)sp->data)[30*64+5] = 0xff0000ff;
+    lgcImage *sparse = lgcBlankImage();
+    sparse->magic = LGC_MAGIC;
+    lgcPushLayer(sparse, sp);
+    // black borders of layers without alpha are kept
+    sp->format = LGC_FMT_RGB8|LGC_FMT_COMPRESSED;
+    sp->length = LGC_LAYER_BODY_LENGTH(sp);
+    lgcPushLayer(sparse, sp);
+    lgcWriteToFile("ngtest_sparse.lc1", LGC_RW_ENTRIE|LGC_RW_SPARSE, sparse);
+    lgcLayer *trimmed = lgcReadLayer("ngtest_sparse.lc1", LGC_RW_ENTRIE, 0);
+    lgcLayer *opaque = lgcReadLayer("ngtest_sparse.lc1", LGC_RW_ENTRIE, 1);
+    if(!trimmed || trimmed->x != 5 || trimmed->y != 10 || trimmed->w != 16 || trimmed->h != 21 ||
+        ((uint32_t*)trimmed->data)[15] != 0xff0000ff || ((uint32_t*)trimmed->data)[20*16] != 0xff0000ff ||
+        !opaque || opaque->x || opaque->w != 64 || opaque->h != 64) {
+        printf("sparse read fail\n");
+        return 1;
+    }
+    lgcDestroyLayer(trimmed, 1);
+    lgcDestroyLayer(opaque, 1);
+    lgcDestroyLayer(sp, 1);
+    lgcDestroyImage(sparse, 1);
+
+    printf("block test\n");
+    lgcLayer *bl = lgcBlankLayer();
+    bl->w = 30;
+    bl->h = 20;
+    bl->format = LGC_FMT_RGBA8;
+    lgcSetLayerLevels(bl, 2);
+    bl->length = LGC_LAYER_BODY_LENGTH(bl);
+    bl->data = malloc(bl->length);
+    memset(bl->data, 0x80, bl->length);
+    lgcImage *blocks = lgcBlankImage();
+    blocks->magic = LGC_MAGIC;
+    if(lgcEncodeLayer(bl, LGC_FMT_BC7, 0) || bl->length != 8*5*16) {
+        printf("block encode fail\n");
+        return 1;
+    }
+    lgcPushLayer(blocks, bl);
+    lgcWriteToFile("ngtest_block.lc1", LGC_RW_ENTRIE, blocks);
+    lgcLayer *bc = lgcReadLayerLevel("ngtest_block.lc1", LGC_RW_ENTRIE, 0, 1);
+    uint8_t *decoded = bc? lgcDecodeBlocks(bc): NULL;
+    if(!decoded || bc->w != 15 || decoded[15*10*4-1] != 0x80) {
+        printf("block read fail\n");
+        return 1;
+    }
+    free(decoded);
+    lgcDestroyLayer(bc, 1);
+    lgcDestroyLayer(bl, 1);
+    lgcDestroyImage(blocks, 1);
+
+    printf("wide test\n");
+    lgcLayer *wl = lgcBlankLayer();
+    wl->format = LGC_FMT_GRAY|LGC_FMT_COMPRESSED;
+    lgcSetLayerSize(wl, 70000, 2, 140000);
+    lgcSetLayerLevels(wl, 1);
+    wl->data = malloc(140000);
+    memset(wl->data, 'w', 140000);
+    lgcImage *wide = lgcBlankImage();
+    lgcPushLayer(wide, wl);
+    lgcWriteToFile("ngtest_wide.lc1", LGC_RW_ENTRIE, wide);
+    lgcImage *wide_in = lgcReadImage("ngtest_wide.lc1", LGC_RW_ENTRIE);
+    lgcLayer *wide_level = lgcReadLayerLevel("ngtest_wide.lc1", LGC_RW_ENTRIE, 0, 1);
+    if(!wide_in || wide_in->magic != LGC_MAGIC_V2 || lgcLayerWidth(&wide_in->layers[0]) != 70000 ||
+        wide_in->layers[0].w != 0xffff || ((char*)wide_in->layers[0].data)[69999] != 'w' ||
+        !wide_level || lgcLayerWidth(wide_level) != 35000) {
+        printf("wide read fail\n");
+        return 1;
+    }
+    lgcDestroyLayer(wide_level, 1);
+    lgcDestroyImage(wide_in, 1);
+    lgcDestroyLayer(wl, 1);
+    lgcDestroyImage(wide, 1);
+
+    printf("v1 test\n");
+    // 2x1 gray layer with the application's flags in the upper byte
+    uint8_t v1[LGC_BASE_OFFSET+8+21+2] = {0};
+    uint8_t v1_head[8+21+2] = {0xff, 0x06, 0x00, 0x10, 1, 0, 0, 0, 2, 0, 1, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0x05, 0, 0, 0x01, 2, 0, 0, 0, 'a', 'b'};
+    memcpy(v1+LGC_BASE_OFFSET, v1_head, sizeof(v1_head));
+    FILE *v1_file = fopen("ngtest_v1.lc1", "wb");
+    fwrite(v1, sizeof(v1), 1, v1_file);
+    fclose(v1_file);
+    lgcImage *v1_in = lgcReadImage("ngtest_v1.lc1", LGC_RW_ENTRIE);
+    if(!v1_in || v1_in->magic != LGC_MAGIC || v1_in->layers_count != 1 ||
+        v1_in->layers[0].flags != 0x01000005 || v1_in->layers[0].length != 2 ||
+        memcmp(v1_in->layers[0].data, "ab", 2)) {
+        printf("v1 read fail\n");
+        return 1;
+    }
+    lgcDestroyImage(v1_in, 1);
+    // editing turns it into v2, unless the flags would mean something else there
+    if(!lgcDeleteLayerFromFile("ngtest_v1.lc1", LGC_RW_ENTRIE, 0)) {
+        printf("v1 edit fail\n");
+        return 1;
+    }
+    v1[LGC_BASE_OFFSET+8+16] = 0;
+    v1_file = fopen("ngtest_v1.lc1", "wb");
+    fwrite(v1, sizeof(v1), 1, v1_file);
+    fclose(v1_file);
+    lgcDeleteLayerFromFile("ngtest_v1.lc1", LGC_RW_ENTRIE, 0);
+    v1_in = lgcReadImage("ngtest_v1.lc1", LGC_RW_ENTRIE);
+    if(!v1_in || v1_in->magic != LGC_MAGIC_V2 || v1_in->layers_count) {
+        printf("v1 edit fail\n");
+        return 1;
+    }
+    lgcDestroyImage(v1_in, 1);
+
+    printf("resize test\n");
+    lgcLayer *rs = lgcResizeLayer(&test2->layers[0], 100, 75, LGC_FILTER_LANCZOS);
+    if(!rs || rs->w != 100 || rs->h != 75 || rs->x != 31 ||
+        ((char*)rs->data)[rs->length-1] != 'a') {
+        printf("resize fail\n");
+        return 1;
+    }
+    lgcDestroyLayer(rs, 1);
+
+    printf("palette test\n");
+    uint32_t i;
+    lgcLayer *pl = lgcBlankLayer();
+    pl->w = pl->h = 64;
+    pl->format = LGC_FMT_RGBA8|LGC_FMT_COMPRESSED;
+    lgcSetLayerLevels(pl, 1);
+    pl->length = LGC_LAYER_BODY_LENGTH(pl);
+    pl->data = malloc(pl->length);
+    for(i = 0; i < 64*64; ++i)
+        ((uint32_t*)pl->data)[i] = 0xff000000 | (i%7)*0x112233;
+    lgcImage *paletted = lgcBlankImage();
+    lgcPushLayer(paletted, pl);
+    lgcWriteToFile("ngtest_palette.lc1", LGC_RW_ENTRIE|LGC_RW_PALETTE, paletted);
+    lgcLayer *il = lgcReadLayer("ngtest_palette.lc1", LGC_RW_ENTRIE, 0);
+    uint16_t colors = 0;
+    uint32_t *expanded = il? lgcExpandPalette(il): NULL;
+    if(!expanded || il->format != (LGC_FMT_INDEXED8|LGC_FMT_COMPRESSED) ||
+        !lgcLayerPalette(il, &colors) || colors != 7 ||
+        memcmp(expanded, pl->data, 64*64*4)) {
+        printf("palette read fail\n");
+        return 1;
+    }
+    free(expanded);
+    lgcDestroyLayer(il, 1);
+    for(i = 0; i < 64*64; ++i)
+        ((uint32_t*)pl->data)[i] = 0xff000000 | (i%64)*0x030201 | (i/64)<<18;
+    if(lgcQuantizeLayer(pl, 16, 0) || !lgcLayerPalette(pl, &colors) || colors != 16 ||
+        pl->length != 64*64) {
+        printf("quantize fail\n");
+        return 1;
+    }
+    // same indices with another palette are not the same layer
+    lgcImage *recolored = lgcBlankImage();
+    lgcPushLayer(recolored, pl);
+    uint8_t recolor[4*16];
+    memcpy(recolor, lgcLayerPalette(pl, NULL), 4*16);
+    recolor[4] ^= 0x10;
+    lgcSetLayerPalette(pl, recolor, 16);
+    lgcPushLayer(recolored, pl);
+    lgcWriteToFile("ngtest_palette.lc1", LGC_RW_ENTRIE, recolored);
+    lgcDeleteLayerFromFile("ngtest_palette.lc1", LGC_RW_ENTRIE, 0);
+    lgcCompactFile("ngtest_palette.lc1", LGC_RW_ENTRIE);
+    il = lgcReadLayer("ngtest_palette.lc1", LGC_RW_ENTRIE, 0);
+    const uint8_t *read_palette = il? lgcLayerPalette(il, &colors): NULL;
+    if(!read_palette || colors != 16 || memcmp(read_palette, recolor, 4*16)) {
+        printf("palette dedup fail\n");
+        return 1;
+    }
+    lgcDestroyLayer(il, 1);
+    // delta of an indexed layer, written whole when compaction drops it's base
+    lgcSetLayerLevels(&recolored->layers[0], 0);
+    lgcSetLayerLevels(&recolored->layers[1], 0);
+    lgcWriteToFile("ngtest_palette.lc1", LGC_RW_ENTRIE|LGC_RW_DELTA, recolored);
+    lgcDeleteLayerFromFile("ngtest_palette.lc1", LGC_RW_ENTRIE, 0);
+    lgcCompactFile("ngtest_palette.lc1", LGC_RW_ENTRIE);
+    il = lgcReadLayer("ngtest_palette.lc1", LGC_RW_ENTRIE, 0);
+    read_palette = il? lgcLayerPalette(il, &colors): NULL;
+    if(!read_palette || colors != 16 || memcmp(read_palette, recolor, 4*16) ||
+        memcmp(il->data, pl->data, pl->length)) {
+        printf("palette delta fail\n");
+        return 1;
+    }
+    lgcDestroyLayer(il, 1);
+    lgcDestroyImage(recolored, 1);
+    lgcDestroyLayer(pl, 1);
+    lgcDestroyImage(paletted, 1);
+
+    printf("archive test\n");
+    const char *names[2] = {"first", "second"};
+    lgcImage *members[2] = {test2, test2};
+    lgcWriteArchive("ngtest.lga", LGC_RW_ENTRIE, 2, names, members);
+    lgcArchive *archive = lgcOpenArchive("ngtest.lga", LGC_RW_ENTRIE);
+    lgcImage *member = archive? lgcArchiveReadImage(archive, LGC_RW_ENTRIE, "second"): NULL;
+    lgcLayer *al = archive? lgcArchiveReadLayer(archive, LGC_RW_ENTRIE, "first", 2): NULL;
+    if(!member || member->layers_count != test2->layers_count || !al || al->x != 50 ||
+        lgcArchiveReadImage(archive, LGC_RW_ENTRIE, "third")) {
+        printf("archive read fail\n");
+        return 1;
+    }
+    lgcDestroyLayer(al, 1);
+    lgcDestroyImage(member, 1);
+    lgcCloseArchive(archive);
+
+    printf("dictionary test\n");
+    uint32_t dict_size;
+    void *dict = lgcTrainDictionary(&test2, 1, 4096, &dict_size);
+    if(!dict || lgcSetDictionary(dict, dict_size) ||
+        lgcWriteToFile("ngtest_dict.lc1", LGC_RW_ENTRIE|LGC_RW_DICT, test2)) {
+        printf("dictionary write fail\n");
+        return 1;
+    }
+    lgcImage *with_dict = lgcReadImage("ngtest_dict.lc1", LGC_RW_ENTRIE|LGC_RW_VERIFY);
+    if(!with_dict || with_dict->layers_count != test2->layers_count ||
+        memcmp(with_dict->layers[2].data, test2->layers[2].data, test2->layers[2].length)) {
+        printf("dictionary read fail\n");
+        return 1;
+    }
+    lgcDestroyImage(with_dict, 1);
+    lgcSetDictionary(NULL, 0);
+    free(dict);
+    lgcFreeDictionaries(); // the cache below loads it again
+
+    printf("cache test\n");
+    lgcCacheServer *cache_server = lgcStartCacheServer("ngtest_cache.sock", 1<<20);
+    lgcCache *cache = cache_server? lgcCacheConnect("ngtest_cache.sock"): NULL;
+    lgcLayer *cl = cache? lgcCacheReadLayer(cache, "ngtest_dict.lc1", 2, 0): NULL;
+    lgcLayer *cl2 = cache? lgcCacheReadLayer(cache, "ngtest_dict.lc1", 2, 0): NULL;
+    uint64_t hits = 0;
+    if(cache_server) lgcCacheServerStats(cache_server, &hits, NULL, NULL);
+    if(!cl || !cl2 || cl->data != cl2->data || hits != 1 ||
+        memcmp(cl->data, test2->layers[2].data, test2->layers[2].length)) {
+        printf("cache fail\n");
+        return 1;
+    }
+    lgcCacheRelease(cache, cl);
+    lgcCacheRelease(cache, cl2);
+    lgcCacheDisconnect(cache);
+    lgcStopCacheServer(cache_server);
+
     lgcDestroyLayer(lgcPopLayer(test2), 1);
     //lgcPopLayer(test2);
     printf("_3\n");
@@ -81,6 +482,21 @@ int main() {
 
     //lgcAppendLayerToFile("ngtest_3.lc1", LGC_RW_ENTRIE, lr);
 
+    printf("edit test\n");
+    if(lgcReplaceLayerInFile("ngtest_3.lc1", LGC_RW_ENTRIE, 1, lr) ||
+        lgcDeleteLayerFromFile("ngtest_3.lc1", LGC_RW_ENTRIE, 0) ||
+        lgcCompactFile("ngtest_3.lc1", LGC_RW_ENTRIE)) {
+        printf("edit fail\n");
+        return 1;
+    }
+
+    lgcImage *edited = lgcReadImage("ngtest_3.lc1", LGC_RW_ENTRIE);
+    if(!edited || edited->layers_count != 1 || edited->layers[0].x != 50) {
+        printf("edited read fail\n");
+        return 1;
+    }
+    lgcDestroyImage(edited, 1);
+
     lgcDestroyLayer(lr, 1);
     lgcDestroyImage(test2, 1);
 